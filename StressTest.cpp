@@ -0,0 +1,241 @@
+#define MITTELVEC_IMPLEMENTATION
+#include "dist/mittelvec.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// Finds how much fits in one block without an audio device: renders the graph back to back,
+// times every block against its deadline, and ramps each kind of load until the deadline
+// is missed. Build with optimizations on, the numbers mean nothing otherwise.
+
+const int NUM_CHANNELS = 2;
+const float SAMPLE_RATE = 48000.0f;
+const int BLOCK_SIZES[] = { 64, 128, 256, 512 };
+
+// A level passes while 99% of blocks finish within this fraction of the deadline.
+// The rest is left for the OS, the device and the game sharing the core.
+const double BUDGET = 0.8;
+const int WARMUP_BLOCKS = 20;
+const int MEASURED_BLOCKS = 1000;
+const int MAX_LOAD = 1 << 16;
+
+using namespace MittelVec;
+
+// Render times as fractions of the block deadline.
+struct Stats {
+  double p50 = 0, p99 = 0, p999 = 0, max = 0;
+};
+
+static bool sustainable(const Stats& stats) {
+  return stats.p99 < BUDGET;
+}
+
+// Renders WARMUP_BLOCKS + MEASURED_BLOCKS blocks. `beforeBlock` stands in for the game
+// thread (triggers etc.) and isn't timed.
+static Stats measure(AudioGraph& graph, const AudioContext& context, const std::function<void(int)>& beforeBlock = nullptr) {
+  const double deadline = context.bufferSize / static_cast<double>(context.sampleRate);
+  AudioBuffer output(context);
+  std::vector<double> times;
+  times.reserve(MEASURED_BLOCKS);
+
+  for (int block = 0; block < WARMUP_BLOCKS + MEASURED_BLOCKS; ++block) {
+    if (beforeBlock) beforeBlock(block);
+
+    auto start = std::chrono::steady_clock::now();
+    graph.processGraph(output);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (block >= WARMUP_BLOCKS) times.push_back(elapsed.count() / deadline);
+  }
+
+  std::sort(times.begin(), times.end());
+  auto percentile = [&](double p) { return times[std::min(times.size() - 1, static_cast<size_t>(p * times.size()))]; };
+  return Stats { percentile(0.5), percentile(0.99), percentile(0.999), times.back() };
+}
+
+// A detuned saw plus a little noise, so voices never play exact zeros.
+static std::shared_ptr<const SampleData> syntheticSample(const AudioContext& context, float seconds = 2.0f) {
+  const int numFrames = static_cast<int>(context.sampleRate * seconds);
+  std::vector<float> samples(static_cast<size_t>(numFrames) * context.numChannels);
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> noise(-0.05f, 0.05f);
+
+  for (int i = 0; i < numFrames; ++i) {
+    for (int ch = 0; ch < context.numChannels; ++ch) {
+      float phase = std::fmod(i * (220.0f + ch) / context.sampleRate, 1.0f);
+      samples[i * context.numChannels + ch] = 0.3f * (2.0f * phase - 1.0f) + noise(rng);
+    }
+  }
+
+  auto sample = std::make_shared<SampleData>(context);
+  sample->setSamples(samples);
+  return sample;
+}
+
+struct Scenario {
+  std::string name;
+  std::string unit;
+  // Builds a graph carrying `load` and measures it.
+  std::function<Stats(const AudioContext&, int load)> run;
+};
+
+static std::vector<Scenario> scenarios() {
+  const EnvConfig env { 0.01f, 0.1f, 0.8f, 0.5f };
+  const FilterConfig filter { FilterMode::Lowpass, 2000.0f, 0.7f };
+
+  return {
+    { "sampler voices, plain", "voices", [](const AudioContext& context, int load) {
+      AudioGraph graph(context);
+      auto [id, sampler] = graph.addNode<Sampler>(syntheticSample(context), load, true);
+      for (int i = 0; i < load; ++i) sampler->noteOn();
+      return measure(graph, context);
+    } },
+
+    { "sampler voices, pitch+env+filter", "voices", [env, filter](const AudioContext& context, int load) {
+      AudioGraph graph(context);
+      auto [id, sampler] = graph.addNode<Sampler>(syntheticSample(context), load, true, 0.5f, 5, env, filter);
+      for (int i = 0; i < load; ++i) sampler->noteOn();
+      return measure(graph, context);
+    } },
+
+    { "sample pack items, env+filter", "items", [env, filter](const AudioContext& context, int load) {
+      AudioGraph graph(context);
+      auto sample = syntheticSample(context);
+      std::vector<SamplePackItem> items;
+      std::vector<std::shared_ptr<const SampleData>> samples;
+      for (int i = 0; i < load; ++i) {
+        items.emplace_back("item-" + std::to_string(i), "synthetic", 1, true, 0.5f, 0, env, filter);
+        samples.push_back(sample);
+      }
+      SamplePack pack(graph, items, samples);
+      for (const auto& item : items) pack.triggerSample(item.slug);
+      return measure(graph, context);
+    } },
+
+    { "triggers per block, 16 short items x 2 voices", "triggers", [](const AudioContext& context, int load) {
+      // Few voices, so this is mostly the cost of triggering and stealing.
+      AudioGraph graph(context);
+      auto sample = syntheticSample(context, 0.1f);
+      std::vector<SamplePackItem> items;
+      std::vector<std::shared_ptr<const SampleData>> samples;
+      for (int i = 0; i < 16; ++i) {
+        items.emplace_back("item-" + std::to_string(i), "synthetic", 2, false, 0.5f);
+        samples.push_back(sample);
+      }
+      SamplePack pack(graph, items, samples);
+      // One batch per block, like gameplay code firing everything for a frame at once.
+      std::vector<SampleTrigger> batch;
+      for (int i = 0; i < load; ++i) {
+        batch.push_back({ pack.getHandle(items[i % items.size()].slug), 1.0f, 0 });
+      }
+      bool queued = true;
+      Stats stats = measure(graph, context, [&](int) { queued = pack.triggerSamples(batch) && queued; });
+      // More than the pack can queue per block isn't a level it can sustain.
+      if (!queued) stats.p99 = BUDGET;
+      return stats;
+    } },
+
+    { "graph width, noise>gain>filter into a mixer", "branches", [filter](const AudioContext& context, int load) {
+      AudioGraph graph(context);
+      auto [mixerId, mixer] = graph.addNode<Mixer>();
+      for (int i = 0; i < load; ++i) {
+        int noiseId = graph.addNode<NoiseGenerator>().first;
+        int gainId = graph.addNode<Gain>(0.1f).first;
+        int filterId = graph.addNode<Filter>(filter).first;
+        graph.connect(noiseId, gainId);
+        graph.connect(gainId, filterId);
+        graph.connect(filterId, mixerId);
+      }
+      return measure(graph, context);
+    } },
+
+    { "graph depth, noise through mixers", "nodes", [](const AudioContext& context, int load) {
+      // Mixers don't fuse, so this is the per node cost of the graph itself.
+      AudioGraph graph(context);
+      int previous = graph.addNode<NoiseGenerator>().first;
+      for (int i = 0; i < load; ++i) {
+        int mixerId = graph.addNode<Mixer>().first;
+        graph.connect(previous, mixerId);
+        previous = mixerId;
+      }
+      return measure(graph, context);
+    } },
+  };
+}
+
+// A level only fails if it fails twice, one preempted run shouldn't end the ramp.
+static bool runLevel(const Scenario& scenario, const AudioContext& context, int load, Stats& stats) {
+  stats = scenario.run(context, load);
+  if (sustainable(stats)) return true;
+  stats = scenario.run(context, load);
+  return sustainable(stats);
+}
+
+// Doubles the load until a level fails, then narrows down on the last one that passed.
+static int findSustainableMax(const Scenario& scenario, const AudioContext& context, Stats& statsAtMax) {
+  int good = 0;
+  int bad = 0;
+  for (int load = 1; load <= MAX_LOAD; load *= 2) {
+    Stats stats;
+    if (!runLevel(scenario, context, load, stats)) {
+      bad = load;
+      break;
+    }
+    good = load;
+    statsAtMax = stats;
+  }
+
+  // Within ~5% is plenty, timings aren't that stable anyway.
+  while (bad != 0 && bad - good > std::max(1, good / 20)) {
+    int load = good + (bad - good) / 2;
+    Stats stats;
+    if (runLevel(scenario, context, load, stats)) {
+      good = load;
+      statsAtMax = stats;
+    } else {
+      bad = load;
+    }
+  }
+  return good;
+}
+
+static std::string percent(double fraction) {
+  char text[16];
+  snprintf(text, sizeof(text), "%5.1f%%", fraction * 100.0);
+  return text;
+}
+
+int main() {
+  // Same as the engine's callback.
+  ScopedFlushDenormals flushDenormals;
+
+  std::cout << "MittelVec callback stress test" << std::endl;
+  std::cout << "Sustainable = 99% of blocks within " << BUDGET * 100 << "% of the deadline, "
+            << NUM_CHANNELS << " channels at " << SAMPLE_RATE << "Hz." << std::endl;
+
+  for (int blockSize : BLOCK_SIZES) {
+    AudioContext context { blockSize, NUM_CHANNELS, SAMPLE_RATE };
+    std::cout << std::endl << "Block " << blockSize << " frames ("
+              << blockSize * 1000.0 / SAMPLE_RATE << " ms deadline)" << std::endl;
+
+    for (const Scenario& scenario : scenarios()) {
+      Stats stats;
+      int max = findSustainableMax(scenario, context, stats);
+      std::string limit = max >= MAX_LOAD ? " (hit MAX_LOAD)" : "";
+
+      std::cout << "  " << scenario.name << ": " << max << " " << scenario.unit << limit << std::endl;
+      if (max > 0) {
+        std::cout << "    p50 " << percent(stats.p50) << "  p99 " << percent(stats.p99)
+                  << "  p99.9 " << percent(stats.p999) << "  max " << percent(stats.max) << std::endl;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -1,25 +1,79 @@
 // MittelVec - Single-Header Library
-// Generated on 2026-02-22
+// Generated on 2026-10-19
 
 #ifndef MITTELVEC_H
 #define MITTELVEC_H
 
 // System includes 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <complex>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
 #include <random>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+  #include <xmmintrin.h>
+  #define MITTELVEC_HAS_MXCSR 1
+#elif defined(__aarch64__)
+  #define MITTELVEC_HAS_FPCR 1
+#endif
+
+#if defined(_WIN32)
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <pthread.h>
+  #include <sched.h>
+  #include <sys/mman.h>
+  #if defined(__APPLE__)
+    #include <dispatch/dispatch.h>
+  #else
+    #include <cerrno>
+    #include <semaphore.h>
+  #endif
+#endif
+
+#if defined(_WIN32)
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
 // NOTE! This lib depends on miniaudio (a single header file audio lib)
 // Ensure miniaudio.h is in your include path
 #include "miniaudio.h"
@@ -64,17 +118,135 @@ private:
 };
 
 
+// How much work nodes may skip to keep up, lowest first. The engine's LoadGovernor steps
+// down this list when callbacks run close to their deadline, and each level keeps the
+// savings of the ones before it.
+enum class Quality {
+  Full,
+  LinearInterpolation, // Pitch shifters interpolate linearly instead of cubically.
+  NoVoiceFilters, // Sampler voices skip their filter.
+  ReducedPolyphony, // Samplers start new notes on half their voices.
+  VirtualVoices, // Quiet sampler voices keep time but aren't rendered.
+};
+
 class AudioNode {
 public:
   AudioNode(const AudioContext& context) : outputBuffer(context) {}
   virtual ~AudioNode() = default;
 
   virtual void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) = 0;
-  
+
+  // Whether the graph may skip process() while every input is silent, i.e. the node has no
+  // output of its own right now. Sources and nodes still ringing out (filter tails etc.) return false.
+  virtual bool canSleep() const { return false; }
+
+  // Nodes that work one sample at a time, in order and with no lookahead, can be fused: when they
+  // form a single-input/single-output chain the graph runs the whole chain a tile at a time,
+  // keeping intermediate samples in a small stack buffer instead of each node's outputBuffer.
+  virtual bool isFusable() const { return false; }
+
+  // Called by the graph, under its lock, when `source` stops feeding this node (disconnected or
+  // removed). For nodes that remember a source, its buffer address can be reused after this.
+  virtual void sourceDisconnected(const AudioNode& /*source*/) {}
+
+  // Process `numFrames` interleaved frames from `in` into `out` (they may alias).
+  // Only called when isFusable(), must do exactly what process() does for a single input.
+  virtual void processTile(const float* /*in*/, float* /*out*/, int /*numFrames*/) {}
+
+  // Called by the graph on the audio thread, between blocks, whenever the quality changes.
+  virtual void setQuality(Quality /*quality*/) {}
+
+  // Changing block size or sample rate on a running graph (AudioGraph::setAudioContext) is
+  // done in two steps. prepareAudioContext runs first, on the caller's thread while the old
+  // settings keep playing, and does anything slow (resampling, FFT setup). setAudioContext
+  // then runs under the graph lock between blocks and should only swap the results in and
+  // resize buffers. Overrides must call AudioNode::setAudioContext.
+  virtual void prepareAudioContext(const AudioContext& /*context*/) {}
+  virtual void setAudioContext(const AudioContext& context) { outputBuffer.setAudioContext(context); }
+
+  // Called by the graph on the last node of a fused chain, whose outputBuffer it wrote.
+  void finishFusedBlock() { silent = false; }
+
+  // True when outputBuffer is known to be all zeros after the last block.
+  bool isSilent() const { return silent; }
+
+  // Called by the graph. Inputs only contain non-silent buffers.
+  void processBlock(const std::vector<const AudioBuffer*>& inputs) {
+    wentSilent = false;
+    process(inputs, outputBuffer);
+    silent = wentSilent;
+  }
+
+  // Called by the graph instead of processBlock when the node can sleep.
+  void sleep() {
+    if (!silent) outputBuffer.clear();
+    silent = true;
+  }
+
   AudioBuffer outputBuffer;
+
+protected:
+  // For single input effects: returns the one signal to process.
+  // A single input is returned as is (no copy), several are summed into `scratch` (usually
+  // the node's own output buffer). Wide fan-in should go through a Mixer node instead.
+  static const AudioBuffer& mixInputs(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& scratch) {
+    if (inputs.size() == 1) return *inputs[0];
+    if (inputs.empty()) {
+      scratch.clear();
+      return scratch;
+    }
+
+    std::copy(inputs[0]->data.begin(), inputs[0]->data.end(), scratch.data.begin());
+    for (size_t n = 1; n < inputs.size(); ++n) {
+      const float* in = inputs[n]->data.data();
+      for (int i = 0; i < scratch.size(); ++i) {
+        scratch[i] += in[i];
+      }
+    }
+    return scratch;
+  }
+
+  // Call from process() when there's nothing to output this block.
+  // Only clears the buffer on the first silent block.
+  void outputSilence() {
+    if (!silent) outputBuffer.clear();
+    wentSilent = true;
+  }
+
+private:
+  bool silent = false;
+  bool wentSilent = false;
 };
 
 
+// Most channels per-channel DSP state is sized for (7.1).
+constexpr int maxDspChannels = 8;
+
+// For nodes with fixed size per-channel state, call wherever the channel count is set.
+inline void requireDspChannels(int numChannels, const char* what) {
+  if (numChannels > maxDspChannels) {
+    throw std::runtime_error(std::string(what) + " supports at most " + std::to_string(maxDspChannels) + " channels.");
+  }
+}
+
+/**
+ * Calls `fn(channels)` with the channel count as a compile time constant for the common
+ * layouts (mono, stereo, 5.1, 7.1) and as a plain int otherwise.
+ * Inner loops over `channels` then have a fixed trip count, so the compiler can unroll them
+ * and run the per-channel work side by side in SIMD lanes.
+ */
+template <typename Fn>
+inline void dispatchChannels(int numChannels, Fn&& fn) {
+  switch (numChannels) {
+    case 1: fn(std::integral_constant<int, 1>()); break;
+    case 2: fn(std::integral_constant<int, 2>()); break;
+    case 6: fn(std::integral_constant<int, 6>()); break;
+    case 8: fn(std::integral_constant<int, 8>()); break;
+    default: fn(numChannels); break;
+  }
+}
+
+
 
 class AudioGraph {
 public:
@@ -83,56 +255,127 @@ public:
     template <typename NodeType, typename... Args>
     std::pair<int, NodeType*> addNode(Args &&...args)
     {
-      int id = nextNodeId++;
+      // Construct outside the graph lock, only the insert needs it.
       auto node = std::make_unique<NodeType>(audioContext, std::forward<Args>(args)...);
-      nodes[id] = std::move(node);
-      isGraphDirty = true;
-      return std::make_pair(id, static_cast<NodeType*>(nodes[id].get()));
+      NodeType* nodePtr = node.get();
+      int id = addNode(std::move(node));
+      return std::make_pair(id, nodePtr);
     }
 
+    // Takes ownership of a node built elsewhere (e.g. on a loader thread), catching it up
+    // first if the graph was reconfigured since (see lockGraphFor).
+    int addNode(std::unique_ptr<AudioNode> node);
+
+    // Holding this lock groups edits so the audio thread sees them all at once, or not at all.
+    // All edit methods lock it themselves, so it's only needed to make several edits atomic.
+    // The audio thread never waits for it: a block due while it's held is skipped, faded out
+    // from the last one, and every node misses that block (playheads, envelopes and tails
+    // included). So build nodes, load and resample before locking, and only insert, connect
+    // and configure under it. Removed nodes are destroyed after it's released.
+    std::unique_lock<std::recursive_mutex> lockGraph();
+    // lockGraph for adding nodes built before a reconfiguration (e.g. on a loader thread).
+    // Catches them up to the graph's settings, the slow part without the lock, and returns
+    // once they match with the lock held. Don't call it with the graph already locked.
+    std::unique_lock<std::recursive_mutex> lockGraphFor(const std::vector<AudioNode*>& nodes);
+
     void removeNode(int nodeId);
     void connect(int sourceNodeId, int destNodeId);
+    // Also feeds the source into dest (and orders it before), but the source still plays on
+    // its own: it doesn't count as connected for the output mix. For nodes that only listen
+    // to a signal, like a Compressor's sidechain. disconnect removes it like any edge.
+    void connectSidechain(int sourceNodeId, int destNodeId);
     void disconnect(int sourceNodeId, int destNodeId);
+    // Never blocks. If an edit holds the graph lock, the block is skipped (see lockGraph).
     void processGraph(AudioBuffer& graphOutputBuffer);
+    // Blocks rendered as silence because an edit held the lock, for diagnostics.
+    int getSkippedBlocks() const { return skippedBlocks.load(std::memory_order_relaxed); }
+
+    // Changes block size and/or sample rate for every node, voice and sample in the graph.
+    // prepareAudioContext does the slow part (resampling etc.) while the graph keeps
+    // playing, setAudioContext swaps it all in under the graph lock, preparing first if
+    // that wasn't done. Ids and node pointers stay valid. The channel count can't change.
+    // Don't remove nodes from another thread while preparing.
+    void prepareAudioContext(AudioContext newContext);
     void setAudioContext(AudioContext newContext);
 
-    void updateProcessOrder();
-    AudioContext audioContext;
-    std::unordered_map<int, std::unique_ptr<AudioNode>> nodes;
-    std::unordered_map<int, std::vector<int>> connections;
-    std::unordered_map<int, std::vector<int>> reverseConnections;
-    int nextNodeId;
-    std::vector<int> processOrder;
-    bool isGraphDirty;
-};
-
+    // Passed on to every node at the start of the next block, so nodes only ever change
+    // quality on the audio thread. Nodes added later start at the current quality.
+    void setQuality(Quality quality);
+    Quality getQuality() const;
 
-struct CallbackData {
-  AudioGraph* graph = nullptr;
-  AudioBuffer* graphOutput = nullptr;
-  AudioContext* globalContext = nullptr;
-};
+    // The node behind an id, or nullptr if it's been removed.
+    AudioNode* getNode(int nodeId) const;
+    size_t getNumNodes() const { return numNodes; }
 
-class Engine {
-public:
-  Engine(AudioContext globalContext);
-  ~Engine();
+    // Full Kahn sort from scratch. Edits keep the order up to date themselves, this is
+    // only needed to recover once a cycle has been broken.
+    void updateProcessOrder();
+    AudioContext audioContext;
 
-  AudioContext globalContext;
-  AudioGraph graph;
-  AudioBuffer output;
+    // Node ids are generational handles. The low bits pick a slot and the rest are that
+    // slot's generation, which is bumped whenever the slot is freed. Lookups are an index
+    // instead of a hash, and a stale id never matches whatever reuses its slot.
+    static constexpr int slotIndexBits = 20;
+    static constexpr int slotIndexMask = (1 << slotIndexBits) - 1;
+    static constexpr int generationMask = (1 << (31 - slotIndexBits)) - 1;
+
+    // Everything about one node, including its edges, so removing it is O(degree).
+    // Edges and processOrder hold slot indices, not ids.
+    struct NodeSlot {
+      std::unique_ptr<AudioNode> node; // Null while the slot is free.
+      int generation = 0;
+      std::vector<int> destinations;
+      std::vector<int> sources;
+      // The destinations connected as sidechains, also in destinations.
+      std::vector<int> sidechains;
+      int position = -1; // Where this node is in processOrder.
+      // Fusable, and the only destination of its only source, so it runs tile by tile
+      // straight after that source as part of a fused chain (see processFusedChain).
+      bool fusedIn = false;
+    };
+
+    std::vector<NodeSlot> slots;
+    std::vector<int> freeSlots;
+    size_t numNodes = 0;
+
+    // Topological order, kept up to date by every edit (Pearce-Kelly), so processGraph
+    // never sorts. Removed nodes leave a -1 hole until there are enough to compact.
+    std::vector<int> processOrder;
+    size_t numOrderHoles = 0;
+    bool hasCycle = false;
 
-  void start();
-  void stop();
+    // Frames per fused tile, small enough to stay in L1 between stages.
+    static constexpr int fusionTileFrames = 64;
 
 private:
-  void initMiniaudio();
-
-  // Miniaudio
-  ma_result result;
-  ma_device_config config;
-  ma_device device;
-  CallbackData cbData;
+    int slotFor(int nodeId) const;
+    void addEdge(int sourceNodeId, int destNodeId, bool sidechain);
+    void orderEdge(int source, int dest);
+    void compactProcessOrder();
+    void refreshFusedIn(int slot);
+    void refreshDestinationsFusedIn(int slot);
+    void processNode(int slot);
+    void processFusedChain(int firstStage);
+    void fadeOutSkippedBlock(AudioBuffer& graphOutputBuffer);
+
+    std::recursive_mutex graphMutex;
+    AudioContext preparedContext {};
+    bool hasPreparedContext = false;
+    std::atomic<Quality> quality { Quality::Full };
+    std::atomic<int> skippedBlocks { 0 };
+    Quality appliedQuality = Quality::Full;
+    std::vector<const AudioBuffer*> inputScratch; // Reused every block to avoid allocating on the audio thread.
+
+    // Audio thread only. Where the last block ended per channel, so a skipped block can ramp
+    // down from there, and whether the next one has to ramp back up.
+    static constexpr int skipFadeFrames = 64;
+    std::vector<float> lastOutputFrame;
+    bool fadeInNext = false;
+
+    // Scratch for orderEdge, a node is visited when its stamp matches visitStamp.
+    std::vector<unsigned> visitStamps;
+    unsigned visitStamp = 0;
+    std::vector<int> forwardRegion, backwardRegion, regionPositions, searchStack;
 };
 
 
@@ -143,9 +386,11 @@ struct EnvConfig {
   float release;
 };
 
-class Envelope : public AudioNode {
+// ADSR state without an AudioNode around it (no output buffer).
+// Sampler voices own one of these only when the item has an envelope.
+class EnvelopeProcessor {
 public:
-  explicit Envelope(const AudioContext& context, const EnvConfig& config = { 0.01f, 0.1f, 0.8f, 0.2f }); // Revisit these defaults values.
+  explicit EnvelopeProcessor(float sampleRate, const EnvConfig& config = { 0.01f, 0.1f, 0.8f, 0.2f });
 
   enum State { Idle, Attack, Decay, Sustain, Release };
 
@@ -156,6 +401,28 @@ public:
   // void setSustain(float sustain);
   // void setRelease(float release);
 
+  float getNextLevel();
+  float getLevel() const { return currentLevel; }
+
+  void noteOn();
+  void noteOff();
+  void reset();
+  bool isActive() const;
+  // Keeps the current stage and level, only the rates change.
+  void setSampleRate(float sampleRate);
+
+private:
+  State state;
+  float attack, decay, sustain, release;
+  float sampleRate;
+  float currentLevel;
+  bool skipSustain = false; // hard coding this for now, may eventually find use case for noteOff/sustains.
+};
+
+class Envelope : public AudioNode {
+public:
+  explicit Envelope(const AudioContext& context, const EnvConfig& config = { 0.01f, 0.1f, 0.8f, 0.2f }); // Revisit these defaults values.
+
   float getNextLevel();
   
   void noteOn();
@@ -165,14 +432,16 @@ public:
 
   void virtual process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
 
+  // Keeps running while active so the envelope doesn't stall when its input goes quiet.
+  bool canSleep() const override { return !envelope.isActive(); }
+  bool isFusable() const override { return true; }
+  void processTile(const float* in, float* out, int numFrames) override;
+
   void applyToBuffer(AudioBuffer& buffer);
+  void setAudioContext(const AudioContext& context) override;
 
 private:
-  State state;
-  float attack, decay, sustain, release;
-  float sampleRate;
-  float currentLevel;
-  bool skipSustain = false; // hard coding this for now, may eventually find use case for noteOff/sustains.
+  EnvelopeProcessor envelope;
 };
 
 
@@ -184,15 +453,45 @@ struct FilterConfig {
   float resonance = 0.707f; // Q
 };
 
-class Filter : public AudioNode {
+// Biquad state and coefficients, without an AudioNode around it (no output buffer).
+// Sampler voices own one of these only when the item has a filter.
+// Each channel has its own delay line, up to maxDspChannels (wider layouts are rejected).
+class BiquadProcessor {
 public:
-  Filter(const AudioContext& context, const FilterConfig& config);
+  BiquadProcessor(float sampleRate, const FilterConfig& config);
 
   void setParams(float cutoff, float resonance);
   void setMode(FilterMode mode);
-  
-  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
-  void applyToBuffer(AudioBuffer& buffer);
+  // Recalculates coefficients, the state carries on.
+  void setSampleRate(float sampleRate);
+  void reset();
+
+  // One interleaved frame through the filter (`in` and `out` may alias).
+  // Defined here so DSP chains can inline it, the channel loop is what gets vectorized.
+  void tick(const float* in, float* out, int numChannels) {
+    for (int ch = 0; ch < numChannels; ++ch) {
+      double x = in[ch];
+
+      // Difference Equation (Direct Form I)
+      double y = (b0 * x) + (b1 * z1_x[ch]) + (b2 * z2_x[ch]) - (a1 * z1_y[ch]) - (a2 * z2_y[ch]);
+
+      // Update state
+      z2_x[ch] = z1_x[ch];
+      z1_x[ch] = x;
+      z2_y[ch] = z1_y[ch];
+      z1_y[ch] = y;
+
+      out[ch] = static_cast<float>(y);
+    }
+  }
+
+  // `numFrames` interleaved frames, `in` and `out` may alias.
+  void process(const float* in, float* out, int numFrames, int numChannels);
+
+  // Snaps state that has decayed below `threshold` to zero (also keeps it out of denormals).
+  void settle(double threshold);
+  // True once the state is all zeros, i.e. the tail has rung out.
+  bool isSettled() const;
 
 private:
   void calculateCoefficients();
@@ -205,986 +504,5638 @@ private:
   // Coefficients
   double b0 = 0, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
   
-  // State memory (Z-delay lines)
-  double z1_x = 0, z2_x = 0, z1_y = 0, z2_y = 0;
+  // State memory (Z-delay lines), one per channel.
+  double z1_x[maxDspChannels] = {}, z2_x[maxDspChannels] = {};
+  double z1_y[maxDspChannels] = {}, z2_y[maxDspChannels] = {};
 };
 
-
-class Gain : public AudioNode {
+class Filter : public AudioNode {
 public:
-    explicit Gain(const AudioContext& context, float gain);
+  Filter(const AudioContext& context, const FilterConfig& config);
 
-    void setGain(float gain);
-    void virtual process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void setParams(float cutoff, float resonance);
+  void setMode(FilterMode mode);
+  
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void applyToBuffer(AudioBuffer& buffer);
+  // Filters `input` into `output`, they may be the same buffer.
+  void apply(const AudioBuffer& input, AudioBuffer& output);
+
+  // Sleeps once the tail has rung out.
+  bool canSleep() const override;
+  bool isFusable() const override { return true; }
+  void processTile(const float* in, float* out, int numFrames) override;
+  void setAudioContext(const AudioContext& context) override;
 
 private:
-    float gain;
+  BiquadProcessor biquad;
 };
 
 
-class PitchShift : public AudioNode {
+// The pitch shifter's state and DSP, without an AudioNode around it (no output buffer).
+// Sampler voices own one of these only when the item is pitch shifted.
+// The ring holds interleaved frames, every channel is read with the same taps and window.
+class PitchShiftProcessor {
 public:
-  explicit PitchShift(const AudioContext& context, int semitoneShift);
-
-  void virtual process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
-  void applyToBuffer(AudioBuffer& buffer);
+  PitchShiftProcessor(const AudioContext& context, int semitoneShift);
+
+  // One interleaved frame in, one out (`in` and `out` may alias). Slower per frame than process,
+  // which renders a group at a time. `numChannels` must be the context's channel count, it's a
+  // parameter so chains can make it a constant.
+  void tick(const float* in, float* out, int numChannels);
+  // `numFrames` interleaved frames, `in` and `out` may alias.
+  void process(const float* in, float* out, int numFrames);
   void setPitch(int semitoneShift);
   void reset();
+  int getRingFrames() const;
+  // Linear is cheaper but dulls the highs a little, used when the engine is under load.
+  void setCubicInterpolation(bool cubic);
+  // Resizes the ring for a new block size, which also clears it.
+  void setAudioContext(const AudioContext& context);
 
 private:
+  // Frames rendered per pass (see renderGroup).
+  static constexpr int groupFrames = 8;
+  static constexpr int guardFrames = 3;
+  // Shortest delay either tap reads at, so they (and the cubic's lookahead) always stay
+  // behind the frames a group has written.
+  static constexpr int minDelayFrames = 20;
+  // Leaves the taps a window of a few ms after minDelayFrames, much shorter and the shift
+  // turns into a buzz.
+  static constexpr int minRingFrames = 256;
+  static constexpr int hannTableSize = 1024;
+  // sin^2 over one period. Built when the library loads, not on the audio thread.
+  static const std::array<float, hannTableSize + 1> hannTable;
+
   // double samplePosition = 0.0;
   double currentDelay = 0.0;
   double ratio;
   std::vector<float> ringBuffer;
+  int ringFrames; // Power of two, not counting guard frames.
+  int windowFrames; // How far the taps sweep, see renderGroup.
+  int channels;
   int ringWriteIdx;
+  bool cubic = true;
 
-  float lerp(float a, float b, float fraction);
+  template <typename Channels>
+  void renderGroup(const float* in, float* out, int numFrames, Channels numChannels);
+  void writeFrame(const float* frame, int numChannels);
+  static std::array<float, hannTableSize + 1> buildHannTable();
+  static float hannWindow(float phase);
   float cubicInterpolation(float sm1, float s0, float s1, float s2, float fraction);
   // float sincInterpolation(const float* inputData, size_t numInputSamples, double position, int numTaps);
   double convertSemitoneToRatio(int semitoneShift);
-  float getLerpSample(double samplePosition);
-  float getCubicSample(double samplePosition);
 };
 
+class PitchShift : public AudioNode {
+public:
+  explicit PitchShift(const AudioContext& context, int semitoneShift);
 
-// Consider making SamplerVoice its own class..
-struct SamplerVoice {
-  int playheadIndex = 0;
-  bool active = false;
+  void virtual process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void applyToBuffer(AudioBuffer& buffer);
+  // Shifts `input` into `output`, they may be the same buffer.
+  void apply(const AudioBuffer& input, AudioBuffer& output);
+  void setPitch(int semitoneShift);
+  void reset();
+  void setQuality(Quality quality) override;
+  void setAudioContext(const AudioContext& context) override;
 
-  std::unique_ptr<Envelope> envelope;
-  std::unique_ptr<PitchShift> pitchShifter;
-  std::unique_ptr<Filter> filter;
+  // Sleeps once everything in the ring buffer is silence.
+  bool canSleep() const override;
 
-  AudioBuffer voiceBuffer;
+private:
+  PitchShiftProcessor shifter;
+  int silentFramesWritten = 0;
+};
 
-  SamplerVoice(const AudioContext& context)
-    : voiceBuffer(context),
-    envelope(std::make_unique<Envelope>(context)),
-    pitchShifter(std::make_unique<PitchShift>(context, 0)),
-    filter(std::make_unique<Filter>(context, FilterConfig { FilterMode::Lowpass, 500.0f, 0.5f }))
-  {}
 
-  void trigger() {
-    playheadIndex = 0;
-    active = true;
-    envelope->noteOn();
-    pitchShifter->reset();
+/**
+ * Statically composed DSP chains.
+ * Each stage is a small value type with `void tick(float* frame, int numChannels)` that processes
+ * one interleaved frame in place, and `Chain<Stages...>::render` runs every stage on a frame
+ * before moving to the next one. The stage list is fixed at compile time, so there's no virtual
+ * dispatch and the compiler can inline the whole chain into one loop. The channel count is
+ * made a constant for common layouts (see dispatchChannels) so each stage's per-channel work
+ * vectorizes across the frame. `Chain<>` renders nothing at all.
+ *
+ * Stages only hold references/values, they're cheap to build per block.
+ * A PitchStage in front is the exception to frame by frame, see Chain<PitchStage, ...>.
+ */
+template <typename... Stages>
+struct Chain {
+  static void render(float* samples, int numFrames, int numChannels, Stages... stages) {
+    dispatchChannels(numChannels, [&](auto channels) {
+      for (int i = 0; i < numFrames; ++i) {
+        float* frame = samples + i * channels;
+        (stages.tick(frame, channels), ...);
+      }
+    });
   }
+};
 
-  void processVoice(
-    const AudioBuffer& sample,
-    AudioBuffer& outputBuffer,
-    bool loop,
-    float gain,
-    int pitchShift,
-    std::optional<EnvConfig> envConfig,
-    std::optional<FilterConfig> filterConfig
-  ) {
-    if (!active) return;
-    
-    voiceBuffer.clear();
-    for (int i = 0; i < voiceBuffer.size(); ++i) {
-      // If voice has reached the end of the sample.  
-      if (playheadIndex >= sample.size()) {
-        if (loop) {
-          playheadIndex = 0;
-          if (envConfig.has_value()) envelope->noteOn();
-        } else {
-          if (envConfig.has_value()) envelope->reset();
-          active = false;
-          playheadIndex = 0;
-          break;
-        }
-      }
+template <>
+struct Chain<> {
+  static void render(float*, int, int) {}
+};
 
-      // Write sample data into voiceBuffer.
-      voiceBuffer[i] = sample[playheadIndex++] * gain;
-    }
+struct PitchStage;
 
-    // Apply per-voice DSP
-    if (pitchShift && pitchShift != 0) {
-      // This are probably being reset redundantly across processVoice calls.
-      // Should cache the values or something.
-      pitchShifter->setPitch(pitchShift);
-      pitchShifter->applyToBuffer(voiceBuffer);
-    }
+// The pitch shifter renders several frames per pass (see PitchShiftProcessor::renderGroup),
+// ticking it a frame at a time throws that away. Nothing comes before it here, so it shifts
+// the whole block first and the stages after it go frame by frame as usual.
+template <typename... Stages>
+struct Chain<PitchStage, Stages...> {
+  static void render(float* samples, int numFrames, int numChannels, PitchStage pitch, Stages... stages);
+};
 
-    if (envConfig.has_value()) {
-      envelope->applyToBuffer(voiceBuffer);
-      if (!envelope->isActive()) {
-        active = false;
-        playheadIndex = 0;
-      }
-    }
+struct GainStage {
+  float gain;
+  void tick(float* frame, int numChannels) const {
+    for (int ch = 0; ch < numChannels; ++ch) frame[ch] *= gain;
+  }
+};
 
-    if (filterConfig.has_value()) {
-      filter->setMode(filterConfig->mode);
-      filter->setParams(filterConfig->cutoff, filterConfig->resonance);
-      filter->applyToBuffer(voiceBuffer);
-    }
+struct BiquadStage {
+  BiquadProcessor& filter;
+  void tick(float* frame, int numChannels) { filter.tick(frame, frame, numChannels); }
+};
 
-    // Sum into main output buffer
-    outputBuffer += voiceBuffer;
+struct EnvelopeStage {
+  EnvelopeProcessor& envelope;
+  void tick(float* frame, int numChannels) {
+    // One envelope step per frame, shared by every channel.
+    const float level = envelope.getNextLevel();
+    for (int ch = 0; ch < numChannels; ++ch) frame[ch] *= level;
   }
 };
-    
-class Sampler : public AudioNode {
-  public:
-  Sampler(
-    const AudioContext& context,
-    std::string samplePath,
-    int polyphony,
-    bool loop = false,
-    float gain = 1.0f,
-    int pitchShift = 0,
-    std::optional<EnvConfig> envConfig = std::nullopt,
-    std::optional<FilterConfig> filterConfig = std::nullopt
-  );
 
-  void noteOn();
-  void noteOff();
-  SamplerVoice* allocateVoice();
-  
-  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
-  
-  private:
-  int polyphony;
-  AudioBuffer sample;
-  std::vector<SamplerVoice> voices;
-  std::list<SamplerVoice*> activeVoices; // indicies per voice of `voices` vector above.
-  bool loop;
-  float gain;
-  int pitchShift;
-  std::optional<EnvConfig> envConfig;
-  std::optional<FilterConfig> filterConfig;
+struct PitchStage {
+  PitchShiftProcessor& pitchShifter;
+  void tick(float* frame, int numChannels) { pitchShifter.tick(frame, frame, numChannels); }
+  void process(float* samples, int numFrames) { pitchShifter.process(samples, samples, numFrames); }
 };
-    
 
+template <typename... Stages>
+void Chain<PitchStage, Stages...>::render(float* samples, int numFrames, int numChannels, PitchStage pitch, Stages... stages) {
+  pitch.process(samples, numFrames);
+  Chain<Stages...>::render(samples, numFrames, numChannels, stages...);
+}
 
-struct MusicCue {
-  std::string slug;
-  std::string fileName;
-  bool loop;
-  float gain;
 
-  MusicCue(
-    std::string slug,
-    std::string fileName,
-    bool loop = true,
-    float gain = 1.0f
-  ) : slug(slug), fileName(fileName), loop(loop), gain(gain) {}
+struct CompressorConfig {
+  float threshold = -20.0f; // dBFS.
+  float ratio = 4.0f;
+  float attack = 0.01f; // Seconds.
+  float release = 0.25f; // Seconds.
+  float makeup = 0.0f; // dB.
 };
 
-class MusicCueOrchestrator {
+/**
+ * Peak compressor, or a ducker when keyed from a sidechain: music turned down under
+ * dialogue, say. The level is followed once per block and the gain ramps smoothly to its
+ * new value across the block, so there's no zipper noise and only a couple of exp/log calls
+ * per block.
+ *
+ * For a sidechain, connect the key node with graph.connectSidechain(keyId, compressorId)
+ * (it keeps playing as normal) and pass it to setSidechain. Every other input is what gets
+ * compressed. Disconnecting or removing the key goes back to keying off the input.
+ * Parameters can be changed from any thread while the graph is running.
+ */
+class Compressor : public AudioNode {
 public:
-  MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::string samplesDir);
+  Compressor(const AudioContext& context, const CompressorConfig& config = {});
 
-  void playCue(const std::string& slug);
-  void stopCue();
+  // nullptr keys off the input itself again.
+  void setSidechain(const AudioNode* source);
+
+  void setThreshold(float threshold);
+  void setRatio(float ratio);
+  void setAttack(float attack);
+  void setRelease(float release);
+  void setMakeup(float makeup);
+
+  // dB currently taken off (before makeup), for meters.
+  float getGainReduction() const { return gainReduction.load(std::memory_order_relaxed); }
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void sourceDisconnected(const AudioNode& source) override;
+  // Sleeps once it has fully released.
+  bool canSleep() const override { return envelope == 0.0f; }
 
 private:
-  AudioGraph& graph;
-  std::unordered_map<std::string, Sampler*> samplers;
-  std::string currentCueSlug;
+  float keyLevel(const AudioBuffer& key) const;
+  float followEnvelope(float level);
+
+  std::atomic<float> threshold;
+  std::atomic<float> ratio;
+  std::atomic<float> attack;
+  std::atomic<float> release;
+  std::atomic<float> makeup;
+  // The key's output buffer, not the node: process() compares it against the `inputs` pointers
+  // to tell the key apart from the signal being compressed.
+  std::atomic<const AudioBuffer*> sidechain { nullptr };
+  std::atomic<float> gainReduction { 0.0f };
+
+  float envelope = 0.0f; // Linear peak level.
+  float currentGain = 1.0f;
+  std::vector<const AudioBuffer*> mainInputs; // Reused every block.
 };
 
-    
-class NoiseGenerator : public AudioNode {
-    public:
-    NoiseGenerator(const AudioContext& context);
-    
-    void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
-    
-    private:
-    std::random_device randomDevice;
-    std::mt19937 randomGen;
-    std::uniform_real_distribution<float> dist;
-};
-    
 
+/**
+ * Radix-2 FFT for real signals.
+ * A real transform of `size` samples is done as a complex transform of size/2 plus a
+ * split step, so it costs about half a full complex FFT. Twiddles and the bit reversal
+ * table are built once in the constructor, forward/inverse don't allocate.
+ * Not thread safe, each thread needs its own instance (it keeps a scratch buffer).
+ */
+class FFT {
+public:
+  // `size` must be a power of two, at least 4.
+  explicit FFT(int size);
 
-struct SamplePackItem {
-  std::string slug;
-  std::string fileName;
-  int polyphony;
-  bool loop;
-  float gain;
-  int pitchShift;
-  std::optional<EnvConfig> envConfig;
-  std::optional<FilterConfig> filterConfig;
+  int getSize() const;
+  // Bins in a spectrum, DC through Nyquist.
+  int getNumBins() const;
 
-  // Constructor enforces required fields and default value for polyphony.
-  SamplePackItem(
-    std::string slug,
-    std::string fileName,
-    int polyphony = 1,
-    bool loop = false,
-    float gain = 1.0,
-    int pitchShift = 0,
-    std::optional<EnvConfig> env = std::nullopt,
-    std::optional<FilterConfig> filterConfig = std::nullopt
-  ) : slug(slug), fileName(fileName), polyphony(polyphony), loop(loop),
-      gain(gain), pitchShift(pitchShift), envConfig(env), filterConfig(filterConfig) {}
+  // `size` real samples in, getNumBins() bins out.
+  void forward(const float* input, std::complex<float>* spectrum);
+  // getNumBins() bins in, `size` real samples out. Scaled so inverse(forward(x)) == x.
+  void inverse(const std::complex<float>* spectrum, float* output);
+
+private:
+  void transform(std::complex<float>* data, bool inverse) const;
+
+  int size;
+  int half;
+  std::vector<int> bitReverse;
+  std::vector<std::complex<float>> twiddles;     // e^(-2*pi*i*k/half), for the complex transform.
+  std::vector<std::complex<float>> realTwiddles; // e^(-2*pi*i*k/size), for the split step.
+  std::vector<std::complex<float>> scratch;
+};
+
+
+/**
+ * Flushes denormals to zero (FTZ and DAZ) on the current thread while in scope.
+ * Filter and envelope tails decay into denormals, which are very slow on x86.
+ * The previous mode is restored on exit, so it's fine on threads we don't own.
+ * Does nothing on CPUs other than x86 with SSE and 64 bit ARM.
+ */
+class ScopedFlushDenormals {
+public:
+  ScopedFlushDenormals();
+  ~ScopedFlushDenormals();
+
+  ScopedFlushDenormals(const ScopedFlushDenormals&) = delete;
+  ScopedFlushDenormals& operator=(const ScopedFlushDenormals&) = delete;
+
+private:
+  unsigned long long previous = 0;
+};
+
+enum class ThreadPriority {
+  Normal,
+  // SCHED_FIFO (time critical on Windows), a little below the audio callback.
+  // Usually needs privileges, e.g. an rtprio limit on Linux.
+  Realtime,
+};
+
+// False if the OS refused.
+bool setThreadPriority(std::thread& thread, ThreadPriority priority);
+bool setCurrentThreadPriority(ThreadPriority priority);
+
+// Priority for worker threads the audio callback relies on (ConvolutionReverb's tail worker).
+// Picked up when they start, so set it before building the graph.
+void setWorkerThreadPriority(ThreadPriority priority);
+ThreadPriority getWorkerThreadPriority();
+
+// Hands work from the audio thread to a worker. signal() never locks or blocks (it posts a
+// semaphore), wait() blocks until signalled. A signal sent before the wait isn't lost.
+class WakeSignal {
+public:
+  WakeSignal();
+  ~WakeSignal();
+
+  WakeSignal(const WakeSignal&) = delete;
+  WakeSignal& operator=(const WakeSignal&) = delete;
+
+  void signal();
+  void wait();
+
+private:
+  void* semaphore = nullptr;
+};
+
+// Keeps a range in RAM. False if refused, e.g. over RLIMIT_MEMLOCK.
+bool lockMemory(const void* data, size_t bytes);
+void unlockMemory(const void* data, size_t bytes);
+// Everything mapped now and later, not available on Windows.
+bool lockProcessMemory();
+
+// Reads a byte from every page so it's mapped in now rather than on first use.
+void prefaultMemory(const void* data, size_t bytes);
+
+
+// How a decoded sample is kept in memory.
+// Everything is still decoded/resampled to the output format at load time,
+// only the in-memory representation changes.
+enum class SampleFormat {
+  Float32,  // 4 bytes per sample, no conversion while rendering.
+  Int16,    // 2 bytes per sample, converted to float while rendering.
+  ImaAdpcm  // ~4 bits per sample, block decoded while rendering.
+};
+
+// A loop inside a sample. In seconds so the points stay put when a sample is resampled,
+// for frame exact points divide the frame by the file's sample rate.
+struct SampleLoop {
+  double start = 0.0;
+  double end = 0.0; // 0 is the end of the sample.
+  // Fades the end of the loop into what comes before its start, so the wrap doesn't click.
+  // Needs that much audio before the start, it's shortened if there isn't.
+  double crossfade = 0.0;
+};
+
+class SampleData {
+public:
+  SampleData(const AudioContext& context, SampleFormat format = SampleFormat::Float32);
+  ~SampleData();
+
+  // Convenience for loaders, always returns data (empty if the file failed to load).
+  static std::shared_ptr<const SampleData> fromFile(const AudioContext& context, const std::string& path, SampleFormat format);
+
+  // Decode a file with miniaudio at the context's channel count and sample rate.
+  // Also picks up the first loop of a WAV's smpl chunk, if it has one.
+  bool loadFile(const std::string& path);
+
+  // Store already decoded, interleaved float samples in this object's format.
+  void setSamples(const std::vector<float>& samples);
+
+  // Wraps already encoded data that lives elsewhere (e.g. a mapped bank file) without copying.
+  // `owner` keeps that memory alive for as long as the returned data is used.
+  static std::shared_ptr<const SampleData> fromEncoded(
+    const AudioContext& context,
+    SampleFormat format,
+    int numSamples,
+    const void* encodedData,
+    const void* blockHeaders,
+    std::shared_ptr<const void> owner,
+    std::optional<SampleLoop> loop = std::nullopt
+  );
+
+  // Copy of the first `count` samples (rounded up to a whole block for ADPCM), same format.
+  std::shared_ptr<const SampleData> copyPrefix(int count) const;
+
+  // Copy at another sample rate, same format and loop (cubic interpolation, no anti-aliasing filter).
+  // Slow, for reconfiguring a running graph, not for the audio thread.
+  std::shared_ptr<const SampleData> resampled(float newSampleRate) const;
+  static int resampledFrames(int numFrames, float fromRate, float toRate);
+
+  // Raw encoded bytes, in the layout fromEncoded expects. Block headers are empty unless ADPCM.
+  const void* getEncodedData() const;
+  size_t getEncodedSize() const;
+  const void* getBlockHeaders() const;
+  size_t getBlockHeadersSize() const;
+
+  // Read `count` interleaved samples starting at sample index `start` into `dest`, scaled by `gain`.
+  // Range must lie inside the sample.
+  void read(int start, float* dest, int count, float gain) const;
+
+  // Keeps the data in RAM until it's destroyed, so reading it never page faults.
+  // False if the OS refused (see lockMemory in Realtime.h).
+  bool lockMemory() const;
+
+  // Loop stored with the sample (from the file), samplers can override it.
+  const std::optional<SampleLoop>& getLoop() const { return loop; }
+  void setLoop(std::optional<SampleLoop> newLoop) { loop = newLoop; }
+
+  int size() const;
+  int getNumChannels() const;
+  int getNumFrames() const;
+  float getSampleRate() const;
+  SampleFormat getFormat() const;
+  size_t getMemoryUsage() const;
+
+  // Frames per independently decodable ADPCM block.
+  static constexpr int adpcmBlockFrames = 64;
+  static constexpr int maxChannels = 8;
+
+private:
+  struct AdpcmBlockHeader {
+    int16_t predictor;
+    uint8_t stepIndex;
+    uint8_t reserved = 0; // Keeps the layout explicit, headers get written to bank files.
+  };
+
+  void encodeAdpcm(const std::vector<float>& samples);
+  void decodeAdpcmBlock(int blockIndex, float* dest) const;
+  size_t encodedSizeFor(int sampleCount) const;
+  void pointAtOwnedData();
+
+  SampleFormat format;
+  int channels;
+  float sampleRate;
+  int numSamples;
+  std::optional<SampleLoop> loop;
+
+  // Owned storage, only one is used depending on format. Empty when wrapping external data.
+  std::vector<float> floatData;
+  std::vector<int16_t> int16Data;
+  std::vector<uint8_t> adpcmData; // 4 bit codes, per block then per channel.
+  std::vector<AdpcmBlockHeader> adpcmHeaders; // One per block per channel.
+
+  // What read() actually uses, points into the vectors above or into external memory.
+  const void* encoded = nullptr;
+  const AdpcmBlockHeader* blockHeaders = nullptr;
+  std::shared_ptr<const void> externalOwner;
+  mutable bool memoryLocked = false;
+};
+
+
+/**
+ * Convolves its input with an impulse response (uniformly partitioned overlap-save).
+ * The IR is cut into partitions of one block (bufferSize rounded up to a power of two) and each
+ * partition's spectrum is precomputed. Every block costs one forward and one inverse FFT plus a
+ * complex multiply-add per partition, so cost grows with IR length but stays flat per block.
+ *
+ * Only the first `headPartitions` are done in the audio callback. An input only reaches the rest
+ * (the tail) `headPartitions` partitions after it arrives, so a worker thread works out its tail
+ * share straight away and the callback adds the finished sums when they're due. Long IRs then
+ * cost the callback about as much as short ones, and with the default two head partitions the
+ * worker has a partition to spare.
+ * The callback never waits on the worker. A sum that isn't finished in time is mixed in as soon
+ * as it is, late but not dropped, and if the worker falls a few partitions behind the callback
+ * does the tail for new input itself until it catches up. Rendering faster than real time
+ * (offline) can get ahead of the worker like that too, set headPartitions to cover the whole IR
+ * when output has to be sample exact.
+ *
+ * Outputs the wet signal only, connect the dry path alongside it (or use it on a send bus).
+ * No added latency when bufferSize is a power of two, otherwise one partition.
+ * Channels are convolved independently with the matching IR channel.
+ */
+class ConvolutionReverb : public AudioNode {
+public:
+  // Decodes the IR with miniaudio at the context's channel count and sample rate.
+  ConvolutionReverb(const AudioContext& context, const std::string& impulsePath, float gain = 1.0f, int headPartitions = 2);
+  ConvolutionReverb(const AudioContext& context, std::shared_ptr<const SampleData> impulse, float gain = 1.0f, int headPartitions = 2);
+  ~ConvolutionReverb() override;
+
+  void setGain(float gain);
+  int getLatencyFrames() const;
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+
+  // Sleeps once the tail has rung out and the state has been cleared.
+  bool canSleep() const override { return settled; }
+
+  // The IR is resampled and its spectra rebuilt for the new partition size up front,
+  // switching over drops whatever is still ringing out.
+  void prepareAudioContext(const AudioContext& context) override;
+  void setAudioContext(const AudioContext& context) override;
+
+private:
+  // What depends on the block size and sample rate. Built off the audio thread.
+  struct Layout {
+    std::shared_ptr<const SampleData> impulse;
+    int partitionFrames = 0;
+    int numPartitions = 0;
+    int irFrames = 0;
+    std::vector<std::complex<float>> irSpectra;
+  };
+
+  Layout buildLayout(const AudioContext& context, std::shared_ptr<const SampleData> impulse) const;
+  void useLayout(Layout layout, int bufferSize);
+  void stopWorker();
+
+  void convolvePartition();
+  void accumulateHead();
+  void mixTails();
+  void queueTail(const std::complex<float>* spectrum);
+  void addTail(const std::complex<float>* spectrum, int64_t input, std::vector<std::complex<float>>& sums, int numSums);
+  bool finishTails(int64_t until);
+  void tailWorker();
+  void clearState();
+
+  std::complex<float>* irSpectrum(int channel, int partition);
+  // All channels of entry `index` in a ring of `size` spectra.
+  std::complex<float>* spectra(std::vector<std::complex<float>>& ring, int64_t index, int size);
+
+  std::shared_ptr<const SampleData> impulse;
+  std::unique_ptr<Layout> pendingLayout;
+  int requestedHeadPartitions;
+
+  int channels;
+  int partitionFrames;
+  int numBins;
+  int numPartitions;
+  int headPartitions;
+  int tailPartitions; // numPartitions - headPartitions
+  int tailFrames; // How long output continues after the input stops.
+  bool zeroLatency;
+  FFT fft;
+  std::atomic<float> gain;
+
+  // The IR is [channel][partition][bin]. Rings are [entry][channel][bin], one entry per
+  // partition of input or output, found by its index modulo the ring size.
+  std::vector<std::complex<float>> irSpectra;
+  std::vector<std::complex<float>> headInputs; // The last headPartitions input spectra.
+  int64_t newestInput = -1; // Partitions are counted from the start.
+
+  std::vector<float> inputHistory; // [channel][2 * partitionFrames], previous then current partition.
+  std::vector<std::complex<float>> headSum; // [channel][bin]
+  std::vector<float> timeScratch;
+
+  // Interleaved partition FIFOs, so blocks don't have to line up with partitions.
+  std::vector<float> inputFifo;
+  std::vector<float> outputFifo;
+  int fifoPosition = 0;
+
+  int silentFrames = 0;
+  bool settled = true;
+
+  // Tail worker. The audio thread queues each input's spectrum, the worker adds it into the
+  // tail sums of the outputs it reaches and hands over each sum once no queued input can
+  // add to it any more. Neither side takes a lock, the counters say who owns what.
+  static constexpr int maxQueuedTails = 4;
+  std::thread worker;
+  WakeSignal workerWake;
+  std::atomic<bool> stopping { false };
+  std::vector<std::complex<float>> queuedInputs; // Ring of maxQueuedTails.
+  std::vector<int64_t> queuedIndices; // Which input each of those is.
+  std::atomic<int64_t> tailsQueued { 0 };
+  std::atomic<int64_t> tailsDone { 0 };
+  std::vector<std::complex<float>> workerSums; // Worker only, ring of tailPartitions outputs.
+  std::vector<std::complex<float>> finishedSums; // Ring of numFinishedSums outputs.
+  int numFinishedSums = 0;
+  std::atomic<int64_t> tailsFinished { 0 }; // Outputs below this are in finishedSums.
+  std::atomic<int64_t> tailsMixed { 0 }; // Outputs below this have been mixed.
+  // Tails the audio thread did itself while the queue was full, ring of numPartitions outputs.
+  std::vector<std::complex<float>> ownSums;
+  int64_t ownSumsUntil = 0;
+};
+
+
+// What a duplex device captured for the block being rendered. Set by the engine's callback
+// right before processGraph and cleared after, so it never points at a stale callback buffer.
+struct CaptureInput {
+  const float* samples = nullptr; // Interleaved, same channel count as the graph.
+  int numFrames = 0;
+};
+
+/**
+ * Brings captured audio (mic, line in) into the graph, from the same callback it's rendered
+ * in, so there's no buffering between capture and output. Needs an Engine opened in duplex
+ * mode: graph.addNode<InputNode>(engine.capture).
+ * Like any node without destinations, an unconnected input goes straight to the output,
+ * mind the feedback.
+ */
+class InputNode : public AudioNode {
+public:
+  InputNode(const AudioContext& context, const CaptureInput& capture);
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+
+private:
+  const CaptureInput& capture;
+};
+
+
+/**
+ * Watches how long each callback takes against the block's deadline and picks a Quality.
+ * Load is smoothed with a fast attack and slow release, so one slow block is enough to
+ * react to but it takes a while of headroom to count as recovered. Quality steps down one
+ * level at a time while the load is above stepDownLoad, and back up one level at a time
+ * after it has stayed under stepUpLoad for about a second.
+ */
+class LoadGovernor {
+public:
+  explicit LoadGovernor(const AudioContext& context);
+
+  // Call from the audio thread once per block with the time spent rendering it.
+  // Returns the quality the next block should use.
+  Quality update(double seconds);
+
+  Quality getQuality() const { return quality.load(std::memory_order_relaxed); }
+  // Smoothed fraction of the block deadline spent rendering, 1 is a dropout.
+  float getLoad() const { return load.load(std::memory_order_relaxed); }
+
+  // Off means full quality always, load is still tracked.
+  void setEnabled(bool enabled);
+  void setAudioContext(const AudioContext& context);
+
+  float stepDownLoad = 0.8f;
+  float stepUpLoad = 0.5f;
+
+private:
+  double deadline; // Seconds per block.
+  int recoveryBlocks; // About a second of blocks.
+  float smoothedLoad = 0.0f;
+  int blocksAtLevel = 0;
+  int blocksWithHeadroom = 0;
+  std::atomic<bool> enabled { true };
+  std::atomic<Quality> quality { Quality::Full };
+  std::atomic<float> load { 0.0f };
+};
+
+
+struct CallbackData {
+  AudioGraph* graph = nullptr;
+  AudioBuffer* graphOutput = nullptr;
+  AudioContext* globalContext = nullptr;
+  LoadGovernor* governor = nullptr;
+  CaptureInput* capture = nullptr;
+};
+
+class Engine {
+public:
+  // Duplex also opens the default capture device, with as many channels as the output,
+  // and hands its audio to InputNodes built from capture.
+  Engine(AudioContext globalContext, bool duplex = false);
+  ~Engine();
+
+  AudioContext globalContext;
+  AudioGraph graph;
+  AudioBuffer output;
+  // Lowers the graph's quality when callbacks get close to their deadline.
+  LoadGovernor governor;
+  // Captured audio for the block being rendered, empty unless duplex.
+  CaptureInput capture;
+
+  void start();
+  void stop();
+
+  // Switches to a new block size and/or sample rate without rebuilding anything. The graph
+  // resamples and resizes everything while the current device keeps playing, then the
+  // device is restarted with the new settings (a short gap). The device may pick another
+  // block size, globalContext has the one in use afterwards.
+  void reconfigure(int bufferSize, float sampleRate);
+
+  // Locks all of the process's memory, now and later, so the callback never page faults on
+  // samples or graph memory that's gone idle. Off by default, it locks the whole game too.
+  // Needs a high enough RLIMIT_MEMLOCK (or privileges), false if refused. Use
+  // SamplePack::lockSampleMemory to lock just the samples.
+  bool lockMemory();
+  // For threads the callback waits on, e.g. convolution reverb tails. Set before building
+  // the graph. Miniaudio already runs the callback itself at high priority.
+  void setWorkerPriority(ThreadPriority priority);
+
+private:
+  void initMiniaudio();
+
+  bool duplex;
+
+  // Miniaudio
+  ma_result result;
+  ma_device_config config;
+  ma_device device;
+  CallbackData cbData;
+};
+
+
+class Gain : public AudioNode {
+public:
+    explicit Gain(const AudioContext& context, float gain);
+
+    void setGain(float gain);
+    void virtual process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+    bool canSleep() const override { return true; }
+    bool isFusable() const override { return true; }
+    void processTile(const float* in, float* out, int numFrames) override;
+
+private:
+    float gain;
+};
+
+
+// BS.1770's absolute gate, what a Meter reports as the loudness of silence.
+constexpr float meterSilenceLufs = -70.0f;
+
+// Levels from the last block a Meter processed.
+struct MeterReading {
+  int numChannels = 0;
+  float peak[maxDspChannels] = {}; // Linear, largest absolute sample.
+  float rms[maxDspChannels] = {}; // Linear.
+  // Short-term loudness (BS.1770, K-weighted over the last 3 seconds), all channels together.
+  // Only measured when the meter was built with loudness on, meterSilenceLufs otherwise.
+  float loudness = meterSilenceLufs;
+};
+
+/**
+ * Passes its input through unchanged and measures it: per channel peak and RMS every block,
+ * and optionally short-term loudness for ducking or a loudness UI. Any thread can call
+ * getReading() at any time, it never blocks or slows down the audio thread.
+ * Meters keep running while their input is silent so the reading drops to zero.
+ */
+class Meter : public AudioNode {
+public:
+  Meter(const AudioContext& context, bool measureLoudness = false);
+
+  // A consistent snapshot, never half of one block and half of the next.
+  MeterReading getReading() const;
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void setAudioContext(const AudioContext& context) override;
+
+private:
+  // One biquad of the K-weighting filter, state per channel.
+  struct KStage {
+    double b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+    double z1[maxDspChannels] = {}, z2[maxDspChannels] = {};
+  };
+
+  void measure(const AudioBuffer& input);
+  void measureLoudness(const AudioBuffer& input);
+  void setupLoudness(const AudioContext& context);
+  void publish(const MeterReading& reading);
+
+  bool loudnessEnabled;
+  KStage shelf; // Head response, +4dB above ~1.5kHz.
+  KStage highpass; // Takes out the lows, ~38Hz.
+  // K-weighted energy of each block in the window, summed over channels.
+  std::vector<double> blockEnergy;
+  size_t blockIndex = 0;
+  float loudness = meterSilenceLufs;
+
+  // Seqlock, odd while the audio thread is writing. Readers retry instead of waiting.
+  std::atomic<unsigned> sequence { 0 };
+  std::atomic<int> publishedChannels { 0 };
+  std::atomic<float> publishedPeak[maxDspChannels] = {};
+  std::atomic<float> publishedRms[maxDspChannels] = {};
+  std::atomic<float> publishedLoudness { meterSilenceLufs };
+};
+
+
+/**
+ * Sums any number of inputs, each with its own gain, plus a master gain.
+ * This is the node to use for buses (a pack's output, a group of sounds, etc.).
+ * Built for wide fan-in: inputs are mixed four at a time, so 100 samplers cost
+ * ~25 passes over the output buffer instead of 100, and there's no separate clear pass.
+ */
+class Mixer : public AudioNode {
+public:
+  explicit Mixer(const AudioContext& context, float gain = 1.0f);
+
+  void setGain(float gain);
+
+  // Gain for one source node's signal. Sources without one are mixed at unity.
+  // Giving a new source a gain while the graph is running needs graph.lockGraph(),
+  // changing an existing source's gain doesn't. Forgotten once the source is disconnected.
+  void setInputGain(const AudioNode* source, float gain);
+  float getInputGain(const AudioNode* source) const;
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void sourceDisconnected(const AudioNode& source) override;
+  bool canSleep() const override { return true; }
+
+private:
+  float gainFor(const AudioBuffer* input) const;
+
+  std::atomic<float> gain;
+  // Keyed by the source's output buffer, that's what process() gets handed.
+  std::unordered_map<const AudioBuffer*, std::atomic<float>> inputGains;
+};
+
+
+struct SampleRequest {
+  std::string path;
+  SampleFormat storage = SampleFormat::Float32;
+};
+
+// Called with the number of decoded files so far and the total number of files.
+// Runs on a loader thread, keep it short and thread safe.
+using LoadProgressCallback = std::function<void(int loaded, int total)>;
+
+// One result per request, in request order. Requests for the same file/format share data.
+using LoadCompleteCallback = std::function<void(std::vector<std::shared_ptr<const SampleData>>)>;
+
+/**
+ * Small thread pool used to decode samples off the game/audio threads.
+ * A loader can be shared by any number of packs and orchestrators and must outlive their loads.
+ */
+class SampleLoader {
+public:
+  explicit SampleLoader(int numThreads = 0); // 0 picks a count from the hardware.
+  ~SampleLoader();
+
+  SampleLoader(const SampleLoader&) = delete;
+  SampleLoader& operator=(const SampleLoader&) = delete;
+
+  void enqueue(std::function<void()> job);
+
+  // Decodes every request in parallel. `onComplete` runs once, on whichever worker finishes last.
+  void loadBatch(
+    const AudioContext& context,
+    const std::vector<SampleRequest>& requests,
+    LoadCompleteCallback onComplete,
+    LoadProgressCallback onProgress = nullptr
+  );
+
+  // Synchronous version of loadBatch for the blocking constructors.
+  static std::vector<std::shared_ptr<const SampleData>> loadAll(
+    const AudioContext& context,
+    const std::vector<SampleRequest>& requests
+  );
+
+private:
+  void workerLoop();
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> jobs;
+  std::mutex jobsMutex;
+  std::condition_variable jobsAvailable;
+  bool stopping = false;
+};
+
+
+class SampleResidency;
+
+/**
+ * The sample data a Sampler plays from.
+ * The head (first block of frames) is always in memory so triggers start instantly. The rest
+ * (the body) can be evicted by a SampleResidency and is reloaded in the background the next
+ * time the sample is triggered. Body frames that aren't back yet play as silence.
+ * Samples that aren't managed by a SampleResidency simply stay fully resident.
+ */
+class ResidentSample : public std::enable_shared_from_this<ResidentSample> {
+public:
+  explicit ResidentSample(std::shared_ptr<const SampleData> data);
+  ~ResidentSample();
+
+  ResidentSample(const ResidentSample&) = delete;
+  ResidentSample& operator=(const ResidentSample&) = delete;
+
+  int size() const;
+  int getNumChannels() const;
+  bool isFullyResident() const;
+  int getUnderruns() const; // Reads that hit evicted frames.
+
+  // Audio thread. Same contract as SampleData::read.
+  void read(int start, float* dest, int count, float gain) const;
+
+  // Call on trigger (game thread) so the residency manager can mark it used and reload it.
+  void touch();
+  // Samplers hold a pin while any of their voices play the sample, so a long looping cue
+  // isn't evicted just because it was triggered a while ago. Any thread, never blocks.
+  void pin();
+  void unpin();
+
+  // Changing the sample rate of a running graph. prepareSampleRate resamples off the audio
+  // thread while the old data keeps playing, applySampleRate swaps the result in and must
+  // be called while nothing reads the sample (under the graph lock). Shared samples only
+  // do the work once.
+  void prepareSampleRate(float sampleRate);
+  void applySampleRate();
+  float getSampleRate() const;
+  const std::optional<SampleLoop>& getLoop() const { return loop; }
+
+  // Locks the head in RAM, and the rest too unless a SampleResidency manages it (that part
+  // comes and goes anyway). Stays locked across sample rate changes.
+  bool lockMemory();
+
+private:
+  friend class SampleResidency;
+
+  std::shared_ptr<const SampleData> head;
+  std::shared_ptr<const SampleData> full; // Owned by the manager side, guarded by its mutex.
+  std::atomic<const SampleData*> body { nullptr }; // What the audio thread reads, null when evicted.
+  mutable std::atomic<int> readers { 0 };
+  mutable std::atomic<int> underruns { 0 };
+  std::atomic<int> pins { 0 };
+  int numSamples;
+  int channels;
+  float sampleRate;
+  std::optional<SampleLoop> loop; // In seconds, so it's the same at any rate.
+
+  // Resampled by prepareSampleRate, waiting for applySampleRate.
+  std::shared_ptr<const SampleData> pendingHead;
+  std::shared_ptr<const SampleData> pendingFull;
+  bool memoryLocked = false;
+
+  // Set when managed. `context` is what the file is decoded at, reloads are resampled to
+  // sampleRate if that has changed since.
+  SampleResidency* residency = nullptr;
+  AudioContext context {};
+  std::string path;
+  SampleFormat storage = SampleFormat::Float32;
+  bool reloading = false;
+  std::list<ResidentSample*>::iterator lruPosition;
 };
 
-class SamplePack {
-public:
-  SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, std::string samplesDir, float gain = 1.0);
-  void triggerSample(std::string slug);
+/**
+ * Keeps the evictable part of managed samples under a byte budget.
+ * Bodies are evicted least-recently-triggered first, skipping the sample being loaded or touched
+ * and any that are still playing (pinned). Those can push it over budget until they stop.
+ * Heads are always resident and aren't counted against the budget.
+ * Must outlive the samples it manages, and `loader` must outlive it.
+ */
+class SampleResidency {
+public:
+  SampleResidency(SampleLoader& loader, size_t budgetBytes, int headFrames = 16384);
+
+  // Decodes a file now and starts managing it. Same path/format pairs share one sample.
+  std::shared_ptr<ResidentSample> load(const AudioContext& context, const std::string& path, SampleFormat storage);
+
+  void setBudget(size_t budgetBytes);
+  size_t getBudget() const;
+  size_t getResidentBytes() const;
+
+private:
+  friend class ResidentSample;
+
+  void touch(ResidentSample* sample);
+  void forget(ResidentSample* sample);
+  void finishReload(ResidentSample* sample, std::shared_ptr<const SampleData> data);
+  void makeResident(ResidentSample* sample, std::shared_ptr<const SampleData> data);
+  void evict(ResidentSample* sample);
+  void enforceBudget(ResidentSample* keep);
+
+  SampleLoader& loader;
+  size_t budgetBytes;
+  size_t residentBytes = 0;
+  int headFrames;
+
+  mutable std::mutex mutex;
+  std::list<ResidentSample*> lru; // Most recently triggered at the front.
+  std::unordered_map<std::string, std::weak_ptr<ResidentSample>> samples;
+};
+
+
+struct SamplerVoice;
+
+// Where a looping sampler's voices wrap, as interleaved sample indices into the sample at its
+// current rate (see Sampler::setLoopPoints).
+struct LoopRegion {
+  int start = 0;
+  int end = 0;
+  int crossfade = 0; // Samples before `end` that fade into the ones before `start`.
+};
+
+// Runs a voice's DSP over `numFrames` interleaved frames in place.
+using VoiceChainFn = void (*)(SamplerVoice& voice, float* samples, int numFrames, int numChannels);
+
+// Consider making SamplerVoice its own class..
+struct SamplerVoice {
+  int playheadIndex = 0;
+  bool active = false;
+  float triggerGain = 1.0f; // Per trigger, on top of the sampler's gain.
+  int basePitch; // The item's own shift, per trigger pitch is added to it.
+
+  // Only the processors the item is configured with exist, stored inline in the voice.
+  std::optional<EnvelopeProcessor> envelope;
+  std::optional<PitchShiftProcessor> pitchShifter;
+  std::optional<BiquadProcessor> filter;
+
+  AudioBuffer voiceBuffer;
+
+  SamplerVoice(
+    const AudioContext& context,
+    int pitchShift,
+    const std::optional<EnvConfig>& envConfig,
+    const std::optional<FilterConfig>& filterConfig
+  ) : basePitch(pitchShift), voiceBuffer(context) {
+    if (envConfig.has_value()) envelope.emplace(context.sampleRate, *envConfig);
+    if (pitchShift != 0) pitchShifter.emplace(context, pitchShift);
+    if (filterConfig.has_value()) {
+      requireDspChannels(context.numChannels, "Sampler voice filter");
+      filter.emplace(context.sampleRate, *filterConfig);
+    }
+  }
+
+  // Only voices of pitch shifted items have a shifter, others play at their own pitch.
+  void trigger(float gain = 1.0f, int semitones = 0) {
+    playheadIndex = 0;
+    active = true;
+    triggerGain = gain;
+    if (envelope) envelope->noteOn();
+    if (pitchShifter) {
+      pitchShifter->setPitch(basePitch + semitones);
+      pitchShifter->reset();
+    }
+  }
+
+  // `loop` is null for one shots. `crossfadeScratch` holds a block, only used in crossfades.
+  void processVoice(
+    const ResidentSample& sample,
+    AudioBuffer& outputBuffer,
+    const LoopRegion* loop,
+    float gain,
+    VoiceChainFn renderChain,
+    float* crossfadeScratch
+  ) {
+    if (!active) return;
+
+    // Nothing to play if the sample failed to load.
+    if (sample.size() == 0) {
+      active = false;
+      return;
+    }
+
+    voiceBuffer.clear();
+    const int end = loop ? loop->end : sample.size();
+    const int fadeStart = loop ? loop->end - loop->crossfade : end;
+    int writeIndex = 0;
+    while (writeIndex < voiceBuffer.size()) {
+      // If voice has reached the end of the sample (or loop).
+      if (playheadIndex >= end) {
+        if (loop) {
+          // The envelope carries on, a held note just keeps going.
+          playheadIndex = wrapPlayhead(playheadIndex, *loop);
+        } else {
+          if (envelope) envelope->reset();
+          active = false;
+          playheadIndex = 0;
+          break;
+        }
+      }
+
+      // Write sample data into voiceBuffer, converting from the sample's storage format.
+      // Stops at the crossfade, that part is read separately.
+      const int stop = playheadIndex < fadeStart ? fadeStart : end;
+      int count = std::min(voiceBuffer.size() - writeIndex, stop - playheadIndex);
+      if (playheadIndex < fadeStart) {
+        sample.read(playheadIndex, &voiceBuffer[writeIndex], count, gain * triggerGain);
+      } else {
+        readCrossfade(sample, *loop, &voiceBuffer[writeIndex], count, gain * triggerGain, crossfadeScratch);
+      }
+      playheadIndex += count;
+      writeIndex += count;
+    }
+
+    // Apply per-voice DSP (pitch, envelope, filter) in one pass, see Sampler::selectVoiceChain.
+    renderChain(*this, voiceBuffer.data.data(), voiceBuffer.getNumFrames(), voiceBuffer.getNumChannels());
+
+    if (envelope && !envelope->isActive()) {
+      active = false;
+      playheadIndex = 0;
+    }
+
+    // Sum into main output buffer
+    outputBuffer += voiceBuffer;
+  }
+
+  // Moves the playhead and envelope on by a block without rendering anything, for voices
+  // too quiet to hear while the engine is under load.
+  void skipVoice(const ResidentSample& sample, const LoopRegion* loop) {
+    if (!active) return;
+
+    const int sampleSize = sample.size();
+    if (sampleSize == 0) {
+      active = false;
+      return;
+    }
+
+    playheadIndex += voiceBuffer.size();
+    if (playheadIndex >= (loop ? loop->end : sampleSize)) {
+      if (loop) {
+        playheadIndex = wrapPlayhead(playheadIndex, *loop);
+      } else {
+        if (envelope) envelope->reset();
+        active = false;
+        playheadIndex = 0;
+        return;
+      }
+    }
+
+    if (envelope) {
+      for (int i = 0; i < voiceBuffer.getNumFrames(); ++i) envelope->getNextLevel();
+      if (!envelope->isActive()) {
+        active = false;
+        playheadIndex = 0;
+      }
+    }
+  }
+
+  // New block size/sample rate. The playhead is moved to the same point in time of a
+  // sample resampled by `ratio` (new rate over old).
+  void setAudioContext(const AudioContext& context, double ratio, int sampleSize) {
+    voiceBuffer.setAudioContext(context);
+    if (envelope) envelope->setSampleRate(context.sampleRate);
+    if (pitchShifter) pitchShifter->setAudioContext(context);
+    if (filter) filter->setSampleRate(context.sampleRate);
+
+    const int channels = context.numChannels;
+    const int frame = static_cast<int>(playheadIndex / channels * ratio);
+    playheadIndex = std::min(frame * channels, sampleSize);
+  }
+
+  static int wrapPlayhead(int playhead, const LoopRegion& loop) {
+    return loop.start + (playhead - loop.start) % (loop.end - loop.start);
+  }
+
+  // `count` samples from the playhead, inside the crossfade, blended linearly from the loop's
+  // end into the same distance before its start. By the last frame it's all the audio just
+  // before the start, so wrapping there carries straight on.
+  void readCrossfade(const ResidentSample& sample, const LoopRegion& loop, float* dest, int count, float gain, float* scratch) const {
+    const int channels = sample.getNumChannels();
+    sample.read(playheadIndex, dest, count, gain);
+    sample.read(playheadIndex - (loop.end - loop.start), scratch, count, gain);
+
+    const float fadeFrames = static_cast<float>(loop.crossfade / channels);
+    const int firstFrame = (playheadIndex - (loop.end - loop.crossfade)) / channels;
+    for (int i = 0; i < count; ++i) {
+      const float t = (firstFrame + i / channels + 0.5f) / fadeFrames;
+      dest[i] += t * (scratch[i] - dest[i]);
+    }
+  }
+
+  // Roughly how loud the voice is right now, before the sample's own level.
+  float getLevel(float gain) const {
+    gain *= triggerGain;
+    return envelope ? gain * envelope->getLevel() : gain;
+  }
+};
+    
+class Sampler : public AudioNode {
+  public:
+  Sampler(
+    const AudioContext& context,
+    std::string samplePath,
+    int polyphony,
+    bool loop = false,
+    float gain = 1.0f,
+    int pitchShift = 0,
+    std::optional<EnvConfig> envConfig = std::nullopt,
+    std::optional<FilterConfig> filterConfig = std::nullopt,
+    SampleFormat storage = SampleFormat::Float32
+  );
+
+  // Plays already decoded data, lets several samplers share one sample.
+  Sampler(
+    const AudioContext& context,
+    std::shared_ptr<const SampleData> sample,
+    int polyphony,
+    bool loop = false,
+    float gain = 1.0f,
+    int pitchShift = 0,
+    std::optional<EnvConfig> envConfig = std::nullopt,
+    std::optional<FilterConfig> filterConfig = std::nullopt
+  );
+
+  // Plays a sample whose memory may be managed by a SampleResidency.
+  Sampler(
+    const AudioContext& context,
+    std::shared_ptr<ResidentSample> sample,
+    int polyphony,
+    bool loop = false,
+    float gain = 1.0f,
+    int pitchShift = 0,
+    std::optional<EnvConfig> envConfig = std::nullopt,
+    std::optional<FilterConfig> filterConfig = std::nullopt
+  );
+  ~Sampler() override;
+
+  // `gain` and `pitchShift` (semitones) apply to this note only, on top of the sampler's own.
+  // The pitch is ignored unless canPitchShift().
+  void noteOn(float gain = 1.0f, int pitchShift = 0);
+  void noteOff();
+  // noteOn without the residency bookkeeping, which takes a lock. For the audio thread,
+  // whoever queued the trigger calls touchSample() instead (see SampleTriggerNode).
+  void startVoice(float gain = 1.0f, int pitchShift = 0);
+  void touchSample();
+  // Only samplers built with a pitch shift get a shifter on their voices. The rest skip
+  // it entirely, so they can't be shifted per note either.
+  bool canPitchShift() const { return pitchShift != 0; }
+  // See ResidentSample::lockMemory.
+  bool lockSampleMemory();
+  SamplerVoice* allocateVoice();
+
+  // Where looping voices wrap, instead of the sample's own loop (a WAV's smpl chunk) or, without
+  // one, the whole sample. nullopt goes back to that. Only used when the sampler loops.
+  // Needs graph.lockGraph() while the graph is running.
+  void setLoopPoints(std::optional<SampleLoop> points);
+
+  // Picks the chain specialization for the configured stages. Unconfigured stages aren't
+  // compiled into it at all, so a voice with no pitch/envelope/filter renders nothing extra.
+  static VoiceChainFn selectVoiceChain(bool pitch, bool envelope, bool filter);
+  
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void setQuality(Quality quality) override;
+  // Resamples the sample, then swaps it in and resizes every voice.
+  void prepareAudioContext(const AudioContext& context) override;
+  void setAudioContext(const AudioContext& context) override;
+  
+  private:
+  // Voices quieter than this (about -60dB) are virtual at Quality::VirtualVoices.
+  static constexpr float virtualVoiceLevel = 0.001f;
+
+  // Works loopPoints (or the sample's loop) out in samples at the sample's current rate.
+  void updateLoopRegion();
+  // Pins the sample while any voice is active, see ResidentSample::pin.
+  void updateSamplePin();
+
+  int polyphony;
+  int voiceLimit; // Voices new notes may use, lowered under load.
+  Quality quality = Quality::Full;
+  std::shared_ptr<ResidentSample> sample;
+  bool pinsSample = false;
+  std::vector<SamplerVoice> voices;
+  std::list<SamplerVoice*> activeVoices; // indicies per voice of `voices` vector above.
+  bool loop;
+  std::optional<SampleLoop> loopPoints;
+  LoopRegion loopRegion;
+  std::vector<float> crossfadeScratch; // A block, for voices in a loop crossfade.
+  float gain;
+  int pitchShift;
+  std::optional<EnvConfig> envConfig;
+  std::optional<FilterConfig> filterConfig;
+  VoiceChainFn voiceChain;
+};
+    
+
+
+// Per-item send levels, keyed by bus name. Items leave out the buses they don't use.
+using SendLevels = std::unordered_map<std::string, float>;
+
+/**
+ * Send/return buses for a group of sources (a pack's samplers, a set of cues).
+ * Each bus is a Mixer that sums every source at its own send level, feeding one shared
+ * effect node whose output is returned into the group's output bus. The effect runs
+ * once per block however many sources send to it, instead of once per source (or voice).
+ *
+ * A source joins a bus the first time its send level is above zero, so unused sends cost
+ * nothing. Sends are taken after the source's own gain (post-fader).
+ */
+class SendBuses {
+public:
+  explicit SendBuses(AudioGraph& graph);
+
+  // Where bus effects return to. Must be set before any bus is added.
+  void setReturnNode(int nodeId);
+
+  // Registers a source node and its initial send levels (including buses not added yet).
+  void addSource(const std::string& slug, int nodeId, const AudioNode* node, SendLevels levels);
+
+  // Adds a bus feeding `effect` and connects every source with a level for it, as one graph edit.
+  // Throws if the name is taken.
+  AudioNode* addBus(const std::string& name, std::unique_ptr<AudioNode> effect);
+
+  // Safe while the graph is running. Only locks the graph when a source first joins a bus.
+  void setSendLevel(const std::string& slug, const std::string& bus, float level);
+  float getSendLevel(const std::string& slug, const std::string& bus) const;
+
+  AudioNode* getEffect(const std::string& bus) const;
+
+private:
+  struct Source {
+    int nodeId;
+    const AudioNode* node;
+    SendLevels levels;
+  };
+
+  struct Bus {
+    int sendNodeId;
+    Mixer* send;
+    int effectNodeId;
+    AudioNode* effect;
+    std::unordered_set<std::string> connected; // Source slugs.
+  };
+
+  void connectSource(Bus& bus, const std::string& slug, const Source& source, float level);
+
+  AudioGraph& graph;
+  int returnNodeId = -1;
+  std::unordered_map<std::string, Source> sources;
+  std::unordered_map<std::string, Bus> buses;
+};
+
+
+class Sampler;
+
+// Compact id for a pack item or music cue, from SamplePack::getHandle etc. Index based,
+// so triggering by handle is an array lookup instead of hashing the slug.
+using SampleHandle = int;
+constexpr SampleHandle invalidSampleHandle = -1;
+
+struct SampleTrigger {
+  SampleHandle handle;
+  float gain = 1.0f; // On top of the item's own gain.
+  // Semitones on top of the item's own shift. Only items built with a pitch shift have a
+  // shifter on their voices, pushing a nonzero one for any other item fails.
+  int pitchShift = 0;
+  bool release = false; // noteOff instead of noteOn.
+};
+
+/**
+ * Single producer, single consumer ring of triggers, from the game thread to the audio thread.
+ * A batch is written and then published with one atomic store, so it's all seen at once.
+ */
+class TriggerQueue {
+public:
+  explicit TriggerQueue(size_t capacity);
+
+  // Producer side, one thread at a time. All or nothing, false if the batch doesn't fit.
+  bool push(const SampleTrigger* triggers, size_t count);
+
+  // Consumer side, calls `fn` for every trigger pushed so far.
+  template <typename Fn>
+  void drain(Fn&& fn) {
+    const size_t write = writeIndex.load(std::memory_order_acquire);
+    size_t read = readIndex.load(std::memory_order_relaxed);
+    for (; read != write; ++read) {
+      fn(ring[read & mask]);
+    }
+    readIndex.store(read, std::memory_order_release);
+  }
+
+private:
+  std::vector<SampleTrigger> ring;
+  size_t mask;
+  alignas(64) std::atomic<size_t> writeIndex { 0 };
+  alignas(64) std::atomic<size_t> readIndex { 0 };
+};
+
+/**
+ * Starts and stops a group's samplers from a TriggerQueue on the audio thread.
+ * It's connected to every sampler it triggers, so it runs first and triggers land in the
+ * same block. Outputs silence, the samplers never see it as an input.
+ */
+class SampleTriggerNode : public AudioNode {
+public:
+  // `samplers` is indexed by handle.
+  SampleTriggerNode(const AudioContext& context, std::vector<Sampler*> samplers, size_t capacity = 1024);
+
+  // From the game thread. Residency bookkeeping for the samples happens here too, so the
+  // audio thread never has to take the residency lock. False, with nothing queued, if the
+  // queue is full, any handle is out of range or asks for a pitch its sampler can't shift to.
+  bool push(const SampleTrigger* triggers, size_t count);
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+
+private:
+  std::vector<Sampler*> samplers;
+  TriggerQueue queue;
+};
+
+
+class SampleBank;
+
+struct MusicCue {
+  std::string slug;
+  std::string fileName;
+  bool loop;
+  float gain;
+  SampleFormat storage;
+  SendLevels sends;
+  // Where the cue wraps, instead of the file's own loop or the whole file. A short loop after
+  // an intro keeps only one pass of the music in memory.
+  std::optional<SampleLoop> loopPoints;
+
+  MusicCue(
+    std::string slug,
+    std::string fileName,
+    bool loop = true,
+    float gain = 1.0f,
+    SampleFormat storage = SampleFormat::Float32,
+    SendLevels sends = {},
+    std::optional<SampleLoop> loopPoints = std::nullopt
+  ) : slug(slug), fileName(fileName), loop(loop), gain(gain), storage(storage), sends(std::move(sends)),
+      loopPoints(loopPoints) {}
+};
+
+class MusicCueOrchestrator {
+public:
+  MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::string samplesDir);
+
+  // Builds the orchestrator from already decoded cues, one per cue in the same order.
+  MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::vector<std::shared_ptr<const SampleData>> samples);
+
+  // Points the cue samplers at data in a mapped sample bank.
+  MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, const SampleBank& bank);
+
+  // Decodes the cues in parallel on `loader`, then adds them to the graph in one edit.
+  static std::future<std::unique_ptr<MusicCueOrchestrator>> loadAsync(
+    SampleLoader& loader,
+    AudioGraph& graph,
+    std::vector<MusicCue> cues,
+    std::string samplesDir,
+    LoadProgressCallback onProgress = nullptr
+  );
+
+  // Resolve a cue's slug once, invalidSampleHandle if there's no such cue.
+  SampleHandle getCueHandle(const std::string& slug) const;
+
+  // Stopping the current cue and starting the next go out as one batch, so they land in
+  // the same block. Both are from the game thread.
+  void playCue(SampleHandle cue);
+  void playCue(const std::string& slug);
+  void stopCue();
+
+  // Shared effect that cues send to by `name` (see MusicCue::sends), returned with the cues' output.
+  template <typename EffectType, typename... Args>
+  EffectType* addSendBus(const std::string& name, Args&&... args) {
+    auto effect = std::make_unique<EffectType>(graph.audioContext, std::forward<Args>(args)...);
+    EffectType* effectPtr = effect.get();
+    sends.addBus(name, std::move(effect));
+    return effectPtr;
+  }
+
+  void setSendLevel(const std::string& slug, const std::string& bus, float level);
+
+  // Turns the music down while `keyNodeId` (dialogue, a loud SFX bus) is playing, through a
+  // Compressor after the cues' output. The key keeps playing as normal. Calling again moves
+  // the ducking to another key and applies `config`. Throws if there's no such node.
+  // The defaults take about 15dB off under dialogue peaking around -10dBFS.
+  Compressor* duckUnder(int keyNodeId, const CompressorConfig& config = { -30.0f, 4.0f, 0.05f, 0.5f, 0.0f });
+
+  // See SamplePack::lockSampleMemory.
+  bool lockSampleMemory();
+
+private:
+  AudioGraph& graph;
+  SendBuses sends;
+  std::unordered_map<std::string, SampleHandle> handles;
+  std::vector<Sampler*> samplers; // By handle.
+  SampleTriggerNode* triggers = nullptr;
+  int outputNodeId = -1;
+  int duckerNodeId = -1;
+  int duckKeyNodeId = -1;
+  Compressor* ducker = nullptr;
+  SampleHandle currentCue = invalidSampleHandle;
+};
+
+    
+class NoiseGenerator : public AudioNode {
+    public:
+    NoiseGenerator(const AudioContext& context);
+    
+    void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+    
+    private:
+    std::random_device randomDevice;
+    std::mt19937 randomGen;
+    std::uniform_real_distribution<float> dist;
+};
+    
+
+
+class SampleBank;
+
+struct SamplePackItem {
+  std::string slug;
+  std::string fileName;
+  int polyphony;
+  bool loop;
+  float gain;
+  int pitchShift; // Nonzero also lets triggers shift the item further, see SampleTrigger.
+  std::optional<EnvConfig> envConfig;
+  std::optional<FilterConfig> filterConfig;
+  SampleFormat storage;
+  SendLevels sends;
+  // Where a looping item wraps, instead of the file's own loop or the whole sample.
+  std::optional<SampleLoop> loopPoints;
+
+  // Constructor enforces required fields and default value for polyphony.
+  SamplePackItem(
+    std::string slug,
+    std::string fileName,
+    int polyphony = 1,
+    bool loop = false,
+    float gain = 1.0,
+    int pitchShift = 0,
+    std::optional<EnvConfig> env = std::nullopt,
+    std::optional<FilterConfig> filterConfig = std::nullopt,
+    SampleFormat storage = SampleFormat::Float32,
+    SendLevels sends = {},
+    std::optional<SampleLoop> loopPoints = std::nullopt
+  ) : slug(slug), fileName(fileName), polyphony(polyphony), loop(loop),
+      gain(gain), pitchShift(pitchShift), envConfig(env), filterConfig(filterConfig),
+      storage(storage), sends(std::move(sends)), loopPoints(loopPoints) {}
+};
+
+class SamplePack {
+public:
+  SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, std::string samplesDir, float gain = 1.0);
+
+  // Builds the pack from already decoded samples, one per item in the same order.
+  SamplePack(
+    AudioGraph& graph,
+    std::vector<SamplePackItem> samplePackItems,
+    std::vector<std::shared_ptr<const SampleData>> samples,
+    float gain = 1.0
+  );
+
+  // Loads through a residency manager, which keeps the pack's sample memory under its budget.
+  SamplePack(
+    AudioGraph& graph,
+    std::vector<SamplePackItem> samplePackItems,
+    std::string samplesDir,
+    SampleResidency& residency,
+    float gain = 1.0
+  );
+
+  // Builds the pack from samples that may be managed by a SampleResidency, one per item.
+  SamplePack(
+    AudioGraph& graph,
+    std::vector<SamplePackItem> samplePackItems,
+    std::vector<std::shared_ptr<ResidentSample>> samples,
+    float gain = 1.0
+  );
+
+  // Points the pack's samplers at data in a mapped sample bank, no decoding or copying.
+  SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, const SampleBank& bank, float gain = 1.0);
+
+  // Decodes the items in parallel on `loader`, then adds the whole pack to the graph in one edit.
+  // The future is ready once the pack is live in the graph.
+  static std::future<std::unique_ptr<SamplePack>> loadAsync(
+    SampleLoader& loader,
+    AudioGraph& graph,
+    std::vector<SamplePackItem> samplePackItems,
+    std::string samplesDir,
+    float gain = 1.0,
+    LoadProgressCallback onProgress = nullptr
+  );
+
+  // Resolve a slug once and trigger by handle after, invalidSampleHandle if there's no such item.
+  // Handles follow the order of the pack's items.
+  SampleHandle getHandle(const std::string& slug) const;
+
+  // Triggers are queued and start at the next block. False if the queue is full, a handle
+  // isn't one of this pack's, or a pitch shift is asked of an item built without one.
+  bool triggerSample(SampleHandle handle, float gain = 1.0f, int pitchShift = 0);
+  bool releaseSample(SampleHandle handle);
+  // Fires the whole batch with one queue push, all or none of it.
+  bool triggerSamples(const SampleTrigger* triggers, size_t count);
+  bool triggerSamples(const std::vector<SampleTrigger>& triggers);
+
+  // Looks the slug up on every call, prefer handles for anything frequent.
+  void triggerSample(const std::string& slug);
+
+  // Adds a shared effect that items send to by `name` (see SamplePackItem::sends).
+  // It runs once per block for the whole pack and returns into `output`.
+  template <typename EffectType, typename... Args>
+  EffectType* addSendBus(const std::string& name, Args&&... args) {
+    auto effect = std::make_unique<EffectType>(graph.audioContext, std::forward<Args>(args)...);
+    EffectType* effectPtr = effect.get();
+    sends.addBus(name, std::move(effect));
+    return effectPtr;
+  }
+
+  void setSendLevel(const std::string& slug, const std::string& bus, float level);
+
+  // Keeps the pack's samples in RAM so triggers never page fault. False if the OS refused
+  // for any of them (see lockMemory in Realtime.h).
+  bool lockSampleMemory();
+
+  std::unordered_map<std::string, Sampler*> samplers;
+  // Every sampler in the pack feeds this bus. The graph owns it.
+  Mixer* output = nullptr;
+  int outputNodeId = -1;
+
+  // Triggers queued per block, more than this between two blocks are dropped.
+  static constexpr size_t triggerQueueSize = 4096;
+
+private:
+  AudioGraph& graph;
+  SendBuses sends;
+  std::unordered_map<std::string, SampleHandle> handles;
+  SampleTriggerNode* triggers = nullptr;
+};
+
+
+/**
+ * Pre-decoded, pre-resampled samples in a single file.
+ * `write` is the offline build step: it decodes every file a pack (or cue list) uses, at the
+ * engine's channel count and sample rate, in each item's storage format, and writes them
+ * with an index. At runtime the bank is memory mapped and samplers read straight out of
+ * the mapping, so loading does no decoding or copying and the OS shares the pages
+ * between processes using the same bank.
+ *
+ * Banks are native endian and tied to the channel count/sample rate they were built with.
+ */
+class SampleBank {
+public:
+  // Maps the bank. Throws if it can't be opened, is corrupt or was built for a different context.
+  SampleBank(const std::string& bankPath, const AudioContext& context);
+
+  // Returns the data for a file, sharing ownership of the mapping. Throws if it isn't in the bank.
+  std::shared_ptr<const SampleData> get(const std::string& fileName, SampleFormat storage = SampleFormat::Float32) const;
+  bool contains(const std::string& fileName, SampleFormat storage = SampleFormat::Float32) const;
+
+  // Build step. Returns false if any file failed to load or the bank couldn't be written.
+  static bool write(
+    const std::string& bankPath,
+    const AudioContext& context,
+    const std::vector<SamplePackItem>& samplePackItems,
+    const std::string& samplesDir
+  );
+  static bool write(
+    const std::string& bankPath,
+    const AudioContext& context,
+    const std::vector<MusicCue>& cues,
+    const std::string& samplesDir
+  );
+  static bool write(
+    const std::string& bankPath,
+    const AudioContext& context,
+    const std::vector<SampleRequest>& files, // paths relative to samplesDir
+    const std::string& samplesDir
+  );
+
+private:
+  struct MappedFile;
+  struct Entry {
+    SampleFormat format;
+    int numSamples;
+    const void* data;
+    const void* blockHeaders;
+    std::optional<SampleLoop> loop; // From the file's smpl chunk.
+  };
+
+  static std::string entryKey(const std::string& fileName, SampleFormat storage);
+
+  AudioContext context;
+  std::shared_ptr<MappedFile> mapping;
+  std::unordered_map<std::string, Entry> entries;
+};
+
+
+// Where the listener is, and which way is their right (unit length).
+struct SpatialListener {
+  float x = 0.0f, y = 0.0f, z = 0.0f;
+  float rightX = 1.0f, rightY = 0.0f, rightZ = 0.0f;
+};
+
+/**
+ * Mixes many positioned sources (emitters) down to the output with distance attenuation
+ * and equal-power stereo panning.
+ * Emitter state is kept as structure-of-arrays, and gains for every emitter are worked out
+ * in one branch-free pass per block so the compiler can vectorize it. Each source is then
+ * downmixed to mono and mixed in with a gain ramp from last block's gains, so moving
+ * emitters don't click. Emitters past maxDistance (and ones whose source is silent) skip the
+ * downmix and mix. Their sources still render every block, so they're in the right place when
+ * they come back in range. To save that cost too, stop them from the game side.
+ *
+ * Attenuation is inverse distance, clamped: ref / (ref + rolloff * (d - ref)) for d >= ref.
+ * Panning goes to channels 0 and 1, mono contexts only get attenuation.
+ */
+class SpatialMixer : public AudioNode {
+public:
+  SpatialMixer(const AudioContext& context, float referenceDistance = 1.0f, float maxDistance = 100.0f, float rolloff = 1.0f);
+
+  // Makes `source` an emitter and returns its index. Emitters start at the listener.
+  // Like Mixer::setInputGain, needs graph.lockGraph() while the graph is running.
+  // Once the source is disconnected its emitter goes away and the index is reused.
+  int addEmitter(const AudioNode* source, float gain = 1.0f);
+  int getNumEmitters() const { return numEmitters; }
+
+  // Position/gain updates are safe from any thread and picked up at the next block.
+  void setEmitterPosition(int emitter, float x, float y, float z);
+  void setEmitterGain(int emitter, float gain);
+  // Positions for emitters [0, count) in one go, e.g. straight from a game's own SoA.
+  void setEmitterPositions(const float* x, const float* y, const float* z, int count);
+  void setListener(const SpatialListener& listener);
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  bool canSleep() const override { return true; }
+  void sourceDisconnected(const AudioNode& source) override;
+  void setAudioContext(const AudioContext& context) override;
+
+private:
+  struct Emitters {
+    std::vector<float> x, y, z, gain;
+    void resize(size_t size);
+  };
+
+  void pullUpdates();
+  void computeGains();
+
+  int channels;
+  float referenceDistance;
+  float maxDistance;
+  float rolloff;
+  int numEmitters = 0;
+
+  // Written by the control thread under pendingMutex. The audio thread copies it
+  // into `live` when it can get the lock, otherwise it keeps last block's state.
+  Emitters pending;
+  SpatialListener pendingListener;
+  std::mutex pendingMutex;
+  std::atomic<bool> pendingDirty { false };
+
+  Emitters live;
+  SpatialListener listener;
+
+  // Per emitter gains, this block's targets and where last block ended.
+  std::vector<float> targetLeft, targetRight;
+  std::vector<float> previousLeft, previousRight;
+
+  std::unordered_map<const AudioBuffer*, int> emitterIndex; // By the source's output buffer.
+  std::vector<int> freeEmitters; // Indices of disconnected sources, silent until reused.
+  std::vector<float> monoScratch;
+};
+} // namespace MittelVec
+
+#endif // MITTELVEC_H
+
+#ifdef MITTELVEC_IMPLEMENTATION
+
+#ifndef MINIAUDIO_IMPLEMENTATION
+    #define MINIAUDIO_IMPLEMENTATION
+#endif
+#include "miniaudio.h"
+
+namespace MittelVec {
+
+
+
+AudioBuffer::AudioBuffer(const AudioContext& context)
+: channels(context.numChannels), frames(context.bufferSize), sampleRate(context.sampleRate)
+{
+  data.resize(static_cast<int>(channels) * frames, 0.0f);
+}
+
+AudioBuffer::~AudioBuffer() = default;
+    
+int AudioBuffer::getNumChannels() const { return channels; }
+int AudioBuffer::getNumFrames() const { return frames; }
+float AudioBuffer::getSampleRate() const { return sampleRate; }
+int AudioBuffer::size() const { return data.size(); }
+
+void AudioBuffer::setAudioContext(AudioContext newContext) {
+  channels = newContext.numChannels;
+  frames = newContext.bufferSize;
+  sampleRate = newContext.sampleRate;
+  data.resize(static_cast<int>(channels) * frames, 0.0f);
+}
+
+// Clear buffer
+void AudioBuffer::clear() { std::fill(data.begin(), data.end(), 0.0f); }
+
+void AudioBuffer::resize(int newBufferSize) {
+  frames = static_cast<int>(newBufferSize);
+  data.resize(frames * channels, 0.0f); // fill buffer with zeroes while resizing.
+}
+
+// Operator overloads
+AudioBuffer& AudioBuffer::operator+=(const AudioBuffer& other) {
+  assert(channels == other.channels && frames == other.frames);
+  for (int i = 0; i < data.size(); ++i) {
+    data[i] += other.data[i];
+  }
+  return *this;
+}
+    
+AudioBuffer AudioBuffer::operator+(const AudioBuffer& other) const {
+  AudioBuffer result(*this);
+  result += other;
+  return result;
+}
+
+float& AudioBuffer::operator[](int index) {
+  return data[index];
+}
+
+const float& AudioBuffer::operator[](int index) const {
+  return data[index];
+}
+
+
+AudioGraph::AudioGraph(const AudioContext& context)
+  : audioContext(context), lastOutputFrame(context.numChannels, 0.0f) {}
+
+int AudioGraph::addNode(std::unique_ptr<AudioNode> node) {
+  auto lock = lockGraphFor({ node.get() });
+  int slot;
+  if (!freeSlots.empty()) {
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+  } else {
+    slot = static_cast<int>(slots.size());
+    if (slot > slotIndexMask) {
+      throw std::runtime_error("Audio graph is full.");
+    }
+    slots.emplace_back();
+    visitStamps.push_back(0);
+  }
+
+  // No edges yet, so the end of the order is as good as anywhere.
+  NodeSlot& entry = slots[slot];
+  entry.node = std::move(node);
+  if (appliedQuality != Quality::Full) entry.node->setQuality(appliedQuality);
+  entry.position = static_cast<int>(processOrder.size());
+  processOrder.push_back(slot);
+  numNodes++;
+  return (entry.generation << slotIndexBits) | slot;
+}
+
+std::unique_lock<std::recursive_mutex> AudioGraph::lockGraph() {
+  return std::unique_lock<std::recursive_mutex>(graphMutex);
+}
+
+static bool sameAudioContext(const AudioContext& a, const AudioContext& b) {
+  return a.bufferSize == b.bufferSize && a.numChannels == b.numChannels && a.sampleRate == b.sampleRate;
+}
+
+static bool behindAudioContext(const AudioNode& node, const AudioContext& context) {
+  const AudioBuffer& buffer = node.outputBuffer;
+  return buffer.getNumFrames() != context.bufferSize || buffer.getSampleRate() != context.sampleRate;
+}
+
+std::unique_lock<std::recursive_mutex> AudioGraph::lockGraphFor(const std::vector<AudioNode*>& nodes) {
+  auto lock = lockGraph();
+  std::vector<AudioNode*> behind;
+  for (;;) {
+    const AudioContext context = audioContext;
+    behind.clear();
+    for (AudioNode* node : nodes) {
+      if (behindAudioContext(*node, context)) behind.push_back(node);
+    }
+    if (behind.empty()) return lock;
+
+    // Prepare without the lock like a reconfiguration does, then swap in under it. Rare, and
+    // if the settings changed again meanwhile, go around once more.
+    lock.unlock();
+    for (AudioNode* node : behind) node->prepareAudioContext(context);
+    lock.lock();
+    if (sameAudioContext(context, audioContext)) {
+      for (AudioNode* node : behind) node->setAudioContext(context);
+      return lock;
+    }
+  }
+}
+
+// Slot index for a live id, -1 for stale or made up ones.
+int AudioGraph::slotFor(int nodeId) const {
+  if (nodeId < 0) return -1;
+  const int slot = nodeId & slotIndexMask;
+  if (slot >= static_cast<int>(slots.size())) return -1;
+  const NodeSlot& entry = slots[slot];
+  if (!entry.node || entry.generation != (nodeId >> slotIndexBits)) return -1;
+  return slot;
+}
+
+AudioNode* AudioGraph::getNode(int nodeId) const {
+  int slot = slotFor(nodeId);
+  return slot < 0 ? nullptr : slots[slot].node.get();
+}
+
+static void eraseEdge(std::vector<int>& edges, int slot) {
+  edges.erase(std::remove(edges.begin(), edges.end(), slot), edges.end());
+}
+
+void AudioGraph::removeNode(int nodeId) {
+  // Destroyed once the lock is released, some nodes take a while (ConvolutionReverb joins its worker).
+  std::unique_ptr<AudioNode> removed;
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
+  const int slot = slotFor(nodeId);
+  if (slot < 0) return;
+
+  // Only the neighbours' edge lists need touching.
+  NodeSlot& entry = slots[slot];
+  std::vector<int> destinations = std::move(entry.destinations);
+  std::vector<int> sources = std::move(entry.sources);
+  for (int dest : destinations) {
+    eraseEdge(slots[dest].sources, slot);
+    slots[dest].node->sourceDisconnected(*entry.node);
+  }
+  for (int source : sources) {
+    eraseEdge(slots[source].destinations, slot);
+    eraseEdge(slots[source].sidechains, slot);
+  }
+
+  processOrder[entry.position] = -1;
+  numOrderHoles++;
+
+  removed = std::move(entry.node);
+  entry.destinations.clear();
+  entry.sources.clear();
+  entry.sidechains.clear();
+  entry.position = -1;
+  entry.fusedIn = false;
+  entry.generation = (entry.generation + 1) & generationMask;
+  freeSlots.push_back(slot);
+  numNodes--;
+
+  for (int dest : destinations) refreshFusedIn(dest);
+  for (int source : sources) refreshDestinationsFusedIn(source);
+
+  if (hasCycle) {
+    updateProcessOrder();
+  } else if (numOrderHoles > processOrder.size() / 2) {
+    compactProcessOrder();
+  }
+}
+
+void AudioGraph::connect(int sourceNodeId, int destNodeId) {
+  addEdge(sourceNodeId, destNodeId, false);
+}
+
+void AudioGraph::connectSidechain(int sourceNodeId, int destNodeId) {
+  addEdge(sourceNodeId, destNodeId, true);
+}
+
+void AudioGraph::addEdge(int sourceNodeId, int destNodeId, bool sidechain) {
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
+  const int source = slotFor(sourceNodeId);
+  const int dest = slotFor(destNodeId);
+  if (source < 0 || dest < 0) {
+    return;
+  }
+
+  slots[source].destinations.push_back(dest);
+  if (sidechain) slots[source].sidechains.push_back(dest);
+  slots[dest].sources.push_back(source);
+  if (!hasCycle) {
+    orderEdge(source, dest);
+  }
+
+  refreshDestinationsFusedIn(source);
+  refreshFusedIn(dest);
+}
+
+void AudioGraph::disconnect(int sourceNodeId, int destNodeId) {
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
+  const int source = slotFor(sourceNodeId);
+  const int dest = slotFor(destNodeId);
+  if (source < 0 || dest < 0) {
+    return;
+  }
+
+  // Taking an edge away never breaks a topological order.
+  std::vector<int>& destinations = slots[source].destinations;
+  if (std::find(destinations.begin(), destinations.end(), dest) != destinations.end()) {
+    slots[dest].node->sourceDisconnected(*slots[source].node);
+  }
+  eraseEdge(slots[source].destinations, dest);
+  eraseEdge(slots[source].sidechains, dest);
+  eraseEdge(slots[dest].sources, source);
+  refreshDestinationsFusedIn(source);
+  refreshFusedIn(dest);
+
+  if (hasCycle) {
+    updateProcessOrder();
+  }
+}
+
+// Pearce-Kelly: after adding source -> dest, only nodes positioned between dest and source
+// can be out of order. Find the ones reachable from dest (forward) and the ones that reach
+// source (backward) within that window, then reuse their positions with the backward set
+// first. Cost is proportional to that region, not the graph.
+void AudioGraph::orderEdge(int source, int dest) {
+  const int lower = slots[dest].position;
+  const int upper = slots[source].position;
+  if (lower > upper) return; // Already in order.
+
+  ++visitStamp;
+  forwardRegion.clear();
+  backwardRegion.clear();
+
+  searchStack.assign(1, dest);
+  visitStamps[dest] = visitStamp;
+  while (!searchStack.empty()) {
+    int slot = searchStack.back();
+    searchStack.pop_back();
+    forwardRegion.push_back(slot);
+    for (int next : slots[slot].destinations) {
+      if (next == source) {
+        std::cerr << "Error: Cycle detected in the audio graph. Audio processing will be stopped." << std::endl;
+        hasCycle = true;
+        return;
+      }
+      if (visitStamps[next] != visitStamp && slots[next].position < upper) {
+        visitStamps[next] = visitStamp;
+        searchStack.push_back(next);
+      }
+    }
+  }
+
+  searchStack.assign(1, source);
+  visitStamps[source] = visitStamp;
+  while (!searchStack.empty()) {
+    int slot = searchStack.back();
+    searchStack.pop_back();
+    backwardRegion.push_back(slot);
+    for (int previous : slots[slot].sources) {
+      if (visitStamps[previous] != visitStamp && slots[previous].position > lower) {
+        visitStamps[previous] = visitStamp;
+        searchStack.push_back(previous);
+      }
+    }
+  }
+
+  auto byPosition = [this](int a, int b) { return slots[a].position < slots[b].position; };
+  std::sort(forwardRegion.begin(), forwardRegion.end(), byPosition);
+  std::sort(backwardRegion.begin(), backwardRegion.end(), byPosition);
+
+  regionPositions.clear();
+  for (int slot : backwardRegion) regionPositions.push_back(slots[slot].position);
+  for (int slot : forwardRegion) regionPositions.push_back(slots[slot].position);
+  std::sort(regionPositions.begin(), regionPositions.end());
+
+  size_t next = 0;
+  for (int slot : backwardRegion) slots[slot].position = regionPositions[next++];
+  for (int slot : forwardRegion) slots[slot].position = regionPositions[next++];
+  for (int slot : backwardRegion) processOrder[slots[slot].position] = slot;
+  for (int slot : forwardRegion) processOrder[slots[slot].position] = slot;
+}
+
+void AudioGraph::compactProcessOrder() {
+  processOrder.erase(std::remove(processOrder.begin(), processOrder.end(), -1), processOrder.end());
+  for (size_t i = 0; i < processOrder.size(); ++i) {
+    slots[processOrder[i]].position = static_cast<int>(i);
+  }
+  numOrderHoles = 0;
+}
+
+void AudioGraph::updateProcessOrder() {
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
+  processOrder.clear();
+  numOrderHoles = 0;
+
+  std::vector<int> inDegree(slots.size(), 0);
+  for (size_t slot = 0; slot < slots.size(); ++slot) {
+    inDegree[slot] = static_cast<int>(slots[slot].sources.size());
+  }
+
+  // Start from the source nodes (in-degree 0)
+  for (size_t slot = 0; slot < slots.size(); ++slot) {
+    if (slots[slot].node && inDegree[slot] == 0) {
+      processOrder.push_back(static_cast<int>(slot));
+    }
+  }
+
+  // Kahn's algorithm, using processOrder itself as the queue.
+  for (size_t next = 0; next < processOrder.size(); ++next) {
+    for (int neighbor : slots[processOrder[next]].destinations) {
+      if (--inDegree[neighbor] == 0) {
+        processOrder.push_back(neighbor);
+      }
+    }
+  }
+
+  hasCycle = processOrder.size() != numNodes;
+  if (hasCycle) {
+    std::cerr << "Error: Cycle detected in the audio graph. Audio processing will be stopped." << std::endl;
+    return;
+  }
+
+  for (size_t i = 0; i < processOrder.size(); ++i) {
+    slots[processOrder[i]].position = static_cast<int>(i);
+  }
+}
+
+// Fusion only depends on a node and its neighbours, so edits refresh it locally.
+void AudioGraph::refreshFusedIn(int slot) {
+  NodeSlot& entry = slots[slot];
+  entry.fusedIn = entry.node && entry.node->isFusable() && entry.sources.size() == 1
+    && slots[entry.sources[0]].destinations.size() == 1;
+}
+
+void AudioGraph::refreshDestinationsFusedIn(int slot) {
+  for (int dest : slots[slot].destinations) refreshFusedIn(dest);
+}
+
+void AudioGraph::processNode(int slot) {
+  const NodeSlot& entry = slots[slot];
+  AudioNode& node = *entry.node;
+
+  // Find inputs for the current node from its predecessors' output buffers.
+  // Silent inputs are left out so nothing downstream spends time mixing zeros.
+  std::vector<const AudioBuffer*>& inputs = inputScratch;
+  inputs.clear();
+  for (int source : entry.sources) {
+    const AudioNode& sourceNode = *slots[source].node;
+    if (!sourceNode.isSilent()) {
+      inputs.push_back(&sourceNode.outputBuffer);
+    }
+  }
+
+  // Skip nodes that have nothing to do, their output just stays cleared.
+  if (inputs.empty() && node.canSleep()) {
+    node.sleep();
+    return;
+  }
+
+  // Process the node
+  node.processBlock(inputs);
+}
+
+// Runs from the chain's first stage through every fused stage after it. Each later stage's
+// only input is the one before, so they can all go now, ahead of their own place in the order.
+void AudioGraph::processFusedChain(int firstStage) {
+  const AudioNode& head = *slots[slots[firstStage].sources[0]].node;
+
+  int lastStage = firstStage;
+  while (slots[lastStage].destinations.size() == 1 && slots[slots[lastStage].destinations[0]].fusedIn) {
+    lastStage = slots[lastStage].destinations[0];
+  }
+
+  // Silent input: run the stages one by one so tails ring out and idle stages sleep as usual.
+  // Same for layouts too wide for the tile, and lone stages, which gain nothing from fusing.
+  if (lastStage == firstStage || head.isSilent() || head.outputBuffer.getNumChannels() > maxDspChannels) {
+    for (int stage = firstStage;; stage = slots[stage].destinations[0]) {
+      processNode(stage);
+      if (stage == lastStage) break;
+    }
+    return;
+  }
+
+  // Stage by stage over one tile, then on to the next tile. Intermediate results stay
+  // in `tile` and only the last stage writes its outputBuffer.
+  const float* in = head.outputBuffer.data.data();
+  AudioNode* first = slots[firstStage].node.get();
+  AudioNode* last = slots[lastStage].node.get();
+  float* out = last->outputBuffer.data.data();
+  const int numFrames = last->outputBuffer.getNumFrames();
+  const int numChannels = last->outputBuffer.getNumChannels();
+  float tile[fusionTileFrames * maxDspChannels];
+
+  for (int frame = 0; frame < numFrames; frame += fusionTileFrames) {
+    const int count = std::min(fusionTileFrames, numFrames - frame);
+    const int offset = frame * numChannels;
+
+    first->processTile(in + offset, tile, count);
+    for (int stage = slots[firstStage].destinations[0]; stage != lastStage; stage = slots[stage].destinations[0]) {
+      slots[stage].node->processTile(tile, tile, count);
+    }
+    last->processTile(tile, out + offset, count);
+  }
+
+  last->finishFusedBlock();
+}
+
+void AudioGraph::processGraph(AudioBuffer& graphOutputBuffer) {
+  // Never wait on an edit (it may be resizing buffers or swapping in a reconfiguration),
+  // a silent block is better than a late one.
+  std::unique_lock<std::recursive_mutex> lock(graphMutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    fadeOutSkippedBlock(graphOutputBuffer);
+    skippedBlocks.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  const Quality wantedQuality = quality.load(std::memory_order_relaxed);
+  if (wantedQuality != appliedQuality) {
+    appliedQuality = wantedQuality;
+    for (NodeSlot& entry : slots) {
+      if (entry.node) entry.node->setQuality(wantedQuality);
+    }
+  }
+
+  if (hasCycle) {
+    graphOutputBuffer.clear();
+    std::fill(lastOutputFrame.begin(), lastOutputFrame.end(), 0.0f);
+    return; // Output silence if graph is invalid
+  }
+
+  // The order is always current, edits keep it that way on their own thread.
+  for (int slot : processOrder) {
+    if (slot < 0) continue;
+    const NodeSlot& entry = slots[slot];
+
+    if (entry.fusedIn) {
+      // Later stages already ran with the first one.
+      if (slots[entry.sources[0]].fusedIn) continue;
+      processFusedChain(slot);
+    } else {
+      processNode(slot);
+    }
+  }
+
+  // Sum the outputs of all "terminal" nodes (nodes with no outgoing connections, sidechains aside)
+  graphOutputBuffer.clear();
+  for (const NodeSlot& entry : slots) {
+    if (!entry.node || entry.destinations.size() != entry.sidechains.size() || entry.node->isSilent()) continue;
+
+    for (int i = 0; i < graphOutputBuffer.size(); ++i) {
+      graphOutputBuffer[i] += entry.node->outputBuffer[i];
+    }
+  }
+
+  // Back from a skipped block, ramp up from the silence instead of jumping in.
+  const int channels = std::min(graphOutputBuffer.getNumChannels(), static_cast<int>(lastOutputFrame.size()));
+  const int numFrames = graphOutputBuffer.getNumFrames();
+  if (fadeInNext) {
+    const int fadeFrames = std::min(skipFadeFrames, numFrames);
+    for (int i = 0; i < fadeFrames; ++i) {
+      const float level = (i + 1.0f) / fadeFrames;
+      for (int ch = 0; ch < channels; ++ch) graphOutputBuffer[i * graphOutputBuffer.getNumChannels() + ch] *= level;
+    }
+    fadeInNext = false;
+  }
+  if (numFrames > 0) {
+    for (int ch = 0; ch < channels; ++ch) {
+      lastOutputFrame[ch] = graphOutputBuffer[(numFrames - 1) * graphOutputBuffer.getNumChannels() + ch];
+    }
+  }
+}
+
+// The graph can't run, but cutting straight to zero would click. Ramp down from where the
+// last block ended instead, the next one ramps back up.
+void AudioGraph::fadeOutSkippedBlock(AudioBuffer& graphOutputBuffer) {
+  graphOutputBuffer.clear();
+  const int stride = graphOutputBuffer.getNumChannels();
+  const int channels = std::min(stride, static_cast<int>(lastOutputFrame.size()));
+  const int fadeFrames = std::min(skipFadeFrames, graphOutputBuffer.getNumFrames());
+  for (int i = 0; i < fadeFrames; ++i) {
+    const float level = 1.0f - (i + 1.0f) / fadeFrames;
+    for (int ch = 0; ch < channels; ++ch) graphOutputBuffer[i * stride + ch] = lastOutputFrame[ch] * level;
+  }
+  std::fill(lastOutputFrame.begin(), lastOutputFrame.end(), 0.0f);
+  fadeInNext = true;
+}
+
+void AudioGraph::setQuality(Quality newQuality) {
+  quality.store(newQuality, std::memory_order_relaxed);
+}
+
+Quality AudioGraph::getQuality() const {
+  return quality.load(std::memory_order_relaxed);
+}
+
+void AudioGraph::prepareAudioContext(AudioContext newContext) {
+  if (newContext.numChannels != audioContext.numChannels) {
+    throw std::runtime_error("Only the buffer size and sample rate of a running graph can change.");
+  }
+
+  std::vector<AudioNode*> nodes;
+  {
+    std::lock_guard<std::recursive_mutex> lock(graphMutex);
+    for (const NodeSlot& entry : slots) {
+      if (entry.node) nodes.push_back(entry.node.get());
+    }
+  }
+
+  // Without the lock, so the graph keeps playing at the old settings meanwhile.
+  for (AudioNode* node : nodes) {
+    node->prepareAudioContext(newContext);
+  }
+  preparedContext = newContext;
+  hasPreparedContext = true;
+}
+
+void AudioGraph::setAudioContext(AudioContext newContext)
+{
+  if (sameAudioContext(newContext, audioContext)) return;
+  if (!hasPreparedContext || !sameAudioContext(newContext, preparedContext)) {
+    prepareAudioContext(newContext);
+  }
+
+  // Every node switches between the same two blocks.
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
+  audioContext = newContext;
+  hasPreparedContext = false;
+  for (NodeSlot& entry : slots) {
+    if (entry.node) entry.node->setAudioContext(newContext);
+  }
+}
+
+
+Compressor::Compressor(const AudioContext& context, const CompressorConfig& config)
+  : AudioNode(context),
+    threshold(config.threshold),
+    ratio(config.ratio),
+    attack(config.attack),
+    release(config.release),
+    makeup(config.makeup)
+{
+  mainInputs.reserve(8);
+}
+
+void Compressor::setSidechain(const AudioNode* source) {
+  sidechain.store(source ? &source->outputBuffer : nullptr, std::memory_order_relaxed);
+}
+
+void Compressor::sourceDisconnected(const AudioNode& source) {
+  // Otherwise a node added later at the same address would become the key.
+  const AudioBuffer* key = &source.outputBuffer;
+  sidechain.compare_exchange_strong(key, nullptr, std::memory_order_relaxed);
+}
+
+void Compressor::setThreshold(float newThreshold) { threshold.store(newThreshold, std::memory_order_relaxed); }
+void Compressor::setRatio(float newRatio) { ratio.store(newRatio, std::memory_order_relaxed); }
+void Compressor::setAttack(float newAttack) { attack.store(newAttack, std::memory_order_relaxed); }
+void Compressor::setRelease(float newRelease) { release.store(newRelease, std::memory_order_relaxed); }
+void Compressor::setMakeup(float newMakeup) { makeup.store(newMakeup, std::memory_order_relaxed); }
+
+float Compressor::keyLevel(const AudioBuffer& key) const {
+  // Eight independent maxima so the loop vectorizes, then folded together.
+  constexpr int lanes = 8;
+  float peak[lanes] = {};
+  const float* in = key.data.data();
+  const int numSamples = key.size();
+
+  int i = 0;
+  for (; i + lanes <= numSamples; i += lanes) {
+    for (int lane = 0; lane < lanes; ++lane) {
+      peak[lane] = std::max(peak[lane], std::abs(in[i + lane]));
+    }
+  }
+  for (; i < numSamples; ++i) {
+    peak[0] = std::max(peak[0], std::abs(in[i]));
+  }
+  return *std::max_element(peak, peak + lanes);
+}
+
+float Compressor::followEnvelope(float level) {
+  // One pole per block, the time constants are in seconds whatever the block size.
+  const float blockSeconds = outputBuffer.getNumFrames() / outputBuffer.getSampleRate();
+  const float time = level > envelope ? attack.load(std::memory_order_relaxed) : release.load(std::memory_order_relaxed);
+  const float coefficient = time > 0.0f ? std::exp(-blockSeconds / time) : 0.0f;
+  envelope = level + coefficient * (envelope - level);
+
+  // Below -100dB counts as released, lets the graph put us to sleep.
+  if (envelope < 1e-5f) envelope = 0.0f;
+  return envelope;
+}
+
+void Compressor::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  // Split the sidechain off, it's only listened to. A silent sidechain isn't in inputs at all.
+  const AudioBuffer* sidechainBuffer = sidechain.load(std::memory_order_relaxed);
+  const AudioBuffer* key = nullptr;
+  mainInputs.clear();
+  for (const AudioBuffer* input : inputs) {
+    if (input == sidechainBuffer) {
+      key = input;
+    } else {
+      mainInputs.push_back(input);
+    }
+  }
+
+  const AudioBuffer* main = mainInputs.empty() ? nullptr : &mixInputs(mainInputs, outputBuffer);
+  if (!sidechainBuffer) key = main;
+
+  // Gain computer, in dB above the threshold.
+  const float envelopeLevel = followEnvelope(key ? keyLevel(*key) : 0.0f);
+  float reduction = 0.0f;
+  if (envelopeLevel > 0.0f) {
+    const float over = 20.0f * std::log10(envelopeLevel) - threshold.load(std::memory_order_relaxed);
+    const float currentRatio = std::max(1.0f, ratio.load(std::memory_order_relaxed));
+    if (over > 0.0f) reduction = over * (1.0f - 1.0f / currentRatio);
+  }
+  gainReduction.store(reduction, std::memory_order_relaxed);
+  const float targetGain = std::pow(10.0f, (makeup.load(std::memory_order_relaxed) - reduction) / 20.0f);
+
+  if (!main) {
+    currentGain = targetGain;
+    outputSilence();
+    return;
+  }
+
+  // Ramp linearly to the new gain over the block, the channel loop runs in SIMD lanes.
+  const int numFrames = outputBuffer.getNumFrames();
+  const float startGain = currentGain;
+  const float step = (targetGain - startGain) / numFrames;
+  const float* in = main->data.data();
+  float* out = outputBuffer.data.data();
+
+  dispatchChannels(outputBuffer.getNumChannels(), [&](auto channels) {
+    for (int i = 0; i < numFrames; ++i) {
+      const float gain = startGain + step * (i + 1);
+      for (int ch = 0; ch < channels; ++ch) {
+        out[i * channels + ch] = in[i * channels + ch] * gain;
+      }
+    }
+  });
+  currentGain = targetGain;
+}
+
+
+// One block, rounded up to a power of two for the FFT.
+static int reverbPartitionFrames(int bufferSize) {
+  int frames = 16;
+  while (frames < bufferSize) frames *= 2;
+  return frames;
+}
+
+// acc += a * b over a whole spectrum, written out so it vectorizes (see FFT.cpp).
+static void multiplyAccumulate(const std::complex<float>* a, const std::complex<float>* b, std::complex<float>* acc, int numBins) {
+  for (int k = 0; k < numBins; ++k) {
+    acc[k] += std::complex<float>(
+      a[k].real() * b[k].real() - a[k].imag() * b[k].imag(),
+      a[k].real() * b[k].imag() + a[k].imag() * b[k].real()
+    );
+  }
+}
+
+ConvolutionReverb::ConvolutionReverb(const AudioContext& context, const std::string& impulsePath, float gain, int headPartitions)
+  : ConvolutionReverb(context, SampleData::fromFile(context, impulsePath, SampleFormat::Float32), gain, headPartitions) {}
+
+ConvolutionReverb::ConvolutionReverb(const AudioContext& context, std::shared_ptr<const SampleData> impulse, float gain, int headPartitions)
+  : AudioNode(context),
+    requestedHeadPartitions(headPartitions),
+    channels(context.numChannels),
+    fft(reverbPartitionFrames(context.bufferSize) * 2),
+    gain(gain)
+{
+  useLayout(buildLayout(context, std::move(impulse)), context.bufferSize);
+}
+
+ConvolutionReverb::~ConvolutionReverb() {
+  stopWorker();
+}
+
+ConvolutionReverb::Layout ConvolutionReverb::buildLayout(const AudioContext& context, std::shared_ptr<const SampleData> impulse) const {
+  Layout layout;
+  layout.impulse = std::move(impulse);
+  layout.partitionFrames = reverbPartitionFrames(context.bufferSize);
+  layout.irFrames = layout.impulse->getNumChannels() == channels ? layout.impulse->getNumFrames() : 0;
+  if (layout.irFrames == 0) return layout;
+
+  const int partitionFrames = layout.partitionFrames;
+  const int numBins = partitionFrames + 1;
+  layout.numPartitions = (layout.irFrames + partitionFrames - 1) / partitionFrames;
+  layout.irSpectra.resize(static_cast<size_t>(channels) * layout.numPartitions * numBins);
+
+  std::vector<float> ir(layout.impulse->size());
+  layout.impulse->read(0, ir.data(), layout.impulse->size(), 1.0f);
+
+  // Each IR partition zero padded to two partitions, so overlap-save's second half is linear convolution.
+  // Own FFT, this can run while the audio thread uses the member one.
+  FFT irFft(partitionFrames * 2);
+  std::vector<float> scratch(2 * partitionFrames);
+  for (int ch = 0; ch < channels; ++ch) {
+    for (int p = 0; p < layout.numPartitions; ++p) {
+      std::fill(scratch.begin(), scratch.end(), 0.0f);
+      for (int i = 0; i < partitionFrames; ++i) {
+        int frame = p * partitionFrames + i;
+        if (frame < layout.irFrames) scratch[i] = ir[frame * channels + ch];
+      }
+      irFft.forward(scratch.data(), &layout.irSpectra[(static_cast<size_t>(ch) * layout.numPartitions + p) * numBins]);
+    }
+  }
+  return layout;
+}
+
+// The worker must be stopped. Starts over with cleared state.
+void ConvolutionReverb::useLayout(Layout layout, int bufferSize) {
+  impulse = std::move(layout.impulse);
+  partitionFrames = layout.partitionFrames;
+  numBins = partitionFrames + 1;
+  numPartitions = layout.numPartitions;
+  zeroLatency = bufferSize == partitionFrames;
+  if (fft.getSize() != partitionFrames * 2) fft = FFT(partitionFrames * 2);
+
+  if (numPartitions == 0) {
+    printf("Convolution reverb has no usable impulse response, it will output silence.\n");
+    headPartitions = 0;
+    tailFrames = 0;
+    return;
+  }
+
+  headPartitions = std::clamp(requestedHeadPartitions, 1, numPartitions);
+  tailFrames = layout.irFrames + 2 * partitionFrames;
+
+  tailPartitions = numPartitions - headPartitions;
+  const size_t spectrumSize = static_cast<size_t>(channels) * numBins;
+  irSpectra = std::move(layout.irSpectra);
+  headInputs.assign(headPartitions * spectrumSize, std::complex<float>());
+  inputHistory.assign(static_cast<size_t>(channels) * 2 * partitionFrames, 0.0f);
+  headSum.assign(spectrumSize, std::complex<float>());
+  timeScratch.assign(2 * partitionFrames, 0.0f);
+  inputFifo.assign(static_cast<size_t>(channels) * partitionFrames, 0.0f);
+  outputFifo.assign(inputFifo.size(), 0.0f);
+  newestInput = -1;
+  fifoPosition = 0;
+  silentFrames = 0;
+  settled = true;
+
+  // Finished sums wait for their partition, at most headPartitions of them, or come in late
+  // behind at most a full queue's worth.
+  numFinishedSums = tailPartitions > 0 ? maxQueuedTails + headPartitions + 1 : 0;
+  queuedInputs.assign(tailPartitions > 0 ? maxQueuedTails * spectrumSize : 0, std::complex<float>());
+  queuedIndices.assign(tailPartitions > 0 ? maxQueuedTails : 0, 0);
+  workerSums.assign(tailPartitions * spectrumSize, std::complex<float>());
+  finishedSums.assign(numFinishedSums * spectrumSize, std::complex<float>());
+  ownSums.assign(tailPartitions > 0 ? numPartitions * spectrumSize : 0, std::complex<float>());
+  ownSumsUntil = 0;
+  tailsQueued.store(0);
+  tailsDone.store(0);
+  tailsFinished.store(0);
+  tailsMixed.store(0);
+
+  if (tailPartitions > 0) {
+    stopping.store(false);
+    worker = std::thread(&ConvolutionReverb::tailWorker, this);
+  }
+}
+
+void ConvolutionReverb::stopWorker() {
+  if (!worker.joinable()) return;
+  stopping.store(true);
+  workerWake.signal();
+  worker.join();
+}
+
+void ConvolutionReverb::prepareAudioContext(const AudioContext& context) {
+  auto resampled = impulse->getSampleRate() == context.sampleRate ? impulse : impulse->resampled(context.sampleRate);
+  pendingLayout = std::make_unique<Layout>(buildLayout(context, std::move(resampled)));
+}
+
+void ConvolutionReverb::setAudioContext(const AudioContext& context) {
+  AudioNode::setAudioContext(context);
+  const bool prepared = pendingLayout && pendingLayout->partitionFrames == reverbPartitionFrames(context.bufferSize)
+    && pendingLayout->impulse->getSampleRate() == context.sampleRate;
+  if (!prepared) prepareAudioContext(context);
+
+  stopWorker();
+  useLayout(std::move(*pendingLayout), context.bufferSize);
+  pendingLayout.reset();
+}
+
+void ConvolutionReverb::setGain(float newGain) {
+  gain.store(newGain, std::memory_order_relaxed);
+}
+
+int ConvolutionReverb::getLatencyFrames() const {
+  return zeroLatency ? 0 : partitionFrames;
+}
+
+std::complex<float>* ConvolutionReverb::irSpectrum(int channel, int partition) {
+  return &irSpectra[(static_cast<size_t>(channel) * numPartitions + partition) * numBins];
+}
+
+std::complex<float>* ConvolutionReverb::spectra(std::vector<std::complex<float>>& ring, int64_t index, int size) {
+  return &ring[static_cast<size_t>(index % size) * channels * numBins];
+}
+
+void ConvolutionReverb::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  if (numPartitions == 0 || (inputs.empty() && settled)) {
+    outputSilence();
+    return;
+  }
+
+  if (inputs.empty()) {
+    silentFrames += outputBuffer.getNumFrames();
+    // Clearing waits until the worker is done with the state and its late sums have been
+    // mixed, there's silence to render meanwhile.
+    const bool workerIdle = tailsDone.load(std::memory_order_acquire) == tailsQueued.load(std::memory_order_relaxed)
+      && tailsMixed.load(std::memory_order_relaxed) >= std::min(tailsFinished.load(std::memory_order_acquire), newestInput + 1);
+    if (silentFrames >= tailFrames && workerIdle) {
+      // Everything has rung out. Clear up so the graph can put us to sleep.
+      clearState();
+      outputSilence();
+      return;
+    }
+  } else {
+    silentFrames = 0;
+    settled = false;
+  }
+
+  const AudioBuffer& input = mixInputs(inputs, outputBuffer);
+  const float* in = input.data.data();
+  float* out = outputBuffer.data.data();
+  const int numFrames = outputBuffer.getNumFrames();
+
+  // Input is always copied into the FIFO before the same span of output is written,
+  // so it's fine for `input` to be outputBuffer.
+  for (int frame = 0; frame < numFrames;) {
+    const int count = std::min(numFrames - frame, partitionFrames - fifoPosition);
+    const int offset = fifoPosition * channels;
+    const int samples = count * channels;
+
+    std::copy(in + frame * channels, in + frame * channels + samples, &inputFifo[offset]);
+    fifoPosition += count;
+
+    // Blocks that are exactly one partition get their own output straight away.
+    // Otherwise output runs one partition behind.
+    const bool full = fifoPosition == partitionFrames;
+    if (full && zeroLatency) convolvePartition();
+    std::copy(&outputFifo[offset], &outputFifo[offset] + samples, out + frame * channels);
+    if (full && !zeroLatency) convolvePartition();
+    if (full) fifoPosition = 0;
+
+    frame += count;
+  }
+}
+
+void ConvolutionReverb::convolvePartition() {
+  const int64_t input = ++newestInput;
+  std::complex<float>* spectrum = spectra(headInputs, input, headPartitions);
+  const float outputGain = gain.load(std::memory_order_relaxed);
+
+  for (int ch = 0; ch < channels; ++ch) {
+    // Slide the history along a partition and append the new input.
+    float* history = &inputHistory[static_cast<size_t>(ch) * 2 * partitionFrames];
+    std::copy(history + partitionFrames, history + 2 * partitionFrames, history);
+    for (int i = 0; i < partitionFrames; ++i) {
+      history[partitionFrames + i] = inputFifo[i * channels + ch];
+    }
+    fft.forward(history, spectrum + static_cast<size_t>(ch) * numBins);
+  }
+
+  accumulateHead();
+
+  if (tailPartitions > 0) {
+    mixTails();
+    queueTail(spectrum);
+  }
+
+  for (int ch = 0; ch < channels; ++ch) {
+    fft.inverse(&headSum[static_cast<size_t>(ch) * numBins], timeScratch.data());
+
+    // Overlap-save: only the second half is valid output.
+    for (int i = 0; i < partitionFrames; ++i) {
+      outputFifo[i * channels + ch] = timeScratch[partitionFrames + i] * outputGain;
+    }
+  }
+}
+
+// Partitions [0, headPartitions) against the newest inputs.
+void ConvolutionReverb::accumulateHead() {
+  std::fill(headSum.begin(), headSum.end(), std::complex<float>());
+  for (int p = 0; p < headPartitions && p <= newestInput; ++p) {
+    const std::complex<float>* in = spectra(headInputs, newestInput - p, headPartitions);
+    for (int ch = 0; ch < channels; ++ch) {
+      const size_t offset = static_cast<size_t>(ch) * numBins;
+      multiplyAccumulate(irSpectrum(ch, p), in + offset, &headSum[offset], numBins);
+    }
+  }
+}
+
+// Adds the tail sums that are due, and any that finished late.
+void ConvolutionReverb::mixTails() {
+  const size_t spectrumSize = headSum.size();
+  const int64_t finished = tailsFinished.load(std::memory_order_acquire);
+  int64_t mixed = tailsMixed.load(std::memory_order_relaxed);
+  for (; mixed <= newestInput && mixed < finished; ++mixed) {
+    const std::complex<float>* sum = spectra(finishedSums, mixed, numFinishedSums);
+    for (size_t k = 0; k < spectrumSize; ++k) headSum[k] += sum[k];
+  }
+  tailsMixed.store(mixed, std::memory_order_release);
+
+  if (newestInput < ownSumsUntil) {
+    std::complex<float>* sum = spectra(ownSums, newestInput, numPartitions);
+    for (size_t k = 0; k < spectrumSize; ++k) headSum[k] += sum[k];
+    std::fill(sum, sum + spectrumSize, std::complex<float>());
+  }
+}
+
+void ConvolutionReverb::queueTail(const std::complex<float>* spectrum) {
+  const int64_t queued = tailsQueued.load(std::memory_order_relaxed);
+  if (queued - tailsDone.load(std::memory_order_acquire) >= maxQueuedTails) {
+    // The worker is well behind. Doing this one here costs the callback, but beats
+    // waiting on it or dropping the input's tail.
+    addTail(spectrum, newestInput, ownSums, numPartitions);
+    ownSumsUntil = newestInput + numPartitions;
+    // Still a partition mixed, see finishTails.
+    workerWake.signal();
+    return;
+  }
+
+  std::copy(spectrum, spectrum + headSum.size(), spectra(queuedInputs, queued, maxQueuedTails));
+  queuedIndices[queued % maxQueuedTails] = newestInput;
+  tailsQueued.store(queued + 1, std::memory_order_release);
+  workerWake.signal();
+}
+
+// Partitions [headPartitions, numPartitions) of one input, added into the sums of the outputs
+// they land on. The first is `input + headPartitions`, after that nothing older can add to it.
+void ConvolutionReverb::addTail(const std::complex<float>* spectrum, int64_t input, std::vector<std::complex<float>>& sums, int numSums) {
+  for (int p = headPartitions; p < numPartitions; ++p) {
+    std::complex<float>* sum = spectra(sums, input + p, numSums);
+    for (int ch = 0; ch < channels; ++ch) {
+      const size_t offset = static_cast<size_t>(ch) * numBins;
+      multiplyAccumulate(irSpectrum(ch, p), spectrum + offset, sum + offset, numBins);
+    }
+  }
+}
+
+// Hands the worker's sums for outputs below `until` to the audio thread. False when stopping.
+bool ConvolutionReverb::finishTails(int64_t until) {
+  const size_t spectrumSize = headSum.size();
+  int64_t output = tailsFinished.load(std::memory_order_relaxed);
+  if (output >= until) return true;
+  for (; output < until; ++output) {
+    // After a long stall (and a run of inputs the audio thread did itself) this can get a
+    // whole ring ahead of what's been mixed. The audio thread signals every partition and
+    // mixes everything that's due, so wait for it here rather than make it wait.
+    while (output - tailsMixed.load(std::memory_order_acquire) >= numFinishedSums) {
+      tailsFinished.store(output, std::memory_order_release);
+      workerWake.wait();
+      if (stopping.load()) return false;
+    }
+    std::complex<float>* sum = spectra(workerSums, output, tailPartitions);
+    std::copy(sum, sum + spectrumSize, spectra(finishedSums, output, numFinishedSums));
+    std::fill(sum, sum + spectrumSize, std::complex<float>());
+  }
+  tailsFinished.store(until, std::memory_order_release);
+  return true;
+}
+
+void ConvolutionReverb::tailWorker() {
+  // Same denormal handling as the callback, and may run at RT priority to keep up with it.
+  ScopedFlushDenormals flushDenormals;
+  setCurrentThreadPriority(getWorkerThreadPriority());
+
+  while (true) {
+    workerWake.wait();
+    if (stopping.load()) return;
+
+    // Signals can outnumber inputs (left over from before a restart), so go by the counters.
+    int64_t done = tailsDone.load(std::memory_order_relaxed);
+    while (done < tailsQueued.load(std::memory_order_acquire)) {
+      const int64_t input = queuedIndices[done % maxQueuedTails];
+      // Inputs the audio thread did itself leave gaps, those outputs are done too. They
+      // have to go before this input's tail wraps around onto their sums.
+      if (!finishTails(input + headPartitions)) return;
+      addTail(spectra(queuedInputs, done, maxQueuedTails), input, workerSums, tailPartitions);
+      if (!finishTails(input + headPartitions + 1)) return;
+      tailsDone.store(++done, std::memory_order_release);
+    }
+  }
+}
+
+// Only while the worker is idle, its sums are ours until the next input is queued.
+void ConvolutionReverb::clearState() {
+  std::fill(headInputs.begin(), headInputs.end(), std::complex<float>());
+  std::fill(inputHistory.begin(), inputHistory.end(), 0.0f);
+  std::fill(workerSums.begin(), workerSums.end(), std::complex<float>());
+  std::fill(finishedSums.begin(), finishedSums.end(), std::complex<float>());
+  std::fill(ownSums.begin(), ownSums.end(), std::complex<float>());
+  std::fill(inputFifo.begin(), inputFifo.end(), 0.0f);
+  std::fill(outputFifo.begin(), outputFifo.end(), 0.0f);
+  fifoPosition = 0;
+  silentFrames = 0;
+  settled = true;
+}
+#define MINIAUDIO_IMPLEMENTATION
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wall"
+#pragma GCC diagnostic ignored "-Wextra"
+#pragma GCC diagnostic pop
+
+
+// Callback for audio playback.
+void miniaudio_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount) {
+  float* out = (float*)pOutput;
+  CallbackData* cbData = (CallbackData*)pDevice->pUserData;
+  // Filter and envelope tails would otherwise spend their last moments as slow denormals.
+  ScopedFlushDenormals flushDenormals;
+
+  // Duplex devices capture and play back the same number of frames, InputNodes read it in place.
+  if (pInput) {
+    cbData->capture->samples = (const float*)pInput;
+    cbData->capture->numFrames = static_cast<int>(frameCount);
+  }
+
+  // Write graph data into graph output buffer, timed for the load governor.
+  auto renderStart = std::chrono::steady_clock::now();
+  cbData->graph->processGraph(*cbData->graphOutput);
+  std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - renderStart;
+  cbData->graph->setQuality(cbData->governor->update(renderTime.count()));
+  
+  // Copy graph output buffer into miniaudio output buffer.
+  memcpy(out, (*cbData->graphOutput).data.data(), frameCount * cbData->globalContext->numChannels * sizeof(float));
+
+  // pInput is only valid during this callback.
+  cbData->capture->samples = nullptr;
+  cbData->capture->numFrames = 0;
+  // std::copy((*cbData->graphOutput).data.begin(), (*cbData->graphOutput).data.end(), out);
+  // for (ma_uint32 i = 0; i < frameCount * pDevice->playback.channels; i++) {
+  //   out[i] = (*(cbData->graphOutput))[i];
+  // }
+}
+
+Engine::Engine(AudioContext globalContext, bool duplex)
+  : globalContext(globalContext),
+    graph(globalContext),
+    output(globalContext),
+    governor(globalContext),
+    duplex(duplex)
+{
+  initMiniaudio();
+}
+
+Engine::~Engine() {
+  stop();
+}
+
+void Engine::initMiniaudio() {
+  // Setup miniaudio
+  config = ma_device_config_init(duplex ? ma_device_type_duplex : ma_device_type_playback);
+  config.playback.format    = ma_format_f32;
+  config.playback.channels  = globalContext.numChannels;
+  if (duplex) {
+    // Miniaudio converts whatever the mic has to this.
+    config.capture.format   = ma_format_f32;
+    config.capture.channels = globalContext.numChannels;
+  }
+  config.sampleRate         = static_cast<int>(globalContext.sampleRate);
+  config.periodSizeInFrames = globalContext.bufferSize;
+  config.dataCallback       = miniaudio_callback;
+  config.pUserData          = &cbData;
+
+  if (ma_device_init(NULL, &config, &device) != MA_SUCCESS) {
+    assert(false);
+  }
+
+  // Miniaudio buffer size not guaranteed here.
+  // We need to cover our bases in the unlikely event the request buffer sized can't be applied.
+  auto miniaudioBufferSize = device.playback.internalPeriodSizeInFrames;
+
+  if (globalContext.bufferSize != miniaudioBufferSize) {
+    printf(
+      "Miniaudio backend couldn't assign requested buffer size of %d. Buffer size %d chosen and assigned instead.\n",
+      globalContext.bufferSize,
+      miniaudioBufferSize
+    );
+    globalContext.bufferSize = miniaudioBufferSize;
+  }
+
+  // Update graph and output buffer's audioContext, nothing to do unless it changed.
+  graph.setAudioContext(globalContext);
+  output.setAudioContext(globalContext);
+  governor.setAudioContext(globalContext);
+}
+
+void Engine::start() {
+  // Update pUserData pointers now that graph/graphOutput/globalContext have been initalized.
+  cbData.graph = &graph;
+  cbData.graphOutput = &output;
+  cbData.globalContext = &globalContext;
+  cbData.governor = &governor;
+  cbData.capture = &capture;
+
+  if (ma_device_start(&device) != MA_SUCCESS) {
+    assert(false);
+  }
+}
+
+void Engine::reconfigure(int bufferSize, float sampleRate) {
+  AudioContext newContext { bufferSize, globalContext.numChannels, sampleRate };
+  graph.prepareAudioContext(newContext);
+
+  // Miniaudio fixes period size and rate at init, so the device has to be rebuilt.
+  const bool wasStarted = ma_device_is_started(&device);
+  ma_device_uninit(&device);
+  globalContext = newContext;
+  initMiniaudio();
+
+  if (wasStarted) start();
+}
+
+bool Engine::lockMemory() {
+  if (!lockProcessMemory()) {
+    printf("Couldn't lock the process's memory, it may be paged out while idle.\n");
+    return false;
+  }
+  return true;
+}
+
+void Engine::setWorkerPriority(ThreadPriority priority) {
+  setWorkerThreadPriority(priority);
+}
+
+void Engine::stop() {
+  ma_device_uninit(&device);
+}
+
+
+EnvelopeProcessor::EnvelopeProcessor(float sampleRate, const EnvConfig& config)
+  : state(Idle),
+    attack(config.attack),
+    decay(config.decay),
+    sustain(config.sustain),
+    release(config.release),
+    sampleRate(sampleRate),
+    currentLevel(0.0f) {}
+
+float EnvelopeProcessor::getNextLevel() {
+  switch (state) {
+  case Idle:
+    break;
+  case Attack:
+    currentLevel += 1.0 / (attack * sampleRate);
+
+    // Clamp level and transition to decay.
+    if (currentLevel >= 1.0) {
+      currentLevel = 1.0;
+      state = Decay;
+    }
+    break;
+  case Decay:
+    currentLevel -= (1.0 - sustain) / (decay * sampleRate);
+    
+    if (currentLevel <= sustain) {
+      currentLevel = sustain;
+      state = Sustain;
+    }
+    break;
+  case Sustain:
+    if (skipSustain) {
+      state = Release;
+    }
+    break;
+  case Release:
+    currentLevel -= sustain / (release * sampleRate);
+    
+    if (currentLevel <= 0.0) {
+      currentLevel = 0.0;
+      state = Idle;
+    }
+    break;
+  default:
+    break;
+  }
+
+  return currentLevel;
+}
+
+void EnvelopeProcessor::noteOn() {
+  state = Attack;
+  currentLevel = 0; // confirm this...
+}
+
+void EnvelopeProcessor::noteOff() {
+  state = Release;
+}
+
+void EnvelopeProcessor::reset() {
+  currentLevel = 0;
+  state = Idle;
+}
+
+bool EnvelopeProcessor::isActive() const {
+  return state != Idle;
+}
+
+void EnvelopeProcessor::setSampleRate(float newSampleRate) {
+  sampleRate = newSampleRate;
+}
+
+Envelope::Envelope(const AudioContext& context, const EnvConfig& config)
+  : AudioNode(context), envelope(context.sampleRate, config) {}
+
+float Envelope::getNextLevel() {
+  return envelope.getNextLevel();
+}
+
+void Envelope::noteOn() {
+  envelope.noteOn();
+}
+
+void Envelope::noteOff() {
+  envelope.noteOff();
+}
+
+void Envelope::reset() {
+  envelope.reset();
+}
+
+bool const Envelope::isActive() {
+  return envelope.isActive();
+}
+
+void Envelope::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  const AudioBuffer& input = mixInputs(inputs, outputBuffer);
+  processTile(input.data.data(), outputBuffer.data.data(), outputBuffer.getNumFrames());
+}
+
+// The envelope steps once per frame, every channel in the frame gets the same level.
+void Envelope::processTile(const float* in, float* out, int numFrames) {
+  const int numChannels = outputBuffer.getNumChannels();
+  for (int i = 0; i < numFrames; ++i) {
+    const float level = envelope.getNextLevel();
+    for (int ch = 0; ch < numChannels; ++ch) {
+      out[i * numChannels + ch] = in[i * numChannels + ch] * level;
+    }
+  }
+}
+
+/**
+ * Applies envelope directly to incoming buffer.
+ * Allows for inline processing as opposed to more modular node/graph style `process` method approach.
+ */
+void Envelope::applyToBuffer(AudioBuffer& buffer) {
+  processTile(buffer.data.data(), buffer.data.data(), buffer.getNumFrames());
+}
+
+void Envelope::setAudioContext(const AudioContext& context) {
+  AudioNode::setAudioContext(context);
+  envelope.setSampleRate(context.sampleRate);
+}
+
+
+// Written out by hand, std::complex multiplication does inf/nan checks that stop it vectorizing.
+static inline std::complex<float> complexMultiply(std::complex<float> a, std::complex<float> b) {
+  return {
+    a.real() * b.real() - a.imag() * b.imag(),
+    a.real() * b.imag() + a.imag() * b.real()
+  };
+}
+
+FFT::FFT(int size) : size(size), half(size / 2) {
+  assert(size >= 4 && (size & (size - 1)) == 0);
+
+  const double pi = std::acos(-1.0);
+
+  bitReverse.resize(half);
+  int bits = 0;
+  while ((1 << bits) < half) ++bits;
+  for (int i = 0; i < half; ++i) {
+    int reversed = 0;
+    for (int b = 0; b < bits; ++b) {
+      if (i & (1 << b)) reversed |= 1 << (bits - 1 - b);
+    }
+    bitReverse[i] = reversed;
+  }
+
+  twiddles.resize(half / 2);
+  for (int k = 0; k < half / 2; ++k) {
+    double angle = -2.0 * pi * k / half;
+    twiddles[k] = { static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)) };
+  }
+
+  realTwiddles.resize(half + 1);
+  for (int k = 0; k <= half; ++k) {
+    double angle = -2.0 * pi * k / size;
+    realTwiddles[k] = { static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)) };
+  }
+
+  scratch.resize(half);
+}
+
+int FFT::getSize() const { return size; }
+int FFT::getNumBins() const { return half + 1; }
+
+// In place iterative radix-2 over `half` points. Unscaled in both directions.
+void FFT::transform(std::complex<float>* data, bool inverse) const {
+  for (int i = 0; i < half; ++i) {
+    int j = bitReverse[i];
+    if (i < j) std::swap(data[i], data[j]);
+  }
+
+  for (int length = 2; length <= half; length <<= 1) {
+    const int span = length / 2;
+    const int stride = half / length;
+    for (int start = 0; start < half; start += length) {
+      for (int k = 0; k < span; ++k) {
+        std::complex<float> w = twiddles[k * stride];
+        if (inverse) w = std::conj(w);
+
+        std::complex<float> u = data[start + k];
+        std::complex<float> v = complexMultiply(data[start + k + span], w);
+        data[start + k] = u + v;
+        data[start + k + span] = u - v;
+      }
+    }
+  }
+}
+
+/**
+ * Even samples go in the real parts and odd samples in the imaginary parts of a half size
+ * complex transform. The split step then separates the two spectra and combines them:
+ * X[k] = E[k] + W^k * O[k].
+ */
+void FFT::forward(const float* input, std::complex<float>* spectrum) {
+  for (int k = 0; k < half; ++k) {
+    scratch[k] = { input[2 * k], input[2 * k + 1] };
+  }
+  transform(scratch.data(), false);
+
+  for (int k = 0; k <= half; ++k) {
+    std::complex<float> zk = scratch[k % half];
+    std::complex<float> zc = std::conj(scratch[(half - k) % half]);
+    std::complex<float> even = (zk + zc) * 0.5f;
+    std::complex<float> diff = zk - zc;
+    std::complex<float> odd = { diff.imag() * 0.5f, -diff.real() * 0.5f }; // diff / 2i
+    spectrum[k] = even + complexMultiply(realTwiddles[k], odd);
+  }
+}
+
+// The forward split step run backwards, then a half size inverse transform.
+void FFT::inverse(const std::complex<float>* spectrum, float* output) {
+  for (int k = 0; k < half; ++k) {
+    std::complex<float> xk = spectrum[k];
+    std::complex<float> xc = std::conj(spectrum[half - k]);
+    std::complex<float> even = (xk + xc) * 0.5f;
+    std::complex<float> odd = complexMultiply((xk - xc) * 0.5f, std::conj(realTwiddles[k]));
+    scratch[k] = { even.real() - odd.imag(), even.imag() + odd.real() }; // even + i * odd
+  }
+  transform(scratch.data(), true);
+
+  const float scale = 1.0f / half;
+  for (int k = 0; k < half; ++k) {
+    output[2 * k] = scratch[k].real() * scale;
+    output[2 * k + 1] = scratch[k].imag() * scale;
+  }
+}
+
+// C++ 17 doesn't have PI constant.
+// We can use arccosine of -1.0 to get pi instead.
+// When x == -1.0 on the unit circle, theta == pi.
+const double PI = std::acos(-1.0);
+
+
+BiquadProcessor::BiquadProcessor(float sampleRate, const FilterConfig& config)
+  : mode(config.mode), 
+    cutoff(config.cutoff), 
+    resonance(config.resonance), 
+    sampleRate(sampleRate) 
+{
+  calculateCoefficients();
+}
+
+void BiquadProcessor::calculateCoefficients() {
+  double w0 = 2.0 * PI * cutoff / sampleRate;
+  double alpha = std::sin(w0) / (2.0 * resonance);
+  double cosW0 = std::cos(w0);
+
+  double a0 = 0;
+
+  switch (mode) {
+    case FilterMode::Lowpass:
+      b0 = (1.0 - cosW0) / 2.0;
+      b1 = 1.0 - cosW0;
+      b2 = (1.0 - cosW0) / 2.0;
+      a0 = 1.0 + alpha;
+      a1 = -2.0 * cosW0;
+      a2 = 1.0 - alpha;
+      break;
+    case FilterMode::Highpass:
+      b0 = (1.0 + cosW0) / 2.0;
+      b1 = -(1.0 + cosW0);
+      b2 = (1.0 + cosW0) / 2.0;
+      a0 = 1.0 + alpha;
+      a1 = -2.0 * cosW0;
+      a2 = 1.0 - alpha;
+      break;
+    case FilterMode::Bandpass:
+      b0 = alpha;
+      b1 = 0;
+      b2 = -alpha;
+      a0 = 1.0 + alpha;
+      a1 = -2.0 * cosW0;
+      a2 = 1.0 - alpha;
+      break;
+    case FilterMode::Notch:
+      b0 = 1.0;
+      b1 = -2.0 * cosW0;
+      b2 = 1.0;
+      a0 = 1.0 + alpha;
+      a1 = -2.0 * cosW0;
+      a2 = 1.0 - alpha;
+      break;
+  }
+
+  // Normalize all coefficients by a0
+  b0 /= a0; b1 /= a0; b2 /= a0;
+  a1 /= a0; a2 /= a0;
+
+  // Debug...
+  // printf("Filter: F=%f, Q=%f, SR=%f | b0=%f, a1=%f\n", cutoff, resonance, sampleRate, b0, a1);
+}
+
+void BiquadProcessor::setParams(float newCutoff, float newResonance) {
+  cutoff = newCutoff;
+  resonance = newResonance;
+  calculateCoefficients();
+}
+
+void BiquadProcessor::setMode(FilterMode newMode) {
+  mode = newMode;
+  calculateCoefficients();
+}
+
+void BiquadProcessor::setSampleRate(float newSampleRate) {
+  sampleRate = newSampleRate;
+  calculateCoefficients();
+}
+
+void BiquadProcessor::reset() {
+  std::fill(std::begin(z1_x), std::end(z1_x), 0.0);
+  std::fill(std::begin(z2_x), std::end(z2_x), 0.0);
+  std::fill(std::begin(z1_y), std::end(z1_y), 0.0);
+  std::fill(std::begin(z2_y), std::end(z2_y), 0.0);
+}
+
+void BiquadProcessor::settle(double threshold) {
+  for (int ch = 0; ch < maxDspChannels; ++ch) {
+    if (std::abs(z1_x[ch]) >= threshold || std::abs(z2_x[ch]) >= threshold
+      || std::abs(z1_y[ch]) >= threshold || std::abs(z2_y[ch]) >= threshold) {
+      return;
+    }
+  }
+  reset();
+}
+
+bool BiquadProcessor::isSettled() const {
+  for (int ch = 0; ch < maxDspChannels; ++ch) {
+    if (z1_x[ch] != 0.0 || z2_x[ch] != 0.0 || z1_y[ch] != 0.0 || z2_y[ch] != 0.0) return false;
+  }
+  return true;
+}
+
+void BiquadProcessor::process(const float* in, float* out, int numFrames, int numChannels) {
+  assert(numChannels <= maxDspChannels);
+
+  dispatchChannels(numChannels, [&](auto channels) {
+    for (int i = 0; i < numFrames; ++i) {
+      tick(in + i * channels, out + i * channels, channels);
+    }
+  });
+}
+
+Filter::Filter(const AudioContext& context, const FilterConfig& config)
+  : AudioNode(context), biquad(static_cast<float>(context.sampleRate), config)
+{
+  requireDspChannels(context.numChannels, "Filter");
+}
+
+void Filter::setParams(float newCutoff, float newResonance) {
+  biquad.setParams(newCutoff, newResonance);
+}
+
+void Filter::setMode(FilterMode newMode) {
+  biquad.setMode(newMode);
+}
+
+void Filter::setAudioContext(const AudioContext& context) {
+  requireDspChannels(context.numChannels, "Filter");
+  AudioNode::setAudioContext(context);
+  biquad.setSampleRate(context.sampleRate);
+}
+
+void Filter::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  // No early out on empty inputs, the filter keeps running on silence until its tail decays.
+  apply(mixInputs(inputs, outputBuffer), outputBuffer);
+
+  // Once the tail is below -120dB, snap the state to zero so the graph can put us to sleep.
+  if (inputs.empty()) {
+    biquad.settle(1e-6);
+  }
+}
+
+bool Filter::canSleep() const {
+  return biquad.isSettled();
+}
+
+void Filter::applyToBuffer(AudioBuffer& buffer) {
+  apply(buffer, buffer);
+}
+
+void Filter::apply(const AudioBuffer& input, AudioBuffer& output) {
+  processTile(input.data.data(), output.data.data(), output.getNumFrames());
+}
+
+void Filter::processTile(const float* in, float* out, int numFrames) {
+  biquad.process(in, out, numFrames, outputBuffer.getNumChannels());
+}
+
+
+Gain::Gain(const AudioContext& context, float gain)
+  : AudioNode(context), gain(gain) {}
+
+void Gain::setGain(float newGain) {
+  this->gain = newGain;
+}
+
+void Gain::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  if (inputs.empty()) {
+    outputSilence();
+    return;
+  }
+
+  // Reads straight from a single input, so it's one pass either way.
+  const AudioBuffer& input = mixInputs(inputs, outputBuffer);
+  processTile(input.data.data(), outputBuffer.data.data(), outputBuffer.getNumFrames());
+}
+
+void Gain::processTile(const float* in, float* out, int numFrames) {
+  const int numSamples = numFrames * outputBuffer.getNumChannels();
+  for (int i = 0; i < numSamples; ++i) {
+    out[i] = in[i] * gain;
+  }
+}
+
+
+InputNode::InputNode(const AudioContext& context, const CaptureInput& capture)
+  : AudioNode(context), capture(capture) {}
+
+void InputNode::process(const std::vector<const AudioBuffer*>& /*inputs*/, AudioBuffer& outputBuffer) {
+  // Not rendering from a duplex callback.
+  if (!capture.samples) {
+    outputSilence();
+    return;
+  }
+
+  // One copy straight out of the device's buffer, the graph hands our outputBuffer downstream.
+  const int count = std::min(capture.numFrames, outputBuffer.getNumFrames()) * outputBuffer.getNumChannels();
+  std::copy(capture.samples, capture.samples + count, outputBuffer.data.begin());
+  std::fill(outputBuffer.data.begin() + count, outputBuffer.data.end(), 0.0f);
+}
+
+
+LoadGovernor::LoadGovernor(const AudioContext& context) {
+  setAudioContext(context);
+}
+
+void LoadGovernor::setAudioContext(const AudioContext& context) {
+  deadline = static_cast<double>(context.bufferSize) / context.sampleRate;
+  recoveryBlocks = std::max(1, static_cast<int>(context.sampleRate / context.bufferSize));
+}
+
+void LoadGovernor::setEnabled(bool enable) {
+  enabled.store(enable, std::memory_order_relaxed);
+}
+
+Quality LoadGovernor::update(double seconds) {
+  const float blockLoad = static_cast<float>(seconds / deadline);
+
+  // Jump straight up to a spike, drift back down.
+  if (blockLoad > smoothedLoad) {
+    smoothedLoad = blockLoad;
+  } else {
+    smoothedLoad += (blockLoad - smoothedLoad) * 0.05f;
+  }
+  load.store(smoothedLoad, std::memory_order_relaxed);
+
+  int level = static_cast<int>(quality.load(std::memory_order_relaxed));
+  if (!enabled.load(std::memory_order_relaxed)) {
+    level = static_cast<int>(Quality::Full);
+  } else {
+    blocksAtLevel++;
+    blocksWithHeadroom = smoothedLoad < stepUpLoad ? blocksWithHeadroom + 1 : 0;
+
+    // Give each step a couple of blocks to take effect before taking another.
+    if (smoothedLoad > stepDownLoad && blocksAtLevel > 2 && level < static_cast<int>(Quality::VirtualVoices)) {
+      level++;
+      blocksAtLevel = 0;
+      blocksWithHeadroom = 0;
+      // The step should bring the load down, don't let the old spike trigger the next one.
+      smoothedLoad = blockLoad;
+    } else if (blocksWithHeadroom >= recoveryBlocks && level > static_cast<int>(Quality::Full)) {
+      level--;
+      blocksAtLevel = 0;
+      blocksWithHeadroom = 0;
+    }
+  }
+
+  quality.store(static_cast<Quality>(level), std::memory_order_relaxed);
+  return static_cast<Quality>(level);
+}
+
+
+// Short-term loudness window.
+static constexpr double loudnessWindowSeconds = 3.0;
+
+Meter::Meter(const AudioContext& context, bool measureLoudness)
+  : AudioNode(context), loudnessEnabled(measureLoudness)
+{
+  requireDspChannels(context.numChannels, "Meter");
+  if (loudnessEnabled) setupLoudness(context);
+}
+
+void Meter::setAudioContext(const AudioContext& context) {
+  requireDspChannels(context.numChannels, "Meter");
+  AudioNode::setAudioContext(context);
+  if (loudnessEnabled) setupLoudness(context);
+}
+
+void Meter::setupLoudness(const AudioContext& context) {
+  // K-weighting from BS.1770, with the coefficients worked out for any sample rate.
+  const double pi = std::acos(-1.0);
+  const double fs = context.sampleRate;
+
+  {
+    const double f0 = 1681.974450955533, gainDb = 3.999843853973347, q = 0.7071752369554196;
+    const double k = std::tan(pi * f0 / fs);
+    const double vh = std::pow(10.0, gainDb / 20.0);
+    const double vb = std::pow(vh, 0.4996667741545416);
+    const double a0 = 1.0 + k / q + k * k;
+    shelf = KStage();
+    shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    shelf.b1 = 2.0 * (k * k - vh) / a0;
+    shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf.a2 = (1.0 - k / q + k * k) / a0;
+  }
+  {
+    const double f0 = 38.13547087602444, q = 0.5003270373238773;
+    const double k = std::tan(pi * f0 / fs);
+    const double a0 = 1.0 + k / q + k * k;
+    highpass = KStage();
+    highpass.b0 = 1.0;
+    highpass.b1 = -2.0;
+    highpass.b2 = 1.0;
+    highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+    highpass.a2 = (1.0 - k / q + k * k) / a0;
+  }
+
+  const size_t numBlocks = std::max<size_t>(1, static_cast<size_t>(std::lround(loudnessWindowSeconds * fs / context.bufferSize)));
+  blockEnergy.assign(numBlocks, 0.0);
+  blockIndex = 0;
+  loudness = meterSilenceLufs;
+}
+
+void Meter::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  // No early out on silence, the reading has to drop with it.
+  const AudioBuffer& input = mixInputs(inputs, outputBuffer);
+  if (&input != &outputBuffer) {
+    std::copy(input.data.begin(), input.data.end(), outputBuffer.data.begin());
+  }
+  measure(outputBuffer);
+}
+
+void Meter::measure(const AudioBuffer& input) {
+  MeterReading reading;
+  reading.numChannels = input.getNumChannels();
+  const float* in = input.data.data();
+  const int numSamples = input.size();
+
+  dispatchChannels(reading.numChannels, [&](auto channels) {
+    // Reduce into 8 independent lanes, sample i going to lane i % 8. The inner loop is a fixed
+    // width max and multiply-add, so it vectorizes without reordering any float math. With
+    // 1, 2 or 8 channels each lane holds a single channel, others fall back to one lane each.
+    constexpr int simdLanes = 8;
+    const int lanes = simdLanes % channels == 0 ? simdLanes : static_cast<int>(channels);
+    float peak[simdLanes] = {};
+    float sumSquares[simdLanes] = {};
+
+    int i = 0;
+    if (lanes == simdLanes) {
+      for (; i + simdLanes <= numSamples; i += simdLanes) {
+        for (int lane = 0; lane < simdLanes; ++lane) {
+          const float x = in[i + lane];
+          peak[lane] = std::max(peak[lane], std::abs(x));
+          sumSquares[lane] += x * x;
+        }
+      }
+    }
+    // The rest, or everything when 8 lanes can't hold whole frames.
+    for (; i < numSamples; ++i) {
+      const int lane = i % lanes;
+      peak[lane] = std::max(peak[lane], std::abs(in[i]));
+      sumSquares[lane] += in[i] * in[i];
+    }
+
+    for (int lane = 0; lane < lanes; ++lane) {
+      const int ch = lane % channels;
+      reading.peak[ch] = std::max(reading.peak[ch], peak[lane]);
+      reading.rms[ch] += sumSquares[lane];
+    }
+  });
+
+  const int numFrames = input.getNumFrames();
+  for (int ch = 0; ch < reading.numChannels; ++ch) {
+    reading.rms[ch] = std::sqrt(reading.rms[ch] / numFrames);
+  }
+
+  if (loudnessEnabled) measureLoudness(input);
+  reading.loudness = loudness;
+  publish(reading);
+}
+
+void Meter::measureLoudness(const AudioBuffer& input) {
+  const int numChannels = input.getNumChannels();
+  const int numFrames = input.getNumFrames();
+  const float* in = input.data.data();
+  double energy = 0.0;
+
+  // Both K-weighting stages per sample, they're too small to be worth a buffer in between.
+  dispatchChannels(numChannels, [&](auto channels) {
+    for (int i = 0; i < numFrames; ++i) {
+      for (int ch = 0; ch < channels; ++ch) {
+        double x = in[i * channels + ch];
+        double y = shelf.b0 * x + shelf.z1[ch];
+        shelf.z1[ch] = shelf.b1 * x - shelf.a1 * y + shelf.z2[ch];
+        shelf.z2[ch] = shelf.b2 * x - shelf.a2 * y;
+
+        x = y;
+        y = highpass.b0 * x + highpass.z1[ch];
+        highpass.z1[ch] = highpass.b1 * x - highpass.a1 * y + highpass.z2[ch];
+        highpass.z2[ch] = highpass.b2 * x - highpass.a2 * y;
+
+        energy += y * y;
+      }
+    }
+  });
+
+  // Keeps the filter state out of denormals once the input has gone quiet.
+  for (KStage* stage : { &shelf, &highpass }) {
+    for (int ch = 0; ch < numChannels; ++ch) {
+      if (std::abs(stage->z1[ch]) < 1e-15) stage->z1[ch] = 0.0;
+      if (std::abs(stage->z2[ch]) < 1e-15) stage->z2[ch] = 0.0;
+    }
+  }
+
+  blockEnergy[blockIndex] = energy;
+  blockIndex = (blockIndex + 1) % blockEnergy.size();
+
+  // Summed from scratch, a running total would drift. It's a few hundred adds.
+  double windowEnergy = 0.0;
+  for (double e : blockEnergy) windowEnergy += e;
+  const double meanSquare = windowEnergy / (static_cast<double>(blockEnergy.size()) * numFrames);
+
+  // Channels are weighted equally, BS.1770 boosts surrounds by 1.5dB but we don't know the layout.
+  loudness = meanSquare > 0.0
+    ? std::max(meterSilenceLufs, static_cast<float>(-0.691 + 10.0 * std::log10(meanSquare)))
+    : meterSilenceLufs;
+}
+
+void Meter::publish(const MeterReading& reading) {
+  // Only the audio thread writes, so a plain load of our own counter is fine.
+  const unsigned seq = sequence.load(std::memory_order_relaxed);
+  sequence.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  publishedChannels.store(reading.numChannels, std::memory_order_relaxed);
+  for (int ch = 0; ch < maxDspChannels; ++ch) {
+    publishedPeak[ch].store(reading.peak[ch], std::memory_order_relaxed);
+    publishedRms[ch].store(reading.rms[ch], std::memory_order_relaxed);
+  }
+  publishedLoudness.store(reading.loudness, std::memory_order_relaxed);
+
+  sequence.store(seq + 2, std::memory_order_release);
+}
+
+MeterReading Meter::getReading() const {
+  MeterReading reading;
+  unsigned before, after;
+  do {
+    before = sequence.load(std::memory_order_acquire);
+    reading.numChannels = publishedChannels.load(std::memory_order_relaxed);
+    for (int ch = 0; ch < maxDspChannels; ++ch) {
+      reading.peak[ch] = publishedPeak[ch].load(std::memory_order_relaxed);
+      reading.rms[ch] = publishedRms[ch].load(std::memory_order_relaxed);
+    }
+    reading.loudness = publishedLoudness.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = sequence.load(std::memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  return reading;
+}
+
+
+Mixer::Mixer(const AudioContext& context, float gain)
+  : AudioNode(context), gain(gain) {}
+
+void Mixer::setGain(float newGain) {
+  gain.store(newGain, std::memory_order_relaxed);
+}
+
+void Mixer::setInputGain(const AudioNode* source, float inputGain) {
+  inputGains[&source->outputBuffer].store(inputGain, std::memory_order_relaxed);
+}
+
+float Mixer::getInputGain(const AudioNode* source) const {
+  return gainFor(&source->outputBuffer);
+}
+
+void Mixer::sourceDisconnected(const AudioNode& source) {
+  // Otherwise a node added later at the same address would get this gain, and removed
+  // sources would pile up.
+  inputGains.erase(&source.outputBuffer);
+}
+
+float Mixer::gainFor(const AudioBuffer* input) const {
+  auto it = inputGains.find(input);
+  return it == inputGains.end() ? 1.0f : it->second.load(std::memory_order_relaxed);
+}
+
+void Mixer::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  if (inputs.empty()) {
+    outputSilence();
+    return;
+  }
+
+  const float master = gain.load(std::memory_order_relaxed);
+  const int numSamples = outputBuffer.size();
+  float* out = outputBuffer.data.data();
+  const size_t numInputs = inputs.size();
+  size_t next = 0;
+
+  // The first pass writes instead of accumulating, which saves clearing the buffer.
+  bool accumulate = false;
+
+  // Four inputs per pass, one read-modify-write of the output per four inputs.
+  for (; next + 4 <= numInputs; next += 4) {
+    const float* a = inputs[next]->data.data();
+    const float* b = inputs[next + 1]->data.data();
+    const float* c = inputs[next + 2]->data.data();
+    const float* d = inputs[next + 3]->data.data();
+    const float gainA = gainFor(inputs[next]) * master;
+    const float gainB = gainFor(inputs[next + 1]) * master;
+    const float gainC = gainFor(inputs[next + 2]) * master;
+    const float gainD = gainFor(inputs[next + 3]) * master;
+
+    if (accumulate) {
+      for (int i = 0; i < numSamples; ++i) {
+        out[i] += a[i] * gainA + b[i] * gainB + c[i] * gainC + d[i] * gainD;
+      }
+    } else {
+      for (int i = 0; i < numSamples; ++i) {
+        out[i] = a[i] * gainA + b[i] * gainB + c[i] * gainC + d[i] * gainD;
+      }
+      accumulate = true;
+    }
+  }
+
+  // Leftovers, one at a time.
+  for (; next < numInputs; ++next) {
+    const float* in = inputs[next]->data.data();
+    const float inputGain = gainFor(inputs[next]) * master;
+
+    if (accumulate) {
+      for (int i = 0; i < numSamples; ++i) {
+        out[i] += in[i] * inputGain;
+      }
+    } else {
+      for (int i = 0; i < numSamples; ++i) {
+        out[i] = in[i] * inputGain;
+      }
+      accumulate = true;
+    }
+  }
+}
+
+
+static std::vector<SampleRequest> musicCueRequests(const std::vector<MusicCue>& cues, const std::string& samplesDir) {
+  std::vector<SampleRequest> requests;
+  requests.reserve(cues.size());
+  for (const auto& item : cues) {
+    requests.push_back({ samplesDir + item.fileName, item.storage });
+  }
+  return requests;
+}
+
+MusicCueOrchestrator::MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::string samplesDir)
+  : MusicCueOrchestrator(
+    graph,
+    cues,
+    SampleLoader::loadAll(graph.audioContext, musicCueRequests(cues, samplesDir))
+  ) {}
+
+static std::vector<std::shared_ptr<const SampleData>> musicCueBankSamples(const std::vector<MusicCue>& cues, const SampleBank& bank) {
+  std::vector<std::shared_ptr<const SampleData>> samples;
+  samples.reserve(cues.size());
+  for (const auto& item : cues) {
+    samples.push_back(bank.get(item.fileName, item.storage));
+  }
+  return samples;
+}
+
+MusicCueOrchestrator::MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, const SampleBank& bank)
+  : MusicCueOrchestrator(graph, cues, musicCueBankSamples(cues, bank)) {}
+
+MusicCueOrchestrator::MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::vector<std::shared_ptr<const SampleData>> samples)
+  : graph(graph), sends(graph) {
+
+  // Validate and build every node before touching the graph.
+  auto outputNode = std::make_unique<Mixer>(graph.audioContext, 1.0f);
+  std::vector<std::unique_ptr<Sampler>> samplerNodes;
+  samplerNodes.reserve(cues.size());
+
+  for (size_t i = 0; i < cues.size(); ++i) {
+    const auto& item = cues[i];
+    if (handles.find(item.slug) != handles.end()) {
+      throw std::runtime_error("Duplicate music cue slug: " + item.slug);
+    }
+
+    if (item.slug.empty()) {
+      throw std::runtime_error("Cue slug name cannot be empty string.");
+    }
+
+    samplerNodes.push_back(std::make_unique<Sampler>(
+      graph.audioContext,
+      samples[i],
+      1, // polyphony
+      item.loop,
+      item.gain,
+      0, // pitchShift
+      EnvConfig { 0.1f, 0.1f, 1.0f, 0.5f } // attack, decay, sustain, release
+    ));
+    if (item.loopPoints) samplerNodes.back()->setLoopPoints(item.loopPoints);
+    handles[item.slug] = static_cast<SampleHandle>(i);
+    samplers.push_back(samplerNodes.back().get());
+  }
+
+  auto triggerNode = std::make_unique<SampleTriggerNode>(graph.audioContext, samplers, 64);
+  triggers = triggerNode.get();
+
+  // Join the graph as one edit, caught up first if a reconfiguration ran while loading.
+  std::vector<AudioNode*> nodes { outputNode.get(), triggerNode.get() };
+  for (const auto& samplerNode : samplerNodes) nodes.push_back(samplerNode.get());
+  auto lock = graph.lockGraphFor(nodes);
+  outputNodeId = graph.addNode(std::move(outputNode));
+  sends.setReturnNode(outputNodeId);
+  int triggerNodeId = graph.addNode(std::move(triggerNode));
+
+  std::vector<int> samplerNodeIds;
+  samplerNodeIds.reserve(samplerNodes.size());
+  for (auto& samplerNode : samplerNodes) {
+    int samplerNodeId = graph.addNode(std::move(samplerNode));
+    graph.connect(triggerNodeId, samplerNodeId);
+    graph.connect(samplerNodeId, outputNodeId);
+    samplerNodeIds.push_back(samplerNodeId);
+  }
+  lock.unlock();
+
+  // No buses yet, so registering the send sources doesn't touch the graph.
+  for (size_t i = 0; i < cues.size(); ++i) {
+    sends.addSource(cues[i].slug, samplerNodeIds[i], samplers[i], cues[i].sends);
+  }
+}
+
+std::future<std::unique_ptr<MusicCueOrchestrator>> MusicCueOrchestrator::loadAsync(
+  SampleLoader& loader,
+  AudioGraph& graph,
+  std::vector<MusicCue> cues,
+  std::string samplesDir,
+  LoadProgressCallback onProgress
+) {
+  auto promise = std::make_shared<std::promise<std::unique_ptr<MusicCueOrchestrator>>>();
+  auto future = promise->get_future();
+  auto requests = musicCueRequests(cues, samplesDir);
+
+  loader.loadBatch(
+    graph.audioContext,
+    requests,
+    [promise, &graph, cues = std::move(cues)](std::vector<std::shared_ptr<const SampleData>> samples) {
+      try {
+        promise->set_value(std::make_unique<MusicCueOrchestrator>(graph, cues, std::move(samples)));
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    },
+    onProgress
+  );
+
+  return future;
+}
+
+SampleHandle MusicCueOrchestrator::getCueHandle(const std::string& slug) const {
+  auto it = handles.find(slug);
+  return it == handles.end() ? invalidSampleHandle : it->second;
+}
+
+void MusicCueOrchestrator::playCue(SampleHandle cue) {
+  if (cue == currentCue || cue < 0 || cue >= static_cast<SampleHandle>(handles.size())) {
+    return;
+  }
+
+  SampleTrigger batch[2];
+  size_t count = 0;
+  if (currentCue != invalidSampleHandle) {
+    batch[count++] = { currentCue, 1.0f, 0, true };
+  }
+  batch[count++] = { cue };
+
+  if (triggers->push(batch, count)) {
+    currentCue = cue;
+  }
+}
+
+void MusicCueOrchestrator::playCue(const std::string& slug) {
+  playCue(getCueHandle(slug));
+}
+
+void MusicCueOrchestrator::stopCue() {
+  if (currentCue == invalidSampleHandle) {
+    return;
+  }
+
+  SampleTrigger release { currentCue, 1.0f, 0, true };
+  if (triggers->push(&release, 1)) {
+    currentCue = invalidSampleHandle;
+  }
+}
+
+bool MusicCueOrchestrator::lockSampleMemory() {
+  bool locked = true;
+  for (Sampler* sampler : samplers) {
+    locked = sampler->lockSampleMemory() && locked;
+  }
+  return locked;
+}
+
+void MusicCueOrchestrator::setSendLevel(const std::string& slug, const std::string& bus, float level) {
+  sends.setSendLevel(slug, bus, level);
+}
+
+Compressor* MusicCueOrchestrator::duckUnder(int keyNodeId, const CompressorConfig& config) {
+  auto lock = graph.lockGraph();
+  const AudioNode* key = graph.getNode(keyNodeId);
+  if (!key) {
+    throw std::runtime_error("Can't duck music cues under a node that isn't in the graph.");
+  }
+
+  if (!ducker) {
+    // Send returns land in the output mixer too, so they're ducked with the cues.
+    auto [nodeId, node] = graph.addNode<Compressor>(config);
+    duckerNodeId = nodeId;
+    ducker = node;
+    graph.connect(outputNodeId, duckerNodeId);
+  } else {
+    graph.disconnect(duckKeyNodeId, duckerNodeId);
+    ducker->setThreshold(config.threshold);
+    ducker->setRatio(config.ratio);
+    ducker->setAttack(config.attack);
+    ducker->setRelease(config.release);
+    ducker->setMakeup(config.makeup);
+  }
+
+  graph.connectSidechain(keyNodeId, duckerNodeId);
+  ducker->setSidechain(key);
+  duckKeyNodeId = keyNodeId;
+  return ducker;
+}
+
+
+NoiseGenerator::NoiseGenerator(const AudioContext& context)
+  : AudioNode(context),
+    randomGen(randomDevice()),
+    dist(-1.0f, 1.0f)
+{}
+
+void NoiseGenerator::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  for (int i = 0; i < outputBuffer.size(); ++i) {
+    outputBuffer[i] = dist(randomGen);
+  }
+}
+
+
+PitchShiftProcessor::PitchShiftProcessor(const AudioContext& context, int semitoneShift)
+  : currentDelay(0.0), ratio(convertSemitoneToRatio(semitoneShift)),
+    ringFrames(minRingFrames), windowFrames(0), channels(context.numChannels), ringWriteIdx(0) {
+    setAudioContext(context);
+
+    // Use below if you want custom window size.
+    // Set a window size of ~20ms (adjust to taste)
+    // int windowSize = static_cast<int>(context.sampleRate * 0.020);
+    // ringBuffer.resize(windowSize);
+  }
+
+PitchShift::PitchShift(const AudioContext& context, int semitoneShift)
+  : AudioNode(context), shifter(context, semitoneShift) {}
+
+  
+void PitchShift::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  if (inputs.empty()) {
+    // Keep reading out what's left in the ring until it only holds silence.
+    outputBuffer.clear();
+    applyToBuffer(outputBuffer);
+    silentFramesWritten += outputBuffer.getNumFrames();
+    return;
+  }
+
+  silentFramesWritten = 0;
+  apply(mixInputs(inputs, outputBuffer), outputBuffer);
+}
+
+void PitchShift::applyToBuffer(AudioBuffer& buffer) {
+  apply(buffer, buffer);
+}
+
+void PitchShift::apply(const AudioBuffer& input, AudioBuffer& output) {
+  shifter.process(input.data.data(), output.data.data(), output.getNumFrames());
+}
+
+void PitchShift::setPitch(int semitoneShift) {
+  shifter.setPitch(semitoneShift);
+}
+
+bool PitchShift::canSleep() const {
+  return silentFramesWritten >= shifter.getRingFrames();
+}
+
+void PitchShift::reset() {
+  shifter.reset();
+}
+
+void PitchShift::setAudioContext(const AudioContext& context) {
+  AudioNode::setAudioContext(context);
+  shifter.setAudioContext(context);
+  silentFramesWritten = 0;
+}
+
+void PitchShift::setQuality(Quality quality) {
+  shifter.setCubicInterpolation(quality < Quality::LinearInterpolation);
+}
+
+void PitchShiftProcessor::process(const float* in, float* out, int numFrames) {
+  dispatchChannels(channels, [&](auto numChannels) {
+    for (int start = 0; start < numFrames; start += groupFrames) {
+      const int count = std::min(groupFrames, numFrames - start);
+      renderGroup(in + start * numChannels, out + start * numChannels, count, numChannels);
+    }
+  });
+}
+
+void PitchShiftProcessor::tick(const float* in, float* out, int numChannels) {
+  assert(numChannels == channels);
+  renderGroup(in, out, 1, numChannels);
+}
+
+/**
+ * Renders up to `groupFrames` frames in three passes: tap positions and window gains for every
+ * frame, then the ring writes, then the interpolation. Reads go through the guard frames so
+ * each tap is four contiguous frames with no wrapping, and the channel loop runs with a
+ * constant trip count for the common layouts.
+ *
+ * Both taps sweep delays in [minDelayFrames, minDelayFrames + windowFrames), which is never
+ * less than a group ahead of the newest frame read or more than the ring still holds once
+ * the group is written. So writing the whole group before reading it is still causal, and
+ * each tap only jumps where its window gain is zero.
+ */
+template <typename Channels>
+void PitchShiftProcessor::renderGroup(const float* in, float* out, int numFrames, Channels numChannels) {
+  const double window = static_cast<double>(windowFrames);
+  const int mask = ringFrames - 1;
+  const int halfWindow = windowFrames / 2; // Tap B is offset by 180 deg.
+
+  int tapA[groupFrames];
+  int tapB[groupFrames];
+  float fractions[groupFrames];
+  float gainsA[groupFrames];
+
+  for (int i = 0; i < numFrames; ++i) {
+    // Offset for Dual Tap delay.
+    currentDelay += (1.0 - ratio);
+
+    // Wrap currentDelay
+    if (currentDelay >= window) currentDelay -= window;
+    if (currentDelay < 0) currentDelay += window;
+
+    // Shifted up by two ring lengths so it's never negative, the truncation is a floor
+    // and the mask does the wrap.
+    double tapAPos = static_cast<double>(ringWriteIdx + i + 2 * ringFrames - minDelayFrames) - currentDelay;
+    int index = static_cast<int>(tapAPos);
+    tapA[i] = index & mask;
+    // B's delay is half a window away, on whichever side keeps it inside the window.
+    tapB[i] = (currentDelay >= halfWindow ? index + halfWindow : index - halfWindow) & mask;
+    fractions[i] = static_cast<float>(tapAPos - index);
+
+    // Hann window for crossfading between taps, B gets the complement.
+    gainsA[i] = hannWindow(static_cast<float>(currentDelay / window));
+  }
+
+  for (int i = 0; i < numFrames; ++i) {
+    writeFrame(in + i * numChannels, numChannels);
+  }
+
+  for (int i = 0; i < numFrames; ++i) {
+    const float* a = &ringBuffer[tapA[i] * numChannels];
+    const float* b = &ringBuffer[tapB[i] * numChannels];
+    const float fraction = fractions[i];
+    const float gainA = gainsA[i];
+    const float gainB = 1.0f - gainA;
+    float* frame = out + i * numChannels;
+
+    if (cubic) {
+      for (int ch = 0; ch < numChannels; ++ch) {
+        float sampleA = cubicInterpolation(a[ch], a[numChannels + ch], a[2 * numChannels + ch], a[3 * numChannels + ch], fraction);
+        float sampleB = cubicInterpolation(b[ch], b[numChannels + ch], b[2 * numChannels + ch], b[3 * numChannels + ch], fraction);
+        frame[ch] = (sampleA * gainA) + (sampleB * gainB);
+      }
+    } else {
+      // Between the middle two frames of each tap.
+      for (int ch = 0; ch < numChannels; ++ch) {
+        float sampleA = a[numChannels + ch] + (a[2 * numChannels + ch] - a[numChannels + ch]) * fraction;
+        float sampleB = b[numChannels + ch] + (b[2 * numChannels + ch] - b[numChannels + ch]) * fraction;
+        frame[ch] = (sampleA * gainA) + (sampleB * gainB);
+      }
+    }
+  }
+}
+
+// Ring frame k is stored at k + 1. Frame 0 holds a copy of the last frame and the two frames
+// past the end hold copies of the first two, so frames i-1..i+2 are always contiguous.
+void PitchShiftProcessor::writeFrame(const float* frame, int numChannels) {
+  const int index = ringWriteIdx;
+  std::copy(frame, frame + numChannels, &ringBuffer[(index + 1) * numChannels]);
+  if (index == ringFrames - 1) {
+    std::copy(frame, frame + numChannels, &ringBuffer[0]);
+  }
+  if (index < 2) {
+    std::copy(frame, frame + numChannels, &ringBuffer[(ringFrames + 1 + index) * numChannels]);
+  }
+
+  // Increment write index.
+  ringWriteIdx = (index + 1) & (ringFrames - 1);
+}
+
+const std::array<float, PitchShiftProcessor::hannTableSize + 1> PitchShiftProcessor::hannTable = PitchShiftProcessor::buildHannTable();
+
+std::array<float, PitchShiftProcessor::hannTableSize + 1> PitchShiftProcessor::buildHannTable() {
+  std::array<float, hannTableSize + 1> values;
+  const double pi = std::acos(-1.0);
+  for (int i = 0; i <= hannTableSize; ++i) {
+    double s = std::sin(pi * i / hannTableSize);
+    values[i] = static_cast<float>(s * s);
+  }
+  return values;
+}
+
+// Interpolated from the table.
+float PitchShiftProcessor::hannWindow(float phase) {
+  const std::array<float, hannTableSize + 1>& table = hannTable;
+  float position = phase * hannTableSize;
+  int index = std::min(static_cast<int>(position), hannTableSize - 1);
+  float fraction = position - index;
+  return table[index] + (table[index + 1] - table[index]) * fraction;
+}
+
+void PitchShiftProcessor::setPitch(int semitoneShift) {
+  ratio = convertSemitoneToRatio(semitoneShift);
+}
+
+int PitchShiftProcessor::getRingFrames() const {
+  return ringFrames;
+}
 
-  std::unordered_map<std::string, Sampler*> samplers;
-  std::unique_ptr<Gain> output;
+void PitchShiftProcessor::setCubicInterpolation(bool useCubic) {
+  cubic = useCubic;
+}
 
-private:
-  AudioGraph& graph;
-};
-} // namespace MittelVec
+void PitchShiftProcessor::setAudioContext(const AudioContext& context) {
+  // At least one block of frames, rounded up to a power of two so positions wrap with a mask.
+  ringFrames = minRingFrames;
+  while (ringFrames < context.bufferSize) ringFrames *= 2;
+  // Even so both taps land on the same fraction (see renderGroup).
+  windowFrames = (ringFrames - minDelayFrames - groupFrames - guardFrames) & ~1;
 
-#endif // MITTELVEC_H
+  // Preallocate ringBuffer, plus the guard frames (see writeFrame).
+  ringBuffer.assign((ringFrames + guardFrames) * channels, 0.0f);
+  currentDelay = 0.0;
+  ringWriteIdx = 0;
+}
 
-#ifdef MITTELVEC_IMPLEMENTATION
+void PitchShiftProcessor::reset() {
+  // samplePosition = 0.0;
+  currentDelay = 0.0;
+  ringWriteIdx = 0;
+  std::fill(ringBuffer.begin(), ringBuffer.end(), 0.0f);
+}
 
-#ifndef MINIAUDIO_IMPLEMENTATION
-    #define MINIAUDIO_IMPLEMENTATION
+// sm1 = s-1
+float PitchShiftProcessor::cubicInterpolation(float sm1, float s0, float s1, float s2, float fraction) {
+  float a = -0.5f * sm1 + 1.5f * s0 - 1.5f * s1 + 0.5f * s2;
+  float b = sm1 - 2.5f * s0 + 2.0f * s1 - 0.5f * s2;
+  float c = -0.5f * sm1 + 0.5f * s1;
+  float d = s0;
+
+  return d + fraction * (c + fraction * (b + fraction * a));
+}
+
+// void Gain::sincInterpolation(const float* inputData, size_t numInputSamples, double position, int numTaps) {
+  
+// }
+
+double PitchShiftProcessor::convertSemitoneToRatio(int semitoneShift) {
+  const double exponent = static_cast<double>(semitoneShift) / 12.0;
+    
+  // The base is 2 (for an octave)
+  return std::pow(2.0, exponent);
+}
+
+
+
+
+#if defined(MITTELVEC_HAS_MXCSR)
+static constexpr unsigned int mxcsrFlushToZero = 0x8000;
+static constexpr unsigned int mxcsrDenormalsAreZero = 0x0040;
+#elif defined(MITTELVEC_HAS_FPCR)
+static constexpr unsigned long long fpcrFlushToZero = 1ull << 24;
 #endif
-#include "miniaudio.h"
 
-namespace MittelVec {
+ScopedFlushDenormals::ScopedFlushDenormals() {
+#if defined(MITTELVEC_HAS_MXCSR)
+  previous = _mm_getcsr();
+  _mm_setcsr(static_cast<unsigned int>(previous) | mxcsrFlushToZero | mxcsrDenormalsAreZero);
+#elif defined(MITTELVEC_HAS_FPCR)
+  // FZ covers inputs and outputs on ARM, there's no separate DAZ.
+  unsigned long long fpcr;
+  __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+  previous = fpcr;
+  fpcr |= fpcrFlushToZero;
+  __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+#endif
+}
 
+ScopedFlushDenormals::~ScopedFlushDenormals() {
+#if defined(MITTELVEC_HAS_MXCSR)
+  _mm_setcsr(static_cast<unsigned int>(previous));
+#elif defined(MITTELVEC_HAS_FPCR)
+  unsigned long long fpcr = previous;
+  __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+#endif
+}
 
+#if defined(_WIN32)
+static bool setPriority(HANDLE thread, ThreadPriority priority) {
+  int level = priority == ThreadPriority::Realtime ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_NORMAL;
+  return SetThreadPriority(thread, level) != 0;
+}
+#else
+static bool setPriority(pthread_t thread, ThreadPriority priority) {
+  sched_param param {};
+  int policy = SCHED_OTHER;
+  if (priority == ThreadPriority::Realtime) {
+    // Middle of the range, audio callbacks usually sit near the top.
+    policy = SCHED_FIFO;
+    param.sched_priority = (sched_get_priority_min(SCHED_FIFO) + sched_get_priority_max(SCHED_FIFO)) / 2;
+  }
+  return pthread_setschedparam(thread, policy, &param) == 0;
+}
+#endif
 
-AudioBuffer::AudioBuffer(const AudioContext& context)
-: channels(context.numChannels), frames(context.bufferSize), sampleRate(context.sampleRate)
-{
-  data.resize(static_cast<int>(channels) * frames, 0.0f);
+bool setThreadPriority(std::thread& thread, ThreadPriority priority) {
+  if (!thread.joinable()) return false;
+  return setPriority(thread.native_handle(), priority);
 }
 
-AudioBuffer::~AudioBuffer() = default;
-    
-int AudioBuffer::getNumChannels() const { return channels; }
-int AudioBuffer::getNumFrames() const { return frames; }
-float AudioBuffer::getSampleRate() const { return sampleRate; }
-int AudioBuffer::size() const { return data.size(); }
+bool setCurrentThreadPriority(ThreadPriority priority) {
+#if defined(_WIN32)
+  return setPriority(GetCurrentThread(), priority);
+#else
+  return setPriority(pthread_self(), priority);
+#endif
+}
 
-void AudioBuffer::setAudioContext(AudioContext newContext) {
-  channels = newContext.numChannels;
-  frames = newContext.bufferSize;
-  sampleRate = newContext.sampleRate;
-  data.resize(static_cast<int>(channels) * frames, 0.0f);
+static std::atomic<ThreadPriority> workerThreadPriority { ThreadPriority::Normal };
+
+void setWorkerThreadPriority(ThreadPriority priority) {
+  workerThreadPriority.store(priority, std::memory_order_relaxed);
 }
 
-// Clear buffer
-void AudioBuffer::clear() { std::fill(data.begin(), data.end(), 0.0f); }
+ThreadPriority getWorkerThreadPriority() {
+  return workerThreadPriority.load(std::memory_order_relaxed);
+}
 
-void AudioBuffer::resize(int newBufferSize) {
-  frames = static_cast<int>(newBufferSize);
-  data.resize(frames * channels, 0.0f); // fill buffer with zeroes while resizing.
+// macOS doesn't do unnamed POSIX semaphores, dispatch ones are the equivalent.
+WakeSignal::WakeSignal() {
+#if defined(_WIN32)
+  semaphore = CreateSemaphoreA(NULL, 0, LONG_MAX, NULL);
+#elif defined(__APPLE__)
+  semaphore = dispatch_semaphore_create(0);
+#else
+  sem_t* posixSemaphore = new sem_t;
+  sem_init(posixSemaphore, 0, 0);
+  semaphore = posixSemaphore;
+#endif
 }
 
-// Operator overloads
-AudioBuffer& AudioBuffer::operator+=(const AudioBuffer& other) {
-  assert(channels == other.channels && frames == other.frames);
-  for (int i = 0; i < data.size(); ++i) {
-    data[i] += other.data[i];
-  }
-  return *this;
+WakeSignal::~WakeSignal() {
+#if defined(_WIN32)
+  CloseHandle(static_cast<HANDLE>(semaphore));
+#elif defined(__APPLE__)
+  dispatch_release(static_cast<dispatch_semaphore_t>(semaphore));
+#else
+  sem_destroy(static_cast<sem_t*>(semaphore));
+  delete static_cast<sem_t*>(semaphore);
+#endif
 }
-    
-AudioBuffer AudioBuffer::operator+(const AudioBuffer& other) const {
-  AudioBuffer result(*this);
-  result += other;
-  return result;
+
+void WakeSignal::signal() {
+#if defined(_WIN32)
+  ReleaseSemaphore(static_cast<HANDLE>(semaphore), 1, NULL);
+#elif defined(__APPLE__)
+  dispatch_semaphore_signal(static_cast<dispatch_semaphore_t>(semaphore));
+#else
+  sem_post(static_cast<sem_t*>(semaphore));
+#endif
 }
 
-float& AudioBuffer::operator[](int index) {
-  return data[index];
+void WakeSignal::wait() {
+#if defined(_WIN32)
+  WaitForSingleObject(static_cast<HANDLE>(semaphore), INFINITE);
+#elif defined(__APPLE__)
+  dispatch_semaphore_wait(static_cast<dispatch_semaphore_t>(semaphore), DISPATCH_TIME_FOREVER);
+#else
+  while (sem_wait(static_cast<sem_t*>(semaphore)) != 0 && errno == EINTR) {}
+#endif
 }
 
-const float& AudioBuffer::operator[](int index) const {
-  return data[index];
+bool lockMemory(const void* data, size_t bytes) {
+  if (!data || bytes == 0) return true;
+#if defined(_WIN32)
+  return VirtualLock(const_cast<void*>(data), bytes) != 0;
+#else
+  return mlock(data, bytes) == 0;
+#endif
 }
 
+void unlockMemory(const void* data, size_t bytes) {
+  if (!data || bytes == 0) return;
+#if defined(_WIN32)
+  VirtualUnlock(const_cast<void*>(data), bytes);
+#else
+  munlock(data, bytes);
+#endif
+}
 
-AudioGraph::AudioGraph(const AudioContext& context)
-  : audioContext(context), nextNodeId(0), isGraphDirty(true) {}
+bool lockProcessMemory() {
+#if defined(_WIN32)
+  return false;
+#else
+  return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+#endif
+}
 
-void AudioGraph::removeNode(int nodeId) {
-  if (nodes.find(nodeId) == nodes.end()) return;
+void prefaultMemory(const void* data, size_t bytes) {
+  // Smallest common page size, touching more often than needed is harmless.
+  constexpr size_t pageSize = 4096;
+  const volatile uint8_t* bytesIn = static_cast<const volatile uint8_t*>(data);
+  for (size_t i = 0; i < bytes; i += pageSize) {
+    (void)bytesIn[i];
+  }
+  if (bytes > 0) (void)bytesIn[bytes - 1];
+}
+
+
+
+// On-disk layout: header, entry table, names, then sample data.
+// Data is aligned so float/int16 reads out of the mapping are aligned too.
+static const char bankMagic[4] = { 'M', 'V', 'B', 'K' };
+static const uint32_t bankVersion = 2; // 2 added loops.
+static const uint64_t bankDataAlignment = 64;
+
+struct BankFileHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t numChannels;
+  float sampleRate;
+  uint32_t entryCount;
+  uint32_t reserved;
+};
+
+struct BankFileEntry {
+  uint64_t nameOffset;
+  uint32_t nameLength;
+  uint32_t format;
+  uint64_t numSamples;
+  uint64_t dataOffset;
+  uint64_t dataSize;
+  uint64_t headersOffset;
+  uint64_t headersSize;
+  uint32_t hasLoop;
+  uint32_t reserved;
+  double loopStart;
+  double loopEnd;
+  double loopCrossfade;
+};
+
+static uint64_t alignBankOffset(uint64_t offset) {
+  return (offset + bankDataAlignment - 1) / bankDataAlignment * bankDataAlignment;
+}
+
+// Written so an untrusted offset + size can't wrap around.
+static bool inMapping(uint64_t offset, uint64_t size, size_t mappingSize) {
+  return size <= mappingSize && offset <= mappingSize - size;
+}
 
-  nodes.erase(nodeId);
-  connections.erase(nodeId);
-  reverseConnections.erase(nodeId);
+struct SampleBank::MappedFile {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+#if defined(_WIN32)
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+#endif
+
+  explicit MappedFile(const std::string& path) {
+#if defined(_WIN32)
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return;
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) return;
+
+    data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (data) size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+      void* mapped = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+      if (mapped != MAP_FAILED) {
+        data = static_cast<const uint8_t*>(mapped);
+        size = static_cast<size_t>(fileStat.st_size);
+      }
+    }
 
-  for (auto& pair : connections) {
-    auto& destinations = pair.second;
-    destinations.erase(std::remove(destinations.begin(), destinations.end(), nodeId), destinations.end());
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+#endif
   }
 
-  for (auto& pair : reverseConnections) {
-    auto& sources = pair.second;
-    sources.erase(std::remove(sources.begin(), sources.end(), nodeId), sources.end());
+  ~MappedFile() {
+#if defined(_WIN32)
+    if (data) UnmapViewOfFile(data);
+    if (mapping != NULL) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (data) munmap(const_cast<uint8_t*>(data), size);
+#endif
   }
+};
 
-  isGraphDirty = true;
+std::string SampleBank::entryKey(const std::string& fileName, SampleFormat storage) {
+  return fileName + "#" + std::to_string(static_cast<int>(storage));
 }
 
-void AudioGraph::connect(int sourceNodeId, int destNodeId) {
-  if (nodes.find(sourceNodeId) == nodes.end() || nodes.find(destNodeId) == nodes.end()) {
-    return;
+SampleBank::SampleBank(const std::string& bankPath, const AudioContext& context)
+  : context(context), mapping(std::make_shared<MappedFile>(bankPath)) {
+  if (!mapping->data || mapping->size < sizeof(BankFileHeader)) {
+    throw std::runtime_error("Failed to map sample bank: " + bankPath);
   }
 
-  connections[sourceNodeId].push_back(destNodeId);
-  reverseConnections[destNodeId].push_back(sourceNodeId);
-  isGraphDirty = true;
-}
+  BankFileHeader header;
+  std::memcpy(&header, mapping->data, sizeof(header));
 
-void AudioGraph::disconnect(int sourceNodeId, int destNodeId) {
-  if (connections.count(sourceNodeId)) {
-    auto& destinations = connections[sourceNodeId];
-    destinations.erase(std::remove(destinations.begin(), destinations.end(), destNodeId), destinations.end());
+  if (std::memcmp(header.magic, bankMagic, sizeof(bankMagic)) != 0 || header.version != bankVersion) {
+    throw std::runtime_error("Not a sample bank (or wrong version): " + bankPath);
+  }
+
+  if (static_cast<int>(header.numChannels) != context.numChannels || header.sampleRate != context.sampleRate) {
+    throw std::runtime_error("Sample bank was built for a different channel count or sample rate: " + bankPath);
   }
 
-  if (reverseConnections.count(destNodeId)) {
-    auto& sources = reverseConnections[destNodeId];
-    sources.erase(std::remove(sources.begin(), sources.end(), sourceNodeId), sources.end());
+  const uint64_t tableEnd = sizeof(BankFileHeader) + static_cast<uint64_t>(header.entryCount) * sizeof(BankFileEntry);
+  if (tableEnd > mapping->size) {
+    throw std::runtime_error("Truncated sample bank: " + bankPath);
   }
 
-  isGraphDirty = true;
+  for (uint32_t i = 0; i < header.entryCount; ++i) {
+    BankFileEntry entry;
+    std::memcpy(&entry, mapping->data + sizeof(BankFileHeader) + i * sizeof(BankFileEntry), sizeof(entry));
+
+    if (!inMapping(entry.nameOffset, entry.nameLength, mapping->size)
+      || !inMapping(entry.dataOffset, entry.dataSize, mapping->size)
+      || !inMapping(entry.headersOffset, entry.headersSize, mapping->size)
+      || entry.dataOffset % bankDataAlignment != 0
+      || entry.headersOffset % bankDataAlignment != 0
+      || entry.format > static_cast<uint32_t>(SampleFormat::ImaAdpcm)
+      || entry.numSamples > static_cast<uint64_t>(std::numeric_limits<int>::max())
+      || entry.numSamples % context.numChannels != 0) {
+      throw std::runtime_error("Corrupt sample bank index: " + bankPath);
+    }
+
+    // Reads trust the sample count, so the data has to be exactly what it takes to hold them.
+    const SampleFormat format = static_cast<SampleFormat>(entry.format);
+    const int numSamples = static_cast<int>(entry.numSamples);
+    auto expected = SampleData::fromEncoded(context, format, numSamples, nullptr, nullptr, nullptr);
+    if (entry.dataSize != expected->getEncodedSize() || entry.headersSize != expected->getBlockHeadersSize()) {
+      throw std::runtime_error("Corrupt sample bank index: " + bankPath);
+    }
+
+    std::string name(reinterpret_cast<const char*>(mapping->data + entry.nameOffset), entry.nameLength);
+    std::optional<SampleLoop> loop;
+    if (entry.hasLoop) loop = SampleLoop { entry.loopStart, entry.loopEnd, entry.loopCrossfade };
+    entries[name] = Entry {
+      format,
+      numSamples,
+      mapping->data + entry.dataOffset,
+      entry.headersSize ? mapping->data + entry.headersOffset : nullptr,
+      loop
+    };
+  }
 }
 
-void AudioGraph::updateProcessOrder() {
-  processOrder.clear();
-  if (nodes.empty()) {
-    isGraphDirty = false;
-    return;
+std::shared_ptr<const SampleData> SampleBank::get(const std::string& fileName, SampleFormat storage) const {
+  auto it = entries.find(entryKey(fileName, storage));
+  if (it == entries.end()) {
+    throw std::runtime_error("Sample not found in bank: " + fileName);
+  }
+
+  const Entry& entry = it->second;
+  auto data = SampleData::fromEncoded(context, entry.format, entry.numSamples, entry.data, entry.blockHeaders, mapping, entry.loop);
+  // Mapped pages load on first read, do that now instead of in the audio callback.
+  prefaultMemory(data->getEncodedData(), data->getEncodedSize());
+  prefaultMemory(data->getBlockHeaders(), data->getBlockHeadersSize());
+  return data;
+}
+
+bool SampleBank::contains(const std::string& fileName, SampleFormat storage) const {
+  return entries.count(entryKey(fileName, storage)) > 0;
+}
+
+bool SampleBank::write(
+  const std::string& bankPath,
+  const AudioContext& context,
+  const std::vector<SamplePackItem>& samplePackItems,
+  const std::string& samplesDir
+) {
+  std::vector<SampleRequest> files;
+  for (const auto& item : samplePackItems) {
+    files.push_back({ item.fileName, item.storage });
   }
+  return write(bankPath, context, files, samplesDir);
+}
 
-  // Map to store in-degrees of each node
-  std::unordered_map<int, int> inDegree;
-  for (const auto& pair : nodes) {
-    inDegree[pair.first] = 0;
+bool SampleBank::write(
+  const std::string& bankPath,
+  const AudioContext& context,
+  const std::vector<MusicCue>& cues,
+  const std::string& samplesDir
+) {
+  std::vector<SampleRequest> files;
+  for (const auto& cue : cues) {
+    files.push_back({ cue.fileName, cue.storage });
   }
+  return write(bankPath, context, files, samplesDir);
+}
 
-  // Calculate in-degrees
-  for (const auto& pair : connections) {
-    for (int destNodeId : pair.second) {
-      inDegree[destNodeId]++;
-    }
+bool SampleBank::write(
+  const std::string& bankPath,
+  const AudioContext& context,
+  const std::vector<SampleRequest>& files,
+  const std::string& samplesDir
+) {
+  // Unique files only, keyed the same way lookups are.
+  std::map<std::string, SampleRequest> unique;
+  for (const auto& file : files) {
+    unique.emplace(entryKey(file.path, file.storage), file);
   }
 
-  // Initialize queue with nodes having an in-degree of 0 (our source nodes)
-  std::queue<int> queue;
-  for (const auto& pair : inDegree) {
-    if (pair.second == 0) {
-      queue.push(pair.first);
+  std::vector<std::string> names;
+  std::vector<std::shared_ptr<const SampleData>> samples;
+  for (const auto& [key, file] : unique) {
+    names.push_back(key);
+    samples.push_back(SampleData::fromFile(context, samplesDir + file.path, file.storage));
+    // fromFile has already said why.
+    if (samples.back()->size() == 0) {
+      printf("Failed to add %s to sample bank %s\n", file.path.c_str(), bankPath.c_str());
+      return false;
     }
   }
 
-  // Process nodes using Kahn's algorithm
-  while (!queue.empty()) {
-    int nodeId = queue.front();
-    queue.pop();
-    processOrder.push_back(nodeId);
+  // Lay out names right after the table, then each entry's data and block headers.
+  std::vector<BankFileEntry> table(names.size());
+  uint64_t offset = sizeof(BankFileHeader) + table.size() * sizeof(BankFileEntry);
 
-    // Decrement inDegrees of neighboring nodes
-    if (connections.count(nodeId)) {
-      for (int neighbor : connections[nodeId]) {
-        inDegree[neighbor]--;
-        if (inDegree[neighbor] == 0) {
-          queue.push(neighbor);
-        }
-      }
+  for (size_t i = 0; i < names.size(); ++i) {
+    table[i].nameOffset = offset;
+    table[i].nameLength = static_cast<uint32_t>(names[i].size());
+    offset += names[i].size();
+  }
+
+  for (size_t i = 0; i < samples.size(); ++i) {
+    table[i].format = static_cast<uint32_t>(samples[i]->getFormat());
+    table[i].numSamples = static_cast<uint64_t>(samples[i]->size());
+    if (const auto& loop = samples[i]->getLoop()) {
+      table[i].hasLoop = 1;
+      table[i].loopStart = loop->start;
+      table[i].loopEnd = loop->end;
+      table[i].loopCrossfade = loop->crossfade;
     }
+
+    offset = alignBankOffset(offset);
+    table[i].dataOffset = offset;
+    table[i].dataSize = samples[i]->getEncodedSize();
+    offset += table[i].dataSize;
+
+    offset = alignBankOffset(offset);
+    table[i].headersOffset = offset;
+    table[i].headersSize = samples[i]->getBlockHeadersSize();
+    offset += table[i].headersSize;
   }
 
-  // Check for cycles. If a cycle exists, the graph is invalid.
-  if (processOrder.size() != nodes.size()) {
-    std::cerr << "Error: Cycle detected in the audio graph. Audio processing will be stopped." << std::endl;
-    processOrder.clear(); // Clear the invalid processing order
+  std::ofstream out(bankPath, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    printf("Failed to open sample bank for writing at path %s\n", bankPath.c_str());
+    return false;
+  }
+
+  BankFileHeader header = {};
+  std::memcpy(header.magic, bankMagic, sizeof(bankMagic));
+  header.version = bankVersion;
+  header.numChannels = static_cast<uint32_t>(context.numChannels);
+  header.sampleRate = context.sampleRate;
+  header.entryCount = static_cast<uint32_t>(table.size());
+
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(BankFileEntry));
+  for (const auto& name : names) {
+    out.write(name.data(), name.size());
+  }
+
+  auto padTo = [&out](uint64_t target) {
+    static const char zeros[bankDataAlignment] = {};
+    uint64_t position = static_cast<uint64_t>(out.tellp());
+    if (target > position) out.write(zeros, target - position);
+  };
+
+  for (size_t i = 0; i < samples.size(); ++i) {
+    padTo(table[i].dataOffset);
+    out.write(static_cast<const char*>(samples[i]->getEncodedData()), table[i].dataSize);
+    padTo(table[i].headersOffset);
+    if (table[i].headersSize) {
+      out.write(static_cast<const char*>(samples[i]->getBlockHeaders()), table[i].headersSize);
+    }
   }
 
-  isGraphDirty = false;
+  return static_cast<bool>(out);
 }
 
 
-void AudioGraph::processGraph(AudioBuffer& graphOutputBuffer) {
-  // If the graph structure has changed, recalculate the processing order.
-  if (isGraphDirty) {
-    updateProcessOrder();
+// Standard IMA-ADPCM tables.
+static const int imaIndexTable[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int imaStepTable[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+  12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static int16_t floatToInt16(float sample) {
+  float scaled = std::round(sample * 32767.0f);
+  return static_cast<int16_t>(std::clamp(scaled, -32768.0f, 32767.0f));
+}
+
+// read() decodes ADPCM a block at a time into a stack buffer sized for maxChannels.
+static void requireAdpcmChannels(int channels) {
+  if (channels > SampleData::maxChannels) {
+    throw std::runtime_error("IMA-ADPCM samples support at most " + std::to_string(SampleData::maxChannels) + " channels.");
   }
+}
 
-  // If the process order is empty (and there are nodes), it means a cycle was detected.
-  if (processOrder.empty() && !nodes.empty()) {
-    graphOutputBuffer.clear();
-    return; // Output silence if graph is invalid
+SampleData::SampleData(const AudioContext& context, SampleFormat format)
+  : format(format), channels(context.numChannels), sampleRate(context.sampleRate), numSamples(0) {}
+
+SampleData::~SampleData() {
+  if (memoryLocked) {
+    unlockMemory(encoded, getEncodedSize());
+    unlockMemory(blockHeaders, getBlockHeadersSize());
   }
+}
+
+bool SampleData::lockMemory() const {
+  if (memoryLocked) return true;
+  memoryLocked = MittelVec::lockMemory(encoded, getEncodedSize())
+    && MittelVec::lockMemory(blockHeaders, getBlockHeadersSize());
+  if (!memoryLocked) unlockMemory(encoded, getEncodedSize());
+  return memoryLocked;
+}
 
-  // Process each node in the topologically sorted order
-  for (int nodeId : processOrder) {
-    auto& node = nodes[nodeId];
+std::shared_ptr<const SampleData> SampleData::fromFile(const AudioContext& context, const std::string& path, SampleFormat format) {
+  auto data = std::make_shared<SampleData>(context, format);
+  data->loadFile(path);
+  return data;
+}
 
-    // Find inputs for the current node from its predecessors' output buffers
-    std::vector<const AudioBuffer*> inputs;
-    if (reverseConnections.count(nodeId)) {
-      for (int sourceId : reverseConnections[nodeId]) {
-        if (nodes.count(sourceId)) {
-          inputs.push_back(&(nodes[sourceId]->outputBuffer));
-        }
-      }
-    }
-    // Process the node
-    node->process(inputs, node->outputBuffer);
+std::shared_ptr<const SampleData> SampleData::fromEncoded(
+  const AudioContext& context,
+  SampleFormat format,
+  int numSamples,
+  const void* encodedData,
+  const void* blockHeaders,
+  std::shared_ptr<const void> owner,
+  std::optional<SampleLoop> loop
+) {
+  if (format == SampleFormat::ImaAdpcm) requireAdpcmChannels(context.numChannels);
+
+  auto data = std::make_shared<SampleData>(context, format);
+  data->numSamples = numSamples;
+  data->loop = loop;
+  data->encoded = encodedData;
+  data->blockHeaders = static_cast<const AdpcmBlockHeader*>(blockHeaders);
+  data->externalOwner = std::move(owner);
+  return data;
+}
+
+std::shared_ptr<const SampleData> SampleData::copyPrefix(int count) const {
+  count = std::clamp(count, 0, numSamples);
+
+  auto prefix = std::make_shared<SampleData>(AudioContext { 0, channels, sampleRate }, format);
+  if (format == SampleFormat::ImaAdpcm) {
+    // Blocks are stored one after another so whole blocks are a plain prefix of the codes/headers.
+    const int blockSamples = adpcmBlockFrames * channels;
+    count = std::min(numSamples, (count + blockSamples - 1) / blockSamples * blockSamples);
   }
 
-  // Sum the outputs of all "terminal" nodes (nodes with no outgoing connections)
-  graphOutputBuffer.clear();
-  for (auto const& [nodeId, node] : nodes) {
-    if (connections.find(nodeId) == connections.end() || connections[nodeId].empty()) {
-      for (int i = 0; i < graphOutputBuffer.size(); ++i) {
-        graphOutputBuffer[i] += node->outputBuffer[i];
-      }
-    }
+  prefix->numSamples = count;
+  const uint8_t* bytes = static_cast<const uint8_t*>(encoded);
+  switch (format) {
+    case SampleFormat::Float32:
+      prefix->floatData.assign(static_cast<const float*>(encoded), static_cast<const float*>(encoded) + count);
+      break;
+    case SampleFormat::Int16:
+      prefix->int16Data.assign(static_cast<const int16_t*>(encoded), static_cast<const int16_t*>(encoded) + count);
+      break;
+    case SampleFormat::ImaAdpcm:
+      prefix->adpcmData.assign(bytes, bytes + prefix->getEncodedSize());
+      prefix->adpcmHeaders.assign(blockHeaders, blockHeaders + prefix->getBlockHeadersSize() / sizeof(AdpcmBlockHeader));
+      break;
   }
+  prefix->pointAtOwnedData();
+  return prefix;
 }
 
-void AudioGraph::setAudioContext(AudioContext newContext)
-{
-  audioContext = newContext;
+int SampleData::resampledFrames(int numFrames, float fromRate, float toRate) {
+  return static_cast<int>(std::lround(static_cast<double>(numFrames) * toRate / fromRate));
 }
-#define MINIAUDIO_IMPLEMENTATION
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wall"
-#pragma GCC diagnostic ignored "-Wextra"
-#pragma GCC diagnostic pop
 
+std::shared_ptr<const SampleData> SampleData::resampled(float newSampleRate) const {
+  auto data = std::make_shared<SampleData>(AudioContext { 0, channels, newSampleRate }, format);
+  const int numFrames = getNumFrames();
+  const int newFrames = resampledFrames(numFrames, sampleRate, newSampleRate);
+  if (numFrames == 0 || newFrames == 0) return data;
 
-// Callback for audio playback.
-void miniaudio_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount) {
-  float* out = (float*)pOutput;
-  CallbackData* cbData = (CallbackData*)pDevice->pUserData;
+  std::vector<float> source(numSamples);
+  read(0, source.data(), numSamples, 1.0f);
 
-  // Write graph data into graph output buffer.
-  cbData->graph->processGraph(*cbData->graphOutput);
-  
-  // Copy graph output buffer into miniaudio output buffer.
-  memcpy(out, (*cbData->graphOutput).data.data(), frameCount * cbData->globalContext->numChannels * sizeof(float));
-  // std::copy((*cbData->graphOutput).data.begin(), (*cbData->graphOutput).data.end(), out);
-  // for (ma_uint32 i = 0; i < frameCount * pDevice->playback.channels; i++) {
-  //   out[i] = (*(cbData->graphOutput))[i];
-  // }
+  // Catmull-Rom between the two nearest frames, edges clamped.
+  auto at = [&](int frame, int ch) { return source[std::clamp(frame, 0, numFrames - 1) * channels + ch]; };
+  const double step = static_cast<double>(sampleRate) / newSampleRate;
+  std::vector<float> samples(static_cast<size_t>(newFrames) * channels);
+
+  for (int i = 0; i < newFrames; ++i) {
+    const double position = i * step;
+    const int frame = static_cast<int>(position);
+    const float t = static_cast<float>(position - frame);
+
+    for (int ch = 0; ch < channels; ++ch) {
+      float p0 = at(frame - 1, ch), p1 = at(frame, ch), p2 = at(frame + 1, ch), p3 = at(frame + 2, ch);
+      samples[i * channels + ch] = p1 + 0.5f * t * (p2 - p0 + t * (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3 + t * (3.0f * (p1 - p2) + p3 - p0)));
+    }
+  }
 
-  (void)pInput; // unused
+  data->setSamples(samples);
+  data->loop = loop;
+  return data;
 }
 
-Engine::Engine(AudioContext globalContext)
-  : globalContext(globalContext),
-    graph(globalContext),
-    output(globalContext)
-{
-  initMiniaudio();
+static uint32_t readLe32(const uint8_t* bytes) {
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
 }
 
-Engine::~Engine() {
-  stop();
+// First loop of a WAV's smpl chunk. Miniaudio doesn't hand us chunks, so this walks the RIFF
+// structure itself, it's only the chunk headers plus fmt and smpl that get read.
+static std::optional<SampleLoop> readWavLoop(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  uint8_t header[12];
+  if (!file.read(reinterpret_cast<char*>(header), sizeof(header))
+    || std::memcmp(header, "RIFF", 4) != 0 || std::memcmp(header + 8, "WAVE", 4) != 0) {
+    return std::nullopt;
+  }
+
+  uint32_t fileSampleRate = 0;
+  std::vector<uint8_t> smpl;
+  uint8_t chunkHeader[8];
+  while (file.read(reinterpret_cast<char*>(chunkHeader), sizeof(chunkHeader))) {
+    const uint32_t chunkSize = readLe32(chunkHeader + 4);
+    const std::streamoff next = static_cast<std::streamoff>(file.tellg()) + chunkSize + (chunkSize & 1); // Chunks are padded to even sizes.
+
+    if (std::memcmp(chunkHeader, "fmt ", 4) == 0 && chunkSize >= 8) {
+      uint8_t fmt[8];
+      if (!file.read(reinterpret_cast<char*>(fmt), sizeof(fmt))) break;
+      fileSampleRate = readLe32(fmt + 4);
+    } else if (std::memcmp(chunkHeader, "smpl", 4) == 0 && chunkSize >= 36) {
+      smpl.resize(chunkSize);
+      if (!file.read(reinterpret_cast<char*>(smpl.data()), chunkSize)) return std::nullopt;
+    }
+    if (fileSampleRate && !smpl.empty()) break;
+    file.seekg(next);
+  }
+
+  // 36 bytes of sampler info, then 24 bytes per loop: id, type, start, end (inclusive), fraction, play count.
+  if (!fileSampleRate || smpl.size() < 36 + 24 || readLe32(smpl.data() + 28) == 0) {
+    return std::nullopt;
+  }
+  const uint32_t start = readLe32(smpl.data() + 36 + 8);
+  const uint32_t end = readLe32(smpl.data() + 36 + 12);
+  if (end < start) return std::nullopt;
+
+  SampleLoop loop;
+  loop.start = static_cast<double>(start) / fileSampleRate;
+  loop.end = static_cast<double>(end + 1) / fileSampleRate;
+  return loop;
 }
 
-void Engine::initMiniaudio() {
-  // Setup miniaudio
-  config = ma_device_config_init(ma_device_type_playback);
-  config.playback.format    = ma_format_f32;
-  config.playback.channels  = globalContext.numChannels;
-  config.sampleRate         = static_cast<int>(globalContext.sampleRate);
-  config.periodSizeInFrames = globalContext.bufferSize;
-  config.dataCallback       = miniaudio_callback;
-  config.pUserData          = &cbData;
+bool SampleData::loadFile(const std::string& path) {
+  // Loaders call this on their threads, so report it like any other failed load.
+  if (format == SampleFormat::ImaAdpcm && channels > maxChannels) {
+    printf("Can't store %s as IMA-ADPCM, more than %d channels.\n", path.c_str(), maxChannels);
+    return false;
+  }
 
-  if (ma_device_init(NULL, &config, &device) != MA_SUCCESS) {
-    assert(false);
+  ma_decoder decoder;
+  ma_decoder_config decoderConfig = ma_decoder_config_init(
+    ma_format_f32,
+    channels,
+    sampleRate
+  );
+
+  if (ma_decoder_init_file(path.c_str(), &decoderConfig, &decoder) != MA_SUCCESS) {
+    printf("Failed to load WAV file at path %s\n", path.c_str());
+    return false;
   }
 
-  // Miniaudio buffer size not guaranteed here.
-  // We need to cover our bases in the unlikely event the request buffer sized can't be applied.
-  auto miniaudioBufferSize = device.playback.internalPeriodSizeInFrames;
+  ma_uint64 totalFrames;
+  if (ma_decoder_get_length_in_pcm_frames(&decoder, &totalFrames) != MA_SUCCESS) {
+    printf("Failed to get length of WAV file.\n");
+    ma_decoder_uninit(&decoder);
+    return false;
+  }
 
-  if (globalContext.bufferSize != miniaudioBufferSize) {
-    printf(
-      "Miniaudio backend couldn't assign requested buffer size of %d. Buffer size %d chosen and assigned instead.\n",
-      globalContext.bufferSize,
-      miniaudioBufferSize
-    );
-    globalContext.bufferSize = miniaudioBufferSize;
-    // Update graph and output buffer's audioContext
-    graph.setAudioContext(globalContext);
-    output.setAudioContext(globalContext);
+  std::vector<float> samples(static_cast<size_t>(totalFrames) * channels, 0.0f);
+  ma_uint64 framesRead = 0;
+  if (ma_decoder_read_pcm_frames(&decoder, samples.data(), totalFrames, &framesRead) != MA_SUCCESS) {
+    printf("Failed to read WAV file.\n");
+  }
+  ma_decoder_uninit(&decoder);
+
+  samples.resize(static_cast<size_t>(framesRead) * channels);
+  setSamples(samples);
+  loop = readWavLoop(path);
+  return true;
+}
+
+void SampleData::setSamples(const std::vector<float>& samples) {
+  numSamples = static_cast<int>(samples.size());
+  floatData.clear();
+  int16Data.clear();
+  adpcmData.clear();
+  adpcmHeaders.clear();
+
+  switch (format) {
+    case SampleFormat::Float32:
+      floatData = samples;
+      break;
+    case SampleFormat::Int16:
+      int16Data.resize(samples.size());
+      std::transform(samples.begin(), samples.end(), int16Data.begin(), floatToInt16);
+      break;
+    case SampleFormat::ImaAdpcm:
+      encodeAdpcm(samples);
+      break;
   }
+
+  pointAtOwnedData();
 }
 
-void Engine::start() {
-  // Update pUserData pointers now that graph/graphOutput/globalContext have been initalized.
-  cbData.graph = &graph;
-  cbData.graphOutput = &output;
-  cbData.globalContext = &globalContext;
+void SampleData::pointAtOwnedData() {
+  externalOwner.reset();
+  blockHeaders = nullptr;
 
-  if (ma_device_start(&device) != MA_SUCCESS) {
-    assert(false);
+  switch (format) {
+    case SampleFormat::Float32:
+      encoded = floatData.data();
+      break;
+    case SampleFormat::Int16:
+      encoded = int16Data.data();
+      break;
+    case SampleFormat::ImaAdpcm:
+      encoded = adpcmData.data();
+      blockHeaders = adpcmHeaders.data();
+      break;
   }
 }
 
-void Engine::stop() {
-  ma_device_uninit(&device);
+void SampleData::encodeAdpcm(const std::vector<float>& samples) {
+  requireAdpcmChannels(channels);
+
+  const int numFrames = getNumFrames();
+  const int numBlocks = (numFrames + adpcmBlockFrames - 1) / adpcmBlockFrames;
+  const int bytesPerChannelBlock = adpcmBlockFrames / 2;
+
+  adpcmHeaders.resize(numBlocks * channels);
+  adpcmData.assign(numBlocks * channels * bytesPerChannelBlock, 0);
+
+  for (int ch = 0; ch < channels; ++ch) {
+    int predictor = 0;
+    int stepIndex = 0;
+
+    for (int block = 0; block < numBlocks; ++block) {
+      // Each block stores the encoder state it starts from so it can be decoded on its own.
+      adpcmHeaders[block * channels + ch] = { static_cast<int16_t>(predictor), static_cast<uint8_t>(stepIndex) };
+      uint8_t* codes = &adpcmData[(block * channels + ch) * bytesPerChannelBlock];
+
+      for (int i = 0; i < adpcmBlockFrames; ++i) {
+        int frame = block * adpcmBlockFrames + i;
+        int sample = frame < numFrames ? floatToInt16(samples[frame * channels + ch]) : 0;
+
+        int diff = sample - predictor;
+        int step = imaStepTable[stepIndex];
+        int code = 0;
+        if (diff < 0) {
+          code = 8;
+          diff = -diff;
+        }
+
+        int delta = step >> 3;
+        if (diff >= step) { code |= 4; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { code |= 2; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { code |= 1; delta += step; }
+
+        predictor += (code & 8) ? -delta : delta;
+        predictor = std::clamp(predictor, -32768, 32767);
+        stepIndex = std::clamp(stepIndex + imaIndexTable[code], 0, 88);
+
+        codes[i / 2] |= (i & 1) ? (code << 4) : code;
+      }
+    }
+  }
 }
 
+// Decodes a whole block into `dest` as interleaved floats.
+void SampleData::decodeAdpcmBlock(int blockIndex, float* dest) const {
+  const int bytesPerChannelBlock = adpcmBlockFrames / 2;
 
-Envelope::Envelope(const AudioContext& context, const EnvConfig& config)
-  : AudioNode(context),
-    state(Idle),
-    attack(config.attack),
-    decay(config.decay),
-    sustain(config.sustain),
-    release(config.release),
-    sampleRate(context.sampleRate),
-    currentLevel(0.0f) {}
+  for (int ch = 0; ch < channels; ++ch) {
+    const AdpcmBlockHeader& header = blockHeaders[blockIndex * channels + ch];
+    const uint8_t* codes = static_cast<const uint8_t*>(encoded) + (blockIndex * channels + ch) * bytesPerChannelBlock;
+    int predictor = header.predictor;
+    int stepIndex = header.stepIndex;
 
-float Envelope::getNextLevel() {
-  switch (state) {
-  case Idle:
-    break;
-  case Attack:
-    currentLevel += 1.0 / (attack * sampleRate);
+    for (int i = 0; i < adpcmBlockFrames; ++i) {
+      int code = (i & 1) ? (codes[i / 2] >> 4) : (codes[i / 2] & 0x0F);
+      int step = imaStepTable[stepIndex];
 
-    // Clamp level and transition to decay.
-    if (currentLevel >= 1.0) {
-      currentLevel = 1.0;
-      state = Decay;
+      int delta = step >> 3;
+      if (code & 4) delta += step;
+      if (code & 2) delta += step >> 1;
+      if (code & 1) delta += step >> 2;
+
+      predictor += (code & 8) ? -delta : delta;
+      predictor = std::clamp(predictor, -32768, 32767);
+      stepIndex = std::clamp(stepIndex + imaIndexTable[code], 0, 88);
+
+      dest[i * channels + ch] = static_cast<float>(predictor) * (1.0f / 32768.0f);
     }
-    break;
-  case Decay:
-    currentLevel -= (1.0 - sustain) / (decay * sampleRate);
-    
-    if (currentLevel <= sustain) {
-      currentLevel = sustain;
-      state = Sustain;
+  }
+}
+
+/**
+ * Converts/decodes straight into the voice's buffer.
+ * The Float32 and Int16 loops are kept branch free so the compiler can vectorize them.
+ * ADPCM is a serial recurrence per channel, so it's decoded a block at a time into
+ * a small stack scratch and then copied out with the gain applied.
+ */
+void SampleData::read(int start, float* dest, int count, float gain) const {
+  assert(start >= 0 && start + count <= numSamples);
+
+  switch (format) {
+    case SampleFormat::Float32: {
+      const float* src = static_cast<const float*>(encoded) + start;
+      for (int i = 0; i < count; ++i) {
+        dest[i] = src[i] * gain;
+      }
+      break;
     }
-    break;
-  case Sustain:
-    if (skipSustain) {
-      state = Release;
+    case SampleFormat::Int16: {
+      const int16_t* src = static_cast<const int16_t*>(encoded) + start;
+      const float scale = gain * (1.0f / 32768.0f);
+      for (int i = 0; i < count; ++i) {
+        dest[i] = static_cast<float>(src[i]) * scale;
+      }
+      break;
     }
-    break;
-  case Release:
-    currentLevel -= sustain / (release * sampleRate);
-    
-    if (currentLevel <= 0.0) {
-      currentLevel = 0.0;
-      state = Idle;
+    case SampleFormat::ImaAdpcm: {
+      float block[adpcmBlockFrames * maxChannels];
+      const int blockSamples = adpcmBlockFrames * channels;
+      int blockIndex = start / blockSamples;
+      int offset = start % blockSamples;
+
+      while (count > 0) {
+        decodeAdpcmBlock(blockIndex, block);
+        int n = std::min(count, blockSamples - offset);
+        for (int i = 0; i < n; ++i) {
+          dest[i] = block[offset + i] * gain;
+        }
+        dest += n;
+        count -= n;
+        offset = 0;
+        ++blockIndex;
+      }
+      break;
     }
-    break;
-  default:
-    break;
   }
-
-  return currentLevel;
 }
 
-void Envelope::noteOn() {
-  state = Attack;
-  currentLevel = 0; // confirm this...
-}
+int SampleData::size() const { return numSamples; }
+int SampleData::getNumChannels() const { return channels; }
+int SampleData::getNumFrames() const { return channels > 0 ? numSamples / channels : 0; }
+float SampleData::getSampleRate() const { return sampleRate; }
+SampleFormat SampleData::getFormat() const { return format; }
 
-void Envelope::noteOff() {
-  state = Release;
+size_t SampleData::getMemoryUsage() const {
+  return getEncodedSize() + getBlockHeadersSize();
 }
 
-void Envelope::reset() {
-  currentLevel = 0;
-  state = Idle;
+size_t SampleData::encodedSizeFor(int sampleCount) const {
+  switch (format) {
+    case SampleFormat::Float32:
+      return sampleCount * sizeof(float);
+    case SampleFormat::Int16:
+      return sampleCount * sizeof(int16_t);
+    case SampleFormat::ImaAdpcm: {
+      const int numFrames = channels > 0 ? sampleCount / channels : 0;
+      const int numBlocks = (numFrames + adpcmBlockFrames - 1) / adpcmBlockFrames;
+      return static_cast<size_t>(numBlocks) * channels * (adpcmBlockFrames / 2);
+    }
+  }
+  return 0;
 }
 
-bool const Envelope::isActive() {
-  return state != Idle;
+const void* SampleData::getEncodedData() const { return encoded; }
+size_t SampleData::getEncodedSize() const { return encodedSizeFor(numSamples); }
+const void* SampleData::getBlockHeaders() const { return blockHeaders; }
+
+size_t SampleData::getBlockHeadersSize() const {
+  if (format != SampleFormat::ImaAdpcm) return 0;
+  return getEncodedSize() / (adpcmBlockFrames / 2) * sizeof(AdpcmBlockHeader);
 }
 
-void Envelope::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
-  if (inputs.empty()) return;
-  outputBuffer.clear();
 
-  // Sum all input buffers into the output buffer
-  for (const auto* inputBufferPtr : inputs) {
-    for (int i = 0; i < outputBuffer.size(); ++i) {
-      outputBuffer[i] += (*inputBufferPtr)[i];
+// Collapses requests for the same file and storage format so each is only decoded once.
+// Returns the unique requests and, per original request, the index of its unique request.
+static std::pair<std::vector<SampleRequest>, std::vector<int>> dedupeRequests(const std::vector<SampleRequest>& requests) {
+  std::vector<SampleRequest> unique;
+  std::vector<int> requestToUnique;
+  std::map<std::pair<std::string, SampleFormat>, int> seen;
+
+  for (const auto& request : requests) {
+    auto key = std::make_pair(request.path, request.storage);
+    auto it = seen.find(key);
+    if (it == seen.end()) {
+      it = seen.emplace(key, static_cast<int>(unique.size())).first;
+      unique.push_back(request);
     }
+    requestToUnique.push_back(it->second);
   }
 
-  // Apply envelope to the summed signal
-  for (int i = 0; i < outputBuffer.size(); ++i) {
-    outputBuffer[i] *= getNextLevel();
-  }
+  return { unique, requestToUnique };
 }
 
-/**
- * Applies envelope directly to incoming buffer.
- * Allows for inline processing as opposed to more modular node/graph style `process` method approach.
- */
-void Envelope::applyToBuffer(AudioBuffer& buffer) {
-  for (int i = 0; i < buffer.size(); ++i) {
-    buffer[i] *= getNextLevel();
+SampleLoader::SampleLoader(int numThreads) {
+  if (numThreads <= 0) {
+    // Leave a core for the game and audio threads.
+    numThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+  }
+
+  workers.reserve(numThreads);
+  for (int i = 0; i < numThreads; ++i) {
+    workers.emplace_back(&SampleLoader::workerLoop, this);
   }
 }
 
-// C++ 17 doesn't have PI constant.
-// We can use arccosine of -1.0 to get pi instead.
-// When x == -1.0 on the unit circle, theta == pi.
-const double PI = std::acos(-1.0);
+SampleLoader::~SampleLoader() {
+  {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    stopping = true;
+  }
+  jobsAvailable.notify_all();
 
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
 
-Filter::Filter(const AudioContext& context, const FilterConfig& config)
-  : AudioNode(context), 
-    mode(config.mode), 
-    cutoff(config.cutoff), 
-    resonance(config.resonance), 
-    sampleRate(static_cast<float>(context.sampleRate)) 
-{
-  calculateCoefficients();
+void SampleLoader::enqueue(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    jobs.push(std::move(job));
+  }
+  jobsAvailable.notify_one();
 }
 
-void Filter::calculateCoefficients() {
-  double w0 = 2.0 * PI * cutoff / sampleRate;
-  double alpha = std::sin(w0) / (2.0 * resonance);
-  double cosW0 = std::cos(w0);
+void SampleLoader::workerLoop() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(jobsMutex);
+      jobsAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
 
-  double a0 = 0;
+      // Drain queued jobs before exiting so pending loads still complete.
+      if (jobs.empty()) return;
 
-  switch (mode) {
-    case FilterMode::Lowpass:
-      b0 = (1.0 - cosW0) / 2.0;
-      b1 = 1.0 - cosW0;
-      b2 = (1.0 - cosW0) / 2.0;
-      a0 = 1.0 + alpha;
-      a1 = -2.0 * cosW0;
-      a2 = 1.0 - alpha;
-      break;
-    case FilterMode::Highpass:
-      b0 = (1.0 + cosW0) / 2.0;
-      b1 = -(1.0 + cosW0);
-      b2 = (1.0 + cosW0) / 2.0;
-      a0 = 1.0 + alpha;
-      a1 = -2.0 * cosW0;
-      a2 = 1.0 - alpha;
-      break;
-    case FilterMode::Bandpass:
-      b0 = alpha;
-      b1 = 0;
-      b2 = -alpha;
-      a0 = 1.0 + alpha;
-      a1 = -2.0 * cosW0;
-      a2 = 1.0 - alpha;
-      break;
-    case FilterMode::Notch:
-      b0 = 1.0;
-      b1 = -2.0 * cosW0;
-      b2 = 1.0;
-      a0 = 1.0 + alpha;
-      a1 = -2.0 * cosW0;
-      a2 = 1.0 - alpha;
-      break;
+      job = std::move(jobs.front());
+      jobs.pop();
+    }
+    job();
   }
+}
 
-  // Normalize all coefficients by a0
-  b0 /= a0; b1 /= a0; b2 /= a0;
-  a1 /= a0; a2 /= a0;
+void SampleLoader::loadBatch(
+  const AudioContext& context,
+  const std::vector<SampleRequest>& requests,
+  LoadCompleteCallback onComplete,
+  LoadProgressCallback onProgress
+) {
+  struct BatchState {
+    AudioContext context;
+    std::vector<SampleRequest> unique;
+    std::vector<int> requestToUnique;
+    std::vector<std::shared_ptr<const SampleData>> decoded;
+    std::atomic<int> remaining;
+    std::atomic<int> loaded { 0 };
+    LoadCompleteCallback onComplete;
+    LoadProgressCallback onProgress;
+
+    void finish() {
+      std::vector<std::shared_ptr<const SampleData>> results;
+      results.reserve(requestToUnique.size());
+      for (int index : requestToUnique) {
+        results.push_back(decoded[index]);
+      }
+      onComplete(std::move(results));
+    }
+  };
+
+  auto [unique, requestToUnique] = dedupeRequests(requests);
+  auto state = std::make_shared<BatchState>();
+  state->context = context;
+  state->unique = std::move(unique);
+  state->requestToUnique = std::move(requestToUnique);
+  state->decoded.resize(state->unique.size());
+  state->remaining = static_cast<int>(state->unique.size());
+  state->onComplete = std::move(onComplete);
+  state->onProgress = std::move(onProgress);
+
+  if (state->unique.empty()) {
+    enqueue([state] { state->finish(); });
+    return;
+  }
 
-  // Debug...
-  // printf("Filter: F=%f, Q=%f, SR=%f | b0=%f, a1=%f\n", cutoff, resonance, sampleRate, b0, a1);
+  const int total = static_cast<int>(state->unique.size());
+  for (int i = 0; i < total; ++i) {
+    enqueue([state, i, total] {
+      const SampleRequest& request = state->unique[i];
+      state->decoded[i] = SampleData::fromFile(state->context, request.path, request.storage);
+
+      int loaded = ++state->loaded;
+      if (state->onProgress) state->onProgress(loaded, total);
+
+      // Last decode to finish hands the whole batch over.
+      if (--state->remaining == 0) {
+        state->finish();
+      }
+    });
+  }
 }
 
-void Filter::setParams(float newCutoff, float newResonance) {
-  cutoff = newCutoff;
-  resonance = newResonance;
-  calculateCoefficients();
+std::vector<std::shared_ptr<const SampleData>> SampleLoader::loadAll(
+  const AudioContext& context,
+  const std::vector<SampleRequest>& requests
+) {
+  auto [unique, requestToUnique] = dedupeRequests(requests);
+
+  std::vector<std::shared_ptr<const SampleData>> decoded;
+  decoded.reserve(unique.size());
+  for (const auto& request : unique) {
+    decoded.push_back(SampleData::fromFile(context, request.path, request.storage));
+  }
+
+  std::vector<std::shared_ptr<const SampleData>> results;
+  results.reserve(requests.size());
+  for (int index : requestToUnique) {
+    results.push_back(decoded[index]);
+  }
+  return results;
 }
 
-void Filter::setMode(FilterMode newMode) {
-  mode = newMode;
-  calculateCoefficients();
+
+static std::vector<SampleRequest> samplePackRequests(const std::vector<SamplePackItem>& samplePackItems, const std::string& samplesDir) {
+  std::vector<SampleRequest> requests;
+  requests.reserve(samplePackItems.size());
+  for (const auto& item : samplePackItems) {
+    requests.push_back({ samplesDir + item.fileName, item.storage });
+  }
+  return requests;
 }
 
-void Filter::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
-  if (inputs.empty()) return;
-  outputBuffer.clear();
+static std::vector<std::shared_ptr<const SampleData>> samplePackBankSamples(const std::vector<SamplePackItem>& samplePackItems, const SampleBank& bank) {
+  std::vector<std::shared_ptr<const SampleData>> samples;
+  samples.reserve(samplePackItems.size());
+  for (const auto& item : samplePackItems) {
+    samples.push_back(bank.get(item.fileName, item.storage));
+  }
+  return samples;
+}
 
-  // Sum inputs
-  for (const auto* inputBufferPtr : inputs) {
-    for (int i = 0; i < outputBuffer.size(); ++i) {
-      outputBuffer[i] += (*inputBufferPtr)[i];
-    }
+static std::vector<std::shared_ptr<ResidentSample>> samplePackResidentSamples(
+  const AudioContext& context,
+  const std::vector<SamplePackItem>& samplePackItems,
+  const std::string& samplesDir,
+  SampleResidency& residency
+) {
+  std::vector<std::shared_ptr<ResidentSample>> samples;
+  samples.reserve(samplePackItems.size());
+  for (const auto& item : samplePackItems) {
+    samples.push_back(residency.load(context, samplesDir + item.fileName, item.storage));
   }
+  return samples;
+}
 
-  applyToBuffer(outputBuffer);
+// Unmanaged samples, always fully resident.
+// Items sharing data share one ResidentSample too, so it's only resampled once on a reconfigure.
+static std::vector<std::shared_ptr<ResidentSample>> wrapResidentSamples(const std::vector<std::shared_ptr<const SampleData>>& samples) {
+  std::vector<std::shared_ptr<ResidentSample>> wrapped;
+  std::unordered_map<const SampleData*, std::shared_ptr<ResidentSample>> bySource;
+  wrapped.reserve(samples.size());
+  for (const auto& sample : samples) {
+    auto& resident = bySource[sample.get()];
+    if (!resident) resident = std::make_shared<ResidentSample>(sample);
+    wrapped.push_back(resident);
+  }
+  return wrapped;
 }
 
-void Filter::applyToBuffer(AudioBuffer& buffer) {
-  for (int i = 0; i < buffer.size(); ++i) {
-    double x = buffer[i];
-    
-    // Difference Equation (Direct Form I)
-    double y = (b0 * x) + (b1 * z1_x) + (b2 * z2_x) - (a1 * z1_y) - (a2 * z2_y);
+SamplePack::SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, std::string samplesDir, float gain)
+  : SamplePack(
+    graph,
+    samplePackItems,
+    SampleLoader::loadAll(graph.audioContext, samplePackRequests(samplePackItems, samplesDir)),
+    gain
+  ) {}
+
+SamplePack::SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, const SampleBank& bank, float gain)
+  : SamplePack(graph, samplePackItems, samplePackBankSamples(samplePackItems, bank), gain) {}
+
+SamplePack::SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, std::string samplesDir, SampleResidency& residency, float gain)
+  : SamplePack(graph, samplePackItems, samplePackResidentSamples(graph.audioContext, samplePackItems, samplesDir, residency), gain) {}
+
+SamplePack::SamplePack(
+  AudioGraph& graph,
+  std::vector<SamplePackItem> samplePackItems,
+  std::vector<std::shared_ptr<const SampleData>> samples,
+  float gain
+) : SamplePack(graph, samplePackItems, wrapResidentSamples(samples), gain) {}
+
+SamplePack::SamplePack(
+  AudioGraph& graph,
+  std::vector<SamplePackItem> samplePackItems,
+  std::vector<std::shared_ptr<ResidentSample>> samples,
+  float gain
+) : graph(graph), sends(graph) {
+    // Build every node up front so the graph lock below only covers inserts.
+    auto outputNode = std::make_unique<Mixer>(graph.audioContext, gain);
+    output = outputNode.get();
+
+    std::vector<std::unique_ptr<Sampler>> samplerNodes;
+    std::vector<Sampler*> samplersByHandle;
+    samplerNodes.reserve(samplePackItems.size());
+    for (size_t i = 0; i < samplePackItems.size(); ++i) {
+      const auto& item = samplePackItems[i];
+      handles[item.slug] = static_cast<SampleHandle>(i);
+      samplerNodes.push_back(std::make_unique<Sampler>(
+        graph.audioContext,
+        samples[i],
+        item.polyphony,
+        item.loop,
+        item.gain,
+        item.pitchShift,
+        item.envConfig,
+        item.filterConfig
+      ));
+      if (item.loopPoints) samplerNodes.back()->setLoopPoints(item.loopPoints);
+      samplersByHandle.push_back(samplerNodes.back().get());
+      samplers[item.slug] = samplerNodes.back().get();
+    }
 
-    // Update state
-    z2_x = z1_x;
-    z1_x = x;
-    z2_y = z1_y;
-    z1_y = y;
+    auto triggerNode = std::make_unique<SampleTriggerNode>(graph.audioContext, samplersByHandle, triggerQueueSize);
+    triggers = triggerNode.get();
+
+    // Join the graph as one edit so the audio thread never sees a half built pack. Samples
+    // loaded before a reconfiguration are resampled first, without holding the lock.
+    std::vector<AudioNode*> nodes { outputNode.get(), triggerNode.get() };
+    for (const auto& samplerNode : samplerNodes) nodes.push_back(samplerNode.get());
+    auto lock = graph.lockGraphFor(nodes);
+    outputNodeId = graph.addNode(std::move(outputNode));
+    sends.setReturnNode(outputNodeId);
+    // Feeds every sampler so triggers are handled before they render.
+    int triggerNodeId = graph.addNode(std::move(triggerNode));
+
+    std::vector<int> samplerNodeIds;
+    samplerNodeIds.reserve(samplerNodes.size());
+    for (auto& samplerNode : samplerNodes) {
+      int samplerNodeId = graph.addNode(std::move(samplerNode));
+      graph.connect(triggerNodeId, samplerNodeId);
+      graph.connect(samplerNodeId, outputNodeId);
+      samplerNodeIds.push_back(samplerNodeId);
+    }
+    lock.unlock();
 
-    buffer[i] = static_cast<float>(y);
+    // No buses yet, so registering the send sources doesn't touch the graph.
+    for (size_t i = 0; i < samplePackItems.size(); ++i) {
+      const auto& item = samplePackItems[i];
+      sends.addSource(item.slug, samplerNodeIds[i], samplersByHandle[i], item.sends);
+    }
   }
+
+std::future<std::unique_ptr<SamplePack>> SamplePack::loadAsync(
+  SampleLoader& loader,
+  AudioGraph& graph,
+  std::vector<SamplePackItem> samplePackItems,
+  std::string samplesDir,
+  float gain,
+  LoadProgressCallback onProgress
+) {
+  auto promise = std::make_shared<std::promise<std::unique_ptr<SamplePack>>>();
+  auto future = promise->get_future();
+  auto requests = samplePackRequests(samplePackItems, samplesDir);
+
+  loader.loadBatch(
+    graph.audioContext,
+    requests,
+    [promise, &graph, samplePackItems = std::move(samplePackItems), gain](std::vector<std::shared_ptr<const SampleData>> samples) {
+      try {
+        promise->set_value(std::make_unique<SamplePack>(graph, samplePackItems, std::move(samples), gain));
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    },
+    onProgress
+  );
+
+  return future;
 }
 
+SampleHandle SamplePack::getHandle(const std::string& slug) const {
+  auto it = handles.find(slug);
+  return it == handles.end() ? invalidSampleHandle : it->second;
+}
 
-Gain::Gain(const AudioContext& context, float gain)
-  : AudioNode(context), gain(gain) {}
+bool SamplePack::triggerSample(SampleHandle handle, float gain, int pitchShift) {
+  SampleTrigger trigger { handle, gain, pitchShift };
+  return triggers->push(&trigger, 1);
+}
 
-void Gain::setGain(float newGain) {
-  this->gain = newGain;
+bool SamplePack::releaseSample(SampleHandle handle) {
+  SampleTrigger trigger { handle, 1.0f, 0, true };
+  return triggers->push(&trigger, 1);
 }
 
-void Gain::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
-  outputBuffer.clear();
+bool SamplePack::triggerSamples(const SampleTrigger* batch, size_t count) {
+  return triggers->push(batch, count);
+}
 
-  if (inputs.empty()) {
+bool SamplePack::triggerSamples(const std::vector<SampleTrigger>& batch) {
+  return triggers->push(batch.data(), batch.size());
+}
+
+void SamplePack::triggerSample(const std::string& slug) {
+  SampleHandle handle = getHandle(slug);
+  if (handle == invalidSampleHandle) {
+    printf("No sample pack item named %s\n", slug.c_str());
     return;
   }
+  triggerSample(handle);
+}
 
-  // Sum all input buffers into the output buffer
-  // Revisit this... Seems wasteful if inputs.length < 1.
-  for (const auto* inputBufferPtr : inputs) {
-    for (int i = 0; i < outputBuffer.size(); ++i) {
-      outputBuffer[i] += (*inputBufferPtr)[i];
-    }
+bool SamplePack::lockSampleMemory() {
+  bool locked = true;
+  for (auto& [slug, sampler] : samplers) {
+    locked = sampler->lockSampleMemory() && locked;
   }
+  return locked;
+}
 
-  // Apply gain to the summed signal
-  for (int i = 0; i < outputBuffer.size(); ++i) {
-    outputBuffer[i] *= gain;
-  }
+void SamplePack::setSendLevel(const std::string& slug, const std::string& bus, float level) {
+  sends.setSendLevel(slug, bus, level);
 }
 
 
-MusicCueOrchestrator::MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::string samplesDir)
-  : graph(graph) {
-  
-  auto [outputNodeId, outputNodePtr] = graph.addNode<Gain>(1.0f);
+ResidentSample::ResidentSample(std::shared_ptr<const SampleData> data)
+  : head(data), full(data), body(data.get()), numSamples(data->size()), channels(data->getNumChannels()),
+    sampleRate(data->getSampleRate()), loop(data->getLoop()) {}
 
-  for (const auto& item : cues) {
-    if (samplers.find(item.slug) != samplers.end()) {
-      throw std::runtime_error("Duplicate music cue slug: " + item.slug);
-    }
+ResidentSample::~ResidentSample() {
+  if (residency) residency->forget(this);
+}
 
-    if (item.slug.empty()) {
-      throw std::runtime_error("Cue slug name cannot be empty string.");
-    }
+int ResidentSample::size() const { return numSamples; }
+int ResidentSample::getNumChannels() const { return channels; }
+bool ResidentSample::isFullyResident() const { return body.load() != nullptr; }
+int ResidentSample::getUnderruns() const { return underruns.load(std::memory_order_relaxed); }
+float ResidentSample::getSampleRate() const { return sampleRate; }
 
-    auto [samplerNodeId, samplerNodePtr] = graph.addNode<Sampler>(
-      samplesDir + item.fileName,
-      1, // polyphony
-      item.loop,
-      item.gain,
-      0, // pitchShift
-      EnvConfig { 0.1f, 0.1f, 1.0f, 0.5f } // attack, decay, sustain, release
-    );
-    
-    samplers[item.slug] = samplerNodePtr;
-    graph.connect(samplerNodeId, outputNodeId);
+void ResidentSample::read(int start, float* dest, int count, float gain) const {
+  const int headSize = head->size();
+  if (start + count <= headSize) {
+    head->read(start, dest, count, gain);
+    return;
   }
+
+  // The reader count goes up before the pointer is loaded and eviction swaps the pointer out
+  // before waiting for readers to drain, so a body we've loaded can't be freed under us.
+  readers.fetch_add(1);
+  const SampleData* data = body.load();
+  if (data) data->read(start, dest, count, gain);
+  readers.fetch_sub(1);
+  if (data) return;
+
+  // Body is evicted, play what the head covers and silence for the rest.
+  int fromHead = std::max(0, headSize - start);
+  if (fromHead > 0) head->read(start, dest, fromHead, gain);
+  std::fill(dest + fromHead, dest + count, 0.0f);
+  underruns.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ResidentSample::touch() {
+  if (residency) residency->touch(this);
+}
+
+void ResidentSample::pin() {
+  pins.fetch_add(1, std::memory_order_relaxed);
 }
 
-void MusicCueOrchestrator::playCue(const std::string& slug) {
-  if (slug == currentCueSlug) {
-    return;
-  }
+void ResidentSample::unpin() {
+  pins.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Decodes the file at the rate it was loaded at, then resamples, same as a reload would.
+// Then a reload after the switch always comes back the same length.
+static std::shared_ptr<const SampleData> decodeAtRate(const AudioContext& context, const std::string& path, SampleFormat storage, float sampleRate) {
+  auto data = SampleData::fromFile(context, path, storage);
+  return data->getSampleRate() == sampleRate ? data : data->resampled(sampleRate);
+}
+
+// Samples wrapping the same data (several samplers built from one SampleData) share one
+// resampled copy instead of each making their own. Entries go once nobody uses the copy.
+struct ResampledCopy {
+  std::weak_ptr<const SampleData> source;
+  float sampleRate;
+  std::weak_ptr<const SampleData> copy;
+};
 
-  if (samplers.count(slug)) {
-    if (!currentCueSlug.empty()) {
-      stopCue();
+static std::shared_ptr<const SampleData> sharedResample(const std::shared_ptr<const SampleData>& source, float sampleRate) {
+  static std::mutex mutex;
+  static std::vector<ResampledCopy> copies;
+
+  // Held while resampling so a second sampler on the same data waits for this copy.
+  std::lock_guard<std::mutex> lock(mutex);
+  copies.erase(std::remove_if(copies.begin(), copies.end(), [](const ResampledCopy& entry) {
+    return entry.source.expired() || entry.copy.expired();
+  }), copies.end());
+
+  for (const ResampledCopy& entry : copies) {
+    // Compared by owner, so a new sample at a freed one's address never matches.
+    const bool sameSource = !entry.source.owner_before(source) && !source.owner_before(entry.source);
+    if (sameSource && entry.sampleRate == sampleRate) {
+      if (auto copy = entry.copy.lock()) return copy;
     }
-    
-    samplers[slug]->noteOn();
-    currentCueSlug = slug;
   }
+
+  auto copy = source->resampled(sampleRate);
+  copies.push_back({ source, sampleRate, copy });
+  return copy;
 }
 
-void MusicCueOrchestrator::stopCue() {
-  if (!currentCueSlug.empty() && samplers.count(currentCueSlug)) {
-    samplers[currentCueSlug]->noteOff();
-    currentCueSlug = "";
+void ResidentSample::prepareSampleRate(float newSampleRate) {
+  if (newSampleRate == sampleRate || (pendingFull && pendingFull->getSampleRate() == newSampleRate)) return;
+
+  if (residency) {
+    // Managed samples may be evicted, so always start from the file.
+    pendingFull = decodeAtRate(context, path, storage, newSampleRate);
+    pendingHead = pendingFull->copyPrefix(residency->headFrames * channels);
+  } else {
+    pendingFull = sharedResample(full, newSampleRate);
+    pendingHead = pendingFull;
   }
 }
 
+void ResidentSample::applySampleRate() {
+  if (!pendingFull) return;
 
-NoiseGenerator::NoiseGenerator(const AudioContext& context)
-  : AudioNode(context),
-    randomGen(randomDevice()),
-    dist(-1.0f, 1.0f)
-{}
-
-void NoiseGenerator::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
-  for (int i = 0; i < outputBuffer.size(); ++i) {
-    outputBuffer[i] = dist(randomGen);
+  if (residency) {
+    // touch() and finishReload() read these under the residency lock on other threads.
+    std::lock_guard<std::mutex> lock(residency->mutex);
+    if (full) {
+      residency->residentBytes -= full->getMemoryUsage();
+      body.store(nullptr);
+      full.reset();
+    }
+    head = std::move(pendingHead);
+    numSamples = pendingFull->size();
+    sampleRate = pendingFull->getSampleRate();
+    residency->makeResident(this, pendingFull);
+    residency->enforceBudget(this);
+  } else {
+    full = pendingFull;
+    body.store(full.get());
+    head = std::move(pendingHead);
+    numSamples = pendingFull->size();
+    sampleRate = pendingFull->getSampleRate();
   }
+
+  pendingFull.reset();
+  if (memoryLocked) lockMemory();
 }
 
+bool ResidentSample::lockMemory() {
+  memoryLocked = head->lockMemory();
+  if (!residency) memoryLocked = full->lockMemory() && memoryLocked;
+  return memoryLocked;
+}
 
-PitchShift::PitchShift(const AudioContext& context, int semitoneShift)
-  : AudioNode(context), currentDelay(0.0), ringWriteIdx(0), ratio(convertSemitoneToRatio(semitoneShift)) {
-    // Preallocate ringBuffer.
-    ringBuffer.resize(context.bufferSize * context.numChannels);
+SampleResidency::SampleResidency(SampleLoader& loader, size_t budgetBytes, int headFrames)
+  : loader(loader), budgetBytes(budgetBytes), headFrames(headFrames) {}
 
-    // Use below if you want custom window size.
-    // Set a window size of ~20ms (adjust to taste)
-    // int windowSize = static_cast<int>(context.sampleRate * 0.020);
-    // ringBuffer.resize(windowSize);
+std::shared_ptr<ResidentSample> SampleResidency::load(const AudioContext& context, const std::string& path, SampleFormat storage) {
+  const std::string key = path + "#" + std::to_string(static_cast<int>(storage));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = samples.find(key);
+    if (it != samples.end()) {
+      if (auto existing = it->second.lock()) return existing;
+    }
   }
 
-  
-void PitchShift::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
-  if (inputs.empty()) {
-    outputBuffer.clear();
-    return;
-  }
+  // Decode outside the lock, this is the slow part.
+  auto data = SampleData::fromFile(context, path, storage);
+  auto sample = std::make_shared<ResidentSample>(data);
+  auto head = data->copyPrefix(headFrames * data->getNumChannels());
 
-  const int numInputSamples = inputs[0]->getNumFrames();
-  
-  // Sum all input buffers into the output buffer
-  // Revisit this... Seems wasteful if inputs.length < 1.
-  for (const auto* inputBufferPtr : inputs) {
-    for (int i = 0; i < outputBuffer.size(); ++i) {
-      outputBuffer[i] += (*inputBufferPtr)[i];
-    }
+  std::lock_guard<std::mutex> lock(mutex);
+  samples[key] = sample;
+
+  // Nothing to evict if the head already covers the whole sample.
+  if (head->size() >= data->size()) {
+    return sample;
   }
 
-  applyToBuffer(outputBuffer);
+  sample->head = head;
+  sample->residency = this;
+  sample->context = context;
+  sample->path = path;
+  sample->storage = storage;
+  lru.push_front(sample.get());
+  sample->lruPosition = lru.begin();
+
+  residentBytes += data->getMemoryUsage();
+  enforceBudget(sample.get());
+  return sample;
 }
 
-void PitchShift::applyToBuffer(AudioBuffer& buffer) {
-  const int numInputSamples = buffer.getNumFrames();
-  const double ringSize = static_cast<double>(ringBuffer.size());
-  // Not sure this margin is strictly necessary but may mitigate some pops/clicks.
-  const double safetyMargin = 20.0;
-
-  for (int i = 0; i < numInputSamples; ++i) {
-    // Write sample into ringBuffer
-    ringBuffer[ringWriteIdx] = buffer[i];
-
-    // Offset for Dual Tap delay.
-    currentDelay += (1.0 - ratio);
+void SampleResidency::setBudget(size_t newBudgetBytes) {
+  std::lock_guard<std::mutex> lock(mutex);
+  budgetBytes = newBudgetBytes;
+  enforceBudget(nullptr);
+}
 
-    // Wrap currentDelay
-    if (currentDelay >= ringSize) currentDelay -= ringSize;
-    if (currentDelay < 0) currentDelay += ringSize;
+size_t SampleResidency::getBudget() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return budgetBytes;
+}
 
-    double tapAPos = static_cast<double>(ringWriteIdx) - (currentDelay + safetyMargin);
-    if (tapAPos < 0) tapAPos += ringSize; // wrap
+size_t SampleResidency::getResidentBytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return residentBytes;
+}
 
-    double tapBPos = tapAPos + (ringSize * 0.5); // Offset by 180 deg
-    if (tapBPos >= ringSize) tapBPos -= ringSize; // wrap
+void SampleResidency::touch(ResidentSample* sample) {
+  std::lock_guard<std::mutex> lock(mutex);
+  lru.splice(lru.begin(), lru, sample->lruPosition);
 
-    // Triangle window for crossfading between taps.
-    // Consider using Hamming window.
-    float windowPhase = static_cast<float>(currentDelay / ringSize);
-    float gainA = 1.0f - std::abs((windowPhase * 2.0f) - 1.0f);
-    float gainB = 1.0f - gainA;
+  if (sample->full) {
+    // Samples that were playing may have kept us over budget, they might have stopped by now.
+    if (residentBytes > budgetBytes) enforceBudget(sample);
+    return;
+  }
+  if (sample->reloading) return;
+
+  sample->reloading = true;
+  std::weak_ptr<ResidentSample> weakSample = sample->weak_from_this();
+  AudioContext context = sample->context;
+  std::string path = sample->path;
+  SampleFormat storage = sample->storage;
+  float sampleRate = sample->sampleRate;
+
+  loader.enqueue([this, weakSample, context, path, storage, sampleRate] {
+    auto data = decodeAtRate(context, path, storage, sampleRate);
+    if (auto reloaded = weakSample.lock()) {
+      finishReload(reloaded.get(), data);
+    }
+  });
+}
 
-    float tapA = getCubicSample(tapAPos);
-    float tapB = getCubicSample(tapBPos);
-    buffer[i] = (tapA * gainA) + (tapB * gainB);
+void SampleResidency::forget(ResidentSample* sample) {
+  std::lock_guard<std::mutex> lock(mutex);
+  lru.erase(sample->lruPosition);
+  if (sample->full) residentBytes -= sample->full->getMemoryUsage();
 
-    // Increment write index.
-    ringWriteIdx = (ringWriteIdx + 1) % static_cast<int>(ringSize);
+  for (auto it = samples.begin(); it != samples.end(); ) {
+    it = it->second.expired() ? samples.erase(it) : std::next(it);
   }
 }
 
-void PitchShift::setPitch(int semitoneShift) {
-  ratio = convertSemitoneToRatio(semitoneShift);
-}
+void SampleResidency::finishReload(ResidentSample* sample, std::shared_ptr<const SampleData> data) {
+  std::lock_guard<std::mutex> lock(mutex);
+  sample->reloading = false;
+  // Also drops reloads started before a sample rate change.
+  if (sample->full || data->getSampleRate() != sample->sampleRate) return;
 
-void PitchShift::reset() {
-  // samplePosition = 0.0;
-  currentDelay = 0.0;
-  ringWriteIdx = 0;
-  std::fill(ringBuffer.begin(), ringBuffer.end(), 0.0f);
+  makeResident(sample, std::move(data));
+  enforceBudget(sample);
 }
 
-float PitchShift::getLerpSample(double samplePosition) {
-  int index0 = static_cast<int>(std::floor(samplePosition));
-  int index1 = (index0 + 1) % static_cast<int>(ringBuffer.size());
-  float fraction = static_cast<float>(samplePosition - std::floor(samplePosition));
-
-  return lerp(ringBuffer[index0], ringBuffer[index1], fraction);
+void SampleResidency::makeResident(ResidentSample* sample, std::shared_ptr<const SampleData> data) {
+  residentBytes += data->getMemoryUsage();
+  sample->full = std::move(data);
+  sample->body.store(sample->full.get());
 }
 
-float PitchShift::getCubicSample(double samplePosition) {
-  int i = static_cast<int>(std::floor(samplePosition));
-  float fraction = static_cast<float>(samplePosition - i);
-  int size = static_cast<int>(ringBuffer.size());
+void SampleResidency::evict(ResidentSample* sample) {
+  sample->body.store(nullptr);
 
-  // Get 4 samples for cubic interpolation: i-1, i, i+1, i+2
-  float sm1 = ringBuffer[(i - 1 + size) % size];
-  float s0  = ringBuffer[i % size];
-  float s1  = ringBuffer[(i + 1) % size];
-  float s2  = ringBuffer[(i + 2) % size];
+  // Wait out any read that picked up the old pointer, at most one block's worth of copying.
+  while (sample->readers.load() != 0) {
+    std::this_thread::yield();
+  }
 
-  return cubicInterpolation(sm1, s0, s1, s2, fraction);
+  residentBytes -= sample->full->getMemoryUsage();
+  sample->full.reset();
 }
 
-float PitchShift::lerp(float a, float b, float fraction) {
-  return a + (b - a) * fraction;
+void SampleResidency::enforceBudget(ResidentSample* keep) {
+  for (auto it = lru.rbegin(); it != lru.rend() && residentBytes > budgetBytes; ++it) {
+    ResidentSample* candidate = *it;
+    if (candidate != keep && candidate->full && candidate->pins.load(std::memory_order_relaxed) == 0) {
+      evict(candidate);
+    }
+  }
 }
 
-// sm1 = s-1
-float PitchShift::cubicInterpolation(float sm1, float s0, float s1, float s2, float fraction) {
-  float a = -0.5f * sm1 + 1.5f * s0 - 1.5f * s1 + 0.5f * s2;
-  float b = sm1 - 2.5f * s0 + 2.0f * s1 - 0.5f * s2;
-  float c = -0.5f * sm1 + 0.5f * s1;
-  float d = s0;
 
-  return d + fraction * (c + fraction * (b + fraction * a));
+static size_t triggerQueueSize(size_t capacity) {
+  size_t size = 16;
+  while (size < capacity) size *= 2;
+  return size;
 }
 
-// void Gain::sincInterpolation(const float* inputData, size_t numInputSamples, double position, int numTaps) {
-  
-// }
+TriggerQueue::TriggerQueue(size_t capacity)
+  : ring(triggerQueueSize(capacity)), mask(ring.size() - 1) {}
 
-double PitchShift::convertSemitoneToRatio(int semitoneShift) {
-  const double exponent = static_cast<double>(semitoneShift) / 12.0;
-    
-  // The base is 2 (for an octave)
-  return std::pow(2.0, exponent);
-}
+bool TriggerQueue::push(const SampleTrigger* triggers, size_t count) {
+  const size_t write = writeIndex.load(std::memory_order_relaxed);
+  const size_t read = readIndex.load(std::memory_order_acquire);
+  if (ring.size() - (write - read) < count) {
+    return false;
+  }
 
+  for (size_t i = 0; i < count; ++i) {
+    ring[(write + i) & mask] = triggers[i];
+  }
+  writeIndex.store(write + count, std::memory_order_release);
+  return true;
+}
 
-SamplePack::SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, std::string samplesDir, float gain)
-  : graph(graph) {
-    auto [outputNodeId, outputNodePtr] = graph.addNode<Gain>(gain); // consider parameterizing gain
+SampleTriggerNode::SampleTriggerNode(const AudioContext& context, std::vector<Sampler*> samplers, size_t capacity)
+  : AudioNode(context), samplers(std::move(samplers)), queue(capacity) {}
 
-    for (auto& item : samplePackItems) {
-      auto [samplerNodeId, samplerNodePtr] = graph.addNode<Sampler>(
-        samplesDir + item.fileName,
-        item.polyphony,
-        item.loop,
-        item.gain,
-        item.pitchShift,
-        item.envConfig,
-        item.filterConfig
-      );
-      samplers[item.slug] = samplerNodePtr;
-      graph.connect(samplerNodeId, outputNodeId);
+bool SampleTriggerNode::push(const SampleTrigger* triggers, size_t count) {
+  // Checked here so a bad handle is an error for the caller, not a trigger the audio thread drops.
+  // Same for a pitch the voices have no shifter for, it would just play at the item's own pitch.
+  for (size_t i = 0; i < count; ++i) {
+    if (triggers[i].handle < 0 || triggers[i].handle >= static_cast<SampleHandle>(samplers.size())) {
+      return false;
+    }
+    if (!triggers[i].release && triggers[i].pitchShift != 0 && !samplers[triggers[i].handle]->canPitchShift()) {
+      return false;
     }
   }
 
-void SamplePack::triggerSample(std::string slug) {
-  samplers[slug]->noteOn();
+  for (size_t i = 0; i < count; ++i) {
+    if (!triggers[i].release) samplers[triggers[i].handle]->touchSample();
+  }
+  return queue.push(triggers, count);
+}
+
+void SampleTriggerNode::process(const std::vector<const AudioBuffer*>& /*inputs*/, AudioBuffer& /*outputBuffer*/) {
+  queue.drain([this](const SampleTrigger& trigger) {
+    if (trigger.handle < 0 || trigger.handle >= static_cast<SampleHandle>(samplers.size())) return;
+
+    Sampler* sampler = samplers[trigger.handle];
+    if (trigger.release) {
+      sampler->noteOff();
+    } else {
+      sampler->startVoice(trigger.gain, trigger.pitchShift);
+    }
+  });
+  outputSilence();
+}
+
+
+template <typename Stage> Stage voiceStage(SamplerVoice& voice);
+template <> PitchStage voiceStage<PitchStage>(SamplerVoice& voice) { return PitchStage { *voice.pitchShifter }; }
+template <> EnvelopeStage voiceStage<EnvelopeStage>(SamplerVoice& voice) { return EnvelopeStage { *voice.envelope }; }
+template <> BiquadStage voiceStage<BiquadStage>(SamplerVoice& voice) { return BiquadStage { *voice.filter }; }
+
+template <typename... Stages>
+static void renderVoiceChain(SamplerVoice& voice, float* samples, int numFrames, int numChannels) {
+  Chain<Stages...>::render(samples, numFrames, numChannels, voiceStage<Stages>(voice)...);
 }
 
+VoiceChainFn Sampler::selectVoiceChain(bool pitch, bool envelope, bool filter) {
+  // Indexed by pitch/envelope/filter bits, stages always run in that order.
+  static const VoiceChainFn chains[8] = {
+    &renderVoiceChain<>,
+    &renderVoiceChain<BiquadStage>,
+    &renderVoiceChain<EnvelopeStage>,
+    &renderVoiceChain<EnvelopeStage, BiquadStage>,
+    &renderVoiceChain<PitchStage>,
+    &renderVoiceChain<PitchStage, BiquadStage>,
+    &renderVoiceChain<PitchStage, EnvelopeStage>,
+    &renderVoiceChain<PitchStage, EnvelopeStage, BiquadStage>,
+  };
+  return chains[(pitch ? 4 : 0) | (envelope ? 2 : 0) | (filter ? 1 : 0)];
+}
 
 Sampler::Sampler(
   const AudioContext &context,
@@ -1194,55 +6145,95 @@ Sampler::Sampler(
   float gain,
   int pitchShift,
   std::optional<EnvConfig> envConfig,
+  std::optional<FilterConfig> filterConfig,
+  SampleFormat storage
+)
+  : Sampler(
+    context,
+    SampleData::fromFile(context, samplePath, storage),
+    polyphony, loop, gain, pitchShift, envConfig, filterConfig
+  ) {}
+
+Sampler::Sampler(
+  const AudioContext &context,
+  std::shared_ptr<const SampleData> sample,
+  int polyphony,
+  bool loop,
+  float gain,
+  int pitchShift,
+  std::optional<EnvConfig> envConfig,
+  std::optional<FilterConfig> filterConfig
+)
+  : Sampler(
+    context,
+    std::make_shared<ResidentSample>(std::move(sample)),
+    polyphony, loop, gain, pitchShift, envConfig, filterConfig
+  ) {}
+
+Sampler::Sampler(
+  const AudioContext &context,
+  std::shared_ptr<ResidentSample> sample,
+  int polyphony,
+  bool loop,
+  float gain,
+  int pitchShift,
+  std::optional<EnvConfig> envConfig,
   std::optional<FilterConfig> filterConfig
 )
-  : AudioNode(context), sample(context), polyphony(polyphony),
+  : AudioNode(context), sample(std::move(sample)), polyphony(polyphony), voiceLimit(polyphony),
   loop(loop), gain(gain), pitchShift(pitchShift),
-  envConfig(envConfig), filterConfig(filterConfig)
+  envConfig(envConfig), filterConfig(filterConfig),
+  voiceChain(selectVoiceChain(pitchShift != 0, envConfig.has_value(), filterConfig.has_value()))
 {
-  // Load sample
-  ma_decoder decoder;
-  ma_decoder_config decoderConfig = ma_decoder_config_init(
-    ma_format_f32,
-    context.numChannels,
-    context.sampleRate
-  );
+  // Setup voices, each only gets the DSP this sampler is configured with.
+  voices.reserve(polyphony);
+  for (int i = 0; i < polyphony; ++i) {
+    voices.emplace_back(context, pitchShift, envConfig, filterConfig);
+  }
 
-  if (ma_decoder_init_file(samplePath.c_str(), &decoderConfig, &decoder) != MA_SUCCESS) {
-    printf("Failed to load WAV file at path %s\n", samplePath.c_str());
-  } else {
-    ma_uint64 totalFrames;
-    ma_result result = ma_decoder_get_length_in_pcm_frames(&decoder, &totalFrames);
+  crossfadeScratch.resize(static_cast<size_t>(context.bufferSize) * context.numChannels);
+  updateLoopRegion();
+}
 
-    if (result != MA_SUCCESS) {
-      printf("Failed to get length of WAV file.\n");
-      ma_decoder_uninit(&decoder);
-    }
+Sampler::~Sampler() {
+  if (pinsSample) sample->unpin();
+}
 
-    sample.resize(static_cast<size_t>(totalFrames));
+void Sampler::setLoopPoints(std::optional<SampleLoop> points) {
+  loopPoints = points;
+  updateLoopRegion();
+}
 
-    ma_uint64 framesRead;
-    result = ma_decoder_read_pcm_frames(&decoder, sample.data.data(), totalFrames, &framesRead);
-    if (result != MA_SUCCESS) {
-      printf("Failed to read WAV file.\n");
+void Sampler::updateLoopRegion() {
+  const int channels = sample->getNumChannels();
+  const int numFrames = channels > 0 ? sample->size() / channels : 0;
+  const double rate = sample->getSampleRate();
+  auto toFrame = [&](double seconds) { return std::clamp(static_cast<int>(std::lround(seconds * rate)), 0, numFrames); };
+
+  int start = 0, end = numFrames, crossfade = 0;
+  const std::optional<SampleLoop>& points = loopPoints ? loopPoints : sample->getLoop();
+  if (points) {
+    const int pointsStart = toFrame(points->start);
+    const int pointsEnd = points->end > 0.0 ? toFrame(points->end) : numFrames;
+    // An empty or backwards loop falls back to the whole sample.
+    if (pointsEnd > pointsStart) {
+      start = pointsStart;
+      end = pointsEnd;
     }
+    // Can't fade in more than there is before the start, or than the loop is long.
+    crossfade = std::min(toFrame(points->crossfade), std::min(start, end - start));
   }
-  
-  // Cleanup miniaudio decoder.
-  ma_decoder_uninit(&decoder);
 
-  // Setup voices.
-  voices.reserve(polyphony);
-  for (int i = 0; i < polyphony; ++i) {
-    voices.emplace_back(context);
-  }
+  loopRegion = LoopRegion { start * channels, end * channels, crossfade * channels };
 }
 
 SamplerVoice* Sampler::allocateVoice() {
-  // Try first inactive voice.
-  for (SamplerVoice& voice : voices) {
-    if (!voice.active) {
-      return &voice;
+  // Try first inactive voice, while under the voice limit.
+  if (static_cast<int>(activeVoices.size()) < voiceLimit) {
+    for (SamplerVoice& voice : voices) {
+      if (!voice.active) {
+        return &voice;
+      }
     }
   }
 
@@ -1252,15 +6243,38 @@ SamplerVoice* Sampler::allocateVoice() {
   return oldestVoice;
 }
 
-void Sampler::noteOn() {
+void Sampler::noteOn(float gain, int pitchShift) {
+  touchSample();
+  startVoice(gain, pitchShift);
+}
+
+void Sampler::startVoice(float gain, int pitchShift) {
   SamplerVoice* freeVoice = allocateVoice();
-  freeVoice->trigger();
+  freeVoice->trigger(gain, pitchShift);
   activeVoices.push_back(freeVoice);
+  updateSamplePin();
+}
+
+// Only changes when the sampler starts or stops sounding, not per voice.
+void Sampler::updateSamplePin() {
+  const bool playing = !activeVoices.empty();
+  if (playing == pinsSample) return;
+  if (playing) {
+    sample->pin();
+  } else {
+    sample->unpin();
+  }
+  pinsSample = playing;
+}
+
+void Sampler::touchSample() {
+  // Lets a residency manager mark the sample as used and start reloading it if evicted.
+  sample->touch();
 }
 
 void Sampler::noteOff() {
   for (SamplerVoice* voice : activeVoices) {
-    if (envConfig.has_value()) {
+    if (voice->envelope) {
       voice->envelope->noteOff();
     } else {
       voice->active = false;
@@ -1269,18 +6283,26 @@ void Sampler::noteOff() {
 }
 
 void Sampler::process(const std::vector<const AudioBuffer *> &inputs, AudioBuffer &outputBuffer) {
+  // Idle samplers report silence instead of clearing/summing every block.
+  if (activeVoices.empty()) {
+    outputSilence();
+    return;
+  }
+
   outputBuffer.clear();
+  const bool virtualize = quality >= Quality::VirtualVoices;
 
   for (SamplerVoice& voice : voices) {
-    if (voice.active) {
+    if (voice.active && virtualize && voice.getLevel(gain) < virtualVoiceLevel) {
+      voice.skipVoice(*sample, loop ? &loopRegion : nullptr);
+    } else if (voice.active) {
       voice.processVoice(
-        sample,
+        *sample,
         outputBuffer,
-        loop,
+        loop ? &loopRegion : nullptr,
         gain,
-        pitchShift,
-        envConfig,
-        filterConfig
+        voiceChain,
+        crossfadeScratch.data()
       );
     }
 
@@ -1291,6 +6313,344 @@ void Sampler::process(const std::vector<const AudioBuffer *> &inputs, AudioBuffe
       activeVoices.remove(&voice);
     }
   }
+  updateSamplePin();
+}
+
+bool Sampler::lockSampleMemory() {
+  return sample->lockMemory();
+}
+
+void Sampler::prepareAudioContext(const AudioContext& context) {
+  sample->prepareSampleRate(context.sampleRate);
+}
+
+void Sampler::setAudioContext(const AudioContext& context) {
+  const double ratio = static_cast<double>(context.sampleRate) / outputBuffer.getSampleRate();
+  AudioNode::setAudioContext(context);
+  sample->prepareSampleRate(context.sampleRate); // Nothing to do if that already happened.
+  sample->applySampleRate();
+
+  for (SamplerVoice& voice : voices) {
+    voice.setAudioContext(context, ratio, sample->size());
+  }
+  crossfadeScratch.resize(static_cast<size_t>(context.bufferSize) * context.numChannels);
+  updateLoopRegion();
+}
+
+void Sampler::setQuality(Quality newQuality) {
+  const bool filters = filterConfig.has_value() && newQuality < Quality::NoVoiceFilters;
+  const bool filtersWereOn = filterConfig.has_value() && quality < Quality::NoVoiceFilters;
+  quality = newQuality;
+
+  for (SamplerVoice& voice : voices) {
+    if (voice.pitchShifter) voice.pitchShifter->setCubicInterpolation(quality < Quality::LinearInterpolation);
+    // Skipped filters kept their old state, start them clean rather than with a stale tail.
+    if (voice.filter && filters && !filtersWereOn) voice.filter->reset();
+  }
+
+  voiceChain = selectVoiceChain(pitchShift != 0, envConfig.has_value(), filters);
+
+  // Voices already playing past the limit are left to finish.
+  voiceLimit = quality >= Quality::ReducedPolyphony ? std::max(1, polyphony / 2) : polyphony;
+}
+
+
+SendBuses::SendBuses(AudioGraph& graph) : graph(graph) {}
+
+void SendBuses::setReturnNode(int nodeId) {
+  returnNodeId = nodeId;
+}
+
+void SendBuses::addSource(const std::string& slug, int nodeId, const AudioNode* node, SendLevels levels) {
+  sources[slug] = Source { nodeId, node, std::move(levels) };
+}
+
+AudioNode* SendBuses::addBus(const std::string& name, std::unique_ptr<AudioNode> effect) {
+  if (returnNodeId < 0) {
+    throw std::runtime_error("Send bus '" + name + "' has nowhere to return to.");
+  }
+  if (buses.count(name)) {
+    throw std::runtime_error("Duplicate send bus name: " + name);
+  }
+
+  auto sendNode = std::make_unique<Mixer>(graph.audioContext, 1.0f);
+  Bus bus { -1, sendNode.get(), -1, effect.get(), {} };
+
+  // One edit, so the audio thread never runs a bus with half its sources.
+  auto lock = graph.lockGraphFor({ sendNode.get(), effect.get() });
+  bus.sendNodeId = graph.addNode(std::move(sendNode));
+  bus.effectNodeId = graph.addNode(std::move(effect));
+  graph.connect(bus.sendNodeId, bus.effectNodeId);
+  graph.connect(bus.effectNodeId, returnNodeId);
+
+  for (const auto& [slug, source] : sources) {
+    auto level = source.levels.find(name);
+    if (level != source.levels.end() && level->second > 0.0f) {
+      connectSource(bus, slug, source, level->second);
+    }
+  }
+
+  AudioNode* effectPtr = bus.effect;
+  buses.emplace(name, std::move(bus));
+  return effectPtr;
+}
+
+// Caller holds the graph lock.
+void SendBuses::connectSource(Bus& bus, const std::string& slug, const Source& source, float level) {
+  bus.send->setInputGain(source.node, level);
+  graph.connect(source.nodeId, bus.sendNodeId);
+  bus.connected.insert(slug);
+}
+
+void SendBuses::setSendLevel(const std::string& slug, const std::string& busName, float level) {
+  auto source = sources.find(slug);
+  if (source == sources.end()) {
+    printf("No send source named %s\n", slug.c_str());
+    return;
+  }
+  source->second.levels[busName] = level;
+
+  auto bus = buses.find(busName);
+  if (bus == buses.end()) {
+    return; // Picked up when the bus is added.
+  }
+
+  if (bus->second.connected.count(slug)) {
+    // Already connected, just a new gain. Zero keeps the edge, the send mixer just scales by it.
+    bus->second.send->setInputGain(source->second.node, level);
+  } else if (level > 0.0f) {
+    auto lock = graph.lockGraph();
+    connectSource(bus->second, slug, source->second, level);
+  }
+}
+
+float SendBuses::getSendLevel(const std::string& slug, const std::string& bus) const {
+  auto source = sources.find(slug);
+  if (source == sources.end()) return 0.0f;
+  auto level = source->second.levels.find(bus);
+  return level == source->second.levels.end() ? 0.0f : level->second;
+}
+
+AudioNode* SendBuses::getEffect(const std::string& bus) const {
+  auto it = buses.find(bus);
+  return it == buses.end() ? nullptr : it->second.effect;
+}
+
+
+void SpatialMixer::Emitters::resize(size_t size) {
+  x.resize(size, 0.0f);
+  y.resize(size, 0.0f);
+  z.resize(size, 0.0f);
+  gain.resize(size, 1.0f);
+}
+
+SpatialMixer::SpatialMixer(const AudioContext& context, float referenceDistance, float maxDistance, float rolloff)
+  : AudioNode(context),
+    channels(context.numChannels),
+    referenceDistance(std::max(referenceDistance, 1e-3f)),
+    maxDistance(maxDistance),
+    rolloff(std::max(rolloff, 0.0f)),
+    monoScratch(context.bufferSize) {}
+
+int SpatialMixer::addEmitter(const AudioNode* source, float gain) {
+  auto existing = emitterIndex.find(&source->outputBuffer);
+  if (existing != emitterIndex.end()) {
+    return existing->second;
+  }
+
+  int index;
+  if (!freeEmitters.empty()) {
+    index = freeEmitters.back();
+    freeEmitters.pop_back();
+  } else {
+    index = numEmitters++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    pending.resize(numEmitters);
+    pending.x[index] = pendingListener.x;
+    pending.y[index] = pendingListener.y;
+    pending.z[index] = pendingListener.z;
+    pending.gain[index] = gain;
+    pendingDirty.store(true, std::memory_order_release);
+  }
+
+  // The audio thread is held off by the graph lock, so its arrays can grow here.
+  live.resize(numEmitters);
+  live.gain[index] = 0.0f; // Silent until the pending state is picked up.
+  targetLeft.resize(numEmitters, 0.0f);
+  targetRight.resize(numEmitters, 0.0f);
+  previousLeft.resize(numEmitters, 0.0f);
+  previousRight.resize(numEmitters, 0.0f);
+  emitterIndex[&source->outputBuffer] = index;
+  return index;
+}
+
+void SpatialMixer::sourceDisconnected(const AudioNode& source) {
+  auto emitter = emitterIndex.find(&source.outputBuffer);
+  if (emitter == emitterIndex.end()) return;
+
+  // Otherwise a node added later at the same address would turn up as this emitter.
+  // The slot stays in the arrays, silenced, until addEmitter hands it out again.
+  const int index = emitter->second;
+  emitterIndex.erase(emitter);
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    pending.gain[index] = 0.0f;
+  }
+  live.gain[index] = 0.0f;
+  targetLeft[index] = targetRight[index] = 0.0f;
+  previousLeft[index] = previousRight[index] = 0.0f;
+  freeEmitters.push_back(index);
+}
+
+void SpatialMixer::setEmitterPosition(int emitter, float x, float y, float z) {
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  if (emitter < 0 || emitter >= static_cast<int>(pending.x.size())) return;
+  pending.x[emitter] = x;
+  pending.y[emitter] = y;
+  pending.z[emitter] = z;
+  pendingDirty.store(true, std::memory_order_release);
+}
+
+void SpatialMixer::setEmitterGain(int emitter, float gain) {
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  if (emitter < 0 || emitter >= static_cast<int>(pending.gain.size())) return;
+  pending.gain[emitter] = gain;
+  pendingDirty.store(true, std::memory_order_release);
+}
+
+void SpatialMixer::setEmitterPositions(const float* x, const float* y, const float* z, int count) {
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  count = std::min(count, static_cast<int>(pending.x.size()));
+  std::copy(x, x + count, pending.x.begin());
+  std::copy(y, y + count, pending.y.begin());
+  std::copy(z, z + count, pending.z.begin());
+  pendingDirty.store(true, std::memory_order_release);
+}
+
+void SpatialMixer::setListener(const SpatialListener& newListener) {
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  pendingListener = newListener;
+  pendingDirty.store(true, std::memory_order_release);
+}
+
+// Never waits on the control thread, if it's mid update we just use last block's state.
+void SpatialMixer::pullUpdates() {
+  if (!pendingDirty.load(std::memory_order_acquire) || !pendingMutex.try_lock()) {
+    return;
+  }
+  std::copy(pending.x.begin(), pending.x.end(), live.x.begin());
+  std::copy(pending.y.begin(), pending.y.end(), live.y.begin());
+  std::copy(pending.z.begin(), pending.z.end(), live.z.begin());
+  std::copy(pending.gain.begin(), pending.gain.end(), live.gain.begin());
+  listener = pendingListener;
+  pendingDirty.store(false, std::memory_order_relaxed);
+  pendingMutex.unlock();
+}
+
+// Every emitter at once. Written without branches (selects and max only) so it vectorizes,
+// sqrt needs -fno-math-errno for that or the compiler has to keep a scalar errno path.
+void SpatialMixer::computeGains() {
+  const float* x = live.x.data();
+  const float* y = live.y.data();
+  const float* z = live.z.data();
+  const float* gain = live.gain.data();
+  float* left = targetLeft.data();
+  float* right = targetRight.data();
+
+  const SpatialListener l = listener;
+  const float ref = referenceDistance;
+  const float maxDist = maxDistance;
+  const float roll = rolloff;
+  // Mono gets no panning, and the centre gain scaled back up to unity.
+  const float panWidth = channels > 1 ? 1.0f : 0.0f;
+  const float centreGain = channels > 1 ? 1.0f : std::sqrt(2.0f);
+
+  for (int i = 0; i < numEmitters; ++i) {
+    const float dx = x[i] - l.x;
+    const float dy = y[i] - l.y;
+    const float dz = z[i] - l.z;
+    const float distance = std::sqrt(dx * dx + dy * dy + dz * dz);
+
+    const float inRange = distance <= maxDist ? 1.0f : 0.0f;
+    const float attenuation = inRange * gain[i] * centreGain * ref / (ref + roll * (std::max(distance, ref) - ref));
+
+    // -1 is hard left, 1 hard right. Sources on top of the listener sit in the middle.
+    const float pan = panWidth * (dx * l.rightX + dy * l.rightY + dz * l.rightZ) / std::max(distance, 1e-6f);
+
+    // Equal power, left^2 + right^2 stays constant across the pan.
+    // The max only guards against rounding taking |pan| just past 1.
+    left[i] = attenuation * std::sqrt(std::max(0.5f - 0.5f * pan, 0.0f));
+    right[i] = attenuation * std::sqrt(std::max(0.5f + 0.5f * pan, 0.0f));
+  }
+}
+
+void SpatialMixer::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  pullUpdates();
+  computeGains();
+
+  if (inputs.empty()) {
+    std::copy(targetLeft.begin(), targetLeft.end(), previousLeft.begin());
+    std::copy(targetRight.begin(), targetRight.end(), previousRight.begin());
+    outputSilence();
+    return;
+  }
+
+  const int numFrames = outputBuffer.getNumFrames();
+  float* out = outputBuffer.data.data();
+  float* mono = monoScratch.data();
+  std::fill(outputBuffer.data.begin(), outputBuffer.data.end(), 0.0f);
+
+  for (const AudioBuffer* input : inputs) {
+    const float* in = input->data.data();
+    auto emitter = emitterIndex.find(input);
+
+    if (emitter == emitterIndex.end()) {
+      // Not an emitter, mix it straight through.
+      for (int i = 0; i < outputBuffer.size(); ++i) out[i] += in[i];
+      continue;
+    }
+
+    const int e = emitter->second;
+    const float startLeft = previousLeft[e];
+    const float startRight = previousRight[e];
+    const float endLeft = targetLeft[e];
+    const float endRight = targetRight[e];
+
+    // Culled, out of range now and last block too.
+    if (startLeft == 0.0f && startRight == 0.0f && endLeft == 0.0f && endRight == 0.0f) {
+      continue;
+    }
+
+    for (int i = 0; i < numFrames; ++i) {
+      float sum = 0.0f;
+      for (int ch = 0; ch < channels; ++ch) sum += in[i * channels + ch];
+      mono[i] = sum / channels;
+    }
+
+    const float stepLeft = (endLeft - startLeft) / numFrames;
+    const float stepRight = (endRight - startRight) / numFrames;
+
+    if (channels == 1) {
+      for (int i = 0; i < numFrames; ++i) {
+        out[i] += mono[i] * (startLeft + stepLeft * (i + 1));
+      }
+    } else {
+      for (int i = 0; i < numFrames; ++i) {
+        out[i * channels] += mono[i] * (startLeft + stepLeft * (i + 1));
+        out[i * channels + 1] += mono[i] * (startRight + stepRight * (i + 1));
+      }
+    }
+  }
+
+  std::copy(targetLeft.begin(), targetLeft.end(), previousLeft.begin());
+  std::copy(targetRight.begin(), targetRight.end(), previousRight.begin());
+}
+
+void SpatialMixer::setAudioContext(const AudioContext& context) {
+  AudioNode::setAudioContext(context);
+  monoScratch.resize(context.bufferSize);
 }
 } // namespace MittelVec
 
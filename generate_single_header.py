@@ -103,6 +103,63 @@ def strip_namespace(content):
         
     return content # Return original if closing brace not found
 
+# Matches any #include "..." (local/relative)
+local_include_pattern = re.compile(r'^\s*#include\s*".*?"', re.MULTILINE)
+
+# Matches any #include <...> (system)
+system_include_pattern = re.compile(r'^\s*#include\s*<.*?>', re.MULTILINE)
+
+conditional_start_pattern = re.compile(r'^\s*#\s*if')
+conditional_end_pattern = re.compile(r'^\s*#\s*endif')
+
+def find_conditional_end(lines, start):
+    """Returns the index of the #endif matching the #if at `start`, or -1."""
+    depth = 0
+    for i in range(start, len(lines)):
+        if conditional_start_pattern.match(lines[i]):
+            depth += 1
+        elif conditional_end_pattern.match(lines[i]):
+            depth -= 1
+            if depth == 0:
+                return i
+    return -1
+
+def hoist_includes(content, system_includes, system_include_blocks):
+    """Strips local includes and hoists system includes out of a file's content.
+
+    #if blocks made up only of preprocessor lines (e.g. platform specific includes)
+    are hoisted whole so the includes keep their guards.
+    """
+    lines = content.splitlines()
+    cleaned_lines = []
+    i = 0
+    while i < len(lines):
+        line = lines[i]
+
+        if conditional_start_pattern.match(line):
+            end = find_conditional_end(lines, i)
+            block = lines[i:end + 1] if end != -1 else []
+            only_directives = all(l.strip() == '' or l.strip().startswith('#') for l in block)
+            has_system_include = any(system_include_pattern.match(l) for l in block)
+            if block and only_directives and has_system_include:
+                block_text = "\n".join(block)
+                if block_text not in system_include_blocks:
+                    system_include_blocks.append(block_text)
+                i = end + 1
+                continue
+
+        # 1. Hoist system includes
+        if system_include_pattern.match(line):
+            system_includes.add(line.strip())
+        # 2. STRIP local includes
+        elif local_include_pattern.match(line):
+            pass
+        else:
+            cleaned_lines.append(line)
+        i += 1
+
+    return "\n".join(cleaned_lines)
+
 def create_single_header():
     """Combines project files into a single header library."""
     if not os.path.exists(os.path.dirname(OUTPUT_FILE)):
@@ -112,13 +169,8 @@ def create_single_header():
     header_files = sort_headers_topologically(header_files)
     source_files = get_project_files(SRC_DIR, ['.cpp', '.c'])
 
-    # Matches any #include "..." (local/relative)
-    local_include_pattern = re.compile(r'^\s*#include\s*".*?"', re.MULTILINE)
-
-    # Matches any #include <...> (system)
-    system_include_pattern = re.compile(r'^\s*#include\s*<.*?>', re.MULTILINE)
-
     system_includes = set()
+    system_include_blocks = []
     processed_headers = []
 
     # --- 1. Process Headers ---
@@ -128,39 +180,14 @@ def create_single_header():
             content = strip_namespace(infile.read())
             # Remove #pragma once
             content = re.sub(r'#pragma once\r?\n?', '', content)
-            
-            lines = content.splitlines()
-            cleaned_lines = []
-            for line in lines:
-                # 1. Hoist system includes
-                if system_include_pattern.match(line):
-                    system_includes.add(line.strip())
-                # 2. STRIP local includes
-                elif local_include_pattern.match(line):
-                    continue 
-                else:
-                    cleaned_lines.append(line)
-            
-            processed_headers.append("\n".join(cleaned_lines))
+            processed_headers.append(hoist_includes(content, system_includes, system_include_blocks))
 
     # --- 2. Process Source Files (just for hoisting system includes) ---
     processed_sources = []
     for filepath in source_files:
         with open(filepath, 'r') as infile:
             content = strip_namespace(infile.read())
-            
-            lines = content.splitlines()
-            cleaned_lines = []
-            for line in lines:
-                # 1. Hoist system includes
-                if system_include_pattern.match(line):
-                    system_includes.add(line.strip())
-                # 2. STRIP local includes
-                elif local_include_pattern.match(line):
-                    continue 
-                else:
-                    cleaned_lines.append(line)
-            processed_sources.append("\n".join(cleaned_lines))
+            processed_sources.append(hoist_includes(content, system_includes, system_include_blocks))
 
     # --- 3. Write Output ---
     with open(OUTPUT_FILE, 'w') as outfile:
@@ -176,6 +203,10 @@ def create_single_header():
             outfile.write(f"{inc}\n")
         outfile.write("\n")
 
+        # Platform specific includes keep their #if guards.
+        for block in system_include_blocks:
+            outfile.write(f"{block}\n\n")
+
         # Write miniaudio dependency include
         outfile.write("// NOTE! This lib depends on miniaudio (a single header file audio lib)\n")
         outfile.write("// Ensure miniaudio.h is in your include path\n")
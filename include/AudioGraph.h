@@ -3,9 +3,11 @@
 #include "AudioNode.h"
 #include "AudioBuffer.h"
 #include "AudioContext.h"
+#include "ChannelDispatch.h"
+#include <atomic>
 #include <vector>
 #include <memory>
-#include <unordered_map>
+#include <mutex>
 
 namespace MittelVec {
 
@@ -16,27 +18,127 @@ public:
     template <typename NodeType, typename... Args>
     std::pair<int, NodeType*> addNode(Args &&...args)
     {
-      int id = nextNodeId++;
+      // Construct outside the graph lock, only the insert needs it.
       auto node = std::make_unique<NodeType>(audioContext, std::forward<Args>(args)...);
-      nodes[id] = std::move(node);
-      isGraphDirty = true;
-      return std::make_pair(id, static_cast<NodeType*>(nodes[id].get()));
+      NodeType* nodePtr = node.get();
+      int id = addNode(std::move(node));
+      return std::make_pair(id, nodePtr);
     }
 
+    // Takes ownership of a node built elsewhere (e.g. on a loader thread), catching it up
+    // first if the graph was reconfigured since (see lockGraphFor).
+    int addNode(std::unique_ptr<AudioNode> node);
+
+    // Holding this lock groups edits so the audio thread sees them all at once, or not at all.
+    // All edit methods lock it themselves, so it's only needed to make several edits atomic.
+    // The audio thread never waits for it: a block due while it's held is skipped, faded out
+    // from the last one, and every node misses that block (playheads, envelopes and tails
+    // included). So build nodes, load and resample before locking, and only insert, connect
+    // and configure under it. Removed nodes are destroyed after it's released.
+    std::unique_lock<std::recursive_mutex> lockGraph();
+    // lockGraph for adding nodes built before a reconfiguration (e.g. on a loader thread).
+    // Catches them up to the graph's settings, the slow part without the lock, and returns
+    // once they match with the lock held. Don't call it with the graph already locked.
+    std::unique_lock<std::recursive_mutex> lockGraphFor(const std::vector<AudioNode*>& nodes);
+
     void removeNode(int nodeId);
     void connect(int sourceNodeId, int destNodeId);
+    // Also feeds the source into dest (and orders it before), but the source still plays on
+    // its own: it doesn't count as connected for the output mix. For nodes that only listen
+    // to a signal, like a Compressor's sidechain. disconnect removes it like any edge.
+    void connectSidechain(int sourceNodeId, int destNodeId);
     void disconnect(int sourceNodeId, int destNodeId);
+    // Never blocks. If an edit holds the graph lock, the block is skipped (see lockGraph).
     void processGraph(AudioBuffer& graphOutputBuffer);
+    // Blocks rendered as silence because an edit held the lock, for diagnostics.
+    int getSkippedBlocks() const { return skippedBlocks.load(std::memory_order_relaxed); }
+
+    // Changes block size and/or sample rate for every node, voice and sample in the graph.
+    // prepareAudioContext does the slow part (resampling etc.) while the graph keeps
+    // playing, setAudioContext swaps it all in under the graph lock, preparing first if
+    // that wasn't done. Ids and node pointers stay valid. The channel count can't change.
+    // Don't remove nodes from another thread while preparing.
+    void prepareAudioContext(AudioContext newContext);
     void setAudioContext(AudioContext newContext);
 
+    // Passed on to every node at the start of the next block, so nodes only ever change
+    // quality on the audio thread. Nodes added later start at the current quality.
+    void setQuality(Quality quality);
+    Quality getQuality() const;
+
+    // The node behind an id, or nullptr if it's been removed.
+    AudioNode* getNode(int nodeId) const;
+    size_t getNumNodes() const { return numNodes; }
+
+    // Full Kahn sort from scratch. Edits keep the order up to date themselves, this is
+    // only needed to recover once a cycle has been broken.
     void updateProcessOrder();
     AudioContext audioContext;
-    std::unordered_map<int, std::unique_ptr<AudioNode>> nodes;
-    std::unordered_map<int, std::vector<int>> connections;
-    std::unordered_map<int, std::vector<int>> reverseConnections;
-    int nextNodeId;
+
+    // Node ids are generational handles. The low bits pick a slot and the rest are that
+    // slot's generation, which is bumped whenever the slot is freed. Lookups are an index
+    // instead of a hash, and a stale id never matches whatever reuses its slot.
+    static constexpr int slotIndexBits = 20;
+    static constexpr int slotIndexMask = (1 << slotIndexBits) - 1;
+    static constexpr int generationMask = (1 << (31 - slotIndexBits)) - 1;
+
+    // Everything about one node, including its edges, so removing it is O(degree).
+    // Edges and processOrder hold slot indices, not ids.
+    struct NodeSlot {
+      std::unique_ptr<AudioNode> node; // Null while the slot is free.
+      int generation = 0;
+      std::vector<int> destinations;
+      std::vector<int> sources;
+      // The destinations connected as sidechains, also in destinations.
+      std::vector<int> sidechains;
+      int position = -1; // Where this node is in processOrder.
+      // Fusable, and the only destination of its only source, so it runs tile by tile
+      // straight after that source as part of a fused chain (see processFusedChain).
+      bool fusedIn = false;
+    };
+
+    std::vector<NodeSlot> slots;
+    std::vector<int> freeSlots;
+    size_t numNodes = 0;
+
+    // Topological order, kept up to date by every edit (Pearce-Kelly), so processGraph
+    // never sorts. Removed nodes leave a -1 hole until there are enough to compact.
     std::vector<int> processOrder;
-    bool isGraphDirty;
+    size_t numOrderHoles = 0;
+    bool hasCycle = false;
+
+    // Frames per fused tile, small enough to stay in L1 between stages.
+    static constexpr int fusionTileFrames = 64;
+
+private:
+    int slotFor(int nodeId) const;
+    void addEdge(int sourceNodeId, int destNodeId, bool sidechain);
+    void orderEdge(int source, int dest);
+    void compactProcessOrder();
+    void refreshFusedIn(int slot);
+    void refreshDestinationsFusedIn(int slot);
+    void processNode(int slot);
+    void processFusedChain(int firstStage);
+    void fadeOutSkippedBlock(AudioBuffer& graphOutputBuffer);
+
+    std::recursive_mutex graphMutex;
+    AudioContext preparedContext {};
+    bool hasPreparedContext = false;
+    std::atomic<Quality> quality { Quality::Full };
+    std::atomic<int> skippedBlocks { 0 };
+    Quality appliedQuality = Quality::Full;
+    std::vector<const AudioBuffer*> inputScratch; // Reused every block to avoid allocating on the audio thread.
+
+    // Audio thread only. Where the last block ended per channel, so a skipped block can ramp
+    // down from there, and whether the next one has to ramp back up.
+    static constexpr int skipFadeFrames = 64;
+    std::vector<float> lastOutputFrame;
+    bool fadeInNext = false;
+
+    // Scratch for orderEdge, a node is visited when its stamp matches visitStamp.
+    std::vector<unsigned> visitStamps;
+    unsigned visitStamp = 0;
+    std::vector<int> forwardRegion, backwardRegion, regionPositions, searchStack;
 };
 
 } // namespace
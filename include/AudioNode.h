@@ -2,18 +2,109 @@
 #include "AudioBuffer.h"
 #include "AudioContext.h"
 #include <vector>
+#include <algorithm>
 #include <memory>
 
 namespace MittelVec {
 
+// How much work nodes may skip to keep up, lowest first. The engine's LoadGovernor steps
+// down this list when callbacks run close to their deadline, and each level keeps the
+// savings of the ones before it.
+enum class Quality {
+  Full,
+  LinearInterpolation, // Pitch shifters interpolate linearly instead of cubically.
+  NoVoiceFilters, // Sampler voices skip their filter.
+  ReducedPolyphony, // Samplers start new notes on half their voices.
+  VirtualVoices, // Quiet sampler voices keep time but aren't rendered.
+};
+
 class AudioNode {
 public:
   AudioNode(const AudioContext& context) : outputBuffer(context) {}
   virtual ~AudioNode() = default;
 
   virtual void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) = 0;
-  
+
+  // Whether the graph may skip process() while every input is silent, i.e. the node has no
+  // output of its own right now. Sources and nodes still ringing out (filter tails etc.) return false.
+  virtual bool canSleep() const { return false; }
+
+  // Nodes that work one sample at a time, in order and with no lookahead, can be fused: when they
+  // form a single-input/single-output chain the graph runs the whole chain a tile at a time,
+  // keeping intermediate samples in a small stack buffer instead of each node's outputBuffer.
+  virtual bool isFusable() const { return false; }
+
+  // Called by the graph, under its lock, when `source` stops feeding this node (disconnected or
+  // removed). For nodes that remember a source, its buffer address can be reused after this.
+  virtual void sourceDisconnected(const AudioNode& /*source*/) {}
+
+  // Process `numFrames` interleaved frames from `in` into `out` (they may alias).
+  // Only called when isFusable(), must do exactly what process() does for a single input.
+  virtual void processTile(const float* /*in*/, float* /*out*/, int /*numFrames*/) {}
+
+  // Called by the graph on the audio thread, between blocks, whenever the quality changes.
+  virtual void setQuality(Quality /*quality*/) {}
+
+  // Changing block size or sample rate on a running graph (AudioGraph::setAudioContext) is
+  // done in two steps. prepareAudioContext runs first, on the caller's thread while the old
+  // settings keep playing, and does anything slow (resampling, FFT setup). setAudioContext
+  // then runs under the graph lock between blocks and should only swap the results in and
+  // resize buffers. Overrides must call AudioNode::setAudioContext.
+  virtual void prepareAudioContext(const AudioContext& /*context*/) {}
+  virtual void setAudioContext(const AudioContext& context) { outputBuffer.setAudioContext(context); }
+
+  // Called by the graph on the last node of a fused chain, whose outputBuffer it wrote.
+  void finishFusedBlock() { silent = false; }
+
+  // True when outputBuffer is known to be all zeros after the last block.
+  bool isSilent() const { return silent; }
+
+  // Called by the graph. Inputs only contain non-silent buffers.
+  void processBlock(const std::vector<const AudioBuffer*>& inputs) {
+    wentSilent = false;
+    process(inputs, outputBuffer);
+    silent = wentSilent;
+  }
+
+  // Called by the graph instead of processBlock when the node can sleep.
+  void sleep() {
+    if (!silent) outputBuffer.clear();
+    silent = true;
+  }
+
   AudioBuffer outputBuffer;
+
+protected:
+  // For single input effects: returns the one signal to process.
+  // A single input is returned as is (no copy), several are summed into `scratch` (usually
+  // the node's own output buffer). Wide fan-in should go through a Mixer node instead.
+  static const AudioBuffer& mixInputs(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& scratch) {
+    if (inputs.size() == 1) return *inputs[0];
+    if (inputs.empty()) {
+      scratch.clear();
+      return scratch;
+    }
+
+    std::copy(inputs[0]->data.begin(), inputs[0]->data.end(), scratch.data.begin());
+    for (size_t n = 1; n < inputs.size(); ++n) {
+      const float* in = inputs[n]->data.data();
+      for (int i = 0; i < scratch.size(); ++i) {
+        scratch[i] += in[i];
+      }
+    }
+    return scratch;
+  }
+
+  // Call from process() when there's nothing to output this block.
+  // Only clears the buffer on the first silent block.
+  void outputSilence() {
+    if (!silent) outputBuffer.clear();
+    wentSilent = true;
+  }
+
+private:
+  bool silent = false;
+  bool wentSilent = false;
 };
 
 } // namespace
@@ -0,0 +1,81 @@
+#pragma once
+#include "Envelope.h"
+#include "Filter.h"
+#include "PitchShift.h"
+#include "ChannelDispatch.h"
+
+namespace MittelVec {
+
+/**
+ * Statically composed DSP chains.
+ * Each stage is a small value type with `void tick(float* frame, int numChannels)` that processes
+ * one interleaved frame in place, and `Chain<Stages...>::render` runs every stage on a frame
+ * before moving to the next one. The stage list is fixed at compile time, so there's no virtual
+ * dispatch and the compiler can inline the whole chain into one loop. The channel count is
+ * made a constant for common layouts (see dispatchChannels) so each stage's per-channel work
+ * vectorizes across the frame. `Chain<>` renders nothing at all.
+ *
+ * Stages only hold references/values, they're cheap to build per block.
+ * A PitchStage in front is the exception to frame by frame, see Chain<PitchStage, ...>.
+ */
+template <typename... Stages>
+struct Chain {
+  static void render(float* samples, int numFrames, int numChannels, Stages... stages) {
+    dispatchChannels(numChannels, [&](auto channels) {
+      for (int i = 0; i < numFrames; ++i) {
+        float* frame = samples + i * channels;
+        (stages.tick(frame, channels), ...);
+      }
+    });
+  }
+};
+
+template <>
+struct Chain<> {
+  static void render(float*, int, int) {}
+};
+
+struct PitchStage;
+
+// The pitch shifter renders several frames per pass (see PitchShiftProcessor::renderGroup),
+// ticking it a frame at a time throws that away. Nothing comes before it here, so it shifts
+// the whole block first and the stages after it go frame by frame as usual.
+template <typename... Stages>
+struct Chain<PitchStage, Stages...> {
+  static void render(float* samples, int numFrames, int numChannels, PitchStage pitch, Stages... stages);
+};
+
+struct GainStage {
+  float gain;
+  void tick(float* frame, int numChannels) const {
+    for (int ch = 0; ch < numChannels; ++ch) frame[ch] *= gain;
+  }
+};
+
+struct BiquadStage {
+  BiquadProcessor& filter;
+  void tick(float* frame, int numChannels) { filter.tick(frame, frame, numChannels); }
+};
+
+struct EnvelopeStage {
+  EnvelopeProcessor& envelope;
+  void tick(float* frame, int numChannels) {
+    // One envelope step per frame, shared by every channel.
+    const float level = envelope.getNextLevel();
+    for (int ch = 0; ch < numChannels; ++ch) frame[ch] *= level;
+  }
+};
+
+struct PitchStage {
+  PitchShiftProcessor& pitchShifter;
+  void tick(float* frame, int numChannels) { pitchShifter.tick(frame, frame, numChannels); }
+  void process(float* samples, int numFrames) { pitchShifter.process(samples, samples, numFrames); }
+};
+
+template <typename... Stages>
+void Chain<PitchStage, Stages...>::render(float* samples, int numFrames, int numChannels, PitchStage pitch, Stages... stages) {
+  pitch.process(samples, numFrames);
+  Chain<Stages...>::render(samples, numFrames, numChannels, stages...);
+}
+
+} // namespace
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace MittelVec {
+
+// Most channels per-channel DSP state is sized for (7.1).
+constexpr int maxDspChannels = 8;
+
+// For nodes with fixed size per-channel state, call wherever the channel count is set.
+inline void requireDspChannels(int numChannels, const char* what) {
+  if (numChannels > maxDspChannels) {
+    throw std::runtime_error(std::string(what) + " supports at most " + std::to_string(maxDspChannels) + " channels.");
+  }
+}
+
+/**
+ * Calls `fn(channels)` with the channel count as a compile time constant for the common
+ * layouts (mono, stereo, 5.1, 7.1) and as a plain int otherwise.
+ * Inner loops over `channels` then have a fixed trip count, so the compiler can unroll them
+ * and run the per-channel work side by side in SIMD lanes.
+ */
+template <typename Fn>
+inline void dispatchChannels(int numChannels, Fn&& fn) {
+  switch (numChannels) {
+    case 1: fn(std::integral_constant<int, 1>()); break;
+    case 2: fn(std::integral_constant<int, 2>()); break;
+    case 6: fn(std::integral_constant<int, 6>()); break;
+    case 8: fn(std::integral_constant<int, 8>()); break;
+    default: fn(numChannels); break;
+  }
+}
+
+} // namespace
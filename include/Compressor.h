@@ -0,0 +1,66 @@
+#pragma once
+#include "AudioNode.h"
+#include <atomic>
+
+namespace MittelVec {
+
+struct CompressorConfig {
+  float threshold = -20.0f; // dBFS.
+  float ratio = 4.0f;
+  float attack = 0.01f; // Seconds.
+  float release = 0.25f; // Seconds.
+  float makeup = 0.0f; // dB.
+};
+
+/**
+ * Peak compressor, or a ducker when keyed from a sidechain: music turned down under
+ * dialogue, say. The level is followed once per block and the gain ramps smoothly to its
+ * new value across the block, so there's no zipper noise and only a couple of exp/log calls
+ * per block.
+ *
+ * For a sidechain, connect the key node with graph.connectSidechain(keyId, compressorId)
+ * (it keeps playing as normal) and pass it to setSidechain. Every other input is what gets
+ * compressed. Disconnecting or removing the key goes back to keying off the input.
+ * Parameters can be changed from any thread while the graph is running.
+ */
+class Compressor : public AudioNode {
+public:
+  Compressor(const AudioContext& context, const CompressorConfig& config = {});
+
+  // nullptr keys off the input itself again.
+  void setSidechain(const AudioNode* source);
+
+  void setThreshold(float threshold);
+  void setRatio(float ratio);
+  void setAttack(float attack);
+  void setRelease(float release);
+  void setMakeup(float makeup);
+
+  // dB currently taken off (before makeup), for meters.
+  float getGainReduction() const { return gainReduction.load(std::memory_order_relaxed); }
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void sourceDisconnected(const AudioNode& source) override;
+  // Sleeps once it has fully released.
+  bool canSleep() const override { return envelope == 0.0f; }
+
+private:
+  float keyLevel(const AudioBuffer& key) const;
+  float followEnvelope(float level);
+
+  std::atomic<float> threshold;
+  std::atomic<float> ratio;
+  std::atomic<float> attack;
+  std::atomic<float> release;
+  std::atomic<float> makeup;
+  // The key's output buffer, not the node: process() compares it against the `inputs` pointers
+  // to tell the key apart from the signal being compressed.
+  std::atomic<const AudioBuffer*> sidechain { nullptr };
+  std::atomic<float> gainReduction { 0.0f };
+
+  float envelope = 0.0f; // Linear peak level.
+  float currentGain = 1.0f;
+  std::vector<const AudioBuffer*> mainInputs; // Reused every block.
+};
+
+} // namespace
@@ -0,0 +1,138 @@
+#pragma once
+#include "AudioNode.h"
+#include "FFT.h"
+#include "Realtime.h"
+#include "SampleData.h"
+#include <atomic>
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace MittelVec {
+
+/**
+ * Convolves its input with an impulse response (uniformly partitioned overlap-save).
+ * The IR is cut into partitions of one block (bufferSize rounded up to a power of two) and each
+ * partition's spectrum is precomputed. Every block costs one forward and one inverse FFT plus a
+ * complex multiply-add per partition, so cost grows with IR length but stays flat per block.
+ *
+ * Only the first `headPartitions` are done in the audio callback. An input only reaches the rest
+ * (the tail) `headPartitions` partitions after it arrives, so a worker thread works out its tail
+ * share straight away and the callback adds the finished sums when they're due. Long IRs then
+ * cost the callback about as much as short ones, and with the default two head partitions the
+ * worker has a partition to spare.
+ * The callback never waits on the worker. A sum that isn't finished in time is mixed in as soon
+ * as it is, late but not dropped, and if the worker falls a few partitions behind the callback
+ * does the tail for new input itself until it catches up. Rendering faster than real time
+ * (offline) can get ahead of the worker like that too, set headPartitions to cover the whole IR
+ * when output has to be sample exact.
+ *
+ * Outputs the wet signal only, connect the dry path alongside it (or use it on a send bus).
+ * No added latency when bufferSize is a power of two, otherwise one partition.
+ * Channels are convolved independently with the matching IR channel.
+ */
+class ConvolutionReverb : public AudioNode {
+public:
+  // Decodes the IR with miniaudio at the context's channel count and sample rate.
+  ConvolutionReverb(const AudioContext& context, const std::string& impulsePath, float gain = 1.0f, int headPartitions = 2);
+  ConvolutionReverb(const AudioContext& context, std::shared_ptr<const SampleData> impulse, float gain = 1.0f, int headPartitions = 2);
+  ~ConvolutionReverb() override;
+
+  void setGain(float gain);
+  int getLatencyFrames() const;
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+
+  // Sleeps once the tail has rung out and the state has been cleared.
+  bool canSleep() const override { return settled; }
+
+  // The IR is resampled and its spectra rebuilt for the new partition size up front,
+  // switching over drops whatever is still ringing out.
+  void prepareAudioContext(const AudioContext& context) override;
+  void setAudioContext(const AudioContext& context) override;
+
+private:
+  // What depends on the block size and sample rate. Built off the audio thread.
+  struct Layout {
+    std::shared_ptr<const SampleData> impulse;
+    int partitionFrames = 0;
+    int numPartitions = 0;
+    int irFrames = 0;
+    std::vector<std::complex<float>> irSpectra;
+  };
+
+  Layout buildLayout(const AudioContext& context, std::shared_ptr<const SampleData> impulse) const;
+  void useLayout(Layout layout, int bufferSize);
+  void stopWorker();
+
+  void convolvePartition();
+  void accumulateHead();
+  void mixTails();
+  void queueTail(const std::complex<float>* spectrum);
+  void addTail(const std::complex<float>* spectrum, int64_t input, std::vector<std::complex<float>>& sums, int numSums);
+  bool finishTails(int64_t until);
+  void tailWorker();
+  void clearState();
+
+  std::complex<float>* irSpectrum(int channel, int partition);
+  // All channels of entry `index` in a ring of `size` spectra.
+  std::complex<float>* spectra(std::vector<std::complex<float>>& ring, int64_t index, int size);
+
+  std::shared_ptr<const SampleData> impulse;
+  std::unique_ptr<Layout> pendingLayout;
+  int requestedHeadPartitions;
+
+  int channels;
+  int partitionFrames;
+  int numBins;
+  int numPartitions;
+  int headPartitions;
+  int tailPartitions; // numPartitions - headPartitions
+  int tailFrames; // How long output continues after the input stops.
+  bool zeroLatency;
+  FFT fft;
+  std::atomic<float> gain;
+
+  // The IR is [channel][partition][bin]. Rings are [entry][channel][bin], one entry per
+  // partition of input or output, found by its index modulo the ring size.
+  std::vector<std::complex<float>> irSpectra;
+  std::vector<std::complex<float>> headInputs; // The last headPartitions input spectra.
+  int64_t newestInput = -1; // Partitions are counted from the start.
+
+  std::vector<float> inputHistory; // [channel][2 * partitionFrames], previous then current partition.
+  std::vector<std::complex<float>> headSum; // [channel][bin]
+  std::vector<float> timeScratch;
+
+  // Interleaved partition FIFOs, so blocks don't have to line up with partitions.
+  std::vector<float> inputFifo;
+  std::vector<float> outputFifo;
+  int fifoPosition = 0;
+
+  int silentFrames = 0;
+  bool settled = true;
+
+  // Tail worker. The audio thread queues each input's spectrum, the worker adds it into the
+  // tail sums of the outputs it reaches and hands over each sum once no queued input can
+  // add to it any more. Neither side takes a lock, the counters say who owns what.
+  static constexpr int maxQueuedTails = 4;
+  std::thread worker;
+  WakeSignal workerWake;
+  std::atomic<bool> stopping { false };
+  std::vector<std::complex<float>> queuedInputs; // Ring of maxQueuedTails.
+  std::vector<int64_t> queuedIndices; // Which input each of those is.
+  std::atomic<int64_t> tailsQueued { 0 };
+  std::atomic<int64_t> tailsDone { 0 };
+  std::vector<std::complex<float>> workerSums; // Worker only, ring of tailPartitions outputs.
+  std::vector<std::complex<float>> finishedSums; // Ring of numFinishedSums outputs.
+  int numFinishedSums = 0;
+  std::atomic<int64_t> tailsFinished { 0 }; // Outputs below this are in finishedSums.
+  std::atomic<int64_t> tailsMixed { 0 }; // Outputs below this have been mixed.
+  // Tails the audio thread did itself while the queue was full, ring of numPartitions outputs.
+  std::vector<std::complex<float>> ownSums;
+  int64_t ownSumsUntil = 0;
+};
+
+} // namespace
@@ -2,6 +2,9 @@
 #include "AudioBuffer.h"
 #include "AudioContext.h"
 #include "AudioGraph.h"
+#include "InputNode.h"
+#include "LoadGovernor.h"
+#include "Realtime.h"
 #include "../miniaudio.h"
 
 namespace MittelVec {
@@ -10,23 +13,48 @@ struct CallbackData {
   AudioGraph* graph = nullptr;
   AudioBuffer* graphOutput = nullptr;
   AudioContext* globalContext = nullptr;
+  LoadGovernor* governor = nullptr;
+  CaptureInput* capture = nullptr;
 };
 
 class Engine {
 public:
-  Engine(AudioContext globalContext);
+  // Duplex also opens the default capture device, with as many channels as the output,
+  // and hands its audio to InputNodes built from capture.
+  Engine(AudioContext globalContext, bool duplex = false);
   ~Engine();
 
   AudioContext globalContext;
   AudioGraph graph;
   AudioBuffer output;
+  // Lowers the graph's quality when callbacks get close to their deadline.
+  LoadGovernor governor;
+  // Captured audio for the block being rendered, empty unless duplex.
+  CaptureInput capture;
 
   void start();
   void stop();
 
+  // Switches to a new block size and/or sample rate without rebuilding anything. The graph
+  // resamples and resizes everything while the current device keeps playing, then the
+  // device is restarted with the new settings (a short gap). The device may pick another
+  // block size, globalContext has the one in use afterwards.
+  void reconfigure(int bufferSize, float sampleRate);
+
+  // Locks all of the process's memory, now and later, so the callback never page faults on
+  // samples or graph memory that's gone idle. Off by default, it locks the whole game too.
+  // Needs a high enough RLIMIT_MEMLOCK (or privileges), false if refused. Use
+  // SamplePack::lockSampleMemory to lock just the samples.
+  bool lockMemory();
+  // For threads the callback waits on, e.g. convolution reverb tails. Set before building
+  // the graph. Miniaudio already runs the callback itself at high priority.
+  void setWorkerPriority(ThreadPriority priority);
+
 private:
   void initMiniaudio();
 
+  bool duplex;
+
   // Miniaudio
   ma_result result;
   ma_device_config config;
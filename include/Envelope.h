@@ -10,9 +10,11 @@ struct EnvConfig {
   float release;
 };
 
-class Envelope : public AudioNode {
+// ADSR state without an AudioNode around it (no output buffer).
+// Sampler voices own one of these only when the item has an envelope.
+class EnvelopeProcessor {
 public:
-  explicit Envelope(const AudioContext& context, const EnvConfig& config = { 0.01f, 0.1f, 0.8f, 0.2f }); // Revisit these defaults values.
+  explicit EnvelopeProcessor(float sampleRate, const EnvConfig& config = { 0.01f, 0.1f, 0.8f, 0.2f });
 
   enum State { Idle, Attack, Decay, Sustain, Release };
 
@@ -23,6 +25,28 @@ public:
   // void setSustain(float sustain);
   // void setRelease(float release);
 
+  float getNextLevel();
+  float getLevel() const { return currentLevel; }
+
+  void noteOn();
+  void noteOff();
+  void reset();
+  bool isActive() const;
+  // Keeps the current stage and level, only the rates change.
+  void setSampleRate(float sampleRate);
+
+private:
+  State state;
+  float attack, decay, sustain, release;
+  float sampleRate;
+  float currentLevel;
+  bool skipSustain = false; // hard coding this for now, may eventually find use case for noteOff/sustains.
+};
+
+class Envelope : public AudioNode {
+public:
+  explicit Envelope(const AudioContext& context, const EnvConfig& config = { 0.01f, 0.1f, 0.8f, 0.2f }); // Revisit these defaults values.
+
   float getNextLevel();
   
   void noteOn();
@@ -32,14 +56,16 @@ public:
 
   void virtual process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
 
+  // Keeps running while active so the envelope doesn't stall when its input goes quiet.
+  bool canSleep() const override { return !envelope.isActive(); }
+  bool isFusable() const override { return true; }
+  void processTile(const float* in, float* out, int numFrames) override;
+
   void applyToBuffer(AudioBuffer& buffer);
+  void setAudioContext(const AudioContext& context) override;
 
 private:
-  State state;
-  float attack, decay, sustain, release;
-  float sampleRate;
-  float currentLevel;
-  bool skipSustain = false; // hard coding this for now, may eventually find use case for noteOff/sustains.
+  EnvelopeProcessor envelope;
 };
 
 } // namespace
\ No newline at end of file
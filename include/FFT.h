@@ -0,0 +1,39 @@
+#pragma once
+#include <complex>
+#include <vector>
+
+namespace MittelVec {
+
+/**
+ * Radix-2 FFT for real signals.
+ * A real transform of `size` samples is done as a complex transform of size/2 plus a
+ * split step, so it costs about half a full complex FFT. Twiddles and the bit reversal
+ * table are built once in the constructor, forward/inverse don't allocate.
+ * Not thread safe, each thread needs its own instance (it keeps a scratch buffer).
+ */
+class FFT {
+public:
+  // `size` must be a power of two, at least 4.
+  explicit FFT(int size);
+
+  int getSize() const;
+  // Bins in a spectrum, DC through Nyquist.
+  int getNumBins() const;
+
+  // `size` real samples in, getNumBins() bins out.
+  void forward(const float* input, std::complex<float>* spectrum);
+  // getNumBins() bins in, `size` real samples out. Scaled so inverse(forward(x)) == x.
+  void inverse(const std::complex<float>* spectrum, float* output);
+
+private:
+  void transform(std::complex<float>* data, bool inverse) const;
+
+  int size;
+  int half;
+  std::vector<int> bitReverse;
+  std::vector<std::complex<float>> twiddles;     // e^(-2*pi*i*k/half), for the complex transform.
+  std::vector<std::complex<float>> realTwiddles; // e^(-2*pi*i*k/size), for the split step.
+  std::vector<std::complex<float>> scratch;
+};
+
+} // namespace
@@ -1,6 +1,7 @@
 #pragma once
 #include <vector>
 #include "AudioNode.h" // Assuming this defines AudioContext and AudioBuffer
+#include "ChannelDispatch.h"
 
 namespace MittelVec {
 
@@ -12,15 +13,45 @@ struct FilterConfig {
   float resonance = 0.707f; // Q
 };
 
-class Filter : public AudioNode {
+// Biquad state and coefficients, without an AudioNode around it (no output buffer).
+// Sampler voices own one of these only when the item has a filter.
+// Each channel has its own delay line, up to maxDspChannels (wider layouts are rejected).
+class BiquadProcessor {
 public:
-  Filter(const AudioContext& context, const FilterConfig& config);
+  BiquadProcessor(float sampleRate, const FilterConfig& config);
 
   void setParams(float cutoff, float resonance);
   void setMode(FilterMode mode);
-  
-  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
-  void applyToBuffer(AudioBuffer& buffer);
+  // Recalculates coefficients, the state carries on.
+  void setSampleRate(float sampleRate);
+  void reset();
+
+  // One interleaved frame through the filter (`in` and `out` may alias).
+  // Defined here so DSP chains can inline it, the channel loop is what gets vectorized.
+  void tick(const float* in, float* out, int numChannels) {
+    for (int ch = 0; ch < numChannels; ++ch) {
+      double x = in[ch];
+
+      // Difference Equation (Direct Form I)
+      double y = (b0 * x) + (b1 * z1_x[ch]) + (b2 * z2_x[ch]) - (a1 * z1_y[ch]) - (a2 * z2_y[ch]);
+
+      // Update state
+      z2_x[ch] = z1_x[ch];
+      z1_x[ch] = x;
+      z2_y[ch] = z1_y[ch];
+      z1_y[ch] = y;
+
+      out[ch] = static_cast<float>(y);
+    }
+  }
+
+  // `numFrames` interleaved frames, `in` and `out` may alias.
+  void process(const float* in, float* out, int numFrames, int numChannels);
+
+  // Snaps state that has decayed below `threshold` to zero (also keeps it out of denormals).
+  void settle(double threshold);
+  // True once the state is all zeros, i.e. the tail has rung out.
+  bool isSettled() const;
 
 private:
   void calculateCoefficients();
@@ -33,8 +64,31 @@ private:
   // Coefficients
   double b0 = 0, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
   
-  // State memory (Z-delay lines)
-  double z1_x = 0, z2_x = 0, z1_y = 0, z2_y = 0;
+  // State memory (Z-delay lines), one per channel.
+  double z1_x[maxDspChannels] = {}, z2_x[maxDspChannels] = {};
+  double z1_y[maxDspChannels] = {}, z2_y[maxDspChannels] = {};
+};
+
+class Filter : public AudioNode {
+public:
+  Filter(const AudioContext& context, const FilterConfig& config);
+
+  void setParams(float cutoff, float resonance);
+  void setMode(FilterMode mode);
+  
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void applyToBuffer(AudioBuffer& buffer);
+  // Filters `input` into `output`, they may be the same buffer.
+  void apply(const AudioBuffer& input, AudioBuffer& output);
+
+  // Sleeps once the tail has rung out.
+  bool canSleep() const override;
+  bool isFusable() const override { return true; }
+  void processTile(const float* in, float* out, int numFrames) override;
+  void setAudioContext(const AudioContext& context) override;
+
+private:
+  BiquadProcessor biquad;
 };
 
 } // namespace MittelVec
@@ -9,6 +9,9 @@ public:
 
     void setGain(float gain);
     void virtual process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+    bool canSleep() const override { return true; }
+    bool isFusable() const override { return true; }
+    void processTile(const float* in, float* out, int numFrames) override;
 
 private:
     float gain;
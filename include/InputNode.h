@@ -0,0 +1,30 @@
+#pragma once
+#include "AudioNode.h"
+
+namespace MittelVec {
+
+// What a duplex device captured for the block being rendered. Set by the engine's callback
+// right before processGraph and cleared after, so it never points at a stale callback buffer.
+struct CaptureInput {
+  const float* samples = nullptr; // Interleaved, same channel count as the graph.
+  int numFrames = 0;
+};
+
+/**
+ * Brings captured audio (mic, line in) into the graph, from the same callback it's rendered
+ * in, so there's no buffering between capture and output. Needs an Engine opened in duplex
+ * mode: graph.addNode<InputNode>(engine.capture).
+ * Like any node without destinations, an unconnected input goes straight to the output,
+ * mind the feedback.
+ */
+class InputNode : public AudioNode {
+public:
+  InputNode(const AudioContext& context, const CaptureInput& capture);
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+
+private:
+  const CaptureInput& capture;
+};
+
+} // namespace
@@ -0,0 +1,45 @@
+#pragma once
+#include "AudioContext.h"
+#include "AudioNode.h"
+#include <atomic>
+
+namespace MittelVec {
+
+/**
+ * Watches how long each callback takes against the block's deadline and picks a Quality.
+ * Load is smoothed with a fast attack and slow release, so one slow block is enough to
+ * react to but it takes a while of headroom to count as recovered. Quality steps down one
+ * level at a time while the load is above stepDownLoad, and back up one level at a time
+ * after it has stayed under stepUpLoad for about a second.
+ */
+class LoadGovernor {
+public:
+  explicit LoadGovernor(const AudioContext& context);
+
+  // Call from the audio thread once per block with the time spent rendering it.
+  // Returns the quality the next block should use.
+  Quality update(double seconds);
+
+  Quality getQuality() const { return quality.load(std::memory_order_relaxed); }
+  // Smoothed fraction of the block deadline spent rendering, 1 is a dropout.
+  float getLoad() const { return load.load(std::memory_order_relaxed); }
+
+  // Off means full quality always, load is still tracked.
+  void setEnabled(bool enabled);
+  void setAudioContext(const AudioContext& context);
+
+  float stepDownLoad = 0.8f;
+  float stepUpLoad = 0.5f;
+
+private:
+  double deadline; // Seconds per block.
+  int recoveryBlocks; // About a second of blocks.
+  float smoothedLoad = 0.0f;
+  int blocksAtLevel = 0;
+  int blocksWithHeadroom = 0;
+  std::atomic<bool> enabled { true };
+  std::atomic<Quality> quality { Quality::Full };
+  std::atomic<float> load { 0.0f };
+};
+
+} // namespace
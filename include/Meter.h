@@ -0,0 +1,65 @@
+#pragma once
+#include "AudioNode.h"
+#include "ChannelDispatch.h"
+#include <atomic>
+
+namespace MittelVec {
+
+// BS.1770's absolute gate, what a Meter reports as the loudness of silence.
+constexpr float meterSilenceLufs = -70.0f;
+
+// Levels from the last block a Meter processed.
+struct MeterReading {
+  int numChannels = 0;
+  float peak[maxDspChannels] = {}; // Linear, largest absolute sample.
+  float rms[maxDspChannels] = {}; // Linear.
+  // Short-term loudness (BS.1770, K-weighted over the last 3 seconds), all channels together.
+  // Only measured when the meter was built with loudness on, meterSilenceLufs otherwise.
+  float loudness = meterSilenceLufs;
+};
+
+/**
+ * Passes its input through unchanged and measures it: per channel peak and RMS every block,
+ * and optionally short-term loudness for ducking or a loudness UI. Any thread can call
+ * getReading() at any time, it never blocks or slows down the audio thread.
+ * Meters keep running while their input is silent so the reading drops to zero.
+ */
+class Meter : public AudioNode {
+public:
+  Meter(const AudioContext& context, bool measureLoudness = false);
+
+  // A consistent snapshot, never half of one block and half of the next.
+  MeterReading getReading() const;
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void setAudioContext(const AudioContext& context) override;
+
+private:
+  // One biquad of the K-weighting filter, state per channel.
+  struct KStage {
+    double b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+    double z1[maxDspChannels] = {}, z2[maxDspChannels] = {};
+  };
+
+  void measure(const AudioBuffer& input);
+  void measureLoudness(const AudioBuffer& input);
+  void setupLoudness(const AudioContext& context);
+  void publish(const MeterReading& reading);
+
+  bool loudnessEnabled;
+  KStage shelf; // Head response, +4dB above ~1.5kHz.
+  KStage highpass; // Takes out the lows, ~38Hz.
+  // K-weighted energy of each block in the window, summed over channels.
+  std::vector<double> blockEnergy;
+  size_t blockIndex = 0;
+  float loudness = meterSilenceLufs;
+
+  // Seqlock, odd while the audio thread is writing. Readers retry instead of waiting.
+  std::atomic<unsigned> sequence { 0 };
+  std::atomic<int> publishedChannels { 0 };
+  std::atomic<float> publishedPeak[maxDspChannels] = {};
+  std::atomic<float> publishedRms[maxDspChannels] = {};
+  std::atomic<float> publishedLoudness { meterSilenceLufs };
+};
+
+} // namespace
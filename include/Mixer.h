@@ -0,0 +1,38 @@
+#pragma once
+#include "AudioNode.h"
+#include <atomic>
+#include <unordered_map>
+
+namespace MittelVec {
+
+/**
+ * Sums any number of inputs, each with its own gain, plus a master gain.
+ * This is the node to use for buses (a pack's output, a group of sounds, etc.).
+ * Built for wide fan-in: inputs are mixed four at a time, so 100 samplers cost
+ * ~25 passes over the output buffer instead of 100, and there's no separate clear pass.
+ */
+class Mixer : public AudioNode {
+public:
+  explicit Mixer(const AudioContext& context, float gain = 1.0f);
+
+  void setGain(float gain);
+
+  // Gain for one source node's signal. Sources without one are mixed at unity.
+  // Giving a new source a gain while the graph is running needs graph.lockGraph(),
+  // changing an existing source's gain doesn't. Forgotten once the source is disconnected.
+  void setInputGain(const AudioNode* source, float gain);
+  float getInputGain(const AudioNode* source) const;
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void sourceDisconnected(const AudioNode& source) override;
+  bool canSleep() const override { return true; }
+
+private:
+  float gainFor(const AudioBuffer* input) const;
+
+  std::atomic<float> gain;
+  // Keyed by the source's output buffer, that's what process() gets handed.
+  std::unordered_map<const AudioBuffer*, std::atomic<float>> inputGains;
+};
+
+} // namespace
@@ -1,38 +1,104 @@
 #pragma once
 #include "AudioGraph.h"
 #include "Sampler.h"
-#include "Gain.h"
+#include "Mixer.h"
+#include "Compressor.h"
+#include "SampleData.h"
+#include "SampleLoader.h"
+#include "SendBuses.h"
+#include "SampleTrigger.h"
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <memory>
+#include <future>
 
 namespace MittelVec {
 
+class SampleBank;
+
 struct MusicCue {
   std::string slug;
   std::string fileName;
   bool loop;
   float gain;
+  SampleFormat storage;
+  SendLevels sends;
+  // Where the cue wraps, instead of the file's own loop or the whole file. A short loop after
+  // an intro keeps only one pass of the music in memory.
+  std::optional<SampleLoop> loopPoints;
 
   MusicCue(
     std::string slug,
     std::string fileName,
     bool loop = true,
-    float gain = 1.0f
-  ) : slug(slug), fileName(fileName), loop(loop), gain(gain) {}
+    float gain = 1.0f,
+    SampleFormat storage = SampleFormat::Float32,
+    SendLevels sends = {},
+    std::optional<SampleLoop> loopPoints = std::nullopt
+  ) : slug(slug), fileName(fileName), loop(loop), gain(gain), storage(storage), sends(std::move(sends)),
+      loopPoints(loopPoints) {}
 };
 
 class MusicCueOrchestrator {
 public:
   MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::string samplesDir);
 
+  // Builds the orchestrator from already decoded cues, one per cue in the same order.
+  MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::vector<std::shared_ptr<const SampleData>> samples);
+
+  // Points the cue samplers at data in a mapped sample bank.
+  MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, const SampleBank& bank);
+
+  // Decodes the cues in parallel on `loader`, then adds them to the graph in one edit.
+  static std::future<std::unique_ptr<MusicCueOrchestrator>> loadAsync(
+    SampleLoader& loader,
+    AudioGraph& graph,
+    std::vector<MusicCue> cues,
+    std::string samplesDir,
+    LoadProgressCallback onProgress = nullptr
+  );
+
+  // Resolve a cue's slug once, invalidSampleHandle if there's no such cue.
+  SampleHandle getCueHandle(const std::string& slug) const;
+
+  // Stopping the current cue and starting the next go out as one batch, so they land in
+  // the same block. Both are from the game thread.
+  void playCue(SampleHandle cue);
   void playCue(const std::string& slug);
   void stopCue();
 
+  // Shared effect that cues send to by `name` (see MusicCue::sends), returned with the cues' output.
+  template <typename EffectType, typename... Args>
+  EffectType* addSendBus(const std::string& name, Args&&... args) {
+    auto effect = std::make_unique<EffectType>(graph.audioContext, std::forward<Args>(args)...);
+    EffectType* effectPtr = effect.get();
+    sends.addBus(name, std::move(effect));
+    return effectPtr;
+  }
+
+  void setSendLevel(const std::string& slug, const std::string& bus, float level);
+
+  // Turns the music down while `keyNodeId` (dialogue, a loud SFX bus) is playing, through a
+  // Compressor after the cues' output. The key keeps playing as normal. Calling again moves
+  // the ducking to another key and applies `config`. Throws if there's no such node.
+  // The defaults take about 15dB off under dialogue peaking around -10dBFS.
+  Compressor* duckUnder(int keyNodeId, const CompressorConfig& config = { -30.0f, 4.0f, 0.05f, 0.5f, 0.0f });
+
+  // See SamplePack::lockSampleMemory.
+  bool lockSampleMemory();
+
 private:
   AudioGraph& graph;
-  std::unordered_map<std::string, Sampler*> samplers;
-  std::string currentCueSlug;
+  SendBuses sends;
+  std::unordered_map<std::string, SampleHandle> handles;
+  std::vector<Sampler*> samplers; // By handle.
+  SampleTriggerNode* triggers = nullptr;
+  int outputNodeId = -1;
+  int duckerNodeId = -1;
+  int duckKeyNodeId = -1;
+  Compressor* ducker = nullptr;
+  SampleHandle currentCue = invalidSampleHandle;
 };
 
 } // namespace MittelVec
\ No newline at end of file
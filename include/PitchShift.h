@@ -1,30 +1,84 @@
 #pragma once
 #include "AudioNode.h"
+#include "ChannelDispatch.h"
+#include <array>
 
 namespace MittelVec {
 
-class PitchShift : public AudioNode {
+// The pitch shifter's state and DSP, without an AudioNode around it (no output buffer).
+// Sampler voices own one of these only when the item is pitch shifted.
+// The ring holds interleaved frames, every channel is read with the same taps and window.
+class PitchShiftProcessor {
 public:
-  explicit PitchShift(const AudioContext& context, int semitoneShift);
+  PitchShiftProcessor(const AudioContext& context, int semitoneShift);
 
-  void virtual process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
-  void applyToBuffer(AudioBuffer& buffer);
+  // One interleaved frame in, one out (`in` and `out` may alias). Slower per frame than process,
+  // which renders a group at a time. `numChannels` must be the context's channel count, it's a
+  // parameter so chains can make it a constant.
+  void tick(const float* in, float* out, int numChannels);
+  // `numFrames` interleaved frames, `in` and `out` may alias.
+  void process(const float* in, float* out, int numFrames);
   void setPitch(int semitoneShift);
   void reset();
+  int getRingFrames() const;
+  // Linear is cheaper but dulls the highs a little, used when the engine is under load.
+  void setCubicInterpolation(bool cubic);
+  // Resizes the ring for a new block size, which also clears it.
+  void setAudioContext(const AudioContext& context);
 
 private:
+  // Frames rendered per pass (see renderGroup).
+  static constexpr int groupFrames = 8;
+  static constexpr int guardFrames = 3;
+  // Shortest delay either tap reads at, so they (and the cubic's lookahead) always stay
+  // behind the frames a group has written.
+  static constexpr int minDelayFrames = 20;
+  // Leaves the taps a window of a few ms after minDelayFrames, much shorter and the shift
+  // turns into a buzz.
+  static constexpr int minRingFrames = 256;
+  static constexpr int hannTableSize = 1024;
+  // sin^2 over one period. Built when the library loads, not on the audio thread.
+  static const std::array<float, hannTableSize + 1> hannTable;
+
   // double samplePosition = 0.0;
   double currentDelay = 0.0;
   double ratio;
   std::vector<float> ringBuffer;
+  int ringFrames; // Power of two, not counting guard frames.
+  int windowFrames; // How far the taps sweep, see renderGroup.
+  int channels;
   int ringWriteIdx;
+  bool cubic = true;
 
-  float lerp(float a, float b, float fraction);
+  template <typename Channels>
+  void renderGroup(const float* in, float* out, int numFrames, Channels numChannels);
+  void writeFrame(const float* frame, int numChannels);
+  static std::array<float, hannTableSize + 1> buildHannTable();
+  static float hannWindow(float phase);
   float cubicInterpolation(float sm1, float s0, float s1, float s2, float fraction);
   // float sincInterpolation(const float* inputData, size_t numInputSamples, double position, int numTaps);
   double convertSemitoneToRatio(int semitoneShift);
-  float getLerpSample(double samplePosition);
-  float getCubicSample(double samplePosition);
+};
+
+class PitchShift : public AudioNode {
+public:
+  explicit PitchShift(const AudioContext& context, int semitoneShift);
+
+  void virtual process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void applyToBuffer(AudioBuffer& buffer);
+  // Shifts `input` into `output`, they may be the same buffer.
+  void apply(const AudioBuffer& input, AudioBuffer& output);
+  void setPitch(int semitoneShift);
+  void reset();
+  void setQuality(Quality quality) override;
+  void setAudioContext(const AudioContext& context) override;
+
+  // Sleeps once everything in the ring buffer is silence.
+  bool canSleep() const override;
+
+private:
+  PitchShiftProcessor shifter;
+  int silentFramesWritten = 0;
 };
 
 } // namespace
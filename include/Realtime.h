@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <thread>
+
+namespace MittelVec {
+
+/**
+ * Flushes denormals to zero (FTZ and DAZ) on the current thread while in scope.
+ * Filter and envelope tails decay into denormals, which are very slow on x86.
+ * The previous mode is restored on exit, so it's fine on threads we don't own.
+ * Does nothing on CPUs other than x86 with SSE and 64 bit ARM.
+ */
+class ScopedFlushDenormals {
+public:
+  ScopedFlushDenormals();
+  ~ScopedFlushDenormals();
+
+  ScopedFlushDenormals(const ScopedFlushDenormals&) = delete;
+  ScopedFlushDenormals& operator=(const ScopedFlushDenormals&) = delete;
+
+private:
+  unsigned long long previous = 0;
+};
+
+enum class ThreadPriority {
+  Normal,
+  // SCHED_FIFO (time critical on Windows), a little below the audio callback.
+  // Usually needs privileges, e.g. an rtprio limit on Linux.
+  Realtime,
+};
+
+// False if the OS refused.
+bool setThreadPriority(std::thread& thread, ThreadPriority priority);
+bool setCurrentThreadPriority(ThreadPriority priority);
+
+// Priority for worker threads the audio callback relies on (ConvolutionReverb's tail worker).
+// Picked up when they start, so set it before building the graph.
+void setWorkerThreadPriority(ThreadPriority priority);
+ThreadPriority getWorkerThreadPriority();
+
+// Hands work from the audio thread to a worker. signal() never locks or blocks (it posts a
+// semaphore), wait() blocks until signalled. A signal sent before the wait isn't lost.
+class WakeSignal {
+public:
+  WakeSignal();
+  ~WakeSignal();
+
+  WakeSignal(const WakeSignal&) = delete;
+  WakeSignal& operator=(const WakeSignal&) = delete;
+
+  void signal();
+  void wait();
+
+private:
+  void* semaphore = nullptr;
+};
+
+// Keeps a range in RAM. False if refused, e.g. over RLIMIT_MEMLOCK.
+bool lockMemory(const void* data, size_t bytes);
+void unlockMemory(const void* data, size_t bytes);
+// Everything mapped now and later, not available on Windows.
+bool lockProcessMemory();
+
+// Reads a byte from every page so it's mapped in now rather than on first use.
+void prefaultMemory(const void* data, size_t bytes);
+
+} // namespace
@@ -0,0 +1,71 @@
+#pragma once
+#include "AudioContext.h"
+#include "SampleData.h"
+#include "Realtime.h"
+#include "SamplePack.h"
+#include "MusicCueOrchestrator.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <optional>
+
+namespace MittelVec {
+
+/**
+ * Pre-decoded, pre-resampled samples in a single file.
+ * `write` is the offline build step: it decodes every file a pack (or cue list) uses, at the
+ * engine's channel count and sample rate, in each item's storage format, and writes them
+ * with an index. At runtime the bank is memory mapped and samplers read straight out of
+ * the mapping, so loading does no decoding or copying and the OS shares the pages
+ * between processes using the same bank.
+ *
+ * Banks are native endian and tied to the channel count/sample rate they were built with.
+ */
+class SampleBank {
+public:
+  // Maps the bank. Throws if it can't be opened, is corrupt or was built for a different context.
+  SampleBank(const std::string& bankPath, const AudioContext& context);
+
+  // Returns the data for a file, sharing ownership of the mapping. Throws if it isn't in the bank.
+  std::shared_ptr<const SampleData> get(const std::string& fileName, SampleFormat storage = SampleFormat::Float32) const;
+  bool contains(const std::string& fileName, SampleFormat storage = SampleFormat::Float32) const;
+
+  // Build step. Returns false if any file failed to load or the bank couldn't be written.
+  static bool write(
+    const std::string& bankPath,
+    const AudioContext& context,
+    const std::vector<SamplePackItem>& samplePackItems,
+    const std::string& samplesDir
+  );
+  static bool write(
+    const std::string& bankPath,
+    const AudioContext& context,
+    const std::vector<MusicCue>& cues,
+    const std::string& samplesDir
+  );
+  static bool write(
+    const std::string& bankPath,
+    const AudioContext& context,
+    const std::vector<SampleRequest>& files, // paths relative to samplesDir
+    const std::string& samplesDir
+  );
+
+private:
+  struct MappedFile;
+  struct Entry {
+    SampleFormat format;
+    int numSamples;
+    const void* data;
+    const void* blockHeaders;
+    std::optional<SampleLoop> loop; // From the file's smpl chunk.
+  };
+
+  static std::string entryKey(const std::string& fileName, SampleFormat storage);
+
+  AudioContext context;
+  std::shared_ptr<MappedFile> mapping;
+  std::unordered_map<std::string, Entry> entries;
+};
+
+} // namespace MittelVec
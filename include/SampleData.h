@@ -0,0 +1,126 @@
+#pragma once
+#include "AudioContext.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <optional>
+
+namespace MittelVec {
+
+// How a decoded sample is kept in memory.
+// Everything is still decoded/resampled to the output format at load time,
+// only the in-memory representation changes.
+enum class SampleFormat {
+  Float32,  // 4 bytes per sample, no conversion while rendering.
+  Int16,    // 2 bytes per sample, converted to float while rendering.
+  ImaAdpcm  // ~4 bits per sample, block decoded while rendering.
+};
+
+// A loop inside a sample. In seconds so the points stay put when a sample is resampled,
+// for frame exact points divide the frame by the file's sample rate.
+struct SampleLoop {
+  double start = 0.0;
+  double end = 0.0; // 0 is the end of the sample.
+  // Fades the end of the loop into what comes before its start, so the wrap doesn't click.
+  // Needs that much audio before the start, it's shortened if there isn't.
+  double crossfade = 0.0;
+};
+
+class SampleData {
+public:
+  SampleData(const AudioContext& context, SampleFormat format = SampleFormat::Float32);
+  ~SampleData();
+
+  // Convenience for loaders, always returns data (empty if the file failed to load).
+  static std::shared_ptr<const SampleData> fromFile(const AudioContext& context, const std::string& path, SampleFormat format);
+
+  // Decode a file with miniaudio at the context's channel count and sample rate.
+  // Also picks up the first loop of a WAV's smpl chunk, if it has one.
+  bool loadFile(const std::string& path);
+
+  // Store already decoded, interleaved float samples in this object's format.
+  void setSamples(const std::vector<float>& samples);
+
+  // Wraps already encoded data that lives elsewhere (e.g. a mapped bank file) without copying.
+  // `owner` keeps that memory alive for as long as the returned data is used.
+  static std::shared_ptr<const SampleData> fromEncoded(
+    const AudioContext& context,
+    SampleFormat format,
+    int numSamples,
+    const void* encodedData,
+    const void* blockHeaders,
+    std::shared_ptr<const void> owner,
+    std::optional<SampleLoop> loop = std::nullopt
+  );
+
+  // Copy of the first `count` samples (rounded up to a whole block for ADPCM), same format.
+  std::shared_ptr<const SampleData> copyPrefix(int count) const;
+
+  // Copy at another sample rate, same format and loop (cubic interpolation, no anti-aliasing filter).
+  // Slow, for reconfiguring a running graph, not for the audio thread.
+  std::shared_ptr<const SampleData> resampled(float newSampleRate) const;
+  static int resampledFrames(int numFrames, float fromRate, float toRate);
+
+  // Raw encoded bytes, in the layout fromEncoded expects. Block headers are empty unless ADPCM.
+  const void* getEncodedData() const;
+  size_t getEncodedSize() const;
+  const void* getBlockHeaders() const;
+  size_t getBlockHeadersSize() const;
+
+  // Read `count` interleaved samples starting at sample index `start` into `dest`, scaled by `gain`.
+  // Range must lie inside the sample.
+  void read(int start, float* dest, int count, float gain) const;
+
+  // Keeps the data in RAM until it's destroyed, so reading it never page faults.
+  // False if the OS refused (see lockMemory in Realtime.h).
+  bool lockMemory() const;
+
+  // Loop stored with the sample (from the file), samplers can override it.
+  const std::optional<SampleLoop>& getLoop() const { return loop; }
+  void setLoop(std::optional<SampleLoop> newLoop) { loop = newLoop; }
+
+  int size() const;
+  int getNumChannels() const;
+  int getNumFrames() const;
+  float getSampleRate() const;
+  SampleFormat getFormat() const;
+  size_t getMemoryUsage() const;
+
+  // Frames per independently decodable ADPCM block.
+  static constexpr int adpcmBlockFrames = 64;
+  static constexpr int maxChannels = 8;
+
+private:
+  struct AdpcmBlockHeader {
+    int16_t predictor;
+    uint8_t stepIndex;
+    uint8_t reserved = 0; // Keeps the layout explicit, headers get written to bank files.
+  };
+
+  void encodeAdpcm(const std::vector<float>& samples);
+  void decodeAdpcmBlock(int blockIndex, float* dest) const;
+  size_t encodedSizeFor(int sampleCount) const;
+  void pointAtOwnedData();
+
+  SampleFormat format;
+  int channels;
+  float sampleRate;
+  int numSamples;
+  std::optional<SampleLoop> loop;
+
+  // Owned storage, only one is used depending on format. Empty when wrapping external data.
+  std::vector<float> floatData;
+  std::vector<int16_t> int16Data;
+  std::vector<uint8_t> adpcmData; // 4 bit codes, per block then per channel.
+  std::vector<AdpcmBlockHeader> adpcmHeaders; // One per block per channel.
+
+  // What read() actually uses, points into the vectors above or into external memory.
+  const void* encoded = nullptr;
+  const AdpcmBlockHeader* blockHeaders = nullptr;
+  std::shared_ptr<const void> externalOwner;
+  mutable bool memoryLocked = false;
+};
+
+} // namespace MittelVec
@@ -0,0 +1,65 @@
+#pragma once
+#include "AudioContext.h"
+#include "SampleData.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+
+namespace MittelVec {
+
+struct SampleRequest {
+  std::string path;
+  SampleFormat storage = SampleFormat::Float32;
+};
+
+// Called with the number of decoded files so far and the total number of files.
+// Runs on a loader thread, keep it short and thread safe.
+using LoadProgressCallback = std::function<void(int loaded, int total)>;
+
+// One result per request, in request order. Requests for the same file/format share data.
+using LoadCompleteCallback = std::function<void(std::vector<std::shared_ptr<const SampleData>>)>;
+
+/**
+ * Small thread pool used to decode samples off the game/audio threads.
+ * A loader can be shared by any number of packs and orchestrators and must outlive their loads.
+ */
+class SampleLoader {
+public:
+  explicit SampleLoader(int numThreads = 0); // 0 picks a count from the hardware.
+  ~SampleLoader();
+
+  SampleLoader(const SampleLoader&) = delete;
+  SampleLoader& operator=(const SampleLoader&) = delete;
+
+  void enqueue(std::function<void()> job);
+
+  // Decodes every request in parallel. `onComplete` runs once, on whichever worker finishes last.
+  void loadBatch(
+    const AudioContext& context,
+    const std::vector<SampleRequest>& requests,
+    LoadCompleteCallback onComplete,
+    LoadProgressCallback onProgress = nullptr
+  );
+
+  // Synchronous version of loadBatch for the blocking constructors.
+  static std::vector<std::shared_ptr<const SampleData>> loadAll(
+    const AudioContext& context,
+    const std::vector<SampleRequest>& requests
+  );
+
+private:
+  void workerLoop();
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> jobs;
+  std::mutex jobsMutex;
+  std::condition_variable jobsAvailable;
+  bool stopping = false;
+};
+
+} // namespace MittelVec
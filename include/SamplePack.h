@@ -1,22 +1,36 @@
 #pragma once
 #include "./AudioGraph.h"
-#include "./Gain.h"
+#include "./Mixer.h"
 #include "./Sampler.h"
 #include "./Envelope.h"
 #include "./Filter.h"
+#include "./SampleData.h"
+#include "./SampleLoader.h"
+#include "./SampleResidency.h"
+#include "./SendBuses.h"
+#include "./SampleTrigger.h"
 #include <optional>
+#include <string>
+#include <memory>
+#include <future>
 
 namespace MittelVec {
 
+class SampleBank;
+
 struct SamplePackItem {
   std::string slug;
   std::string fileName;
   int polyphony;
   bool loop;
   float gain;
-  int pitchShift;
+  int pitchShift; // Nonzero also lets triggers shift the item further, see SampleTrigger.
   std::optional<EnvConfig> envConfig;
   std::optional<FilterConfig> filterConfig;
+  SampleFormat storage;
+  SendLevels sends;
+  // Where a looping item wraps, instead of the file's own loop or the whole sample.
+  std::optional<SampleLoop> loopPoints;
 
   // Constructor enforces required fields and default value for polyphony.
   SamplePackItem(
@@ -27,21 +41,102 @@ struct SamplePackItem {
     float gain = 1.0,
     int pitchShift = 0,
     std::optional<EnvConfig> env = std::nullopt,
-    std::optional<FilterConfig> filterConfig = std::nullopt
+    std::optional<FilterConfig> filterConfig = std::nullopt,
+    SampleFormat storage = SampleFormat::Float32,
+    SendLevels sends = {},
+    std::optional<SampleLoop> loopPoints = std::nullopt
   ) : slug(slug), fileName(fileName), polyphony(polyphony), loop(loop),
-      gain(gain), pitchShift(pitchShift), envConfig(env), filterConfig(filterConfig) {}
+      gain(gain), pitchShift(pitchShift), envConfig(env), filterConfig(filterConfig),
+      storage(storage), sends(std::move(sends)), loopPoints(loopPoints) {}
 };
 
 class SamplePack {
 public:
   SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, std::string samplesDir, float gain = 1.0);
-  void triggerSample(std::string slug);
+
+  // Builds the pack from already decoded samples, one per item in the same order.
+  SamplePack(
+    AudioGraph& graph,
+    std::vector<SamplePackItem> samplePackItems,
+    std::vector<std::shared_ptr<const SampleData>> samples,
+    float gain = 1.0
+  );
+
+  // Loads through a residency manager, which keeps the pack's sample memory under its budget.
+  SamplePack(
+    AudioGraph& graph,
+    std::vector<SamplePackItem> samplePackItems,
+    std::string samplesDir,
+    SampleResidency& residency,
+    float gain = 1.0
+  );
+
+  // Builds the pack from samples that may be managed by a SampleResidency, one per item.
+  SamplePack(
+    AudioGraph& graph,
+    std::vector<SamplePackItem> samplePackItems,
+    std::vector<std::shared_ptr<ResidentSample>> samples,
+    float gain = 1.0
+  );
+
+  // Points the pack's samplers at data in a mapped sample bank, no decoding or copying.
+  SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, const SampleBank& bank, float gain = 1.0);
+
+  // Decodes the items in parallel on `loader`, then adds the whole pack to the graph in one edit.
+  // The future is ready once the pack is live in the graph.
+  static std::future<std::unique_ptr<SamplePack>> loadAsync(
+    SampleLoader& loader,
+    AudioGraph& graph,
+    std::vector<SamplePackItem> samplePackItems,
+    std::string samplesDir,
+    float gain = 1.0,
+    LoadProgressCallback onProgress = nullptr
+  );
+
+  // Resolve a slug once and trigger by handle after, invalidSampleHandle if there's no such item.
+  // Handles follow the order of the pack's items.
+  SampleHandle getHandle(const std::string& slug) const;
+
+  // Triggers are queued and start at the next block. False if the queue is full, a handle
+  // isn't one of this pack's, or a pitch shift is asked of an item built without one.
+  bool triggerSample(SampleHandle handle, float gain = 1.0f, int pitchShift = 0);
+  bool releaseSample(SampleHandle handle);
+  // Fires the whole batch with one queue push, all or none of it.
+  bool triggerSamples(const SampleTrigger* triggers, size_t count);
+  bool triggerSamples(const std::vector<SampleTrigger>& triggers);
+
+  // Looks the slug up on every call, prefer handles for anything frequent.
+  void triggerSample(const std::string& slug);
+
+  // Adds a shared effect that items send to by `name` (see SamplePackItem::sends).
+  // It runs once per block for the whole pack and returns into `output`.
+  template <typename EffectType, typename... Args>
+  EffectType* addSendBus(const std::string& name, Args&&... args) {
+    auto effect = std::make_unique<EffectType>(graph.audioContext, std::forward<Args>(args)...);
+    EffectType* effectPtr = effect.get();
+    sends.addBus(name, std::move(effect));
+    return effectPtr;
+  }
+
+  void setSendLevel(const std::string& slug, const std::string& bus, float level);
+
+  // Keeps the pack's samples in RAM so triggers never page fault. False if the OS refused
+  // for any of them (see lockMemory in Realtime.h).
+  bool lockSampleMemory();
 
   std::unordered_map<std::string, Sampler*> samplers;
-  std::unique_ptr<Gain> output;
+  // Every sampler in the pack feeds this bus. The graph owns it.
+  Mixer* output = nullptr;
+  int outputNodeId = -1;
+
+  // Triggers queued per block, more than this between two blocks are dropped.
+  static constexpr size_t triggerQueueSize = 4096;
 
 private:
   AudioGraph& graph;
+  SendBuses sends;
+  std::unordered_map<std::string, SampleHandle> handles;
+  SampleTriggerNode* triggers = nullptr;
 };
 
 } // namespace
@@ -0,0 +1,126 @@
+#pragma once
+#include "AudioContext.h"
+#include "SampleData.h"
+#include "SampleLoader.h"
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace MittelVec {
+
+class SampleResidency;
+
+/**
+ * The sample data a Sampler plays from.
+ * The head (first block of frames) is always in memory so triggers start instantly. The rest
+ * (the body) can be evicted by a SampleResidency and is reloaded in the background the next
+ * time the sample is triggered. Body frames that aren't back yet play as silence.
+ * Samples that aren't managed by a SampleResidency simply stay fully resident.
+ */
+class ResidentSample : public std::enable_shared_from_this<ResidentSample> {
+public:
+  explicit ResidentSample(std::shared_ptr<const SampleData> data);
+  ~ResidentSample();
+
+  ResidentSample(const ResidentSample&) = delete;
+  ResidentSample& operator=(const ResidentSample&) = delete;
+
+  int size() const;
+  int getNumChannels() const;
+  bool isFullyResident() const;
+  int getUnderruns() const; // Reads that hit evicted frames.
+
+  // Audio thread. Same contract as SampleData::read.
+  void read(int start, float* dest, int count, float gain) const;
+
+  // Call on trigger (game thread) so the residency manager can mark it used and reload it.
+  void touch();
+  // Samplers hold a pin while any of their voices play the sample, so a long looping cue
+  // isn't evicted just because it was triggered a while ago. Any thread, never blocks.
+  void pin();
+  void unpin();
+
+  // Changing the sample rate of a running graph. prepareSampleRate resamples off the audio
+  // thread while the old data keeps playing, applySampleRate swaps the result in and must
+  // be called while nothing reads the sample (under the graph lock). Shared samples only
+  // do the work once.
+  void prepareSampleRate(float sampleRate);
+  void applySampleRate();
+  float getSampleRate() const;
+  const std::optional<SampleLoop>& getLoop() const { return loop; }
+
+  // Locks the head in RAM, and the rest too unless a SampleResidency manages it (that part
+  // comes and goes anyway). Stays locked across sample rate changes.
+  bool lockMemory();
+
+private:
+  friend class SampleResidency;
+
+  std::shared_ptr<const SampleData> head;
+  std::shared_ptr<const SampleData> full; // Owned by the manager side, guarded by its mutex.
+  std::atomic<const SampleData*> body { nullptr }; // What the audio thread reads, null when evicted.
+  mutable std::atomic<int> readers { 0 };
+  mutable std::atomic<int> underruns { 0 };
+  std::atomic<int> pins { 0 };
+  int numSamples;
+  int channels;
+  float sampleRate;
+  std::optional<SampleLoop> loop; // In seconds, so it's the same at any rate.
+
+  // Resampled by prepareSampleRate, waiting for applySampleRate.
+  std::shared_ptr<const SampleData> pendingHead;
+  std::shared_ptr<const SampleData> pendingFull;
+  bool memoryLocked = false;
+
+  // Set when managed. `context` is what the file is decoded at, reloads are resampled to
+  // sampleRate if that has changed since.
+  SampleResidency* residency = nullptr;
+  AudioContext context {};
+  std::string path;
+  SampleFormat storage = SampleFormat::Float32;
+  bool reloading = false;
+  std::list<ResidentSample*>::iterator lruPosition;
+};
+
+/**
+ * Keeps the evictable part of managed samples under a byte budget.
+ * Bodies are evicted least-recently-triggered first, skipping the sample being loaded or touched
+ * and any that are still playing (pinned). Those can push it over budget until they stop.
+ * Heads are always resident and aren't counted against the budget.
+ * Must outlive the samples it manages, and `loader` must outlive it.
+ */
+class SampleResidency {
+public:
+  SampleResidency(SampleLoader& loader, size_t budgetBytes, int headFrames = 16384);
+
+  // Decodes a file now and starts managing it. Same path/format pairs share one sample.
+  std::shared_ptr<ResidentSample> load(const AudioContext& context, const std::string& path, SampleFormat storage);
+
+  void setBudget(size_t budgetBytes);
+  size_t getBudget() const;
+  size_t getResidentBytes() const;
+
+private:
+  friend class ResidentSample;
+
+  void touch(ResidentSample* sample);
+  void forget(ResidentSample* sample);
+  void finishReload(ResidentSample* sample, std::shared_ptr<const SampleData> data);
+  void makeResident(ResidentSample* sample, std::shared_ptr<const SampleData> data);
+  void evict(ResidentSample* sample);
+  void enforceBudget(ResidentSample* keep);
+
+  SampleLoader& loader;
+  size_t budgetBytes;
+  size_t residentBytes = 0;
+  int headFrames;
+
+  mutable std::mutex mutex;
+  std::list<ResidentSample*> lru; // Most recently triggered at the front.
+  std::unordered_map<std::string, std::weak_ptr<ResidentSample>> samples;
+};
+
+} // namespace MittelVec
@@ -0,0 +1,75 @@
+#pragma once
+#include "AudioNode.h"
+#include <atomic>
+#include <vector>
+
+namespace MittelVec {
+
+class Sampler;
+
+// Compact id for a pack item or music cue, from SamplePack::getHandle etc. Index based,
+// so triggering by handle is an array lookup instead of hashing the slug.
+using SampleHandle = int;
+constexpr SampleHandle invalidSampleHandle = -1;
+
+struct SampleTrigger {
+  SampleHandle handle;
+  float gain = 1.0f; // On top of the item's own gain.
+  // Semitones on top of the item's own shift. Only items built with a pitch shift have a
+  // shifter on their voices, pushing a nonzero one for any other item fails.
+  int pitchShift = 0;
+  bool release = false; // noteOff instead of noteOn.
+};
+
+/**
+ * Single producer, single consumer ring of triggers, from the game thread to the audio thread.
+ * A batch is written and then published with one atomic store, so it's all seen at once.
+ */
+class TriggerQueue {
+public:
+  explicit TriggerQueue(size_t capacity);
+
+  // Producer side, one thread at a time. All or nothing, false if the batch doesn't fit.
+  bool push(const SampleTrigger* triggers, size_t count);
+
+  // Consumer side, calls `fn` for every trigger pushed so far.
+  template <typename Fn>
+  void drain(Fn&& fn) {
+    const size_t write = writeIndex.load(std::memory_order_acquire);
+    size_t read = readIndex.load(std::memory_order_relaxed);
+    for (; read != write; ++read) {
+      fn(ring[read & mask]);
+    }
+    readIndex.store(read, std::memory_order_release);
+  }
+
+private:
+  std::vector<SampleTrigger> ring;
+  size_t mask;
+  alignas(64) std::atomic<size_t> writeIndex { 0 };
+  alignas(64) std::atomic<size_t> readIndex { 0 };
+};
+
+/**
+ * Starts and stops a group's samplers from a TriggerQueue on the audio thread.
+ * It's connected to every sampler it triggers, so it runs first and triggers land in the
+ * same block. Outputs silence, the samplers never see it as an input.
+ */
+class SampleTriggerNode : public AudioNode {
+public:
+  // `samplers` is indexed by handle.
+  SampleTriggerNode(const AudioContext& context, std::vector<Sampler*> samplers, size_t capacity = 1024);
+
+  // From the game thread. Residency bookkeeping for the samples happens here too, so the
+  // audio thread never has to take the residency lock. False, with nothing queued, if the
+  // queue is full, any handle is out of range or asks for a pitch its sampler can't shift to.
+  bool push(const SampleTrigger* triggers, size_t count);
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+
+private:
+  std::vector<Sampler*> samplers;
+  TriggerQueue queue;
+};
+
+} // namespace
@@ -1,92 +1,200 @@
 #pragma once
 #include <list>
 #include <optional>
+#include <memory>
+#include <string>
 #include "AudioNode.h"
 #include "Envelope.h"
 #include "PitchShift.h"
 #include "Filter.h"
+#include "Chain.h"
+#include "SampleData.h"
+#include "SampleResidency.h"
 
 namespace MittelVec {
 
+struct SamplerVoice;
+
+// Where a looping sampler's voices wrap, as interleaved sample indices into the sample at its
+// current rate (see Sampler::setLoopPoints).
+struct LoopRegion {
+  int start = 0;
+  int end = 0;
+  int crossfade = 0; // Samples before `end` that fade into the ones before `start`.
+};
+
+// Runs a voice's DSP over `numFrames` interleaved frames in place.
+using VoiceChainFn = void (*)(SamplerVoice& voice, float* samples, int numFrames, int numChannels);
+
 // Consider making SamplerVoice its own class..
 struct SamplerVoice {
   int playheadIndex = 0;
   bool active = false;
+  float triggerGain = 1.0f; // Per trigger, on top of the sampler's gain.
+  int basePitch; // The item's own shift, per trigger pitch is added to it.
 
-  std::unique_ptr<Envelope> envelope;
-  std::unique_ptr<PitchShift> pitchShifter;
-  std::unique_ptr<Filter> filter;
+  // Only the processors the item is configured with exist, stored inline in the voice.
+  std::optional<EnvelopeProcessor> envelope;
+  std::optional<PitchShiftProcessor> pitchShifter;
+  std::optional<BiquadProcessor> filter;
 
   AudioBuffer voiceBuffer;
 
-  SamplerVoice(const AudioContext& context)
-    : voiceBuffer(context),
-    envelope(std::make_unique<Envelope>(context)),
-    pitchShifter(std::make_unique<PitchShift>(context, 0)),
-    filter(std::make_unique<Filter>(context, FilterConfig { FilterMode::Lowpass, 500.0f, 0.5f }))
-  {}
+  SamplerVoice(
+    const AudioContext& context,
+    int pitchShift,
+    const std::optional<EnvConfig>& envConfig,
+    const std::optional<FilterConfig>& filterConfig
+  ) : basePitch(pitchShift), voiceBuffer(context) {
+    if (envConfig.has_value()) envelope.emplace(context.sampleRate, *envConfig);
+    if (pitchShift != 0) pitchShifter.emplace(context, pitchShift);
+    if (filterConfig.has_value()) {
+      requireDspChannels(context.numChannels, "Sampler voice filter");
+      filter.emplace(context.sampleRate, *filterConfig);
+    }
+  }
 
-  void trigger() {
+  // Only voices of pitch shifted items have a shifter, others play at their own pitch.
+  void trigger(float gain = 1.0f, int semitones = 0) {
     playheadIndex = 0;
     active = true;
-    envelope->noteOn();
-    pitchShifter->reset();
+    triggerGain = gain;
+    if (envelope) envelope->noteOn();
+    if (pitchShifter) {
+      pitchShifter->setPitch(basePitch + semitones);
+      pitchShifter->reset();
+    }
   }
 
+  // `loop` is null for one shots. `crossfadeScratch` holds a block, only used in crossfades.
   void processVoice(
-    const AudioBuffer& sample,
+    const ResidentSample& sample,
     AudioBuffer& outputBuffer,
-    bool loop,
+    const LoopRegion* loop,
     float gain,
-    int pitchShift,
-    std::optional<EnvConfig> envConfig,
-    std::optional<FilterConfig> filterConfig
+    VoiceChainFn renderChain,
+    float* crossfadeScratch
   ) {
     if (!active) return;
-    
+
+    // Nothing to play if the sample failed to load.
+    if (sample.size() == 0) {
+      active = false;
+      return;
+    }
+
     voiceBuffer.clear();
-    for (int i = 0; i < voiceBuffer.size(); ++i) {
-      // If voice has reached the end of the sample.  
-      if (playheadIndex >= sample.size()) {
+    const int end = loop ? loop->end : sample.size();
+    const int fadeStart = loop ? loop->end - loop->crossfade : end;
+    int writeIndex = 0;
+    while (writeIndex < voiceBuffer.size()) {
+      // If voice has reached the end of the sample (or loop).
+      if (playheadIndex >= end) {
         if (loop) {
-          playheadIndex = 0;
-          if (envConfig.has_value()) envelope->noteOn();
+          // The envelope carries on, a held note just keeps going.
+          playheadIndex = wrapPlayhead(playheadIndex, *loop);
         } else {
-          if (envConfig.has_value()) envelope->reset();
+          if (envelope) envelope->reset();
           active = false;
           playheadIndex = 0;
           break;
         }
       }
 
-      // Write sample data into voiceBuffer.
-      voiceBuffer[i] = sample[playheadIndex++] * gain;
+      // Write sample data into voiceBuffer, converting from the sample's storage format.
+      // Stops at the crossfade, that part is read separately.
+      const int stop = playheadIndex < fadeStart ? fadeStart : end;
+      int count = std::min(voiceBuffer.size() - writeIndex, stop - playheadIndex);
+      if (playheadIndex < fadeStart) {
+        sample.read(playheadIndex, &voiceBuffer[writeIndex], count, gain * triggerGain);
+      } else {
+        readCrossfade(sample, *loop, &voiceBuffer[writeIndex], count, gain * triggerGain, crossfadeScratch);
+      }
+      playheadIndex += count;
+      writeIndex += count;
     }
 
-    // Apply per-voice DSP
-    if (pitchShift && pitchShift != 0) {
-      // This are probably being reset redundantly across processVoice calls.
-      // Should cache the values or something.
-      pitchShifter->setPitch(pitchShift);
-      pitchShifter->applyToBuffer(voiceBuffer);
+    // Apply per-voice DSP (pitch, envelope, filter) in one pass, see Sampler::selectVoiceChain.
+    renderChain(*this, voiceBuffer.data.data(), voiceBuffer.getNumFrames(), voiceBuffer.getNumChannels());
+
+    if (envelope && !envelope->isActive()) {
+      active = false;
+      playheadIndex = 0;
+    }
+
+    // Sum into main output buffer
+    outputBuffer += voiceBuffer;
+  }
+
+  // Moves the playhead and envelope on by a block without rendering anything, for voices
+  // too quiet to hear while the engine is under load.
+  void skipVoice(const ResidentSample& sample, const LoopRegion* loop) {
+    if (!active) return;
+
+    const int sampleSize = sample.size();
+    if (sampleSize == 0) {
+      active = false;
+      return;
+    }
+
+    playheadIndex += voiceBuffer.size();
+    if (playheadIndex >= (loop ? loop->end : sampleSize)) {
+      if (loop) {
+        playheadIndex = wrapPlayhead(playheadIndex, *loop);
+      } else {
+        if (envelope) envelope->reset();
+        active = false;
+        playheadIndex = 0;
+        return;
+      }
     }
 
-    if (envConfig.has_value()) {
-      envelope->applyToBuffer(voiceBuffer);
+    if (envelope) {
+      for (int i = 0; i < voiceBuffer.getNumFrames(); ++i) envelope->getNextLevel();
       if (!envelope->isActive()) {
         active = false;
         playheadIndex = 0;
       }
     }
+  }
 
-    if (filterConfig.has_value()) {
-      filter->setMode(filterConfig->mode);
-      filter->setParams(filterConfig->cutoff, filterConfig->resonance);
-      filter->applyToBuffer(voiceBuffer);
+  // New block size/sample rate. The playhead is moved to the same point in time of a
+  // sample resampled by `ratio` (new rate over old).
+  void setAudioContext(const AudioContext& context, double ratio, int sampleSize) {
+    voiceBuffer.setAudioContext(context);
+    if (envelope) envelope->setSampleRate(context.sampleRate);
+    if (pitchShifter) pitchShifter->setAudioContext(context);
+    if (filter) filter->setSampleRate(context.sampleRate);
+
+    const int channels = context.numChannels;
+    const int frame = static_cast<int>(playheadIndex / channels * ratio);
+    playheadIndex = std::min(frame * channels, sampleSize);
+  }
+
+  static int wrapPlayhead(int playhead, const LoopRegion& loop) {
+    return loop.start + (playhead - loop.start) % (loop.end - loop.start);
+  }
+
+  // `count` samples from the playhead, inside the crossfade, blended linearly from the loop's
+  // end into the same distance before its start. By the last frame it's all the audio just
+  // before the start, so wrapping there carries straight on.
+  void readCrossfade(const ResidentSample& sample, const LoopRegion& loop, float* dest, int count, float gain, float* scratch) const {
+    const int channels = sample.getNumChannels();
+    sample.read(playheadIndex, dest, count, gain);
+    sample.read(playheadIndex - (loop.end - loop.start), scratch, count, gain);
+
+    const float fadeFrames = static_cast<float>(loop.crossfade / channels);
+    const int firstFrame = (playheadIndex - (loop.end - loop.crossfade)) / channels;
+    for (int i = 0; i < count; ++i) {
+      const float t = (firstFrame + i / channels + 0.5f) / fadeFrames;
+      dest[i] += t * (scratch[i] - dest[i]);
     }
+  }
 
-    // Sum into main output buffer
-    outputBuffer += voiceBuffer;
+  // Roughly how loud the voice is right now, before the sample's own level.
+  float getLevel(float gain) const {
+    gain *= triggerGain;
+    return envelope ? gain * envelope->getLevel() : gain;
   }
 };
     
@@ -100,25 +208,90 @@ class Sampler : public AudioNode {
     float gain = 1.0f,
     int pitchShift = 0,
     std::optional<EnvConfig> envConfig = std::nullopt,
+    std::optional<FilterConfig> filterConfig = std::nullopt,
+    SampleFormat storage = SampleFormat::Float32
+  );
+
+  // Plays already decoded data, lets several samplers share one sample.
+  Sampler(
+    const AudioContext& context,
+    std::shared_ptr<const SampleData> sample,
+    int polyphony,
+    bool loop = false,
+    float gain = 1.0f,
+    int pitchShift = 0,
+    std::optional<EnvConfig> envConfig = std::nullopt,
+    std::optional<FilterConfig> filterConfig = std::nullopt
+  );
+
+  // Plays a sample whose memory may be managed by a SampleResidency.
+  Sampler(
+    const AudioContext& context,
+    std::shared_ptr<ResidentSample> sample,
+    int polyphony,
+    bool loop = false,
+    float gain = 1.0f,
+    int pitchShift = 0,
+    std::optional<EnvConfig> envConfig = std::nullopt,
     std::optional<FilterConfig> filterConfig = std::nullopt
   );
+  ~Sampler() override;
 
-  void noteOn();
+  // `gain` and `pitchShift` (semitones) apply to this note only, on top of the sampler's own.
+  // The pitch is ignored unless canPitchShift().
+  void noteOn(float gain = 1.0f, int pitchShift = 0);
   void noteOff();
+  // noteOn without the residency bookkeeping, which takes a lock. For the audio thread,
+  // whoever queued the trigger calls touchSample() instead (see SampleTriggerNode).
+  void startVoice(float gain = 1.0f, int pitchShift = 0);
+  void touchSample();
+  // Only samplers built with a pitch shift get a shifter on their voices. The rest skip
+  // it entirely, so they can't be shifted per note either.
+  bool canPitchShift() const { return pitchShift != 0; }
+  // See ResidentSample::lockMemory.
+  bool lockSampleMemory();
   SamplerVoice* allocateVoice();
+
+  // Where looping voices wrap, instead of the sample's own loop (a WAV's smpl chunk) or, without
+  // one, the whole sample. nullopt goes back to that. Only used when the sampler loops.
+  // Needs graph.lockGraph() while the graph is running.
+  void setLoopPoints(std::optional<SampleLoop> points);
+
+  // Picks the chain specialization for the configured stages. Unconfigured stages aren't
+  // compiled into it at all, so a voice with no pitch/envelope/filter renders nothing extra.
+  static VoiceChainFn selectVoiceChain(bool pitch, bool envelope, bool filter);
   
   void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  void setQuality(Quality quality) override;
+  // Resamples the sample, then swaps it in and resizes every voice.
+  void prepareAudioContext(const AudioContext& context) override;
+  void setAudioContext(const AudioContext& context) override;
   
   private:
+  // Voices quieter than this (about -60dB) are virtual at Quality::VirtualVoices.
+  static constexpr float virtualVoiceLevel = 0.001f;
+
+  // Works loopPoints (or the sample's loop) out in samples at the sample's current rate.
+  void updateLoopRegion();
+  // Pins the sample while any voice is active, see ResidentSample::pin.
+  void updateSamplePin();
+
   int polyphony;
-  AudioBuffer sample;
+  int voiceLimit; // Voices new notes may use, lowered under load.
+  Quality quality = Quality::Full;
+  std::shared_ptr<ResidentSample> sample;
+  bool pinsSample = false;
   std::vector<SamplerVoice> voices;
   std::list<SamplerVoice*> activeVoices; // indicies per voice of `voices` vector above.
   bool loop;
+  std::optional<SampleLoop> loopPoints;
+  LoopRegion loopRegion;
+  std::vector<float> crossfadeScratch; // A block, for voices in a loop crossfade.
   float gain;
   int pitchShift;
   std::optional<EnvConfig> envConfig;
   std::optional<FilterConfig> filterConfig;
+  VoiceChainFn voiceChain;
 };
     
 } // namespace
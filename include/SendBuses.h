@@ -0,0 +1,66 @@
+#pragma once
+#include "AudioGraph.h"
+#include "Mixer.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace MittelVec {
+
+// Per-item send levels, keyed by bus name. Items leave out the buses they don't use.
+using SendLevels = std::unordered_map<std::string, float>;
+
+/**
+ * Send/return buses for a group of sources (a pack's samplers, a set of cues).
+ * Each bus is a Mixer that sums every source at its own send level, feeding one shared
+ * effect node whose output is returned into the group's output bus. The effect runs
+ * once per block however many sources send to it, instead of once per source (or voice).
+ *
+ * A source joins a bus the first time its send level is above zero, so unused sends cost
+ * nothing. Sends are taken after the source's own gain (post-fader).
+ */
+class SendBuses {
+public:
+  explicit SendBuses(AudioGraph& graph);
+
+  // Where bus effects return to. Must be set before any bus is added.
+  void setReturnNode(int nodeId);
+
+  // Registers a source node and its initial send levels (including buses not added yet).
+  void addSource(const std::string& slug, int nodeId, const AudioNode* node, SendLevels levels);
+
+  // Adds a bus feeding `effect` and connects every source with a level for it, as one graph edit.
+  // Throws if the name is taken.
+  AudioNode* addBus(const std::string& name, std::unique_ptr<AudioNode> effect);
+
+  // Safe while the graph is running. Only locks the graph when a source first joins a bus.
+  void setSendLevel(const std::string& slug, const std::string& bus, float level);
+  float getSendLevel(const std::string& slug, const std::string& bus) const;
+
+  AudioNode* getEffect(const std::string& bus) const;
+
+private:
+  struct Source {
+    int nodeId;
+    const AudioNode* node;
+    SendLevels levels;
+  };
+
+  struct Bus {
+    int sendNodeId;
+    Mixer* send;
+    int effectNodeId;
+    AudioNode* effect;
+    std::unordered_set<std::string> connected; // Source slugs.
+  };
+
+  void connectSource(Bus& bus, const std::string& slug, const Source& source, float level);
+
+  AudioGraph& graph;
+  int returnNodeId = -1;
+  std::unordered_map<std::string, Source> sources;
+  std::unordered_map<std::string, Bus> buses;
+};
+
+} // namespace
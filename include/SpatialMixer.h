@@ -0,0 +1,85 @@
+#pragma once
+#include "AudioNode.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace MittelVec {
+
+// Where the listener is, and which way is their right (unit length).
+struct SpatialListener {
+  float x = 0.0f, y = 0.0f, z = 0.0f;
+  float rightX = 1.0f, rightY = 0.0f, rightZ = 0.0f;
+};
+
+/**
+ * Mixes many positioned sources (emitters) down to the output with distance attenuation
+ * and equal-power stereo panning.
+ * Emitter state is kept as structure-of-arrays, and gains for every emitter are worked out
+ * in one branch-free pass per block so the compiler can vectorize it. Each source is then
+ * downmixed to mono and mixed in with a gain ramp from last block's gains, so moving
+ * emitters don't click. Emitters past maxDistance (and ones whose source is silent) skip the
+ * downmix and mix. Their sources still render every block, so they're in the right place when
+ * they come back in range. To save that cost too, stop them from the game side.
+ *
+ * Attenuation is inverse distance, clamped: ref / (ref + rolloff * (d - ref)) for d >= ref.
+ * Panning goes to channels 0 and 1, mono contexts only get attenuation.
+ */
+class SpatialMixer : public AudioNode {
+public:
+  SpatialMixer(const AudioContext& context, float referenceDistance = 1.0f, float maxDistance = 100.0f, float rolloff = 1.0f);
+
+  // Makes `source` an emitter and returns its index. Emitters start at the listener.
+  // Like Mixer::setInputGain, needs graph.lockGraph() while the graph is running.
+  // Once the source is disconnected its emitter goes away and the index is reused.
+  int addEmitter(const AudioNode* source, float gain = 1.0f);
+  int getNumEmitters() const { return numEmitters; }
+
+  // Position/gain updates are safe from any thread and picked up at the next block.
+  void setEmitterPosition(int emitter, float x, float y, float z);
+  void setEmitterGain(int emitter, float gain);
+  // Positions for emitters [0, count) in one go, e.g. straight from a game's own SoA.
+  void setEmitterPositions(const float* x, const float* y, const float* z, int count);
+  void setListener(const SpatialListener& listener);
+
+  void process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) override;
+  bool canSleep() const override { return true; }
+  void sourceDisconnected(const AudioNode& source) override;
+  void setAudioContext(const AudioContext& context) override;
+
+private:
+  struct Emitters {
+    std::vector<float> x, y, z, gain;
+    void resize(size_t size);
+  };
+
+  void pullUpdates();
+  void computeGains();
+
+  int channels;
+  float referenceDistance;
+  float maxDistance;
+  float rolloff;
+  int numEmitters = 0;
+
+  // Written by the control thread under pendingMutex. The audio thread copies it
+  // into `live` when it can get the lock, otherwise it keeps last block's state.
+  Emitters pending;
+  SpatialListener pendingListener;
+  std::mutex pendingMutex;
+  std::atomic<bool> pendingDirty { false };
+
+  Emitters live;
+  SpatialListener listener;
+
+  // Per emitter gains, this block's targets and where last block ended.
+  std::vector<float> targetLeft, targetRight;
+  std::vector<float> previousLeft, previousRight;
+
+  std::unordered_map<const AudioBuffer*, int> emitterIndex; // By the source's output buffer.
+  std::vector<int> freeEmitters; // Indices of disconnected sources, silent until reused.
+  std::vector<float> monoScratch;
+};
+
+} // namespace
@@ -1,155 +1,497 @@
 #include "../include/AudioGraph.h"
 #include <algorithm>
-#include <unordered_set>
-#include <queue>
 #include <iostream>
+#include <stdexcept>
 
 namespace MittelVec {
 
 AudioGraph::AudioGraph(const AudioContext& context)
-  : audioContext(context), nextNodeId(0), isGraphDirty(true) {}
+  : audioContext(context), lastOutputFrame(context.numChannels, 0.0f) {}
 
-void AudioGraph::removeNode(int nodeId) {
-  if (nodes.find(nodeId) == nodes.end()) return;
+int AudioGraph::addNode(std::unique_ptr<AudioNode> node) {
+  auto lock = lockGraphFor({ node.get() });
+  int slot;
+  if (!freeSlots.empty()) {
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+  } else {
+    slot = static_cast<int>(slots.size());
+    if (slot > slotIndexMask) {
+      throw std::runtime_error("Audio graph is full.");
+    }
+    slots.emplace_back();
+    visitStamps.push_back(0);
+  }
+
+  // No edges yet, so the end of the order is as good as anywhere.
+  NodeSlot& entry = slots[slot];
+  entry.node = std::move(node);
+  if (appliedQuality != Quality::Full) entry.node->setQuality(appliedQuality);
+  entry.position = static_cast<int>(processOrder.size());
+  processOrder.push_back(slot);
+  numNodes++;
+  return (entry.generation << slotIndexBits) | slot;
+}
+
+std::unique_lock<std::recursive_mutex> AudioGraph::lockGraph() {
+  return std::unique_lock<std::recursive_mutex>(graphMutex);
+}
 
-  nodes.erase(nodeId);
-  connections.erase(nodeId);
-  reverseConnections.erase(nodeId);
+static bool sameAudioContext(const AudioContext& a, const AudioContext& b) {
+  return a.bufferSize == b.bufferSize && a.numChannels == b.numChannels && a.sampleRate == b.sampleRate;
+}
 
-  for (auto& pair : connections) {
-    auto& destinations = pair.second;
-    destinations.erase(std::remove(destinations.begin(), destinations.end(), nodeId), destinations.end());
+static bool behindAudioContext(const AudioNode& node, const AudioContext& context) {
+  const AudioBuffer& buffer = node.outputBuffer;
+  return buffer.getNumFrames() != context.bufferSize || buffer.getSampleRate() != context.sampleRate;
+}
+
+std::unique_lock<std::recursive_mutex> AudioGraph::lockGraphFor(const std::vector<AudioNode*>& nodes) {
+  auto lock = lockGraph();
+  std::vector<AudioNode*> behind;
+  for (;;) {
+    const AudioContext context = audioContext;
+    behind.clear();
+    for (AudioNode* node : nodes) {
+      if (behindAudioContext(*node, context)) behind.push_back(node);
+    }
+    if (behind.empty()) return lock;
+
+    // Prepare without the lock like a reconfiguration does, then swap in under it. Rare, and
+    // if the settings changed again meanwhile, go around once more.
+    lock.unlock();
+    for (AudioNode* node : behind) node->prepareAudioContext(context);
+    lock.lock();
+    if (sameAudioContext(context, audioContext)) {
+      for (AudioNode* node : behind) node->setAudioContext(context);
+      return lock;
+    }
   }
+}
+
+// Slot index for a live id, -1 for stale or made up ones.
+int AudioGraph::slotFor(int nodeId) const {
+  if (nodeId < 0) return -1;
+  const int slot = nodeId & slotIndexMask;
+  if (slot >= static_cast<int>(slots.size())) return -1;
+  const NodeSlot& entry = slots[slot];
+  if (!entry.node || entry.generation != (nodeId >> slotIndexBits)) return -1;
+  return slot;
+}
+
+AudioNode* AudioGraph::getNode(int nodeId) const {
+  int slot = slotFor(nodeId);
+  return slot < 0 ? nullptr : slots[slot].node.get();
+}
+
+static void eraseEdge(std::vector<int>& edges, int slot) {
+  edges.erase(std::remove(edges.begin(), edges.end(), slot), edges.end());
+}
+
+void AudioGraph::removeNode(int nodeId) {
+  // Destroyed once the lock is released, some nodes take a while (ConvolutionReverb joins its worker).
+  std::unique_ptr<AudioNode> removed;
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
+  const int slot = slotFor(nodeId);
+  if (slot < 0) return;
 
-  for (auto& pair : reverseConnections) {
-    auto& sources = pair.second;
-    sources.erase(std::remove(sources.begin(), sources.end(), nodeId), sources.end());
+  // Only the neighbours' edge lists need touching.
+  NodeSlot& entry = slots[slot];
+  std::vector<int> destinations = std::move(entry.destinations);
+  std::vector<int> sources = std::move(entry.sources);
+  for (int dest : destinations) {
+    eraseEdge(slots[dest].sources, slot);
+    slots[dest].node->sourceDisconnected(*entry.node);
+  }
+  for (int source : sources) {
+    eraseEdge(slots[source].destinations, slot);
+    eraseEdge(slots[source].sidechains, slot);
   }
 
-  isGraphDirty = true;
+  processOrder[entry.position] = -1;
+  numOrderHoles++;
+
+  removed = std::move(entry.node);
+  entry.destinations.clear();
+  entry.sources.clear();
+  entry.sidechains.clear();
+  entry.position = -1;
+  entry.fusedIn = false;
+  entry.generation = (entry.generation + 1) & generationMask;
+  freeSlots.push_back(slot);
+  numNodes--;
+
+  for (int dest : destinations) refreshFusedIn(dest);
+  for (int source : sources) refreshDestinationsFusedIn(source);
+
+  if (hasCycle) {
+    updateProcessOrder();
+  } else if (numOrderHoles > processOrder.size() / 2) {
+    compactProcessOrder();
+  }
 }
 
 void AudioGraph::connect(int sourceNodeId, int destNodeId) {
-  if (nodes.find(sourceNodeId) == nodes.end() || nodes.find(destNodeId) == nodes.end()) {
+  addEdge(sourceNodeId, destNodeId, false);
+}
+
+void AudioGraph::connectSidechain(int sourceNodeId, int destNodeId) {
+  addEdge(sourceNodeId, destNodeId, true);
+}
+
+void AudioGraph::addEdge(int sourceNodeId, int destNodeId, bool sidechain) {
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
+  const int source = slotFor(sourceNodeId);
+  const int dest = slotFor(destNodeId);
+  if (source < 0 || dest < 0) {
     return;
   }
 
-  connections[sourceNodeId].push_back(destNodeId);
-  reverseConnections[destNodeId].push_back(sourceNodeId);
-  isGraphDirty = true;
+  slots[source].destinations.push_back(dest);
+  if (sidechain) slots[source].sidechains.push_back(dest);
+  slots[dest].sources.push_back(source);
+  if (!hasCycle) {
+    orderEdge(source, dest);
+  }
+
+  refreshDestinationsFusedIn(source);
+  refreshFusedIn(dest);
 }
 
 void AudioGraph::disconnect(int sourceNodeId, int destNodeId) {
-  if (connections.count(sourceNodeId)) {
-    auto& destinations = connections[sourceNodeId];
-    destinations.erase(std::remove(destinations.begin(), destinations.end(), destNodeId), destinations.end());
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
+  const int source = slotFor(sourceNodeId);
+  const int dest = slotFor(destNodeId);
+  if (source < 0 || dest < 0) {
+    return;
   }
 
-  if (reverseConnections.count(destNodeId)) {
-    auto& sources = reverseConnections[destNodeId];
-    sources.erase(std::remove(sources.begin(), sources.end(), sourceNodeId), sources.end());
+  // Taking an edge away never breaks a topological order.
+  std::vector<int>& destinations = slots[source].destinations;
+  if (std::find(destinations.begin(), destinations.end(), dest) != destinations.end()) {
+    slots[dest].node->sourceDisconnected(*slots[source].node);
   }
+  eraseEdge(slots[source].destinations, dest);
+  eraseEdge(slots[source].sidechains, dest);
+  eraseEdge(slots[dest].sources, source);
+  refreshDestinationsFusedIn(source);
+  refreshFusedIn(dest);
 
-  isGraphDirty = true;
+  if (hasCycle) {
+    updateProcessOrder();
+  }
+}
+
+// Pearce-Kelly: after adding source -> dest, only nodes positioned between dest and source
+// can be out of order. Find the ones reachable from dest (forward) and the ones that reach
+// source (backward) within that window, then reuse their positions with the backward set
+// first. Cost is proportional to that region, not the graph.
+void AudioGraph::orderEdge(int source, int dest) {
+  const int lower = slots[dest].position;
+  const int upper = slots[source].position;
+  if (lower > upper) return; // Already in order.
+
+  ++visitStamp;
+  forwardRegion.clear();
+  backwardRegion.clear();
+
+  searchStack.assign(1, dest);
+  visitStamps[dest] = visitStamp;
+  while (!searchStack.empty()) {
+    int slot = searchStack.back();
+    searchStack.pop_back();
+    forwardRegion.push_back(slot);
+    for (int next : slots[slot].destinations) {
+      if (next == source) {
+        std::cerr << "Error: Cycle detected in the audio graph. Audio processing will be stopped." << std::endl;
+        hasCycle = true;
+        return;
+      }
+      if (visitStamps[next] != visitStamp && slots[next].position < upper) {
+        visitStamps[next] = visitStamp;
+        searchStack.push_back(next);
+      }
+    }
+  }
+
+  searchStack.assign(1, source);
+  visitStamps[source] = visitStamp;
+  while (!searchStack.empty()) {
+    int slot = searchStack.back();
+    searchStack.pop_back();
+    backwardRegion.push_back(slot);
+    for (int previous : slots[slot].sources) {
+      if (visitStamps[previous] != visitStamp && slots[previous].position > lower) {
+        visitStamps[previous] = visitStamp;
+        searchStack.push_back(previous);
+      }
+    }
+  }
+
+  auto byPosition = [this](int a, int b) { return slots[a].position < slots[b].position; };
+  std::sort(forwardRegion.begin(), forwardRegion.end(), byPosition);
+  std::sort(backwardRegion.begin(), backwardRegion.end(), byPosition);
+
+  regionPositions.clear();
+  for (int slot : backwardRegion) regionPositions.push_back(slots[slot].position);
+  for (int slot : forwardRegion) regionPositions.push_back(slots[slot].position);
+  std::sort(regionPositions.begin(), regionPositions.end());
+
+  size_t next = 0;
+  for (int slot : backwardRegion) slots[slot].position = regionPositions[next++];
+  for (int slot : forwardRegion) slots[slot].position = regionPositions[next++];
+  for (int slot : backwardRegion) processOrder[slots[slot].position] = slot;
+  for (int slot : forwardRegion) processOrder[slots[slot].position] = slot;
+}
+
+void AudioGraph::compactProcessOrder() {
+  processOrder.erase(std::remove(processOrder.begin(), processOrder.end(), -1), processOrder.end());
+  for (size_t i = 0; i < processOrder.size(); ++i) {
+    slots[processOrder[i]].position = static_cast<int>(i);
+  }
+  numOrderHoles = 0;
 }
 
 void AudioGraph::updateProcessOrder() {
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
   processOrder.clear();
-  if (nodes.empty()) {
-    isGraphDirty = false;
-    return;
-  }
+  numOrderHoles = 0;
 
-  // Map to store in-degrees of each node
-  std::unordered_map<int, int> inDegree;
-  for (const auto& pair : nodes) {
-    inDegree[pair.first] = 0;
+  std::vector<int> inDegree(slots.size(), 0);
+  for (size_t slot = 0; slot < slots.size(); ++slot) {
+    inDegree[slot] = static_cast<int>(slots[slot].sources.size());
   }
 
-  // Calculate in-degrees
-  for (const auto& pair : connections) {
-    for (int destNodeId : pair.second) {
-      inDegree[destNodeId]++;
+  // Start from the source nodes (in-degree 0)
+  for (size_t slot = 0; slot < slots.size(); ++slot) {
+    if (slots[slot].node && inDegree[slot] == 0) {
+      processOrder.push_back(static_cast<int>(slot));
     }
   }
 
-  // Initialize queue with nodes having an in-degree of 0 (our source nodes)
-  std::queue<int> queue;
-  for (const auto& pair : inDegree) {
-    if (pair.second == 0) {
-      queue.push(pair.first);
+  // Kahn's algorithm, using processOrder itself as the queue.
+  for (size_t next = 0; next < processOrder.size(); ++next) {
+    for (int neighbor : slots[processOrder[next]].destinations) {
+      if (--inDegree[neighbor] == 0) {
+        processOrder.push_back(neighbor);
+      }
     }
   }
 
-  // Process nodes using Kahn's algorithm
-  while (!queue.empty()) {
-    int nodeId = queue.front();
-    queue.pop();
-    processOrder.push_back(nodeId);
+  hasCycle = processOrder.size() != numNodes;
+  if (hasCycle) {
+    std::cerr << "Error: Cycle detected in the audio graph. Audio processing will be stopped." << std::endl;
+    return;
+  }
 
-    // Decrement inDegrees of neighboring nodes
-    if (connections.count(nodeId)) {
-      for (int neighbor : connections[nodeId]) {
-        inDegree[neighbor]--;
-        if (inDegree[neighbor] == 0) {
-          queue.push(neighbor);
-        }
-      }
+  for (size_t i = 0; i < processOrder.size(); ++i) {
+    slots[processOrder[i]].position = static_cast<int>(i);
+  }
+}
+
+// Fusion only depends on a node and its neighbours, so edits refresh it locally.
+void AudioGraph::refreshFusedIn(int slot) {
+  NodeSlot& entry = slots[slot];
+  entry.fusedIn = entry.node && entry.node->isFusable() && entry.sources.size() == 1
+    && slots[entry.sources[0]].destinations.size() == 1;
+}
+
+void AudioGraph::refreshDestinationsFusedIn(int slot) {
+  for (int dest : slots[slot].destinations) refreshFusedIn(dest);
+}
+
+void AudioGraph::processNode(int slot) {
+  const NodeSlot& entry = slots[slot];
+  AudioNode& node = *entry.node;
+
+  // Find inputs for the current node from its predecessors' output buffers.
+  // Silent inputs are left out so nothing downstream spends time mixing zeros.
+  std::vector<const AudioBuffer*>& inputs = inputScratch;
+  inputs.clear();
+  for (int source : entry.sources) {
+    const AudioNode& sourceNode = *slots[source].node;
+    if (!sourceNode.isSilent()) {
+      inputs.push_back(&sourceNode.outputBuffer);
     }
   }
 
-  // Check for cycles. If a cycle exists, the graph is invalid.
-  if (processOrder.size() != nodes.size()) {
-    std::cerr << "Error: Cycle detected in the audio graph. Audio processing will be stopped." << std::endl;
-    processOrder.clear(); // Clear the invalid processing order
+  // Skip nodes that have nothing to do, their output just stays cleared.
+  if (inputs.empty() && node.canSleep()) {
+    node.sleep();
+    return;
   }
 
-  isGraphDirty = false;
+  // Process the node
+  node.processBlock(inputs);
 }
 
+// Runs from the chain's first stage through every fused stage after it. Each later stage's
+// only input is the one before, so they can all go now, ahead of their own place in the order.
+void AudioGraph::processFusedChain(int firstStage) {
+  const AudioNode& head = *slots[slots[firstStage].sources[0]].node;
+
+  int lastStage = firstStage;
+  while (slots[lastStage].destinations.size() == 1 && slots[slots[lastStage].destinations[0]].fusedIn) {
+    lastStage = slots[lastStage].destinations[0];
+  }
+
+  // Silent input: run the stages one by one so tails ring out and idle stages sleep as usual.
+  // Same for layouts too wide for the tile, and lone stages, which gain nothing from fusing.
+  if (lastStage == firstStage || head.isSilent() || head.outputBuffer.getNumChannels() > maxDspChannels) {
+    for (int stage = firstStage;; stage = slots[stage].destinations[0]) {
+      processNode(stage);
+      if (stage == lastStage) break;
+    }
+    return;
+  }
+
+  // Stage by stage over one tile, then on to the next tile. Intermediate results stay
+  // in `tile` and only the last stage writes its outputBuffer.
+  const float* in = head.outputBuffer.data.data();
+  AudioNode* first = slots[firstStage].node.get();
+  AudioNode* last = slots[lastStage].node.get();
+  float* out = last->outputBuffer.data.data();
+  const int numFrames = last->outputBuffer.getNumFrames();
+  const int numChannels = last->outputBuffer.getNumChannels();
+  float tile[fusionTileFrames * maxDspChannels];
+
+  for (int frame = 0; frame < numFrames; frame += fusionTileFrames) {
+    const int count = std::min(fusionTileFrames, numFrames - frame);
+    const int offset = frame * numChannels;
+
+    first->processTile(in + offset, tile, count);
+    for (int stage = slots[firstStage].destinations[0]; stage != lastStage; stage = slots[stage].destinations[0]) {
+      slots[stage].node->processTile(tile, tile, count);
+    }
+    last->processTile(tile, out + offset, count);
+  }
+
+  last->finishFusedBlock();
+}
 
 void AudioGraph::processGraph(AudioBuffer& graphOutputBuffer) {
-  // If the graph structure has changed, recalculate the processing order.
-  if (isGraphDirty) {
-    updateProcessOrder();
+  // Never wait on an edit (it may be resizing buffers or swapping in a reconfiguration),
+  // a silent block is better than a late one.
+  std::unique_lock<std::recursive_mutex> lock(graphMutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    fadeOutSkippedBlock(graphOutputBuffer);
+    skippedBlocks.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  const Quality wantedQuality = quality.load(std::memory_order_relaxed);
+  if (wantedQuality != appliedQuality) {
+    appliedQuality = wantedQuality;
+    for (NodeSlot& entry : slots) {
+      if (entry.node) entry.node->setQuality(wantedQuality);
+    }
   }
 
-  // If the process order is empty (and there are nodes), it means a cycle was detected.
-  if (processOrder.empty() && !nodes.empty()) {
+  if (hasCycle) {
     graphOutputBuffer.clear();
+    std::fill(lastOutputFrame.begin(), lastOutputFrame.end(), 0.0f);
     return; // Output silence if graph is invalid
   }
 
-  // Process each node in the topologically sorted order
-  for (int nodeId : processOrder) {
-    auto& node = nodes[nodeId];
+  // The order is always current, edits keep it that way on their own thread.
+  for (int slot : processOrder) {
+    if (slot < 0) continue;
+    const NodeSlot& entry = slots[slot];
 
-    // Find inputs for the current node from its predecessors' output buffers
-    std::vector<const AudioBuffer*> inputs;
-    if (reverseConnections.count(nodeId)) {
-      for (int sourceId : reverseConnections[nodeId]) {
-        if (nodes.count(sourceId)) {
-          inputs.push_back(&(nodes[sourceId]->outputBuffer));
-        }
-      }
+    if (entry.fusedIn) {
+      // Later stages already ran with the first one.
+      if (slots[entry.sources[0]].fusedIn) continue;
+      processFusedChain(slot);
+    } else {
+      processNode(slot);
     }
-    // Process the node
-    node->process(inputs, node->outputBuffer);
   }
 
-  // Sum the outputs of all "terminal" nodes (nodes with no outgoing connections)
+  // Sum the outputs of all "terminal" nodes (nodes with no outgoing connections, sidechains aside)
   graphOutputBuffer.clear();
-  for (auto const& [nodeId, node] : nodes) {
-    if (connections.find(nodeId) == connections.end() || connections[nodeId].empty()) {
-      for (int i = 0; i < graphOutputBuffer.size(); ++i) {
-        graphOutputBuffer[i] += node->outputBuffer[i];
-      }
+  for (const NodeSlot& entry : slots) {
+    if (!entry.node || entry.destinations.size() != entry.sidechains.size() || entry.node->isSilent()) continue;
+
+    for (int i = 0; i < graphOutputBuffer.size(); ++i) {
+      graphOutputBuffer[i] += entry.node->outputBuffer[i];
+    }
+  }
+
+  // Back from a skipped block, ramp up from the silence instead of jumping in.
+  const int channels = std::min(graphOutputBuffer.getNumChannels(), static_cast<int>(lastOutputFrame.size()));
+  const int numFrames = graphOutputBuffer.getNumFrames();
+  if (fadeInNext) {
+    const int fadeFrames = std::min(skipFadeFrames, numFrames);
+    for (int i = 0; i < fadeFrames; ++i) {
+      const float level = (i + 1.0f) / fadeFrames;
+      for (int ch = 0; ch < channels; ++ch) graphOutputBuffer[i * graphOutputBuffer.getNumChannels() + ch] *= level;
+    }
+    fadeInNext = false;
+  }
+  if (numFrames > 0) {
+    for (int ch = 0; ch < channels; ++ch) {
+      lastOutputFrame[ch] = graphOutputBuffer[(numFrames - 1) * graphOutputBuffer.getNumChannels() + ch];
     }
   }
 }
 
+// The graph can't run, but cutting straight to zero would click. Ramp down from where the
+// last block ended instead, the next one ramps back up.
+void AudioGraph::fadeOutSkippedBlock(AudioBuffer& graphOutputBuffer) {
+  graphOutputBuffer.clear();
+  const int stride = graphOutputBuffer.getNumChannels();
+  const int channels = std::min(stride, static_cast<int>(lastOutputFrame.size()));
+  const int fadeFrames = std::min(skipFadeFrames, graphOutputBuffer.getNumFrames());
+  for (int i = 0; i < fadeFrames; ++i) {
+    const float level = 1.0f - (i + 1.0f) / fadeFrames;
+    for (int ch = 0; ch < channels; ++ch) graphOutputBuffer[i * stride + ch] = lastOutputFrame[ch] * level;
+  }
+  std::fill(lastOutputFrame.begin(), lastOutputFrame.end(), 0.0f);
+  fadeInNext = true;
+}
+
+void AudioGraph::setQuality(Quality newQuality) {
+  quality.store(newQuality, std::memory_order_relaxed);
+}
+
+Quality AudioGraph::getQuality() const {
+  return quality.load(std::memory_order_relaxed);
+}
+
+void AudioGraph::prepareAudioContext(AudioContext newContext) {
+  if (newContext.numChannels != audioContext.numChannels) {
+    throw std::runtime_error("Only the buffer size and sample rate of a running graph can change.");
+  }
+
+  std::vector<AudioNode*> nodes;
+  {
+    std::lock_guard<std::recursive_mutex> lock(graphMutex);
+    for (const NodeSlot& entry : slots) {
+      if (entry.node) nodes.push_back(entry.node.get());
+    }
+  }
+
+  // Without the lock, so the graph keeps playing at the old settings meanwhile.
+  for (AudioNode* node : nodes) {
+    node->prepareAudioContext(newContext);
+  }
+  preparedContext = newContext;
+  hasPreparedContext = true;
+}
+
 void AudioGraph::setAudioContext(AudioContext newContext)
 {
+  if (sameAudioContext(newContext, audioContext)) return;
+  if (!hasPreparedContext || !sameAudioContext(newContext, preparedContext)) {
+    prepareAudioContext(newContext);
+  }
+
+  // Every node switches between the same two blocks.
+  std::lock_guard<std::recursive_mutex> lock(graphMutex);
   audioContext = newContext;
+  hasPreparedContext = false;
+  for (NodeSlot& entry : slots) {
+    if (entry.node) entry.node->setAudioContext(newContext);
+  }
 }
 } // namespace
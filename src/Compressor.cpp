@@ -0,0 +1,116 @@
+#include "../include/Compressor.h"
+#include "../include/ChannelDispatch.h"
+#include <cmath>
+
+namespace MittelVec {
+
+Compressor::Compressor(const AudioContext& context, const CompressorConfig& config)
+  : AudioNode(context),
+    threshold(config.threshold),
+    ratio(config.ratio),
+    attack(config.attack),
+    release(config.release),
+    makeup(config.makeup)
+{
+  mainInputs.reserve(8);
+}
+
+void Compressor::setSidechain(const AudioNode* source) {
+  sidechain.store(source ? &source->outputBuffer : nullptr, std::memory_order_relaxed);
+}
+
+void Compressor::sourceDisconnected(const AudioNode& source) {
+  // Otherwise a node added later at the same address would become the key.
+  const AudioBuffer* key = &source.outputBuffer;
+  sidechain.compare_exchange_strong(key, nullptr, std::memory_order_relaxed);
+}
+
+void Compressor::setThreshold(float newThreshold) { threshold.store(newThreshold, std::memory_order_relaxed); }
+void Compressor::setRatio(float newRatio) { ratio.store(newRatio, std::memory_order_relaxed); }
+void Compressor::setAttack(float newAttack) { attack.store(newAttack, std::memory_order_relaxed); }
+void Compressor::setRelease(float newRelease) { release.store(newRelease, std::memory_order_relaxed); }
+void Compressor::setMakeup(float newMakeup) { makeup.store(newMakeup, std::memory_order_relaxed); }
+
+float Compressor::keyLevel(const AudioBuffer& key) const {
+  // Eight independent maxima so the loop vectorizes, then folded together.
+  constexpr int lanes = 8;
+  float peak[lanes] = {};
+  const float* in = key.data.data();
+  const int numSamples = key.size();
+
+  int i = 0;
+  for (; i + lanes <= numSamples; i += lanes) {
+    for (int lane = 0; lane < lanes; ++lane) {
+      peak[lane] = std::max(peak[lane], std::abs(in[i + lane]));
+    }
+  }
+  for (; i < numSamples; ++i) {
+    peak[0] = std::max(peak[0], std::abs(in[i]));
+  }
+  return *std::max_element(peak, peak + lanes);
+}
+
+float Compressor::followEnvelope(float level) {
+  // One pole per block, the time constants are in seconds whatever the block size.
+  const float blockSeconds = outputBuffer.getNumFrames() / outputBuffer.getSampleRate();
+  const float time = level > envelope ? attack.load(std::memory_order_relaxed) : release.load(std::memory_order_relaxed);
+  const float coefficient = time > 0.0f ? std::exp(-blockSeconds / time) : 0.0f;
+  envelope = level + coefficient * (envelope - level);
+
+  // Below -100dB counts as released, lets the graph put us to sleep.
+  if (envelope < 1e-5f) envelope = 0.0f;
+  return envelope;
+}
+
+void Compressor::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  // Split the sidechain off, it's only listened to. A silent sidechain isn't in inputs at all.
+  const AudioBuffer* sidechainBuffer = sidechain.load(std::memory_order_relaxed);
+  const AudioBuffer* key = nullptr;
+  mainInputs.clear();
+  for (const AudioBuffer* input : inputs) {
+    if (input == sidechainBuffer) {
+      key = input;
+    } else {
+      mainInputs.push_back(input);
+    }
+  }
+
+  const AudioBuffer* main = mainInputs.empty() ? nullptr : &mixInputs(mainInputs, outputBuffer);
+  if (!sidechainBuffer) key = main;
+
+  // Gain computer, in dB above the threshold.
+  const float envelopeLevel = followEnvelope(key ? keyLevel(*key) : 0.0f);
+  float reduction = 0.0f;
+  if (envelopeLevel > 0.0f) {
+    const float over = 20.0f * std::log10(envelopeLevel) - threshold.load(std::memory_order_relaxed);
+    const float currentRatio = std::max(1.0f, ratio.load(std::memory_order_relaxed));
+    if (over > 0.0f) reduction = over * (1.0f - 1.0f / currentRatio);
+  }
+  gainReduction.store(reduction, std::memory_order_relaxed);
+  const float targetGain = std::pow(10.0f, (makeup.load(std::memory_order_relaxed) - reduction) / 20.0f);
+
+  if (!main) {
+    currentGain = targetGain;
+    outputSilence();
+    return;
+  }
+
+  // Ramp linearly to the new gain over the block, the channel loop runs in SIMD lanes.
+  const int numFrames = outputBuffer.getNumFrames();
+  const float startGain = currentGain;
+  const float step = (targetGain - startGain) / numFrames;
+  const float* in = main->data.data();
+  float* out = outputBuffer.data.data();
+
+  dispatchChannels(outputBuffer.getNumChannels(), [&](auto channels) {
+    for (int i = 0; i < numFrames; ++i) {
+      const float gain = startGain + step * (i + 1);
+      for (int ch = 0; ch < channels; ++ch) {
+        out[i * channels + ch] = in[i * channels + ch] * gain;
+      }
+    }
+  });
+  currentGain = targetGain;
+}
+
+} // namespace
@@ -0,0 +1,366 @@
+#include "../include/ConvolutionReverb.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace MittelVec {
+
+// One block, rounded up to a power of two for the FFT.
+static int reverbPartitionFrames(int bufferSize) {
+  int frames = 16;
+  while (frames < bufferSize) frames *= 2;
+  return frames;
+}
+
+// acc += a * b over a whole spectrum, written out so it vectorizes (see FFT.cpp).
+static void multiplyAccumulate(const std::complex<float>* a, const std::complex<float>* b, std::complex<float>* acc, int numBins) {
+  for (int k = 0; k < numBins; ++k) {
+    acc[k] += std::complex<float>(
+      a[k].real() * b[k].real() - a[k].imag() * b[k].imag(),
+      a[k].real() * b[k].imag() + a[k].imag() * b[k].real()
+    );
+  }
+}
+
+ConvolutionReverb::ConvolutionReverb(const AudioContext& context, const std::string& impulsePath, float gain, int headPartitions)
+  : ConvolutionReverb(context, SampleData::fromFile(context, impulsePath, SampleFormat::Float32), gain, headPartitions) {}
+
+ConvolutionReverb::ConvolutionReverb(const AudioContext& context, std::shared_ptr<const SampleData> impulse, float gain, int headPartitions)
+  : AudioNode(context),
+    requestedHeadPartitions(headPartitions),
+    channels(context.numChannels),
+    fft(reverbPartitionFrames(context.bufferSize) * 2),
+    gain(gain)
+{
+  useLayout(buildLayout(context, std::move(impulse)), context.bufferSize);
+}
+
+ConvolutionReverb::~ConvolutionReverb() {
+  stopWorker();
+}
+
+ConvolutionReverb::Layout ConvolutionReverb::buildLayout(const AudioContext& context, std::shared_ptr<const SampleData> impulse) const {
+  Layout layout;
+  layout.impulse = std::move(impulse);
+  layout.partitionFrames = reverbPartitionFrames(context.bufferSize);
+  layout.irFrames = layout.impulse->getNumChannels() == channels ? layout.impulse->getNumFrames() : 0;
+  if (layout.irFrames == 0) return layout;
+
+  const int partitionFrames = layout.partitionFrames;
+  const int numBins = partitionFrames + 1;
+  layout.numPartitions = (layout.irFrames + partitionFrames - 1) / partitionFrames;
+  layout.irSpectra.resize(static_cast<size_t>(channels) * layout.numPartitions * numBins);
+
+  std::vector<float> ir(layout.impulse->size());
+  layout.impulse->read(0, ir.data(), layout.impulse->size(), 1.0f);
+
+  // Each IR partition zero padded to two partitions, so overlap-save's second half is linear convolution.
+  // Own FFT, this can run while the audio thread uses the member one.
+  FFT irFft(partitionFrames * 2);
+  std::vector<float> scratch(2 * partitionFrames);
+  for (int ch = 0; ch < channels; ++ch) {
+    for (int p = 0; p < layout.numPartitions; ++p) {
+      std::fill(scratch.begin(), scratch.end(), 0.0f);
+      for (int i = 0; i < partitionFrames; ++i) {
+        int frame = p * partitionFrames + i;
+        if (frame < layout.irFrames) scratch[i] = ir[frame * channels + ch];
+      }
+      irFft.forward(scratch.data(), &layout.irSpectra[(static_cast<size_t>(ch) * layout.numPartitions + p) * numBins]);
+    }
+  }
+  return layout;
+}
+
+// The worker must be stopped. Starts over with cleared state.
+void ConvolutionReverb::useLayout(Layout layout, int bufferSize) {
+  impulse = std::move(layout.impulse);
+  partitionFrames = layout.partitionFrames;
+  numBins = partitionFrames + 1;
+  numPartitions = layout.numPartitions;
+  zeroLatency = bufferSize == partitionFrames;
+  if (fft.getSize() != partitionFrames * 2) fft = FFT(partitionFrames * 2);
+
+  if (numPartitions == 0) {
+    printf("Convolution reverb has no usable impulse response, it will output silence.\n");
+    headPartitions = 0;
+    tailFrames = 0;
+    return;
+  }
+
+  headPartitions = std::clamp(requestedHeadPartitions, 1, numPartitions);
+  tailFrames = layout.irFrames + 2 * partitionFrames;
+
+  tailPartitions = numPartitions - headPartitions;
+  const size_t spectrumSize = static_cast<size_t>(channels) * numBins;
+  irSpectra = std::move(layout.irSpectra);
+  headInputs.assign(headPartitions * spectrumSize, std::complex<float>());
+  inputHistory.assign(static_cast<size_t>(channels) * 2 * partitionFrames, 0.0f);
+  headSum.assign(spectrumSize, std::complex<float>());
+  timeScratch.assign(2 * partitionFrames, 0.0f);
+  inputFifo.assign(static_cast<size_t>(channels) * partitionFrames, 0.0f);
+  outputFifo.assign(inputFifo.size(), 0.0f);
+  newestInput = -1;
+  fifoPosition = 0;
+  silentFrames = 0;
+  settled = true;
+
+  // Finished sums wait for their partition, at most headPartitions of them, or come in late
+  // behind at most a full queue's worth.
+  numFinishedSums = tailPartitions > 0 ? maxQueuedTails + headPartitions + 1 : 0;
+  queuedInputs.assign(tailPartitions > 0 ? maxQueuedTails * spectrumSize : 0, std::complex<float>());
+  queuedIndices.assign(tailPartitions > 0 ? maxQueuedTails : 0, 0);
+  workerSums.assign(tailPartitions * spectrumSize, std::complex<float>());
+  finishedSums.assign(numFinishedSums * spectrumSize, std::complex<float>());
+  ownSums.assign(tailPartitions > 0 ? numPartitions * spectrumSize : 0, std::complex<float>());
+  ownSumsUntil = 0;
+  tailsQueued.store(0);
+  tailsDone.store(0);
+  tailsFinished.store(0);
+  tailsMixed.store(0);
+
+  if (tailPartitions > 0) {
+    stopping.store(false);
+    worker = std::thread(&ConvolutionReverb::tailWorker, this);
+  }
+}
+
+void ConvolutionReverb::stopWorker() {
+  if (!worker.joinable()) return;
+  stopping.store(true);
+  workerWake.signal();
+  worker.join();
+}
+
+void ConvolutionReverb::prepareAudioContext(const AudioContext& context) {
+  auto resampled = impulse->getSampleRate() == context.sampleRate ? impulse : impulse->resampled(context.sampleRate);
+  pendingLayout = std::make_unique<Layout>(buildLayout(context, std::move(resampled)));
+}
+
+void ConvolutionReverb::setAudioContext(const AudioContext& context) {
+  AudioNode::setAudioContext(context);
+  const bool prepared = pendingLayout && pendingLayout->partitionFrames == reverbPartitionFrames(context.bufferSize)
+    && pendingLayout->impulse->getSampleRate() == context.sampleRate;
+  if (!prepared) prepareAudioContext(context);
+
+  stopWorker();
+  useLayout(std::move(*pendingLayout), context.bufferSize);
+  pendingLayout.reset();
+}
+
+void ConvolutionReverb::setGain(float newGain) {
+  gain.store(newGain, std::memory_order_relaxed);
+}
+
+int ConvolutionReverb::getLatencyFrames() const {
+  return zeroLatency ? 0 : partitionFrames;
+}
+
+std::complex<float>* ConvolutionReverb::irSpectrum(int channel, int partition) {
+  return &irSpectra[(static_cast<size_t>(channel) * numPartitions + partition) * numBins];
+}
+
+std::complex<float>* ConvolutionReverb::spectra(std::vector<std::complex<float>>& ring, int64_t index, int size) {
+  return &ring[static_cast<size_t>(index % size) * channels * numBins];
+}
+
+void ConvolutionReverb::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  if (numPartitions == 0 || (inputs.empty() && settled)) {
+    outputSilence();
+    return;
+  }
+
+  if (inputs.empty()) {
+    silentFrames += outputBuffer.getNumFrames();
+    // Clearing waits until the worker is done with the state and its late sums have been
+    // mixed, there's silence to render meanwhile.
+    const bool workerIdle = tailsDone.load(std::memory_order_acquire) == tailsQueued.load(std::memory_order_relaxed)
+      && tailsMixed.load(std::memory_order_relaxed) >= std::min(tailsFinished.load(std::memory_order_acquire), newestInput + 1);
+    if (silentFrames >= tailFrames && workerIdle) {
+      // Everything has rung out. Clear up so the graph can put us to sleep.
+      clearState();
+      outputSilence();
+      return;
+    }
+  } else {
+    silentFrames = 0;
+    settled = false;
+  }
+
+  const AudioBuffer& input = mixInputs(inputs, outputBuffer);
+  const float* in = input.data.data();
+  float* out = outputBuffer.data.data();
+  const int numFrames = outputBuffer.getNumFrames();
+
+  // Input is always copied into the FIFO before the same span of output is written,
+  // so it's fine for `input` to be outputBuffer.
+  for (int frame = 0; frame < numFrames;) {
+    const int count = std::min(numFrames - frame, partitionFrames - fifoPosition);
+    const int offset = fifoPosition * channels;
+    const int samples = count * channels;
+
+    std::copy(in + frame * channels, in + frame * channels + samples, &inputFifo[offset]);
+    fifoPosition += count;
+
+    // Blocks that are exactly one partition get their own output straight away.
+    // Otherwise output runs one partition behind.
+    const bool full = fifoPosition == partitionFrames;
+    if (full && zeroLatency) convolvePartition();
+    std::copy(&outputFifo[offset], &outputFifo[offset] + samples, out + frame * channels);
+    if (full && !zeroLatency) convolvePartition();
+    if (full) fifoPosition = 0;
+
+    frame += count;
+  }
+}
+
+void ConvolutionReverb::convolvePartition() {
+  const int64_t input = ++newestInput;
+  std::complex<float>* spectrum = spectra(headInputs, input, headPartitions);
+  const float outputGain = gain.load(std::memory_order_relaxed);
+
+  for (int ch = 0; ch < channels; ++ch) {
+    // Slide the history along a partition and append the new input.
+    float* history = &inputHistory[static_cast<size_t>(ch) * 2 * partitionFrames];
+    std::copy(history + partitionFrames, history + 2 * partitionFrames, history);
+    for (int i = 0; i < partitionFrames; ++i) {
+      history[partitionFrames + i] = inputFifo[i * channels + ch];
+    }
+    fft.forward(history, spectrum + static_cast<size_t>(ch) * numBins);
+  }
+
+  accumulateHead();
+
+  if (tailPartitions > 0) {
+    mixTails();
+    queueTail(spectrum);
+  }
+
+  for (int ch = 0; ch < channels; ++ch) {
+    fft.inverse(&headSum[static_cast<size_t>(ch) * numBins], timeScratch.data());
+
+    // Overlap-save: only the second half is valid output.
+    for (int i = 0; i < partitionFrames; ++i) {
+      outputFifo[i * channels + ch] = timeScratch[partitionFrames + i] * outputGain;
+    }
+  }
+}
+
+// Partitions [0, headPartitions) against the newest inputs.
+void ConvolutionReverb::accumulateHead() {
+  std::fill(headSum.begin(), headSum.end(), std::complex<float>());
+  for (int p = 0; p < headPartitions && p <= newestInput; ++p) {
+    const std::complex<float>* in = spectra(headInputs, newestInput - p, headPartitions);
+    for (int ch = 0; ch < channels; ++ch) {
+      const size_t offset = static_cast<size_t>(ch) * numBins;
+      multiplyAccumulate(irSpectrum(ch, p), in + offset, &headSum[offset], numBins);
+    }
+  }
+}
+
+// Adds the tail sums that are due, and any that finished late.
+void ConvolutionReverb::mixTails() {
+  const size_t spectrumSize = headSum.size();
+  const int64_t finished = tailsFinished.load(std::memory_order_acquire);
+  int64_t mixed = tailsMixed.load(std::memory_order_relaxed);
+  for (; mixed <= newestInput && mixed < finished; ++mixed) {
+    const std::complex<float>* sum = spectra(finishedSums, mixed, numFinishedSums);
+    for (size_t k = 0; k < spectrumSize; ++k) headSum[k] += sum[k];
+  }
+  tailsMixed.store(mixed, std::memory_order_release);
+
+  if (newestInput < ownSumsUntil) {
+    std::complex<float>* sum = spectra(ownSums, newestInput, numPartitions);
+    for (size_t k = 0; k < spectrumSize; ++k) headSum[k] += sum[k];
+    std::fill(sum, sum + spectrumSize, std::complex<float>());
+  }
+}
+
+void ConvolutionReverb::queueTail(const std::complex<float>* spectrum) {
+  const int64_t queued = tailsQueued.load(std::memory_order_relaxed);
+  if (queued - tailsDone.load(std::memory_order_acquire) >= maxQueuedTails) {
+    // The worker is well behind. Doing this one here costs the callback, but beats
+    // waiting on it or dropping the input's tail.
+    addTail(spectrum, newestInput, ownSums, numPartitions);
+    ownSumsUntil = newestInput + numPartitions;
+    // Still a partition mixed, see finishTails.
+    workerWake.signal();
+    return;
+  }
+
+  std::copy(spectrum, spectrum + headSum.size(), spectra(queuedInputs, queued, maxQueuedTails));
+  queuedIndices[queued % maxQueuedTails] = newestInput;
+  tailsQueued.store(queued + 1, std::memory_order_release);
+  workerWake.signal();
+}
+
+// Partitions [headPartitions, numPartitions) of one input, added into the sums of the outputs
+// they land on. The first is `input + headPartitions`, after that nothing older can add to it.
+void ConvolutionReverb::addTail(const std::complex<float>* spectrum, int64_t input, std::vector<std::complex<float>>& sums, int numSums) {
+  for (int p = headPartitions; p < numPartitions; ++p) {
+    std::complex<float>* sum = spectra(sums, input + p, numSums);
+    for (int ch = 0; ch < channels; ++ch) {
+      const size_t offset = static_cast<size_t>(ch) * numBins;
+      multiplyAccumulate(irSpectrum(ch, p), spectrum + offset, sum + offset, numBins);
+    }
+  }
+}
+
+// Hands the worker's sums for outputs below `until` to the audio thread. False when stopping.
+bool ConvolutionReverb::finishTails(int64_t until) {
+  const size_t spectrumSize = headSum.size();
+  int64_t output = tailsFinished.load(std::memory_order_relaxed);
+  if (output >= until) return true;
+  for (; output < until; ++output) {
+    // After a long stall (and a run of inputs the audio thread did itself) this can get a
+    // whole ring ahead of what's been mixed. The audio thread signals every partition and
+    // mixes everything that's due, so wait for it here rather than make it wait.
+    while (output - tailsMixed.load(std::memory_order_acquire) >= numFinishedSums) {
+      tailsFinished.store(output, std::memory_order_release);
+      workerWake.wait();
+      if (stopping.load()) return false;
+    }
+    std::complex<float>* sum = spectra(workerSums, output, tailPartitions);
+    std::copy(sum, sum + spectrumSize, spectra(finishedSums, output, numFinishedSums));
+    std::fill(sum, sum + spectrumSize, std::complex<float>());
+  }
+  tailsFinished.store(until, std::memory_order_release);
+  return true;
+}
+
+void ConvolutionReverb::tailWorker() {
+  // Same denormal handling as the callback, and may run at RT priority to keep up with it.
+  ScopedFlushDenormals flushDenormals;
+  setCurrentThreadPriority(getWorkerThreadPriority());
+
+  while (true) {
+    workerWake.wait();
+    if (stopping.load()) return;
+
+    // Signals can outnumber inputs (left over from before a restart), so go by the counters.
+    int64_t done = tailsDone.load(std::memory_order_relaxed);
+    while (done < tailsQueued.load(std::memory_order_acquire)) {
+      const int64_t input = queuedIndices[done % maxQueuedTails];
+      // Inputs the audio thread did itself leave gaps, those outputs are done too. They
+      // have to go before this input's tail wraps around onto their sums.
+      if (!finishTails(input + headPartitions)) return;
+      addTail(spectra(queuedInputs, done, maxQueuedTails), input, workerSums, tailPartitions);
+      if (!finishTails(input + headPartitions + 1)) return;
+      tailsDone.store(++done, std::memory_order_release);
+    }
+  }
+}
+
+// Only while the worker is idle, its sums are ours until the next input is queued.
+void ConvolutionReverb::clearState() {
+  std::fill(headInputs.begin(), headInputs.end(), std::complex<float>());
+  std::fill(inputHistory.begin(), inputHistory.end(), 0.0f);
+  std::fill(workerSums.begin(), workerSums.end(), std::complex<float>());
+  std::fill(finishedSums.begin(), finishedSums.end(), std::complex<float>());
+  std::fill(ownSums.begin(), ownSums.end(), std::complex<float>());
+  std::fill(inputFifo.begin(), inputFifo.end(), 0.0f);
+  std::fill(outputFifo.begin(), outputFifo.end(), 0.0f);
+  fifoPosition = 0;
+  silentFrames = 0;
+  settled = true;
+}
+
+} // namespace
@@ -1,4 +1,5 @@
 #include "../include/Engine.h"
+#include <chrono>
 #define MINIAUDIO_IMPLEMENTATION
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wall"
@@ -12,24 +13,39 @@ namespace MittelVec {
 void miniaudio_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount) {
   float* out = (float*)pOutput;
   CallbackData* cbData = (CallbackData*)pDevice->pUserData;
+  // Filter and envelope tails would otherwise spend their last moments as slow denormals.
+  ScopedFlushDenormals flushDenormals;
 
-  // Write graph data into graph output buffer.
+  // Duplex devices capture and play back the same number of frames, InputNodes read it in place.
+  if (pInput) {
+    cbData->capture->samples = (const float*)pInput;
+    cbData->capture->numFrames = static_cast<int>(frameCount);
+  }
+
+  // Write graph data into graph output buffer, timed for the load governor.
+  auto renderStart = std::chrono::steady_clock::now();
   cbData->graph->processGraph(*cbData->graphOutput);
+  std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - renderStart;
+  cbData->graph->setQuality(cbData->governor->update(renderTime.count()));
   
   // Copy graph output buffer into miniaudio output buffer.
   memcpy(out, (*cbData->graphOutput).data.data(), frameCount * cbData->globalContext->numChannels * sizeof(float));
+
+  // pInput is only valid during this callback.
+  cbData->capture->samples = nullptr;
+  cbData->capture->numFrames = 0;
   // std::copy((*cbData->graphOutput).data.begin(), (*cbData->graphOutput).data.end(), out);
   // for (ma_uint32 i = 0; i < frameCount * pDevice->playback.channels; i++) {
   //   out[i] = (*(cbData->graphOutput))[i];
   // }
-
-  (void)pInput; // unused
 }
 
-Engine::Engine(AudioContext globalContext)
+Engine::Engine(AudioContext globalContext, bool duplex)
   : globalContext(globalContext),
     graph(globalContext),
-    output(globalContext)
+    output(globalContext),
+    governor(globalContext),
+    duplex(duplex)
 {
   initMiniaudio();
 }
@@ -40,9 +56,14 @@ Engine::~Engine() {
 
 void Engine::initMiniaudio() {
   // Setup miniaudio
-  config = ma_device_config_init(ma_device_type_playback);
+  config = ma_device_config_init(duplex ? ma_device_type_duplex : ma_device_type_playback);
   config.playback.format    = ma_format_f32;
   config.playback.channels  = globalContext.numChannels;
+  if (duplex) {
+    // Miniaudio converts whatever the mic has to this.
+    config.capture.format   = ma_format_f32;
+    config.capture.channels = globalContext.numChannels;
+  }
   config.sampleRate         = static_cast<int>(globalContext.sampleRate);
   config.periodSizeInFrames = globalContext.bufferSize;
   config.dataCallback       = miniaudio_callback;
@@ -63,10 +84,12 @@ void Engine::initMiniaudio() {
       miniaudioBufferSize
     );
     globalContext.bufferSize = miniaudioBufferSize;
-    // Update graph and output buffer's audioContext
-    graph.setAudioContext(globalContext);
-    output.setAudioContext(globalContext);
   }
+
+  // Update graph and output buffer's audioContext, nothing to do unless it changed.
+  graph.setAudioContext(globalContext);
+  output.setAudioContext(globalContext);
+  governor.setAudioContext(globalContext);
 }
 
 void Engine::start() {
@@ -74,12 +97,39 @@ void Engine::start() {
   cbData.graph = &graph;
   cbData.graphOutput = &output;
   cbData.globalContext = &globalContext;
+  cbData.governor = &governor;
+  cbData.capture = &capture;
 
   if (ma_device_start(&device) != MA_SUCCESS) {
     assert(false);
   }
 }
 
+void Engine::reconfigure(int bufferSize, float sampleRate) {
+  AudioContext newContext { bufferSize, globalContext.numChannels, sampleRate };
+  graph.prepareAudioContext(newContext);
+
+  // Miniaudio fixes period size and rate at init, so the device has to be rebuilt.
+  const bool wasStarted = ma_device_is_started(&device);
+  ma_device_uninit(&device);
+  globalContext = newContext;
+  initMiniaudio();
+
+  if (wasStarted) start();
+}
+
+bool Engine::lockMemory() {
+  if (!lockProcessMemory()) {
+    printf("Couldn't lock the process's memory, it may be paged out while idle.\n");
+    return false;
+  }
+  return true;
+}
+
+void Engine::setWorkerPriority(ThreadPriority priority) {
+  setWorkerThreadPriority(priority);
+}
+
 void Engine::stop() {
   ma_device_uninit(&device);
 }
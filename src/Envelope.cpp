@@ -2,17 +2,16 @@
 
 namespace MittelVec {
 
-Envelope::Envelope(const AudioContext& context, const EnvConfig& config)
-  : AudioNode(context),
-    state(Idle),
+EnvelopeProcessor::EnvelopeProcessor(float sampleRate, const EnvConfig& config)
+  : state(Idle),
     attack(config.attack),
     decay(config.decay),
     sustain(config.sustain),
     release(config.release),
-    sampleRate(context.sampleRate),
+    sampleRate(sampleRate),
     currentLevel(0.0f) {}
 
-float Envelope::getNextLevel() {
+float EnvelopeProcessor::getNextLevel() {
   switch (state) {
   case Idle:
     break;
@@ -53,39 +52,65 @@ float Envelope::getNextLevel() {
   return currentLevel;
 }
 
-void Envelope::noteOn() {
+void EnvelopeProcessor::noteOn() {
   state = Attack;
   currentLevel = 0; // confirm this...
 }
 
-void Envelope::noteOff() {
+void EnvelopeProcessor::noteOff() {
   state = Release;
 }
 
-void Envelope::reset() {
+void EnvelopeProcessor::reset() {
   currentLevel = 0;
   state = Idle;
 }
 
-bool const Envelope::isActive() {
+bool EnvelopeProcessor::isActive() const {
   return state != Idle;
 }
 
+void EnvelopeProcessor::setSampleRate(float newSampleRate) {
+  sampleRate = newSampleRate;
+}
+
+Envelope::Envelope(const AudioContext& context, const EnvConfig& config)
+  : AudioNode(context), envelope(context.sampleRate, config) {}
+
+float Envelope::getNextLevel() {
+  return envelope.getNextLevel();
+}
+
+void Envelope::noteOn() {
+  envelope.noteOn();
+}
+
+void Envelope::noteOff() {
+  envelope.noteOff();
+}
+
+void Envelope::reset() {
+  envelope.reset();
+}
+
+bool const Envelope::isActive() {
+  return envelope.isActive();
+}
+
 void Envelope::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
-  if (inputs.empty()) return;
-  outputBuffer.clear();
+  const AudioBuffer& input = mixInputs(inputs, outputBuffer);
+  processTile(input.data.data(), outputBuffer.data.data(), outputBuffer.getNumFrames());
+}
 
-  // Sum all input buffers into the output buffer
-  for (const auto* inputBufferPtr : inputs) {
-    for (int i = 0; i < outputBuffer.size(); ++i) {
-      outputBuffer[i] += (*inputBufferPtr)[i];
+// The envelope steps once per frame, every channel in the frame gets the same level.
+void Envelope::processTile(const float* in, float* out, int numFrames) {
+  const int numChannels = outputBuffer.getNumChannels();
+  for (int i = 0; i < numFrames; ++i) {
+    const float level = envelope.getNextLevel();
+    for (int ch = 0; ch < numChannels; ++ch) {
+      out[i * numChannels + ch] = in[i * numChannels + ch] * level;
     }
   }
-
-  // Apply envelope to the summed signal
-  for (int i = 0; i < outputBuffer.size(); ++i) {
-    outputBuffer[i] *= getNextLevel();
-  }
 }
 
 /**
@@ -93,9 +118,12 @@ void Envelope::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffe
  * Allows for inline processing as opposed to more modular node/graph style `process` method approach.
  */
 void Envelope::applyToBuffer(AudioBuffer& buffer) {
-  for (int i = 0; i < buffer.size(); ++i) {
-    buffer[i] *= getNextLevel();
-  }
+  processTile(buffer.data.data(), buffer.data.data(), buffer.getNumFrames());
+}
+
+void Envelope::setAudioContext(const AudioContext& context) {
+  AudioNode::setAudioContext(context);
+  envelope.setSampleRate(context.sampleRate);
 }
 
 } // namespace MittelVec
\ No newline at end of file
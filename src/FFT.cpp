@@ -0,0 +1,113 @@
+#include "../include/FFT.h"
+#include <cassert>
+#include <cmath>
+#include <utility>
+
+namespace MittelVec {
+
+// Written out by hand, std::complex multiplication does inf/nan checks that stop it vectorizing.
+static inline std::complex<float> complexMultiply(std::complex<float> a, std::complex<float> b) {
+  return {
+    a.real() * b.real() - a.imag() * b.imag(),
+    a.real() * b.imag() + a.imag() * b.real()
+  };
+}
+
+FFT::FFT(int size) : size(size), half(size / 2) {
+  assert(size >= 4 && (size & (size - 1)) == 0);
+
+  const double pi = std::acos(-1.0);
+
+  bitReverse.resize(half);
+  int bits = 0;
+  while ((1 << bits) < half) ++bits;
+  for (int i = 0; i < half; ++i) {
+    int reversed = 0;
+    for (int b = 0; b < bits; ++b) {
+      if (i & (1 << b)) reversed |= 1 << (bits - 1 - b);
+    }
+    bitReverse[i] = reversed;
+  }
+
+  twiddles.resize(half / 2);
+  for (int k = 0; k < half / 2; ++k) {
+    double angle = -2.0 * pi * k / half;
+    twiddles[k] = { static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)) };
+  }
+
+  realTwiddles.resize(half + 1);
+  for (int k = 0; k <= half; ++k) {
+    double angle = -2.0 * pi * k / size;
+    realTwiddles[k] = { static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)) };
+  }
+
+  scratch.resize(half);
+}
+
+int FFT::getSize() const { return size; }
+int FFT::getNumBins() const { return half + 1; }
+
+// In place iterative radix-2 over `half` points. Unscaled in both directions.
+void FFT::transform(std::complex<float>* data, bool inverse) const {
+  for (int i = 0; i < half; ++i) {
+    int j = bitReverse[i];
+    if (i < j) std::swap(data[i], data[j]);
+  }
+
+  for (int length = 2; length <= half; length <<= 1) {
+    const int span = length / 2;
+    const int stride = half / length;
+    for (int start = 0; start < half; start += length) {
+      for (int k = 0; k < span; ++k) {
+        std::complex<float> w = twiddles[k * stride];
+        if (inverse) w = std::conj(w);
+
+        std::complex<float> u = data[start + k];
+        std::complex<float> v = complexMultiply(data[start + k + span], w);
+        data[start + k] = u + v;
+        data[start + k + span] = u - v;
+      }
+    }
+  }
+}
+
+/**
+ * Even samples go in the real parts and odd samples in the imaginary parts of a half size
+ * complex transform. The split step then separates the two spectra and combines them:
+ * X[k] = E[k] + W^k * O[k].
+ */
+void FFT::forward(const float* input, std::complex<float>* spectrum) {
+  for (int k = 0; k < half; ++k) {
+    scratch[k] = { input[2 * k], input[2 * k + 1] };
+  }
+  transform(scratch.data(), false);
+
+  for (int k = 0; k <= half; ++k) {
+    std::complex<float> zk = scratch[k % half];
+    std::complex<float> zc = std::conj(scratch[(half - k) % half]);
+    std::complex<float> even = (zk + zc) * 0.5f;
+    std::complex<float> diff = zk - zc;
+    std::complex<float> odd = { diff.imag() * 0.5f, -diff.real() * 0.5f }; // diff / 2i
+    spectrum[k] = even + complexMultiply(realTwiddles[k], odd);
+  }
+}
+
+// The forward split step run backwards, then a half size inverse transform.
+void FFT::inverse(const std::complex<float>* spectrum, float* output) {
+  for (int k = 0; k < half; ++k) {
+    std::complex<float> xk = spectrum[k];
+    std::complex<float> xc = std::conj(spectrum[half - k]);
+    std::complex<float> even = (xk + xc) * 0.5f;
+    std::complex<float> odd = complexMultiply((xk - xc) * 0.5f, std::conj(realTwiddles[k]));
+    scratch[k] = { even.real() - odd.imag(), even.imag() + odd.real() }; // even + i * odd
+  }
+  transform(scratch.data(), true);
+
+  const float scale = 1.0f / half;
+  for (int k = 0; k < half; ++k) {
+    output[2 * k] = scratch[k].real() * scale;
+    output[2 * k + 1] = scratch[k].imag() * scale;
+  }
+}
+
+} // namespace
@@ -1,5 +1,7 @@
 #include "../include/Filter.h"
 #include <cmath>
+#include <algorithm>
+#include <cassert>
 
 // C++ 17 doesn't have PI constant.
 // We can use arccosine of -1.0 to get pi instead.
@@ -8,17 +10,16 @@ const double PI = std::acos(-1.0);
 
 namespace MittelVec {
 
-Filter::Filter(const AudioContext& context, const FilterConfig& config)
-  : AudioNode(context), 
-    mode(config.mode), 
+BiquadProcessor::BiquadProcessor(float sampleRate, const FilterConfig& config)
+  : mode(config.mode), 
     cutoff(config.cutoff), 
     resonance(config.resonance), 
-    sampleRate(static_cast<float>(context.sampleRate)) 
+    sampleRate(sampleRate) 
 {
   calculateCoefficients();
 }
 
-void Filter::calculateCoefficients() {
+void BiquadProcessor::calculateCoefficients() {
   double w0 = 2.0 * PI * cutoff / sampleRate;
   double alpha = std::sin(w0) / (2.0 * resonance);
   double cosW0 = std::cos(w0);
@@ -68,46 +69,100 @@ void Filter::calculateCoefficients() {
   // printf("Filter: F=%f, Q=%f, SR=%f | b0=%f, a1=%f\n", cutoff, resonance, sampleRate, b0, a1);
 }
 
-void Filter::setParams(float newCutoff, float newResonance) {
+void BiquadProcessor::setParams(float newCutoff, float newResonance) {
   cutoff = newCutoff;
   resonance = newResonance;
   calculateCoefficients();
 }
 
-void Filter::setMode(FilterMode newMode) {
+void BiquadProcessor::setMode(FilterMode newMode) {
   mode = newMode;
   calculateCoefficients();
 }
 
-void Filter::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
-  if (inputs.empty()) return;
-  outputBuffer.clear();
+void BiquadProcessor::setSampleRate(float newSampleRate) {
+  sampleRate = newSampleRate;
+  calculateCoefficients();
+}
+
+void BiquadProcessor::reset() {
+  std::fill(std::begin(z1_x), std::end(z1_x), 0.0);
+  std::fill(std::begin(z2_x), std::end(z2_x), 0.0);
+  std::fill(std::begin(z1_y), std::end(z1_y), 0.0);
+  std::fill(std::begin(z2_y), std::end(z2_y), 0.0);
+}
 
-  // Sum inputs
-  for (const auto* inputBufferPtr : inputs) {
-    for (int i = 0; i < outputBuffer.size(); ++i) {
-      outputBuffer[i] += (*inputBufferPtr)[i];
+void BiquadProcessor::settle(double threshold) {
+  for (int ch = 0; ch < maxDspChannels; ++ch) {
+    if (std::abs(z1_x[ch]) >= threshold || std::abs(z2_x[ch]) >= threshold
+      || std::abs(z1_y[ch]) >= threshold || std::abs(z2_y[ch]) >= threshold) {
+      return;
     }
   }
+  reset();
+}
 
-  applyToBuffer(outputBuffer);
+bool BiquadProcessor::isSettled() const {
+  for (int ch = 0; ch < maxDspChannels; ++ch) {
+    if (z1_x[ch] != 0.0 || z2_x[ch] != 0.0 || z1_y[ch] != 0.0 || z2_y[ch] != 0.0) return false;
+  }
+  return true;
 }
 
-void Filter::applyToBuffer(AudioBuffer& buffer) {
-  for (int i = 0; i < buffer.size(); ++i) {
-    double x = buffer[i];
-    
-    // Difference Equation (Direct Form I)
-    double y = (b0 * x) + (b1 * z1_x) + (b2 * z2_x) - (a1 * z1_y) - (a2 * z2_y);
-
-    // Update state
-    z2_x = z1_x;
-    z1_x = x;
-    z2_y = z1_y;
-    z1_y = y;
-
-    buffer[i] = static_cast<float>(y);
+void BiquadProcessor::process(const float* in, float* out, int numFrames, int numChannels) {
+  assert(numChannels <= maxDspChannels);
+
+  dispatchChannels(numChannels, [&](auto channels) {
+    for (int i = 0; i < numFrames; ++i) {
+      tick(in + i * channels, out + i * channels, channels);
+    }
+  });
+}
+
+Filter::Filter(const AudioContext& context, const FilterConfig& config)
+  : AudioNode(context), biquad(static_cast<float>(context.sampleRate), config)
+{
+  requireDspChannels(context.numChannels, "Filter");
+}
+
+void Filter::setParams(float newCutoff, float newResonance) {
+  biquad.setParams(newCutoff, newResonance);
+}
+
+void Filter::setMode(FilterMode newMode) {
+  biquad.setMode(newMode);
+}
+
+void Filter::setAudioContext(const AudioContext& context) {
+  requireDspChannels(context.numChannels, "Filter");
+  AudioNode::setAudioContext(context);
+  biquad.setSampleRate(context.sampleRate);
+}
+
+void Filter::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  // No early out on empty inputs, the filter keeps running on silence until its tail decays.
+  apply(mixInputs(inputs, outputBuffer), outputBuffer);
+
+  // Once the tail is below -120dB, snap the state to zero so the graph can put us to sleep.
+  if (inputs.empty()) {
+    biquad.settle(1e-6);
   }
 }
 
+bool Filter::canSleep() const {
+  return biquad.isSettled();
+}
+
+void Filter::applyToBuffer(AudioBuffer& buffer) {
+  apply(buffer, buffer);
+}
+
+void Filter::apply(const AudioBuffer& input, AudioBuffer& output) {
+  processTile(input.data.data(), output.data.data(), output.getNumFrames());
+}
+
+void Filter::processTile(const float* in, float* out, int numFrames) {
+  biquad.process(in, out, numFrames, outputBuffer.getNumChannels());
+}
+
 } // namespace MittelVec
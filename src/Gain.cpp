@@ -10,23 +10,20 @@ void Gain::setGain(float newGain) {
 }
 
 void Gain::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
-  outputBuffer.clear();
-
   if (inputs.empty()) {
+    outputSilence();
     return;
   }
 
-  // Sum all input buffers into the output buffer
-  // Revisit this... Seems wasteful if inputs.length < 1.
-  for (const auto* inputBufferPtr : inputs) {
-    for (int i = 0; i < outputBuffer.size(); ++i) {
-      outputBuffer[i] += (*inputBufferPtr)[i];
-    }
-  }
+  // Reads straight from a single input, so it's one pass either way.
+  const AudioBuffer& input = mixInputs(inputs, outputBuffer);
+  processTile(input.data.data(), outputBuffer.data.data(), outputBuffer.getNumFrames());
+}
 
-  // Apply gain to the summed signal
-  for (int i = 0; i < outputBuffer.size(); ++i) {
-    outputBuffer[i] *= gain;
+void Gain::processTile(const float* in, float* out, int numFrames) {
+  const int numSamples = numFrames * outputBuffer.getNumChannels();
+  for (int i = 0; i < numSamples; ++i) {
+    out[i] = in[i] * gain;
   }
 }
 
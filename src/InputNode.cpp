@@ -0,0 +1,22 @@
+#include "../include/InputNode.h"
+#include <algorithm>
+
+namespace MittelVec {
+
+InputNode::InputNode(const AudioContext& context, const CaptureInput& capture)
+  : AudioNode(context), capture(capture) {}
+
+void InputNode::process(const std::vector<const AudioBuffer*>& /*inputs*/, AudioBuffer& outputBuffer) {
+  // Not rendering from a duplex callback.
+  if (!capture.samples) {
+    outputSilence();
+    return;
+  }
+
+  // One copy straight out of the device's buffer, the graph hands our outputBuffer downstream.
+  const int count = std::min(capture.numFrames, outputBuffer.getNumFrames()) * outputBuffer.getNumChannels();
+  std::copy(capture.samples, capture.samples + count, outputBuffer.data.begin());
+  std::fill(outputBuffer.data.begin() + count, outputBuffer.data.end(), 0.0f);
+}
+
+} // namespace
@@ -0,0 +1,55 @@
+#include "../include/LoadGovernor.h"
+#include <algorithm>
+
+namespace MittelVec {
+
+LoadGovernor::LoadGovernor(const AudioContext& context) {
+  setAudioContext(context);
+}
+
+void LoadGovernor::setAudioContext(const AudioContext& context) {
+  deadline = static_cast<double>(context.bufferSize) / context.sampleRate;
+  recoveryBlocks = std::max(1, static_cast<int>(context.sampleRate / context.bufferSize));
+}
+
+void LoadGovernor::setEnabled(bool enable) {
+  enabled.store(enable, std::memory_order_relaxed);
+}
+
+Quality LoadGovernor::update(double seconds) {
+  const float blockLoad = static_cast<float>(seconds / deadline);
+
+  // Jump straight up to a spike, drift back down.
+  if (blockLoad > smoothedLoad) {
+    smoothedLoad = blockLoad;
+  } else {
+    smoothedLoad += (blockLoad - smoothedLoad) * 0.05f;
+  }
+  load.store(smoothedLoad, std::memory_order_relaxed);
+
+  int level = static_cast<int>(quality.load(std::memory_order_relaxed));
+  if (!enabled.load(std::memory_order_relaxed)) {
+    level = static_cast<int>(Quality::Full);
+  } else {
+    blocksAtLevel++;
+    blocksWithHeadroom = smoothedLoad < stepUpLoad ? blocksWithHeadroom + 1 : 0;
+
+    // Give each step a couple of blocks to take effect before taking another.
+    if (smoothedLoad > stepDownLoad && blocksAtLevel > 2 && level < static_cast<int>(Quality::VirtualVoices)) {
+      level++;
+      blocksAtLevel = 0;
+      blocksWithHeadroom = 0;
+      // The step should bring the load down, don't let the old spike trigger the next one.
+      smoothedLoad = blockLoad;
+    } else if (blocksWithHeadroom >= recoveryBlocks && level > static_cast<int>(Quality::Full)) {
+      level--;
+      blocksAtLevel = 0;
+      blocksWithHeadroom = 0;
+    }
+  }
+
+  quality.store(static_cast<Quality>(level), std::memory_order_relaxed);
+  return static_cast<Quality>(level);
+}
+
+} // namespace
@@ -0,0 +1,196 @@
+#include "../include/Meter.h"
+#include <cmath>
+
+namespace MittelVec {
+
+// Short-term loudness window.
+static constexpr double loudnessWindowSeconds = 3.0;
+
+Meter::Meter(const AudioContext& context, bool measureLoudness)
+  : AudioNode(context), loudnessEnabled(measureLoudness)
+{
+  requireDspChannels(context.numChannels, "Meter");
+  if (loudnessEnabled) setupLoudness(context);
+}
+
+void Meter::setAudioContext(const AudioContext& context) {
+  requireDspChannels(context.numChannels, "Meter");
+  AudioNode::setAudioContext(context);
+  if (loudnessEnabled) setupLoudness(context);
+}
+
+void Meter::setupLoudness(const AudioContext& context) {
+  // K-weighting from BS.1770, with the coefficients worked out for any sample rate.
+  const double pi = std::acos(-1.0);
+  const double fs = context.sampleRate;
+
+  {
+    const double f0 = 1681.974450955533, gainDb = 3.999843853973347, q = 0.7071752369554196;
+    const double k = std::tan(pi * f0 / fs);
+    const double vh = std::pow(10.0, gainDb / 20.0);
+    const double vb = std::pow(vh, 0.4996667741545416);
+    const double a0 = 1.0 + k / q + k * k;
+    shelf = KStage();
+    shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    shelf.b1 = 2.0 * (k * k - vh) / a0;
+    shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf.a2 = (1.0 - k / q + k * k) / a0;
+  }
+  {
+    const double f0 = 38.13547087602444, q = 0.5003270373238773;
+    const double k = std::tan(pi * f0 / fs);
+    const double a0 = 1.0 + k / q + k * k;
+    highpass = KStage();
+    highpass.b0 = 1.0;
+    highpass.b1 = -2.0;
+    highpass.b2 = 1.0;
+    highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+    highpass.a2 = (1.0 - k / q + k * k) / a0;
+  }
+
+  const size_t numBlocks = std::max<size_t>(1, static_cast<size_t>(std::lround(loudnessWindowSeconds * fs / context.bufferSize)));
+  blockEnergy.assign(numBlocks, 0.0);
+  blockIndex = 0;
+  loudness = meterSilenceLufs;
+}
+
+void Meter::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  // No early out on silence, the reading has to drop with it.
+  const AudioBuffer& input = mixInputs(inputs, outputBuffer);
+  if (&input != &outputBuffer) {
+    std::copy(input.data.begin(), input.data.end(), outputBuffer.data.begin());
+  }
+  measure(outputBuffer);
+}
+
+void Meter::measure(const AudioBuffer& input) {
+  MeterReading reading;
+  reading.numChannels = input.getNumChannels();
+  const float* in = input.data.data();
+  const int numSamples = input.size();
+
+  dispatchChannels(reading.numChannels, [&](auto channels) {
+    // Reduce into 8 independent lanes, sample i going to lane i % 8. The inner loop is a fixed
+    // width max and multiply-add, so it vectorizes without reordering any float math. With
+    // 1, 2 or 8 channels each lane holds a single channel, others fall back to one lane each.
+    constexpr int simdLanes = 8;
+    const int lanes = simdLanes % channels == 0 ? simdLanes : static_cast<int>(channels);
+    float peak[simdLanes] = {};
+    float sumSquares[simdLanes] = {};
+
+    int i = 0;
+    if (lanes == simdLanes) {
+      for (; i + simdLanes <= numSamples; i += simdLanes) {
+        for (int lane = 0; lane < simdLanes; ++lane) {
+          const float x = in[i + lane];
+          peak[lane] = std::max(peak[lane], std::abs(x));
+          sumSquares[lane] += x * x;
+        }
+      }
+    }
+    // The rest, or everything when 8 lanes can't hold whole frames.
+    for (; i < numSamples; ++i) {
+      const int lane = i % lanes;
+      peak[lane] = std::max(peak[lane], std::abs(in[i]));
+      sumSquares[lane] += in[i] * in[i];
+    }
+
+    for (int lane = 0; lane < lanes; ++lane) {
+      const int ch = lane % channels;
+      reading.peak[ch] = std::max(reading.peak[ch], peak[lane]);
+      reading.rms[ch] += sumSquares[lane];
+    }
+  });
+
+  const int numFrames = input.getNumFrames();
+  for (int ch = 0; ch < reading.numChannels; ++ch) {
+    reading.rms[ch] = std::sqrt(reading.rms[ch] / numFrames);
+  }
+
+  if (loudnessEnabled) measureLoudness(input);
+  reading.loudness = loudness;
+  publish(reading);
+}
+
+void Meter::measureLoudness(const AudioBuffer& input) {
+  const int numChannels = input.getNumChannels();
+  const int numFrames = input.getNumFrames();
+  const float* in = input.data.data();
+  double energy = 0.0;
+
+  // Both K-weighting stages per sample, they're too small to be worth a buffer in between.
+  dispatchChannels(numChannels, [&](auto channels) {
+    for (int i = 0; i < numFrames; ++i) {
+      for (int ch = 0; ch < channels; ++ch) {
+        double x = in[i * channels + ch];
+        double y = shelf.b0 * x + shelf.z1[ch];
+        shelf.z1[ch] = shelf.b1 * x - shelf.a1 * y + shelf.z2[ch];
+        shelf.z2[ch] = shelf.b2 * x - shelf.a2 * y;
+
+        x = y;
+        y = highpass.b0 * x + highpass.z1[ch];
+        highpass.z1[ch] = highpass.b1 * x - highpass.a1 * y + highpass.z2[ch];
+        highpass.z2[ch] = highpass.b2 * x - highpass.a2 * y;
+
+        energy += y * y;
+      }
+    }
+  });
+
+  // Keeps the filter state out of denormals once the input has gone quiet.
+  for (KStage* stage : { &shelf, &highpass }) {
+    for (int ch = 0; ch < numChannels; ++ch) {
+      if (std::abs(stage->z1[ch]) < 1e-15) stage->z1[ch] = 0.0;
+      if (std::abs(stage->z2[ch]) < 1e-15) stage->z2[ch] = 0.0;
+    }
+  }
+
+  blockEnergy[blockIndex] = energy;
+  blockIndex = (blockIndex + 1) % blockEnergy.size();
+
+  // Summed from scratch, a running total would drift. It's a few hundred adds.
+  double windowEnergy = 0.0;
+  for (double e : blockEnergy) windowEnergy += e;
+  const double meanSquare = windowEnergy / (static_cast<double>(blockEnergy.size()) * numFrames);
+
+  // Channels are weighted equally, BS.1770 boosts surrounds by 1.5dB but we don't know the layout.
+  loudness = meanSquare > 0.0
+    ? std::max(meterSilenceLufs, static_cast<float>(-0.691 + 10.0 * std::log10(meanSquare)))
+    : meterSilenceLufs;
+}
+
+void Meter::publish(const MeterReading& reading) {
+  // Only the audio thread writes, so a plain load of our own counter is fine.
+  const unsigned seq = sequence.load(std::memory_order_relaxed);
+  sequence.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  publishedChannels.store(reading.numChannels, std::memory_order_relaxed);
+  for (int ch = 0; ch < maxDspChannels; ++ch) {
+    publishedPeak[ch].store(reading.peak[ch], std::memory_order_relaxed);
+    publishedRms[ch].store(reading.rms[ch], std::memory_order_relaxed);
+  }
+  publishedLoudness.store(reading.loudness, std::memory_order_relaxed);
+
+  sequence.store(seq + 2, std::memory_order_release);
+}
+
+MeterReading Meter::getReading() const {
+  MeterReading reading;
+  unsigned before, after;
+  do {
+    before = sequence.load(std::memory_order_acquire);
+    reading.numChannels = publishedChannels.load(std::memory_order_relaxed);
+    for (int ch = 0; ch < maxDspChannels; ++ch) {
+      reading.peak[ch] = publishedPeak[ch].load(std::memory_order_relaxed);
+      reading.rms[ch] = publishedRms[ch].load(std::memory_order_relaxed);
+    }
+    reading.loudness = publishedLoudness.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = sequence.load(std::memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  return reading;
+}
+
+} // namespace
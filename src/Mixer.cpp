@@ -0,0 +1,87 @@
+#include "../include/Mixer.h"
+
+namespace MittelVec {
+
+Mixer::Mixer(const AudioContext& context, float gain)
+  : AudioNode(context), gain(gain) {}
+
+void Mixer::setGain(float newGain) {
+  gain.store(newGain, std::memory_order_relaxed);
+}
+
+void Mixer::setInputGain(const AudioNode* source, float inputGain) {
+  inputGains[&source->outputBuffer].store(inputGain, std::memory_order_relaxed);
+}
+
+float Mixer::getInputGain(const AudioNode* source) const {
+  return gainFor(&source->outputBuffer);
+}
+
+void Mixer::sourceDisconnected(const AudioNode& source) {
+  // Otherwise a node added later at the same address would get this gain, and removed
+  // sources would pile up.
+  inputGains.erase(&source.outputBuffer);
+}
+
+float Mixer::gainFor(const AudioBuffer* input) const {
+  auto it = inputGains.find(input);
+  return it == inputGains.end() ? 1.0f : it->second.load(std::memory_order_relaxed);
+}
+
+void Mixer::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  if (inputs.empty()) {
+    outputSilence();
+    return;
+  }
+
+  const float master = gain.load(std::memory_order_relaxed);
+  const int numSamples = outputBuffer.size();
+  float* out = outputBuffer.data.data();
+  const size_t numInputs = inputs.size();
+  size_t next = 0;
+
+  // The first pass writes instead of accumulating, which saves clearing the buffer.
+  bool accumulate = false;
+
+  // Four inputs per pass, one read-modify-write of the output per four inputs.
+  for (; next + 4 <= numInputs; next += 4) {
+    const float* a = inputs[next]->data.data();
+    const float* b = inputs[next + 1]->data.data();
+    const float* c = inputs[next + 2]->data.data();
+    const float* d = inputs[next + 3]->data.data();
+    const float gainA = gainFor(inputs[next]) * master;
+    const float gainB = gainFor(inputs[next + 1]) * master;
+    const float gainC = gainFor(inputs[next + 2]) * master;
+    const float gainD = gainFor(inputs[next + 3]) * master;
+
+    if (accumulate) {
+      for (int i = 0; i < numSamples; ++i) {
+        out[i] += a[i] * gainA + b[i] * gainB + c[i] * gainC + d[i] * gainD;
+      }
+    } else {
+      for (int i = 0; i < numSamples; ++i) {
+        out[i] = a[i] * gainA + b[i] * gainB + c[i] * gainC + d[i] * gainD;
+      }
+      accumulate = true;
+    }
+  }
+
+  // Leftovers, one at a time.
+  for (; next < numInputs; ++next) {
+    const float* in = inputs[next]->data.data();
+    const float inputGain = gainFor(inputs[next]) * master;
+
+    if (accumulate) {
+      for (int i = 0; i < numSamples; ++i) {
+        out[i] += in[i] * inputGain;
+      }
+    } else {
+      for (int i = 0; i < numSamples; ++i) {
+        out[i] = in[i] * inputGain;
+      }
+      accumulate = true;
+    }
+  }
+}
+
+} // namespace
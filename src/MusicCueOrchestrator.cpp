@@ -1,15 +1,48 @@
 #include "../include/MusicCueOrchestrator.h"
+#include "../include/SampleBank.h"
 #include <stdexcept>
 
 namespace MittelVec {
 
+static std::vector<SampleRequest> musicCueRequests(const std::vector<MusicCue>& cues, const std::string& samplesDir) {
+  std::vector<SampleRequest> requests;
+  requests.reserve(cues.size());
+  for (const auto& item : cues) {
+    requests.push_back({ samplesDir + item.fileName, item.storage });
+  }
+  return requests;
+}
+
 MusicCueOrchestrator::MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::string samplesDir)
-  : graph(graph) {
-  
-  auto [outputNodeId, outputNodePtr] = graph.addNode<Gain>(1.0f);
+  : MusicCueOrchestrator(
+    graph,
+    cues,
+    SampleLoader::loadAll(graph.audioContext, musicCueRequests(cues, samplesDir))
+  ) {}
 
+static std::vector<std::shared_ptr<const SampleData>> musicCueBankSamples(const std::vector<MusicCue>& cues, const SampleBank& bank) {
+  std::vector<std::shared_ptr<const SampleData>> samples;
+  samples.reserve(cues.size());
   for (const auto& item : cues) {
-    if (samplers.find(item.slug) != samplers.end()) {
+    samples.push_back(bank.get(item.fileName, item.storage));
+  }
+  return samples;
+}
+
+MusicCueOrchestrator::MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, const SampleBank& bank)
+  : MusicCueOrchestrator(graph, cues, musicCueBankSamples(cues, bank)) {}
+
+MusicCueOrchestrator::MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicCue> cues, std::vector<std::shared_ptr<const SampleData>> samples)
+  : graph(graph), sends(graph) {
+
+  // Validate and build every node before touching the graph.
+  auto outputNode = std::make_unique<Mixer>(graph.audioContext, 1.0f);
+  std::vector<std::unique_ptr<Sampler>> samplerNodes;
+  samplerNodes.reserve(cues.size());
+
+  for (size_t i = 0; i < cues.size(); ++i) {
+    const auto& item = cues[i];
+    if (handles.find(item.slug) != handles.end()) {
       throw std::runtime_error("Duplicate music cue slug: " + item.slug);
     }
 
@@ -17,40 +50,149 @@ MusicCueOrchestrator::MusicCueOrchestrator(AudioGraph& graph, std::vector<MusicC
       throw std::runtime_error("Cue slug name cannot be empty string.");
     }
 
-    auto [samplerNodeId, samplerNodePtr] = graph.addNode<Sampler>(
-      samplesDir + item.fileName,
+    samplerNodes.push_back(std::make_unique<Sampler>(
+      graph.audioContext,
+      samples[i],
       1, // polyphony
       item.loop,
       item.gain,
       0, // pitchShift
       EnvConfig { 0.1f, 0.1f, 1.0f, 0.5f } // attack, decay, sustain, release
-    );
-    
-    samplers[item.slug] = samplerNodePtr;
+    ));
+    if (item.loopPoints) samplerNodes.back()->setLoopPoints(item.loopPoints);
+    handles[item.slug] = static_cast<SampleHandle>(i);
+    samplers.push_back(samplerNodes.back().get());
+  }
+
+  auto triggerNode = std::make_unique<SampleTriggerNode>(graph.audioContext, samplers, 64);
+  triggers = triggerNode.get();
+
+  // Join the graph as one edit, caught up first if a reconfiguration ran while loading.
+  std::vector<AudioNode*> nodes { outputNode.get(), triggerNode.get() };
+  for (const auto& samplerNode : samplerNodes) nodes.push_back(samplerNode.get());
+  auto lock = graph.lockGraphFor(nodes);
+  outputNodeId = graph.addNode(std::move(outputNode));
+  sends.setReturnNode(outputNodeId);
+  int triggerNodeId = graph.addNode(std::move(triggerNode));
+
+  std::vector<int> samplerNodeIds;
+  samplerNodeIds.reserve(samplerNodes.size());
+  for (auto& samplerNode : samplerNodes) {
+    int samplerNodeId = graph.addNode(std::move(samplerNode));
+    graph.connect(triggerNodeId, samplerNodeId);
     graph.connect(samplerNodeId, outputNodeId);
+    samplerNodeIds.push_back(samplerNodeId);
+  }
+  lock.unlock();
+
+  // No buses yet, so registering the send sources doesn't touch the graph.
+  for (size_t i = 0; i < cues.size(); ++i) {
+    sends.addSource(cues[i].slug, samplerNodeIds[i], samplers[i], cues[i].sends);
   }
 }
 
-void MusicCueOrchestrator::playCue(const std::string& slug) {
-  if (slug == currentCueSlug) {
+std::future<std::unique_ptr<MusicCueOrchestrator>> MusicCueOrchestrator::loadAsync(
+  SampleLoader& loader,
+  AudioGraph& graph,
+  std::vector<MusicCue> cues,
+  std::string samplesDir,
+  LoadProgressCallback onProgress
+) {
+  auto promise = std::make_shared<std::promise<std::unique_ptr<MusicCueOrchestrator>>>();
+  auto future = promise->get_future();
+  auto requests = musicCueRequests(cues, samplesDir);
+
+  loader.loadBatch(
+    graph.audioContext,
+    requests,
+    [promise, &graph, cues = std::move(cues)](std::vector<std::shared_ptr<const SampleData>> samples) {
+      try {
+        promise->set_value(std::make_unique<MusicCueOrchestrator>(graph, cues, std::move(samples)));
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    },
+    onProgress
+  );
+
+  return future;
+}
+
+SampleHandle MusicCueOrchestrator::getCueHandle(const std::string& slug) const {
+  auto it = handles.find(slug);
+  return it == handles.end() ? invalidSampleHandle : it->second;
+}
+
+void MusicCueOrchestrator::playCue(SampleHandle cue) {
+  if (cue == currentCue || cue < 0 || cue >= static_cast<SampleHandle>(handles.size())) {
     return;
   }
 
-  if (samplers.count(slug)) {
-    if (!currentCueSlug.empty()) {
-      stopCue();
-    }
-    
-    samplers[slug]->noteOn();
-    currentCueSlug = slug;
+  SampleTrigger batch[2];
+  size_t count = 0;
+  if (currentCue != invalidSampleHandle) {
+    batch[count++] = { currentCue, 1.0f, 0, true };
+  }
+  batch[count++] = { cue };
+
+  if (triggers->push(batch, count)) {
+    currentCue = cue;
   }
 }
 
+void MusicCueOrchestrator::playCue(const std::string& slug) {
+  playCue(getCueHandle(slug));
+}
+
 void MusicCueOrchestrator::stopCue() {
-  if (!currentCueSlug.empty() && samplers.count(currentCueSlug)) {
-    samplers[currentCueSlug]->noteOff();
-    currentCueSlug = "";
+  if (currentCue == invalidSampleHandle) {
+    return;
   }
+
+  SampleTrigger release { currentCue, 1.0f, 0, true };
+  if (triggers->push(&release, 1)) {
+    currentCue = invalidSampleHandle;
+  }
+}
+
+bool MusicCueOrchestrator::lockSampleMemory() {
+  bool locked = true;
+  for (Sampler* sampler : samplers) {
+    locked = sampler->lockSampleMemory() && locked;
+  }
+  return locked;
+}
+
+void MusicCueOrchestrator::setSendLevel(const std::string& slug, const std::string& bus, float level) {
+  sends.setSendLevel(slug, bus, level);
+}
+
+Compressor* MusicCueOrchestrator::duckUnder(int keyNodeId, const CompressorConfig& config) {
+  auto lock = graph.lockGraph();
+  const AudioNode* key = graph.getNode(keyNodeId);
+  if (!key) {
+    throw std::runtime_error("Can't duck music cues under a node that isn't in the graph.");
+  }
+
+  if (!ducker) {
+    // Send returns land in the output mixer too, so they're ducked with the cues.
+    auto [nodeId, node] = graph.addNode<Compressor>(config);
+    duckerNodeId = nodeId;
+    ducker = node;
+    graph.connect(outputNodeId, duckerNodeId);
+  } else {
+    graph.disconnect(duckKeyNodeId, duckerNodeId);
+    ducker->setThreshold(config.threshold);
+    ducker->setRatio(config.ratio);
+    ducker->setAttack(config.attack);
+    ducker->setRelease(config.release);
+    ducker->setMakeup(config.makeup);
+  }
+
+  graph.connectSidechain(keyNodeId, duckerNodeId);
+  ducker->setSidechain(key);
+  duckKeyNodeId = keyNodeId;
+  return ducker;
 }
 
 } // namespace MittelVec
\ No newline at end of file
@@ -1,12 +1,14 @@
 #include "../include/PitchShift.h"
 #include <cmath>
+#include <cassert>
+#include <algorithm>
 
 namespace MittelVec {
 
-PitchShift::PitchShift(const AudioContext& context, int semitoneShift)
-  : AudioNode(context), currentDelay(0.0), ringWriteIdx(0), ratio(convertSemitoneToRatio(semitoneShift)) {
-    // Preallocate ringBuffer.
-    ringBuffer.resize(context.bufferSize * context.numChannels);
+PitchShiftProcessor::PitchShiftProcessor(const AudioContext& context, int semitoneShift)
+  : currentDelay(0.0), ratio(convertSemitoneToRatio(semitoneShift)),
+    ringFrames(minRingFrames), windowFrames(0), channels(context.numChannels), ringWriteIdx(0) {
+    setAudioContext(context);
 
     // Use below if you want custom window size.
     // Set a window size of ~20ms (adjust to taste)
@@ -14,103 +16,210 @@ PitchShift::PitchShift(const AudioContext& context, int semitoneShift)
     // ringBuffer.resize(windowSize);
   }
 
+PitchShift::PitchShift(const AudioContext& context, int semitoneShift)
+  : AudioNode(context), shifter(context, semitoneShift) {}
+
   
 void PitchShift::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
   if (inputs.empty()) {
+    // Keep reading out what's left in the ring until it only holds silence.
     outputBuffer.clear();
+    applyToBuffer(outputBuffer);
+    silentFramesWritten += outputBuffer.getNumFrames();
     return;
   }
 
-  const int numInputSamples = inputs[0]->getNumFrames();
-  
-  // Sum all input buffers into the output buffer
-  // Revisit this... Seems wasteful if inputs.length < 1.
-  for (const auto* inputBufferPtr : inputs) {
-    for (int i = 0; i < outputBuffer.size(); ++i) {
-      outputBuffer[i] += (*inputBufferPtr)[i];
-    }
-  }
-
-  applyToBuffer(outputBuffer);
+  silentFramesWritten = 0;
+  apply(mixInputs(inputs, outputBuffer), outputBuffer);
 }
 
 void PitchShift::applyToBuffer(AudioBuffer& buffer) {
-  const int numInputSamples = buffer.getNumFrames();
-  const double ringSize = static_cast<double>(ringBuffer.size());
-  // Not sure this margin is strictly necessary but may mitigate some pops/clicks.
-  const double safetyMargin = 20.0;
+  apply(buffer, buffer);
+}
+
+void PitchShift::apply(const AudioBuffer& input, AudioBuffer& output) {
+  shifter.process(input.data.data(), output.data.data(), output.getNumFrames());
+}
+
+void PitchShift::setPitch(int semitoneShift) {
+  shifter.setPitch(semitoneShift);
+}
 
-  for (int i = 0; i < numInputSamples; ++i) {
-    // Write sample into ringBuffer
-    ringBuffer[ringWriteIdx] = buffer[i];
+bool PitchShift::canSleep() const {
+  return silentFramesWritten >= shifter.getRingFrames();
+}
+
+void PitchShift::reset() {
+  shifter.reset();
+}
+
+void PitchShift::setAudioContext(const AudioContext& context) {
+  AudioNode::setAudioContext(context);
+  shifter.setAudioContext(context);
+  silentFramesWritten = 0;
+}
+
+void PitchShift::setQuality(Quality quality) {
+  shifter.setCubicInterpolation(quality < Quality::LinearInterpolation);
+}
+
+void PitchShiftProcessor::process(const float* in, float* out, int numFrames) {
+  dispatchChannels(channels, [&](auto numChannels) {
+    for (int start = 0; start < numFrames; start += groupFrames) {
+      const int count = std::min(groupFrames, numFrames - start);
+      renderGroup(in + start * numChannels, out + start * numChannels, count, numChannels);
+    }
+  });
+}
+
+void PitchShiftProcessor::tick(const float* in, float* out, int numChannels) {
+  assert(numChannels == channels);
+  renderGroup(in, out, 1, numChannels);
+}
 
+/**
+ * Renders up to `groupFrames` frames in three passes: tap positions and window gains for every
+ * frame, then the ring writes, then the interpolation. Reads go through the guard frames so
+ * each tap is four contiguous frames with no wrapping, and the channel loop runs with a
+ * constant trip count for the common layouts.
+ *
+ * Both taps sweep delays in [minDelayFrames, minDelayFrames + windowFrames), which is never
+ * less than a group ahead of the newest frame read or more than the ring still holds once
+ * the group is written. So writing the whole group before reading it is still causal, and
+ * each tap only jumps where its window gain is zero.
+ */
+template <typename Channels>
+void PitchShiftProcessor::renderGroup(const float* in, float* out, int numFrames, Channels numChannels) {
+  const double window = static_cast<double>(windowFrames);
+  const int mask = ringFrames - 1;
+  const int halfWindow = windowFrames / 2; // Tap B is offset by 180 deg.
+
+  int tapA[groupFrames];
+  int tapB[groupFrames];
+  float fractions[groupFrames];
+  float gainsA[groupFrames];
+
+  for (int i = 0; i < numFrames; ++i) {
     // Offset for Dual Tap delay.
     currentDelay += (1.0 - ratio);
 
     // Wrap currentDelay
-    if (currentDelay >= ringSize) currentDelay -= ringSize;
-    if (currentDelay < 0) currentDelay += ringSize;
+    if (currentDelay >= window) currentDelay -= window;
+    if (currentDelay < 0) currentDelay += window;
+
+    // Shifted up by two ring lengths so it's never negative, the truncation is a floor
+    // and the mask does the wrap.
+    double tapAPos = static_cast<double>(ringWriteIdx + i + 2 * ringFrames - minDelayFrames) - currentDelay;
+    int index = static_cast<int>(tapAPos);
+    tapA[i] = index & mask;
+    // B's delay is half a window away, on whichever side keeps it inside the window.
+    tapB[i] = (currentDelay >= halfWindow ? index + halfWindow : index - halfWindow) & mask;
+    fractions[i] = static_cast<float>(tapAPos - index);
+
+    // Hann window for crossfading between taps, B gets the complement.
+    gainsA[i] = hannWindow(static_cast<float>(currentDelay / window));
+  }
 
-    double tapAPos = static_cast<double>(ringWriteIdx) - (currentDelay + safetyMargin);
-    if (tapAPos < 0) tapAPos += ringSize; // wrap
+  for (int i = 0; i < numFrames; ++i) {
+    writeFrame(in + i * numChannels, numChannels);
+  }
 
-    double tapBPos = tapAPos + (ringSize * 0.5); // Offset by 180 deg
-    if (tapBPos >= ringSize) tapBPos -= ringSize; // wrap
+  for (int i = 0; i < numFrames; ++i) {
+    const float* a = &ringBuffer[tapA[i] * numChannels];
+    const float* b = &ringBuffer[tapB[i] * numChannels];
+    const float fraction = fractions[i];
+    const float gainA = gainsA[i];
+    const float gainB = 1.0f - gainA;
+    float* frame = out + i * numChannels;
+
+    if (cubic) {
+      for (int ch = 0; ch < numChannels; ++ch) {
+        float sampleA = cubicInterpolation(a[ch], a[numChannels + ch], a[2 * numChannels + ch], a[3 * numChannels + ch], fraction);
+        float sampleB = cubicInterpolation(b[ch], b[numChannels + ch], b[2 * numChannels + ch], b[3 * numChannels + ch], fraction);
+        frame[ch] = (sampleA * gainA) + (sampleB * gainB);
+      }
+    } else {
+      // Between the middle two frames of each tap.
+      for (int ch = 0; ch < numChannels; ++ch) {
+        float sampleA = a[numChannels + ch] + (a[2 * numChannels + ch] - a[numChannels + ch]) * fraction;
+        float sampleB = b[numChannels + ch] + (b[2 * numChannels + ch] - b[numChannels + ch]) * fraction;
+        frame[ch] = (sampleA * gainA) + (sampleB * gainB);
+      }
+    }
+  }
+}
 
-    // Triangle window for crossfading between taps.
-    // Consider using Hamming window.
-    float windowPhase = static_cast<float>(currentDelay / ringSize);
-    float gainA = 1.0f - std::abs((windowPhase * 2.0f) - 1.0f);
-    float gainB = 1.0f - gainA;
+// Ring frame k is stored at k + 1. Frame 0 holds a copy of the last frame and the two frames
+// past the end hold copies of the first two, so frames i-1..i+2 are always contiguous.
+void PitchShiftProcessor::writeFrame(const float* frame, int numChannels) {
+  const int index = ringWriteIdx;
+  std::copy(frame, frame + numChannels, &ringBuffer[(index + 1) * numChannels]);
+  if (index == ringFrames - 1) {
+    std::copy(frame, frame + numChannels, &ringBuffer[0]);
+  }
+  if (index < 2) {
+    std::copy(frame, frame + numChannels, &ringBuffer[(ringFrames + 1 + index) * numChannels]);
+  }
 
-    float tapA = getCubicSample(tapAPos);
-    float tapB = getCubicSample(tapBPos);
-    buffer[i] = (tapA * gainA) + (tapB * gainB);
+  // Increment write index.
+  ringWriteIdx = (index + 1) & (ringFrames - 1);
+}
+
+const std::array<float, PitchShiftProcessor::hannTableSize + 1> PitchShiftProcessor::hannTable = PitchShiftProcessor::buildHannTable();
 
-    // Increment write index.
-    ringWriteIdx = (ringWriteIdx + 1) % static_cast<int>(ringSize);
+std::array<float, PitchShiftProcessor::hannTableSize + 1> PitchShiftProcessor::buildHannTable() {
+  std::array<float, hannTableSize + 1> values;
+  const double pi = std::acos(-1.0);
+  for (int i = 0; i <= hannTableSize; ++i) {
+    double s = std::sin(pi * i / hannTableSize);
+    values[i] = static_cast<float>(s * s);
   }
+  return values;
 }
 
-void PitchShift::setPitch(int semitoneShift) {
-  ratio = convertSemitoneToRatio(semitoneShift);
+// Interpolated from the table.
+float PitchShiftProcessor::hannWindow(float phase) {
+  const std::array<float, hannTableSize + 1>& table = hannTable;
+  float position = phase * hannTableSize;
+  int index = std::min(static_cast<int>(position), hannTableSize - 1);
+  float fraction = position - index;
+  return table[index] + (table[index + 1] - table[index]) * fraction;
 }
 
-void PitchShift::reset() {
-  // samplePosition = 0.0;
-  currentDelay = 0.0;
-  ringWriteIdx = 0;
-  std::fill(ringBuffer.begin(), ringBuffer.end(), 0.0f);
+void PitchShiftProcessor::setPitch(int semitoneShift) {
+  ratio = convertSemitoneToRatio(semitoneShift);
 }
 
-float PitchShift::getLerpSample(double samplePosition) {
-  int index0 = static_cast<int>(std::floor(samplePosition));
-  int index1 = (index0 + 1) % static_cast<int>(ringBuffer.size());
-  float fraction = static_cast<float>(samplePosition - std::floor(samplePosition));
-
-  return lerp(ringBuffer[index0], ringBuffer[index1], fraction);
+int PitchShiftProcessor::getRingFrames() const {
+  return ringFrames;
 }
 
-float PitchShift::getCubicSample(double samplePosition) {
-  int i = static_cast<int>(std::floor(samplePosition));
-  float fraction = static_cast<float>(samplePosition - i);
-  int size = static_cast<int>(ringBuffer.size());
+void PitchShiftProcessor::setCubicInterpolation(bool useCubic) {
+  cubic = useCubic;
+}
 
-  // Get 4 samples for cubic interpolation: i-1, i, i+1, i+2
-  float sm1 = ringBuffer[(i - 1 + size) % size];
-  float s0  = ringBuffer[i % size];
-  float s1  = ringBuffer[(i + 1) % size];
-  float s2  = ringBuffer[(i + 2) % size];
+void PitchShiftProcessor::setAudioContext(const AudioContext& context) {
+  // At least one block of frames, rounded up to a power of two so positions wrap with a mask.
+  ringFrames = minRingFrames;
+  while (ringFrames < context.bufferSize) ringFrames *= 2;
+  // Even so both taps land on the same fraction (see renderGroup).
+  windowFrames = (ringFrames - minDelayFrames - groupFrames - guardFrames) & ~1;
 
-  return cubicInterpolation(sm1, s0, s1, s2, fraction);
+  // Preallocate ringBuffer, plus the guard frames (see writeFrame).
+  ringBuffer.assign((ringFrames + guardFrames) * channels, 0.0f);
+  currentDelay = 0.0;
+  ringWriteIdx = 0;
 }
 
-float PitchShift::lerp(float a, float b, float fraction) {
-  return a + (b - a) * fraction;
+void PitchShiftProcessor::reset() {
+  // samplePosition = 0.0;
+  currentDelay = 0.0;
+  ringWriteIdx = 0;
+  std::fill(ringBuffer.begin(), ringBuffer.end(), 0.0f);
 }
 
 // sm1 = s-1
-float PitchShift::cubicInterpolation(float sm1, float s0, float s1, float s2, float fraction) {
+float PitchShiftProcessor::cubicInterpolation(float sm1, float s0, float s1, float s2, float fraction) {
   float a = -0.5f * sm1 + 1.5f * s0 - 1.5f * s1 + 0.5f * s2;
   float b = sm1 - 2.5f * s0 + 2.0f * s1 - 0.5f * s2;
   float c = -0.5f * sm1 + 0.5f * s1;
@@ -123,7 +232,7 @@ float PitchShift::cubicInterpolation(float sm1, float s0, float s1, float s2, fl
   
 // }
 
-double PitchShift::convertSemitoneToRatio(int semitoneShift) {
+double PitchShiftProcessor::convertSemitoneToRatio(int semitoneShift) {
   const double exponent = static_cast<double>(semitoneShift) / 12.0;
     
   // The base is 2 (for an octave)
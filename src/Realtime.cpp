@@ -0,0 +1,182 @@
+#include "../include/Realtime.h"
+#include <atomic>
+#include <cstdint>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+  #include <xmmintrin.h>
+  #define MITTELVEC_HAS_MXCSR 1
+#elif defined(__aarch64__)
+  #define MITTELVEC_HAS_FPCR 1
+#endif
+
+#if defined(_WIN32)
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <pthread.h>
+  #include <sched.h>
+  #include <sys/mman.h>
+  #if defined(__APPLE__)
+    #include <dispatch/dispatch.h>
+  #else
+    #include <cerrno>
+    #include <semaphore.h>
+  #endif
+#endif
+
+namespace MittelVec {
+
+#if defined(MITTELVEC_HAS_MXCSR)
+static constexpr unsigned int mxcsrFlushToZero = 0x8000;
+static constexpr unsigned int mxcsrDenormalsAreZero = 0x0040;
+#elif defined(MITTELVEC_HAS_FPCR)
+static constexpr unsigned long long fpcrFlushToZero = 1ull << 24;
+#endif
+
+ScopedFlushDenormals::ScopedFlushDenormals() {
+#if defined(MITTELVEC_HAS_MXCSR)
+  previous = _mm_getcsr();
+  _mm_setcsr(static_cast<unsigned int>(previous) | mxcsrFlushToZero | mxcsrDenormalsAreZero);
+#elif defined(MITTELVEC_HAS_FPCR)
+  // FZ covers inputs and outputs on ARM, there's no separate DAZ.
+  unsigned long long fpcr;
+  __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+  previous = fpcr;
+  fpcr |= fpcrFlushToZero;
+  __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+#endif
+}
+
+ScopedFlushDenormals::~ScopedFlushDenormals() {
+#if defined(MITTELVEC_HAS_MXCSR)
+  _mm_setcsr(static_cast<unsigned int>(previous));
+#elif defined(MITTELVEC_HAS_FPCR)
+  unsigned long long fpcr = previous;
+  __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+#endif
+}
+
+#if defined(_WIN32)
+static bool setPriority(HANDLE thread, ThreadPriority priority) {
+  int level = priority == ThreadPriority::Realtime ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_NORMAL;
+  return SetThreadPriority(thread, level) != 0;
+}
+#else
+static bool setPriority(pthread_t thread, ThreadPriority priority) {
+  sched_param param {};
+  int policy = SCHED_OTHER;
+  if (priority == ThreadPriority::Realtime) {
+    // Middle of the range, audio callbacks usually sit near the top.
+    policy = SCHED_FIFO;
+    param.sched_priority = (sched_get_priority_min(SCHED_FIFO) + sched_get_priority_max(SCHED_FIFO)) / 2;
+  }
+  return pthread_setschedparam(thread, policy, &param) == 0;
+}
+#endif
+
+bool setThreadPriority(std::thread& thread, ThreadPriority priority) {
+  if (!thread.joinable()) return false;
+  return setPriority(thread.native_handle(), priority);
+}
+
+bool setCurrentThreadPriority(ThreadPriority priority) {
+#if defined(_WIN32)
+  return setPriority(GetCurrentThread(), priority);
+#else
+  return setPriority(pthread_self(), priority);
+#endif
+}
+
+static std::atomic<ThreadPriority> workerThreadPriority { ThreadPriority::Normal };
+
+void setWorkerThreadPriority(ThreadPriority priority) {
+  workerThreadPriority.store(priority, std::memory_order_relaxed);
+}
+
+ThreadPriority getWorkerThreadPriority() {
+  return workerThreadPriority.load(std::memory_order_relaxed);
+}
+
+// macOS doesn't do unnamed POSIX semaphores, dispatch ones are the equivalent.
+WakeSignal::WakeSignal() {
+#if defined(_WIN32)
+  semaphore = CreateSemaphoreA(NULL, 0, LONG_MAX, NULL);
+#elif defined(__APPLE__)
+  semaphore = dispatch_semaphore_create(0);
+#else
+  sem_t* posixSemaphore = new sem_t;
+  sem_init(posixSemaphore, 0, 0);
+  semaphore = posixSemaphore;
+#endif
+}
+
+WakeSignal::~WakeSignal() {
+#if defined(_WIN32)
+  CloseHandle(static_cast<HANDLE>(semaphore));
+#elif defined(__APPLE__)
+  dispatch_release(static_cast<dispatch_semaphore_t>(semaphore));
+#else
+  sem_destroy(static_cast<sem_t*>(semaphore));
+  delete static_cast<sem_t*>(semaphore);
+#endif
+}
+
+void WakeSignal::signal() {
+#if defined(_WIN32)
+  ReleaseSemaphore(static_cast<HANDLE>(semaphore), 1, NULL);
+#elif defined(__APPLE__)
+  dispatch_semaphore_signal(static_cast<dispatch_semaphore_t>(semaphore));
+#else
+  sem_post(static_cast<sem_t*>(semaphore));
+#endif
+}
+
+void WakeSignal::wait() {
+#if defined(_WIN32)
+  WaitForSingleObject(static_cast<HANDLE>(semaphore), INFINITE);
+#elif defined(__APPLE__)
+  dispatch_semaphore_wait(static_cast<dispatch_semaphore_t>(semaphore), DISPATCH_TIME_FOREVER);
+#else
+  while (sem_wait(static_cast<sem_t*>(semaphore)) != 0 && errno == EINTR) {}
+#endif
+}
+
+bool lockMemory(const void* data, size_t bytes) {
+  if (!data || bytes == 0) return true;
+#if defined(_WIN32)
+  return VirtualLock(const_cast<void*>(data), bytes) != 0;
+#else
+  return mlock(data, bytes) == 0;
+#endif
+}
+
+void unlockMemory(const void* data, size_t bytes) {
+  if (!data || bytes == 0) return;
+#if defined(_WIN32)
+  VirtualUnlock(const_cast<void*>(data), bytes);
+#else
+  munlock(data, bytes);
+#endif
+}
+
+bool lockProcessMemory() {
+#if defined(_WIN32)
+  return false;
+#else
+  return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+#endif
+}
+
+void prefaultMemory(const void* data, size_t bytes) {
+  // Smallest common page size, touching more often than needed is harmless.
+  constexpr size_t pageSize = 4096;
+  const volatile uint8_t* bytesIn = static_cast<const volatile uint8_t*>(data);
+  for (size_t i = 0; i < bytes; i += pageSize) {
+    (void)bytesIn[i];
+  }
+  if (bytes > 0) (void)bytesIn[bytes - 1];
+}
+
+} // namespace
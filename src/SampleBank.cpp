@@ -0,0 +1,311 @@
+#include "../include/SampleBank.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+
+#if defined(_WIN32)
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+namespace MittelVec {
+
+// On-disk layout: header, entry table, names, then sample data.
+// Data is aligned so float/int16 reads out of the mapping are aligned too.
+static const char bankMagic[4] = { 'M', 'V', 'B', 'K' };
+static const uint32_t bankVersion = 2; // 2 added loops.
+static const uint64_t bankDataAlignment = 64;
+
+struct BankFileHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t numChannels;
+  float sampleRate;
+  uint32_t entryCount;
+  uint32_t reserved;
+};
+
+struct BankFileEntry {
+  uint64_t nameOffset;
+  uint32_t nameLength;
+  uint32_t format;
+  uint64_t numSamples;
+  uint64_t dataOffset;
+  uint64_t dataSize;
+  uint64_t headersOffset;
+  uint64_t headersSize;
+  uint32_t hasLoop;
+  uint32_t reserved;
+  double loopStart;
+  double loopEnd;
+  double loopCrossfade;
+};
+
+static uint64_t alignBankOffset(uint64_t offset) {
+  return (offset + bankDataAlignment - 1) / bankDataAlignment * bankDataAlignment;
+}
+
+// Written so an untrusted offset + size can't wrap around.
+static bool inMapping(uint64_t offset, uint64_t size, size_t mappingSize) {
+  return size <= mappingSize && offset <= mappingSize - size;
+}
+
+struct SampleBank::MappedFile {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+#if defined(_WIN32)
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+#endif
+
+  explicit MappedFile(const std::string& path) {
+#if defined(_WIN32)
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return;
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) return;
+
+    data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (data) size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+      void* mapped = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+      if (mapped != MAP_FAILED) {
+        data = static_cast<const uint8_t*>(mapped);
+        size = static_cast<size_t>(fileStat.st_size);
+      }
+    }
+
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+#endif
+  }
+
+  ~MappedFile() {
+#if defined(_WIN32)
+    if (data) UnmapViewOfFile(data);
+    if (mapping != NULL) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (data) munmap(const_cast<uint8_t*>(data), size);
+#endif
+  }
+};
+
+std::string SampleBank::entryKey(const std::string& fileName, SampleFormat storage) {
+  return fileName + "#" + std::to_string(static_cast<int>(storage));
+}
+
+SampleBank::SampleBank(const std::string& bankPath, const AudioContext& context)
+  : context(context), mapping(std::make_shared<MappedFile>(bankPath)) {
+  if (!mapping->data || mapping->size < sizeof(BankFileHeader)) {
+    throw std::runtime_error("Failed to map sample bank: " + bankPath);
+  }
+
+  BankFileHeader header;
+  std::memcpy(&header, mapping->data, sizeof(header));
+
+  if (std::memcmp(header.magic, bankMagic, sizeof(bankMagic)) != 0 || header.version != bankVersion) {
+    throw std::runtime_error("Not a sample bank (or wrong version): " + bankPath);
+  }
+
+  if (static_cast<int>(header.numChannels) != context.numChannels || header.sampleRate != context.sampleRate) {
+    throw std::runtime_error("Sample bank was built for a different channel count or sample rate: " + bankPath);
+  }
+
+  const uint64_t tableEnd = sizeof(BankFileHeader) + static_cast<uint64_t>(header.entryCount) * sizeof(BankFileEntry);
+  if (tableEnd > mapping->size) {
+    throw std::runtime_error("Truncated sample bank: " + bankPath);
+  }
+
+  for (uint32_t i = 0; i < header.entryCount; ++i) {
+    BankFileEntry entry;
+    std::memcpy(&entry, mapping->data + sizeof(BankFileHeader) + i * sizeof(BankFileEntry), sizeof(entry));
+
+    if (!inMapping(entry.nameOffset, entry.nameLength, mapping->size)
+      || !inMapping(entry.dataOffset, entry.dataSize, mapping->size)
+      || !inMapping(entry.headersOffset, entry.headersSize, mapping->size)
+      || entry.dataOffset % bankDataAlignment != 0
+      || entry.headersOffset % bankDataAlignment != 0
+      || entry.format > static_cast<uint32_t>(SampleFormat::ImaAdpcm)
+      || entry.numSamples > static_cast<uint64_t>(std::numeric_limits<int>::max())
+      || entry.numSamples % context.numChannels != 0) {
+      throw std::runtime_error("Corrupt sample bank index: " + bankPath);
+    }
+
+    // Reads trust the sample count, so the data has to be exactly what it takes to hold them.
+    const SampleFormat format = static_cast<SampleFormat>(entry.format);
+    const int numSamples = static_cast<int>(entry.numSamples);
+    auto expected = SampleData::fromEncoded(context, format, numSamples, nullptr, nullptr, nullptr);
+    if (entry.dataSize != expected->getEncodedSize() || entry.headersSize != expected->getBlockHeadersSize()) {
+      throw std::runtime_error("Corrupt sample bank index: " + bankPath);
+    }
+
+    std::string name(reinterpret_cast<const char*>(mapping->data + entry.nameOffset), entry.nameLength);
+    std::optional<SampleLoop> loop;
+    if (entry.hasLoop) loop = SampleLoop { entry.loopStart, entry.loopEnd, entry.loopCrossfade };
+    entries[name] = Entry {
+      format,
+      numSamples,
+      mapping->data + entry.dataOffset,
+      entry.headersSize ? mapping->data + entry.headersOffset : nullptr,
+      loop
+    };
+  }
+}
+
+std::shared_ptr<const SampleData> SampleBank::get(const std::string& fileName, SampleFormat storage) const {
+  auto it = entries.find(entryKey(fileName, storage));
+  if (it == entries.end()) {
+    throw std::runtime_error("Sample not found in bank: " + fileName);
+  }
+
+  const Entry& entry = it->second;
+  auto data = SampleData::fromEncoded(context, entry.format, entry.numSamples, entry.data, entry.blockHeaders, mapping, entry.loop);
+  // Mapped pages load on first read, do that now instead of in the audio callback.
+  prefaultMemory(data->getEncodedData(), data->getEncodedSize());
+  prefaultMemory(data->getBlockHeaders(), data->getBlockHeadersSize());
+  return data;
+}
+
+bool SampleBank::contains(const std::string& fileName, SampleFormat storage) const {
+  return entries.count(entryKey(fileName, storage)) > 0;
+}
+
+bool SampleBank::write(
+  const std::string& bankPath,
+  const AudioContext& context,
+  const std::vector<SamplePackItem>& samplePackItems,
+  const std::string& samplesDir
+) {
+  std::vector<SampleRequest> files;
+  for (const auto& item : samplePackItems) {
+    files.push_back({ item.fileName, item.storage });
+  }
+  return write(bankPath, context, files, samplesDir);
+}
+
+bool SampleBank::write(
+  const std::string& bankPath,
+  const AudioContext& context,
+  const std::vector<MusicCue>& cues,
+  const std::string& samplesDir
+) {
+  std::vector<SampleRequest> files;
+  for (const auto& cue : cues) {
+    files.push_back({ cue.fileName, cue.storage });
+  }
+  return write(bankPath, context, files, samplesDir);
+}
+
+bool SampleBank::write(
+  const std::string& bankPath,
+  const AudioContext& context,
+  const std::vector<SampleRequest>& files,
+  const std::string& samplesDir
+) {
+  // Unique files only, keyed the same way lookups are.
+  std::map<std::string, SampleRequest> unique;
+  for (const auto& file : files) {
+    unique.emplace(entryKey(file.path, file.storage), file);
+  }
+
+  std::vector<std::string> names;
+  std::vector<std::shared_ptr<const SampleData>> samples;
+  for (const auto& [key, file] : unique) {
+    names.push_back(key);
+    samples.push_back(SampleData::fromFile(context, samplesDir + file.path, file.storage));
+    // fromFile has already said why.
+    if (samples.back()->size() == 0) {
+      printf("Failed to add %s to sample bank %s\n", file.path.c_str(), bankPath.c_str());
+      return false;
+    }
+  }
+
+  // Lay out names right after the table, then each entry's data and block headers.
+  std::vector<BankFileEntry> table(names.size());
+  uint64_t offset = sizeof(BankFileHeader) + table.size() * sizeof(BankFileEntry);
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    table[i].nameOffset = offset;
+    table[i].nameLength = static_cast<uint32_t>(names[i].size());
+    offset += names[i].size();
+  }
+
+  for (size_t i = 0; i < samples.size(); ++i) {
+    table[i].format = static_cast<uint32_t>(samples[i]->getFormat());
+    table[i].numSamples = static_cast<uint64_t>(samples[i]->size());
+    if (const auto& loop = samples[i]->getLoop()) {
+      table[i].hasLoop = 1;
+      table[i].loopStart = loop->start;
+      table[i].loopEnd = loop->end;
+      table[i].loopCrossfade = loop->crossfade;
+    }
+
+    offset = alignBankOffset(offset);
+    table[i].dataOffset = offset;
+    table[i].dataSize = samples[i]->getEncodedSize();
+    offset += table[i].dataSize;
+
+    offset = alignBankOffset(offset);
+    table[i].headersOffset = offset;
+    table[i].headersSize = samples[i]->getBlockHeadersSize();
+    offset += table[i].headersSize;
+  }
+
+  std::ofstream out(bankPath, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    printf("Failed to open sample bank for writing at path %s\n", bankPath.c_str());
+    return false;
+  }
+
+  BankFileHeader header = {};
+  std::memcpy(header.magic, bankMagic, sizeof(bankMagic));
+  header.version = bankVersion;
+  header.numChannels = static_cast<uint32_t>(context.numChannels);
+  header.sampleRate = context.sampleRate;
+  header.entryCount = static_cast<uint32_t>(table.size());
+
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(BankFileEntry));
+  for (const auto& name : names) {
+    out.write(name.data(), name.size());
+  }
+
+  auto padTo = [&out](uint64_t target) {
+    static const char zeros[bankDataAlignment] = {};
+    uint64_t position = static_cast<uint64_t>(out.tellp());
+    if (target > position) out.write(zeros, target - position);
+  };
+
+  for (size_t i = 0; i < samples.size(); ++i) {
+    padTo(table[i].dataOffset);
+    out.write(static_cast<const char*>(samples[i]->getEncodedData()), table[i].dataSize);
+    padTo(table[i].headersOffset);
+    if (table[i].headersSize) {
+      out.write(static_cast<const char*>(samples[i]->getBlockHeaders()), table[i].headersSize);
+    }
+  }
+
+  return static_cast<bool>(out);
+}
+
+} // namespace MittelVec
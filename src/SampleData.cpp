@@ -0,0 +1,431 @@
+#include "../include/SampleData.h"
+#include "../include/Realtime.h"
+#include "../miniaudio.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+namespace MittelVec {
+
+// Standard IMA-ADPCM tables.
+static const int imaIndexTable[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int imaStepTable[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+  12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static int16_t floatToInt16(float sample) {
+  float scaled = std::round(sample * 32767.0f);
+  return static_cast<int16_t>(std::clamp(scaled, -32768.0f, 32767.0f));
+}
+
+// read() decodes ADPCM a block at a time into a stack buffer sized for maxChannels.
+static void requireAdpcmChannels(int channels) {
+  if (channels > SampleData::maxChannels) {
+    throw std::runtime_error("IMA-ADPCM samples support at most " + std::to_string(SampleData::maxChannels) + " channels.");
+  }
+}
+
+SampleData::SampleData(const AudioContext& context, SampleFormat format)
+  : format(format), channels(context.numChannels), sampleRate(context.sampleRate), numSamples(0) {}
+
+SampleData::~SampleData() {
+  if (memoryLocked) {
+    unlockMemory(encoded, getEncodedSize());
+    unlockMemory(blockHeaders, getBlockHeadersSize());
+  }
+}
+
+bool SampleData::lockMemory() const {
+  if (memoryLocked) return true;
+  memoryLocked = MittelVec::lockMemory(encoded, getEncodedSize())
+    && MittelVec::lockMemory(blockHeaders, getBlockHeadersSize());
+  if (!memoryLocked) unlockMemory(encoded, getEncodedSize());
+  return memoryLocked;
+}
+
+std::shared_ptr<const SampleData> SampleData::fromFile(const AudioContext& context, const std::string& path, SampleFormat format) {
+  auto data = std::make_shared<SampleData>(context, format);
+  data->loadFile(path);
+  return data;
+}
+
+std::shared_ptr<const SampleData> SampleData::fromEncoded(
+  const AudioContext& context,
+  SampleFormat format,
+  int numSamples,
+  const void* encodedData,
+  const void* blockHeaders,
+  std::shared_ptr<const void> owner,
+  std::optional<SampleLoop> loop
+) {
+  if (format == SampleFormat::ImaAdpcm) requireAdpcmChannels(context.numChannels);
+
+  auto data = std::make_shared<SampleData>(context, format);
+  data->numSamples = numSamples;
+  data->loop = loop;
+  data->encoded = encodedData;
+  data->blockHeaders = static_cast<const AdpcmBlockHeader*>(blockHeaders);
+  data->externalOwner = std::move(owner);
+  return data;
+}
+
+std::shared_ptr<const SampleData> SampleData::copyPrefix(int count) const {
+  count = std::clamp(count, 0, numSamples);
+
+  auto prefix = std::make_shared<SampleData>(AudioContext { 0, channels, sampleRate }, format);
+  if (format == SampleFormat::ImaAdpcm) {
+    // Blocks are stored one after another so whole blocks are a plain prefix of the codes/headers.
+    const int blockSamples = adpcmBlockFrames * channels;
+    count = std::min(numSamples, (count + blockSamples - 1) / blockSamples * blockSamples);
+  }
+
+  prefix->numSamples = count;
+  const uint8_t* bytes = static_cast<const uint8_t*>(encoded);
+  switch (format) {
+    case SampleFormat::Float32:
+      prefix->floatData.assign(static_cast<const float*>(encoded), static_cast<const float*>(encoded) + count);
+      break;
+    case SampleFormat::Int16:
+      prefix->int16Data.assign(static_cast<const int16_t*>(encoded), static_cast<const int16_t*>(encoded) + count);
+      break;
+    case SampleFormat::ImaAdpcm:
+      prefix->adpcmData.assign(bytes, bytes + prefix->getEncodedSize());
+      prefix->adpcmHeaders.assign(blockHeaders, blockHeaders + prefix->getBlockHeadersSize() / sizeof(AdpcmBlockHeader));
+      break;
+  }
+  prefix->pointAtOwnedData();
+  return prefix;
+}
+
+int SampleData::resampledFrames(int numFrames, float fromRate, float toRate) {
+  return static_cast<int>(std::lround(static_cast<double>(numFrames) * toRate / fromRate));
+}
+
+std::shared_ptr<const SampleData> SampleData::resampled(float newSampleRate) const {
+  auto data = std::make_shared<SampleData>(AudioContext { 0, channels, newSampleRate }, format);
+  const int numFrames = getNumFrames();
+  const int newFrames = resampledFrames(numFrames, sampleRate, newSampleRate);
+  if (numFrames == 0 || newFrames == 0) return data;
+
+  std::vector<float> source(numSamples);
+  read(0, source.data(), numSamples, 1.0f);
+
+  // Catmull-Rom between the two nearest frames, edges clamped.
+  auto at = [&](int frame, int ch) { return source[std::clamp(frame, 0, numFrames - 1) * channels + ch]; };
+  const double step = static_cast<double>(sampleRate) / newSampleRate;
+  std::vector<float> samples(static_cast<size_t>(newFrames) * channels);
+
+  for (int i = 0; i < newFrames; ++i) {
+    const double position = i * step;
+    const int frame = static_cast<int>(position);
+    const float t = static_cast<float>(position - frame);
+
+    for (int ch = 0; ch < channels; ++ch) {
+      float p0 = at(frame - 1, ch), p1 = at(frame, ch), p2 = at(frame + 1, ch), p3 = at(frame + 2, ch);
+      samples[i * channels + ch] = p1 + 0.5f * t * (p2 - p0 + t * (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3 + t * (3.0f * (p1 - p2) + p3 - p0)));
+    }
+  }
+
+  data->setSamples(samples);
+  data->loop = loop;
+  return data;
+}
+
+static uint32_t readLe32(const uint8_t* bytes) {
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+// First loop of a WAV's smpl chunk. Miniaudio doesn't hand us chunks, so this walks the RIFF
+// structure itself, it's only the chunk headers plus fmt and smpl that get read.
+static std::optional<SampleLoop> readWavLoop(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  uint8_t header[12];
+  if (!file.read(reinterpret_cast<char*>(header), sizeof(header))
+    || std::memcmp(header, "RIFF", 4) != 0 || std::memcmp(header + 8, "WAVE", 4) != 0) {
+    return std::nullopt;
+  }
+
+  uint32_t fileSampleRate = 0;
+  std::vector<uint8_t> smpl;
+  uint8_t chunkHeader[8];
+  while (file.read(reinterpret_cast<char*>(chunkHeader), sizeof(chunkHeader))) {
+    const uint32_t chunkSize = readLe32(chunkHeader + 4);
+    const std::streamoff next = static_cast<std::streamoff>(file.tellg()) + chunkSize + (chunkSize & 1); // Chunks are padded to even sizes.
+
+    if (std::memcmp(chunkHeader, "fmt ", 4) == 0 && chunkSize >= 8) {
+      uint8_t fmt[8];
+      if (!file.read(reinterpret_cast<char*>(fmt), sizeof(fmt))) break;
+      fileSampleRate = readLe32(fmt + 4);
+    } else if (std::memcmp(chunkHeader, "smpl", 4) == 0 && chunkSize >= 36) {
+      smpl.resize(chunkSize);
+      if (!file.read(reinterpret_cast<char*>(smpl.data()), chunkSize)) return std::nullopt;
+    }
+    if (fileSampleRate && !smpl.empty()) break;
+    file.seekg(next);
+  }
+
+  // 36 bytes of sampler info, then 24 bytes per loop: id, type, start, end (inclusive), fraction, play count.
+  if (!fileSampleRate || smpl.size() < 36 + 24 || readLe32(smpl.data() + 28) == 0) {
+    return std::nullopt;
+  }
+  const uint32_t start = readLe32(smpl.data() + 36 + 8);
+  const uint32_t end = readLe32(smpl.data() + 36 + 12);
+  if (end < start) return std::nullopt;
+
+  SampleLoop loop;
+  loop.start = static_cast<double>(start) / fileSampleRate;
+  loop.end = static_cast<double>(end + 1) / fileSampleRate;
+  return loop;
+}
+
+bool SampleData::loadFile(const std::string& path) {
+  // Loaders call this on their threads, so report it like any other failed load.
+  if (format == SampleFormat::ImaAdpcm && channels > maxChannels) {
+    printf("Can't store %s as IMA-ADPCM, more than %d channels.\n", path.c_str(), maxChannels);
+    return false;
+  }
+
+  ma_decoder decoder;
+  ma_decoder_config decoderConfig = ma_decoder_config_init(
+    ma_format_f32,
+    channels,
+    sampleRate
+  );
+
+  if (ma_decoder_init_file(path.c_str(), &decoderConfig, &decoder) != MA_SUCCESS) {
+    printf("Failed to load WAV file at path %s\n", path.c_str());
+    return false;
+  }
+
+  ma_uint64 totalFrames;
+  if (ma_decoder_get_length_in_pcm_frames(&decoder, &totalFrames) != MA_SUCCESS) {
+    printf("Failed to get length of WAV file.\n");
+    ma_decoder_uninit(&decoder);
+    return false;
+  }
+
+  std::vector<float> samples(static_cast<size_t>(totalFrames) * channels, 0.0f);
+  ma_uint64 framesRead = 0;
+  if (ma_decoder_read_pcm_frames(&decoder, samples.data(), totalFrames, &framesRead) != MA_SUCCESS) {
+    printf("Failed to read WAV file.\n");
+  }
+  ma_decoder_uninit(&decoder);
+
+  samples.resize(static_cast<size_t>(framesRead) * channels);
+  setSamples(samples);
+  loop = readWavLoop(path);
+  return true;
+}
+
+void SampleData::setSamples(const std::vector<float>& samples) {
+  numSamples = static_cast<int>(samples.size());
+  floatData.clear();
+  int16Data.clear();
+  adpcmData.clear();
+  adpcmHeaders.clear();
+
+  switch (format) {
+    case SampleFormat::Float32:
+      floatData = samples;
+      break;
+    case SampleFormat::Int16:
+      int16Data.resize(samples.size());
+      std::transform(samples.begin(), samples.end(), int16Data.begin(), floatToInt16);
+      break;
+    case SampleFormat::ImaAdpcm:
+      encodeAdpcm(samples);
+      break;
+  }
+
+  pointAtOwnedData();
+}
+
+void SampleData::pointAtOwnedData() {
+  externalOwner.reset();
+  blockHeaders = nullptr;
+
+  switch (format) {
+    case SampleFormat::Float32:
+      encoded = floatData.data();
+      break;
+    case SampleFormat::Int16:
+      encoded = int16Data.data();
+      break;
+    case SampleFormat::ImaAdpcm:
+      encoded = adpcmData.data();
+      blockHeaders = adpcmHeaders.data();
+      break;
+  }
+}
+
+void SampleData::encodeAdpcm(const std::vector<float>& samples) {
+  requireAdpcmChannels(channels);
+
+  const int numFrames = getNumFrames();
+  const int numBlocks = (numFrames + adpcmBlockFrames - 1) / adpcmBlockFrames;
+  const int bytesPerChannelBlock = adpcmBlockFrames / 2;
+
+  adpcmHeaders.resize(numBlocks * channels);
+  adpcmData.assign(numBlocks * channels * bytesPerChannelBlock, 0);
+
+  for (int ch = 0; ch < channels; ++ch) {
+    int predictor = 0;
+    int stepIndex = 0;
+
+    for (int block = 0; block < numBlocks; ++block) {
+      // Each block stores the encoder state it starts from so it can be decoded on its own.
+      adpcmHeaders[block * channels + ch] = { static_cast<int16_t>(predictor), static_cast<uint8_t>(stepIndex) };
+      uint8_t* codes = &adpcmData[(block * channels + ch) * bytesPerChannelBlock];
+
+      for (int i = 0; i < adpcmBlockFrames; ++i) {
+        int frame = block * adpcmBlockFrames + i;
+        int sample = frame < numFrames ? floatToInt16(samples[frame * channels + ch]) : 0;
+
+        int diff = sample - predictor;
+        int step = imaStepTable[stepIndex];
+        int code = 0;
+        if (diff < 0) {
+          code = 8;
+          diff = -diff;
+        }
+
+        int delta = step >> 3;
+        if (diff >= step) { code |= 4; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { code |= 2; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { code |= 1; delta += step; }
+
+        predictor += (code & 8) ? -delta : delta;
+        predictor = std::clamp(predictor, -32768, 32767);
+        stepIndex = std::clamp(stepIndex + imaIndexTable[code], 0, 88);
+
+        codes[i / 2] |= (i & 1) ? (code << 4) : code;
+      }
+    }
+  }
+}
+
+// Decodes a whole block into `dest` as interleaved floats.
+void SampleData::decodeAdpcmBlock(int blockIndex, float* dest) const {
+  const int bytesPerChannelBlock = adpcmBlockFrames / 2;
+
+  for (int ch = 0; ch < channels; ++ch) {
+    const AdpcmBlockHeader& header = blockHeaders[blockIndex * channels + ch];
+    const uint8_t* codes = static_cast<const uint8_t*>(encoded) + (blockIndex * channels + ch) * bytesPerChannelBlock;
+    int predictor = header.predictor;
+    int stepIndex = header.stepIndex;
+
+    for (int i = 0; i < adpcmBlockFrames; ++i) {
+      int code = (i & 1) ? (codes[i / 2] >> 4) : (codes[i / 2] & 0x0F);
+      int step = imaStepTable[stepIndex];
+
+      int delta = step >> 3;
+      if (code & 4) delta += step;
+      if (code & 2) delta += step >> 1;
+      if (code & 1) delta += step >> 2;
+
+      predictor += (code & 8) ? -delta : delta;
+      predictor = std::clamp(predictor, -32768, 32767);
+      stepIndex = std::clamp(stepIndex + imaIndexTable[code], 0, 88);
+
+      dest[i * channels + ch] = static_cast<float>(predictor) * (1.0f / 32768.0f);
+    }
+  }
+}
+
+/**
+ * Converts/decodes straight into the voice's buffer.
+ * The Float32 and Int16 loops are kept branch free so the compiler can vectorize them.
+ * ADPCM is a serial recurrence per channel, so it's decoded a block at a time into
+ * a small stack scratch and then copied out with the gain applied.
+ */
+void SampleData::read(int start, float* dest, int count, float gain) const {
+  assert(start >= 0 && start + count <= numSamples);
+
+  switch (format) {
+    case SampleFormat::Float32: {
+      const float* src = static_cast<const float*>(encoded) + start;
+      for (int i = 0; i < count; ++i) {
+        dest[i] = src[i] * gain;
+      }
+      break;
+    }
+    case SampleFormat::Int16: {
+      const int16_t* src = static_cast<const int16_t*>(encoded) + start;
+      const float scale = gain * (1.0f / 32768.0f);
+      for (int i = 0; i < count; ++i) {
+        dest[i] = static_cast<float>(src[i]) * scale;
+      }
+      break;
+    }
+    case SampleFormat::ImaAdpcm: {
+      float block[adpcmBlockFrames * maxChannels];
+      const int blockSamples = adpcmBlockFrames * channels;
+      int blockIndex = start / blockSamples;
+      int offset = start % blockSamples;
+
+      while (count > 0) {
+        decodeAdpcmBlock(blockIndex, block);
+        int n = std::min(count, blockSamples - offset);
+        for (int i = 0; i < n; ++i) {
+          dest[i] = block[offset + i] * gain;
+        }
+        dest += n;
+        count -= n;
+        offset = 0;
+        ++blockIndex;
+      }
+      break;
+    }
+  }
+}
+
+int SampleData::size() const { return numSamples; }
+int SampleData::getNumChannels() const { return channels; }
+int SampleData::getNumFrames() const { return channels > 0 ? numSamples / channels : 0; }
+float SampleData::getSampleRate() const { return sampleRate; }
+SampleFormat SampleData::getFormat() const { return format; }
+
+size_t SampleData::getMemoryUsage() const {
+  return getEncodedSize() + getBlockHeadersSize();
+}
+
+size_t SampleData::encodedSizeFor(int sampleCount) const {
+  switch (format) {
+    case SampleFormat::Float32:
+      return sampleCount * sizeof(float);
+    case SampleFormat::Int16:
+      return sampleCount * sizeof(int16_t);
+    case SampleFormat::ImaAdpcm: {
+      const int numFrames = channels > 0 ? sampleCount / channels : 0;
+      const int numBlocks = (numFrames + adpcmBlockFrames - 1) / adpcmBlockFrames;
+      return static_cast<size_t>(numBlocks) * channels * (adpcmBlockFrames / 2);
+    }
+  }
+  return 0;
+}
+
+const void* SampleData::getEncodedData() const { return encoded; }
+size_t SampleData::getEncodedSize() const { return encodedSizeFor(numSamples); }
+const void* SampleData::getBlockHeaders() const { return blockHeaders; }
+
+size_t SampleData::getBlockHeadersSize() const {
+  if (format != SampleFormat::ImaAdpcm) return 0;
+  return getEncodedSize() / (adpcmBlockFrames / 2) * sizeof(AdpcmBlockHeader);
+}
+
+} // namespace MittelVec
@@ -0,0 +1,155 @@
+#include "../include/SampleLoader.h"
+#include <atomic>
+#include <map>
+#include <utility>
+
+namespace MittelVec {
+
+// Collapses requests for the same file and storage format so each is only decoded once.
+// Returns the unique requests and, per original request, the index of its unique request.
+static std::pair<std::vector<SampleRequest>, std::vector<int>> dedupeRequests(const std::vector<SampleRequest>& requests) {
+  std::vector<SampleRequest> unique;
+  std::vector<int> requestToUnique;
+  std::map<std::pair<std::string, SampleFormat>, int> seen;
+
+  for (const auto& request : requests) {
+    auto key = std::make_pair(request.path, request.storage);
+    auto it = seen.find(key);
+    if (it == seen.end()) {
+      it = seen.emplace(key, static_cast<int>(unique.size())).first;
+      unique.push_back(request);
+    }
+    requestToUnique.push_back(it->second);
+  }
+
+  return { unique, requestToUnique };
+}
+
+SampleLoader::SampleLoader(int numThreads) {
+  if (numThreads <= 0) {
+    // Leave a core for the game and audio threads.
+    numThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+  }
+
+  workers.reserve(numThreads);
+  for (int i = 0; i < numThreads; ++i) {
+    workers.emplace_back(&SampleLoader::workerLoop, this);
+  }
+}
+
+SampleLoader::~SampleLoader() {
+  {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    stopping = true;
+  }
+  jobsAvailable.notify_all();
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void SampleLoader::enqueue(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    jobs.push(std::move(job));
+  }
+  jobsAvailable.notify_one();
+}
+
+void SampleLoader::workerLoop() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(jobsMutex);
+      jobsAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
+
+      // Drain queued jobs before exiting so pending loads still complete.
+      if (jobs.empty()) return;
+
+      job = std::move(jobs.front());
+      jobs.pop();
+    }
+    job();
+  }
+}
+
+void SampleLoader::loadBatch(
+  const AudioContext& context,
+  const std::vector<SampleRequest>& requests,
+  LoadCompleteCallback onComplete,
+  LoadProgressCallback onProgress
+) {
+  struct BatchState {
+    AudioContext context;
+    std::vector<SampleRequest> unique;
+    std::vector<int> requestToUnique;
+    std::vector<std::shared_ptr<const SampleData>> decoded;
+    std::atomic<int> remaining;
+    std::atomic<int> loaded { 0 };
+    LoadCompleteCallback onComplete;
+    LoadProgressCallback onProgress;
+
+    void finish() {
+      std::vector<std::shared_ptr<const SampleData>> results;
+      results.reserve(requestToUnique.size());
+      for (int index : requestToUnique) {
+        results.push_back(decoded[index]);
+      }
+      onComplete(std::move(results));
+    }
+  };
+
+  auto [unique, requestToUnique] = dedupeRequests(requests);
+  auto state = std::make_shared<BatchState>();
+  state->context = context;
+  state->unique = std::move(unique);
+  state->requestToUnique = std::move(requestToUnique);
+  state->decoded.resize(state->unique.size());
+  state->remaining = static_cast<int>(state->unique.size());
+  state->onComplete = std::move(onComplete);
+  state->onProgress = std::move(onProgress);
+
+  if (state->unique.empty()) {
+    enqueue([state] { state->finish(); });
+    return;
+  }
+
+  const int total = static_cast<int>(state->unique.size());
+  for (int i = 0; i < total; ++i) {
+    enqueue([state, i, total] {
+      const SampleRequest& request = state->unique[i];
+      state->decoded[i] = SampleData::fromFile(state->context, request.path, request.storage);
+
+      int loaded = ++state->loaded;
+      if (state->onProgress) state->onProgress(loaded, total);
+
+      // Last decode to finish hands the whole batch over.
+      if (--state->remaining == 0) {
+        state->finish();
+      }
+    });
+  }
+}
+
+std::vector<std::shared_ptr<const SampleData>> SampleLoader::loadAll(
+  const AudioContext& context,
+  const std::vector<SampleRequest>& requests
+) {
+  auto [unique, requestToUnique] = dedupeRequests(requests);
+
+  std::vector<std::shared_ptr<const SampleData>> decoded;
+  decoded.reserve(unique.size());
+  for (const auto& request : unique) {
+    decoded.push_back(SampleData::fromFile(context, request.path, request.storage));
+  }
+
+  std::vector<std::shared_ptr<const SampleData>> results;
+  results.reserve(requests.size());
+  for (int index : requestToUnique) {
+    results.push_back(decoded[index]);
+  }
+  return results;
+}
+
+} // namespace MittelVec
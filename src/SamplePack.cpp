@@ -1,28 +1,207 @@
 #include "../include/SamplePack.h"
+#include "../include/SampleBank.h"
+#include <cstdio>
 
 namespace MittelVec {
 
+static std::vector<SampleRequest> samplePackRequests(const std::vector<SamplePackItem>& samplePackItems, const std::string& samplesDir) {
+  std::vector<SampleRequest> requests;
+  requests.reserve(samplePackItems.size());
+  for (const auto& item : samplePackItems) {
+    requests.push_back({ samplesDir + item.fileName, item.storage });
+  }
+  return requests;
+}
+
+static std::vector<std::shared_ptr<const SampleData>> samplePackBankSamples(const std::vector<SamplePackItem>& samplePackItems, const SampleBank& bank) {
+  std::vector<std::shared_ptr<const SampleData>> samples;
+  samples.reserve(samplePackItems.size());
+  for (const auto& item : samplePackItems) {
+    samples.push_back(bank.get(item.fileName, item.storage));
+  }
+  return samples;
+}
+
+static std::vector<std::shared_ptr<ResidentSample>> samplePackResidentSamples(
+  const AudioContext& context,
+  const std::vector<SamplePackItem>& samplePackItems,
+  const std::string& samplesDir,
+  SampleResidency& residency
+) {
+  std::vector<std::shared_ptr<ResidentSample>> samples;
+  samples.reserve(samplePackItems.size());
+  for (const auto& item : samplePackItems) {
+    samples.push_back(residency.load(context, samplesDir + item.fileName, item.storage));
+  }
+  return samples;
+}
+
+// Unmanaged samples, always fully resident.
+// Items sharing data share one ResidentSample too, so it's only resampled once on a reconfigure.
+static std::vector<std::shared_ptr<ResidentSample>> wrapResidentSamples(const std::vector<std::shared_ptr<const SampleData>>& samples) {
+  std::vector<std::shared_ptr<ResidentSample>> wrapped;
+  std::unordered_map<const SampleData*, std::shared_ptr<ResidentSample>> bySource;
+  wrapped.reserve(samples.size());
+  for (const auto& sample : samples) {
+    auto& resident = bySource[sample.get()];
+    if (!resident) resident = std::make_shared<ResidentSample>(sample);
+    wrapped.push_back(resident);
+  }
+  return wrapped;
+}
+
 SamplePack::SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, std::string samplesDir, float gain)
-  : graph(graph) {
-    auto [outputNodeId, outputNodePtr] = graph.addNode<Gain>(gain); // consider parameterizing gain
+  : SamplePack(
+    graph,
+    samplePackItems,
+    SampleLoader::loadAll(graph.audioContext, samplePackRequests(samplePackItems, samplesDir)),
+    gain
+  ) {}
+
+SamplePack::SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, const SampleBank& bank, float gain)
+  : SamplePack(graph, samplePackItems, samplePackBankSamples(samplePackItems, bank), gain) {}
+
+SamplePack::SamplePack(AudioGraph& graph, std::vector<SamplePackItem> samplePackItems, std::string samplesDir, SampleResidency& residency, float gain)
+  : SamplePack(graph, samplePackItems, samplePackResidentSamples(graph.audioContext, samplePackItems, samplesDir, residency), gain) {}
+
+SamplePack::SamplePack(
+  AudioGraph& graph,
+  std::vector<SamplePackItem> samplePackItems,
+  std::vector<std::shared_ptr<const SampleData>> samples,
+  float gain
+) : SamplePack(graph, samplePackItems, wrapResidentSamples(samples), gain) {}
+
+SamplePack::SamplePack(
+  AudioGraph& graph,
+  std::vector<SamplePackItem> samplePackItems,
+  std::vector<std::shared_ptr<ResidentSample>> samples,
+  float gain
+) : graph(graph), sends(graph) {
+    // Build every node up front so the graph lock below only covers inserts.
+    auto outputNode = std::make_unique<Mixer>(graph.audioContext, gain);
+    output = outputNode.get();
 
-    for (auto& item : samplePackItems) {
-      auto [samplerNodeId, samplerNodePtr] = graph.addNode<Sampler>(
-        samplesDir + item.fileName,
+    std::vector<std::unique_ptr<Sampler>> samplerNodes;
+    std::vector<Sampler*> samplersByHandle;
+    samplerNodes.reserve(samplePackItems.size());
+    for (size_t i = 0; i < samplePackItems.size(); ++i) {
+      const auto& item = samplePackItems[i];
+      handles[item.slug] = static_cast<SampleHandle>(i);
+      samplerNodes.push_back(std::make_unique<Sampler>(
+        graph.audioContext,
+        samples[i],
         item.polyphony,
         item.loop,
         item.gain,
         item.pitchShift,
         item.envConfig,
         item.filterConfig
-      );
-      samplers[item.slug] = samplerNodePtr;
+      ));
+      if (item.loopPoints) samplerNodes.back()->setLoopPoints(item.loopPoints);
+      samplersByHandle.push_back(samplerNodes.back().get());
+      samplers[item.slug] = samplerNodes.back().get();
+    }
+
+    auto triggerNode = std::make_unique<SampleTriggerNode>(graph.audioContext, samplersByHandle, triggerQueueSize);
+    triggers = triggerNode.get();
+
+    // Join the graph as one edit so the audio thread never sees a half built pack. Samples
+    // loaded before a reconfiguration are resampled first, without holding the lock.
+    std::vector<AudioNode*> nodes { outputNode.get(), triggerNode.get() };
+    for (const auto& samplerNode : samplerNodes) nodes.push_back(samplerNode.get());
+    auto lock = graph.lockGraphFor(nodes);
+    outputNodeId = graph.addNode(std::move(outputNode));
+    sends.setReturnNode(outputNodeId);
+    // Feeds every sampler so triggers are handled before they render.
+    int triggerNodeId = graph.addNode(std::move(triggerNode));
+
+    std::vector<int> samplerNodeIds;
+    samplerNodeIds.reserve(samplerNodes.size());
+    for (auto& samplerNode : samplerNodes) {
+      int samplerNodeId = graph.addNode(std::move(samplerNode));
+      graph.connect(triggerNodeId, samplerNodeId);
       graph.connect(samplerNodeId, outputNodeId);
+      samplerNodeIds.push_back(samplerNodeId);
+    }
+    lock.unlock();
+
+    // No buses yet, so registering the send sources doesn't touch the graph.
+    for (size_t i = 0; i < samplePackItems.size(); ++i) {
+      const auto& item = samplePackItems[i];
+      sends.addSource(item.slug, samplerNodeIds[i], samplersByHandle[i], item.sends);
     }
   }
 
-void SamplePack::triggerSample(std::string slug) {
-  samplers[slug]->noteOn();
+std::future<std::unique_ptr<SamplePack>> SamplePack::loadAsync(
+  SampleLoader& loader,
+  AudioGraph& graph,
+  std::vector<SamplePackItem> samplePackItems,
+  std::string samplesDir,
+  float gain,
+  LoadProgressCallback onProgress
+) {
+  auto promise = std::make_shared<std::promise<std::unique_ptr<SamplePack>>>();
+  auto future = promise->get_future();
+  auto requests = samplePackRequests(samplePackItems, samplesDir);
+
+  loader.loadBatch(
+    graph.audioContext,
+    requests,
+    [promise, &graph, samplePackItems = std::move(samplePackItems), gain](std::vector<std::shared_ptr<const SampleData>> samples) {
+      try {
+        promise->set_value(std::make_unique<SamplePack>(graph, samplePackItems, std::move(samples), gain));
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    },
+    onProgress
+  );
+
+  return future;
+}
+
+SampleHandle SamplePack::getHandle(const std::string& slug) const {
+  auto it = handles.find(slug);
+  return it == handles.end() ? invalidSampleHandle : it->second;
+}
+
+bool SamplePack::triggerSample(SampleHandle handle, float gain, int pitchShift) {
+  SampleTrigger trigger { handle, gain, pitchShift };
+  return triggers->push(&trigger, 1);
+}
+
+bool SamplePack::releaseSample(SampleHandle handle) {
+  SampleTrigger trigger { handle, 1.0f, 0, true };
+  return triggers->push(&trigger, 1);
+}
+
+bool SamplePack::triggerSamples(const SampleTrigger* batch, size_t count) {
+  return triggers->push(batch, count);
+}
+
+bool SamplePack::triggerSamples(const std::vector<SampleTrigger>& batch) {
+  return triggers->push(batch.data(), batch.size());
+}
+
+void SamplePack::triggerSample(const std::string& slug) {
+  SampleHandle handle = getHandle(slug);
+  if (handle == invalidSampleHandle) {
+    printf("No sample pack item named %s\n", slug.c_str());
+    return;
+  }
+  triggerSample(handle);
+}
+
+bool SamplePack::lockSampleMemory() {
+  bool locked = true;
+  for (auto& [slug, sampler] : samplers) {
+    locked = sampler->lockSampleMemory() && locked;
+  }
+  return locked;
+}
+
+void SamplePack::setSendLevel(const std::string& slug, const std::string& bus, float level) {
+  sends.setSendLevel(slug, bus, level);
 }
 
 } // namespace
\ No newline at end of file
@@ -0,0 +1,270 @@
+#include "../include/SampleResidency.h"
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace MittelVec {
+
+ResidentSample::ResidentSample(std::shared_ptr<const SampleData> data)
+  : head(data), full(data), body(data.get()), numSamples(data->size()), channels(data->getNumChannels()),
+    sampleRate(data->getSampleRate()), loop(data->getLoop()) {}
+
+ResidentSample::~ResidentSample() {
+  if (residency) residency->forget(this);
+}
+
+int ResidentSample::size() const { return numSamples; }
+int ResidentSample::getNumChannels() const { return channels; }
+bool ResidentSample::isFullyResident() const { return body.load() != nullptr; }
+int ResidentSample::getUnderruns() const { return underruns.load(std::memory_order_relaxed); }
+float ResidentSample::getSampleRate() const { return sampleRate; }
+
+void ResidentSample::read(int start, float* dest, int count, float gain) const {
+  const int headSize = head->size();
+  if (start + count <= headSize) {
+    head->read(start, dest, count, gain);
+    return;
+  }
+
+  // The reader count goes up before the pointer is loaded and eviction swaps the pointer out
+  // before waiting for readers to drain, so a body we've loaded can't be freed under us.
+  readers.fetch_add(1);
+  const SampleData* data = body.load();
+  if (data) data->read(start, dest, count, gain);
+  readers.fetch_sub(1);
+  if (data) return;
+
+  // Body is evicted, play what the head covers and silence for the rest.
+  int fromHead = std::max(0, headSize - start);
+  if (fromHead > 0) head->read(start, dest, fromHead, gain);
+  std::fill(dest + fromHead, dest + count, 0.0f);
+  underruns.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ResidentSample::touch() {
+  if (residency) residency->touch(this);
+}
+
+void ResidentSample::pin() {
+  pins.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ResidentSample::unpin() {
+  pins.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Decodes the file at the rate it was loaded at, then resamples, same as a reload would.
+// Then a reload after the switch always comes back the same length.
+static std::shared_ptr<const SampleData> decodeAtRate(const AudioContext& context, const std::string& path, SampleFormat storage, float sampleRate) {
+  auto data = SampleData::fromFile(context, path, storage);
+  return data->getSampleRate() == sampleRate ? data : data->resampled(sampleRate);
+}
+
+// Samples wrapping the same data (several samplers built from one SampleData) share one
+// resampled copy instead of each making their own. Entries go once nobody uses the copy.
+struct ResampledCopy {
+  std::weak_ptr<const SampleData> source;
+  float sampleRate;
+  std::weak_ptr<const SampleData> copy;
+};
+
+static std::shared_ptr<const SampleData> sharedResample(const std::shared_ptr<const SampleData>& source, float sampleRate) {
+  static std::mutex mutex;
+  static std::vector<ResampledCopy> copies;
+
+  // Held while resampling so a second sampler on the same data waits for this copy.
+  std::lock_guard<std::mutex> lock(mutex);
+  copies.erase(std::remove_if(copies.begin(), copies.end(), [](const ResampledCopy& entry) {
+    return entry.source.expired() || entry.copy.expired();
+  }), copies.end());
+
+  for (const ResampledCopy& entry : copies) {
+    // Compared by owner, so a new sample at a freed one's address never matches.
+    const bool sameSource = !entry.source.owner_before(source) && !source.owner_before(entry.source);
+    if (sameSource && entry.sampleRate == sampleRate) {
+      if (auto copy = entry.copy.lock()) return copy;
+    }
+  }
+
+  auto copy = source->resampled(sampleRate);
+  copies.push_back({ source, sampleRate, copy });
+  return copy;
+}
+
+void ResidentSample::prepareSampleRate(float newSampleRate) {
+  if (newSampleRate == sampleRate || (pendingFull && pendingFull->getSampleRate() == newSampleRate)) return;
+
+  if (residency) {
+    // Managed samples may be evicted, so always start from the file.
+    pendingFull = decodeAtRate(context, path, storage, newSampleRate);
+    pendingHead = pendingFull->copyPrefix(residency->headFrames * channels);
+  } else {
+    pendingFull = sharedResample(full, newSampleRate);
+    pendingHead = pendingFull;
+  }
+}
+
+void ResidentSample::applySampleRate() {
+  if (!pendingFull) return;
+
+  if (residency) {
+    // touch() and finishReload() read these under the residency lock on other threads.
+    std::lock_guard<std::mutex> lock(residency->mutex);
+    if (full) {
+      residency->residentBytes -= full->getMemoryUsage();
+      body.store(nullptr);
+      full.reset();
+    }
+    head = std::move(pendingHead);
+    numSamples = pendingFull->size();
+    sampleRate = pendingFull->getSampleRate();
+    residency->makeResident(this, pendingFull);
+    residency->enforceBudget(this);
+  } else {
+    full = pendingFull;
+    body.store(full.get());
+    head = std::move(pendingHead);
+    numSamples = pendingFull->size();
+    sampleRate = pendingFull->getSampleRate();
+  }
+
+  pendingFull.reset();
+  if (memoryLocked) lockMemory();
+}
+
+bool ResidentSample::lockMemory() {
+  memoryLocked = head->lockMemory();
+  if (!residency) memoryLocked = full->lockMemory() && memoryLocked;
+  return memoryLocked;
+}
+
+SampleResidency::SampleResidency(SampleLoader& loader, size_t budgetBytes, int headFrames)
+  : loader(loader), budgetBytes(budgetBytes), headFrames(headFrames) {}
+
+std::shared_ptr<ResidentSample> SampleResidency::load(const AudioContext& context, const std::string& path, SampleFormat storage) {
+  const std::string key = path + "#" + std::to_string(static_cast<int>(storage));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = samples.find(key);
+    if (it != samples.end()) {
+      if (auto existing = it->second.lock()) return existing;
+    }
+  }
+
+  // Decode outside the lock, this is the slow part.
+  auto data = SampleData::fromFile(context, path, storage);
+  auto sample = std::make_shared<ResidentSample>(data);
+  auto head = data->copyPrefix(headFrames * data->getNumChannels());
+
+  std::lock_guard<std::mutex> lock(mutex);
+  samples[key] = sample;
+
+  // Nothing to evict if the head already covers the whole sample.
+  if (head->size() >= data->size()) {
+    return sample;
+  }
+
+  sample->head = head;
+  sample->residency = this;
+  sample->context = context;
+  sample->path = path;
+  sample->storage = storage;
+  lru.push_front(sample.get());
+  sample->lruPosition = lru.begin();
+
+  residentBytes += data->getMemoryUsage();
+  enforceBudget(sample.get());
+  return sample;
+}
+
+void SampleResidency::setBudget(size_t newBudgetBytes) {
+  std::lock_guard<std::mutex> lock(mutex);
+  budgetBytes = newBudgetBytes;
+  enforceBudget(nullptr);
+}
+
+size_t SampleResidency::getBudget() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return budgetBytes;
+}
+
+size_t SampleResidency::getResidentBytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return residentBytes;
+}
+
+void SampleResidency::touch(ResidentSample* sample) {
+  std::lock_guard<std::mutex> lock(mutex);
+  lru.splice(lru.begin(), lru, sample->lruPosition);
+
+  if (sample->full) {
+    // Samples that were playing may have kept us over budget, they might have stopped by now.
+    if (residentBytes > budgetBytes) enforceBudget(sample);
+    return;
+  }
+  if (sample->reloading) return;
+
+  sample->reloading = true;
+  std::weak_ptr<ResidentSample> weakSample = sample->weak_from_this();
+  AudioContext context = sample->context;
+  std::string path = sample->path;
+  SampleFormat storage = sample->storage;
+  float sampleRate = sample->sampleRate;
+
+  loader.enqueue([this, weakSample, context, path, storage, sampleRate] {
+    auto data = decodeAtRate(context, path, storage, sampleRate);
+    if (auto reloaded = weakSample.lock()) {
+      finishReload(reloaded.get(), data);
+    }
+  });
+}
+
+void SampleResidency::forget(ResidentSample* sample) {
+  std::lock_guard<std::mutex> lock(mutex);
+  lru.erase(sample->lruPosition);
+  if (sample->full) residentBytes -= sample->full->getMemoryUsage();
+
+  for (auto it = samples.begin(); it != samples.end(); ) {
+    it = it->second.expired() ? samples.erase(it) : std::next(it);
+  }
+}
+
+void SampleResidency::finishReload(ResidentSample* sample, std::shared_ptr<const SampleData> data) {
+  std::lock_guard<std::mutex> lock(mutex);
+  sample->reloading = false;
+  // Also drops reloads started before a sample rate change.
+  if (sample->full || data->getSampleRate() != sample->sampleRate) return;
+
+  makeResident(sample, std::move(data));
+  enforceBudget(sample);
+}
+
+void SampleResidency::makeResident(ResidentSample* sample, std::shared_ptr<const SampleData> data) {
+  residentBytes += data->getMemoryUsage();
+  sample->full = std::move(data);
+  sample->body.store(sample->full.get());
+}
+
+void SampleResidency::evict(ResidentSample* sample) {
+  sample->body.store(nullptr);
+
+  // Wait out any read that picked up the old pointer, at most one block's worth of copying.
+  while (sample->readers.load() != 0) {
+    std::this_thread::yield();
+  }
+
+  residentBytes -= sample->full->getMemoryUsage();
+  sample->full.reset();
+}
+
+void SampleResidency::enforceBudget(ResidentSample* keep) {
+  for (auto it = lru.rbegin(); it != lru.rend() && residentBytes > budgetBytes; ++it) {
+    ResidentSample* candidate = *it;
+    if (candidate != keep && candidate->full && candidate->pins.load(std::memory_order_relaxed) == 0) {
+      evict(candidate);
+    }
+  }
+}
+
+} // namespace MittelVec
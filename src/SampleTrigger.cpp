@@ -0,0 +1,64 @@
+#include "../include/SampleTrigger.h"
+#include "../include/Sampler.h"
+
+namespace MittelVec {
+
+static size_t triggerQueueSize(size_t capacity) {
+  size_t size = 16;
+  while (size < capacity) size *= 2;
+  return size;
+}
+
+TriggerQueue::TriggerQueue(size_t capacity)
+  : ring(triggerQueueSize(capacity)), mask(ring.size() - 1) {}
+
+bool TriggerQueue::push(const SampleTrigger* triggers, size_t count) {
+  const size_t write = writeIndex.load(std::memory_order_relaxed);
+  const size_t read = readIndex.load(std::memory_order_acquire);
+  if (ring.size() - (write - read) < count) {
+    return false;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    ring[(write + i) & mask] = triggers[i];
+  }
+  writeIndex.store(write + count, std::memory_order_release);
+  return true;
+}
+
+SampleTriggerNode::SampleTriggerNode(const AudioContext& context, std::vector<Sampler*> samplers, size_t capacity)
+  : AudioNode(context), samplers(std::move(samplers)), queue(capacity) {}
+
+bool SampleTriggerNode::push(const SampleTrigger* triggers, size_t count) {
+  // Checked here so a bad handle is an error for the caller, not a trigger the audio thread drops.
+  // Same for a pitch the voices have no shifter for, it would just play at the item's own pitch.
+  for (size_t i = 0; i < count; ++i) {
+    if (triggers[i].handle < 0 || triggers[i].handle >= static_cast<SampleHandle>(samplers.size())) {
+      return false;
+    }
+    if (!triggers[i].release && triggers[i].pitchShift != 0 && !samplers[triggers[i].handle]->canPitchShift()) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (!triggers[i].release) samplers[triggers[i].handle]->touchSample();
+  }
+  return queue.push(triggers, count);
+}
+
+void SampleTriggerNode::process(const std::vector<const AudioBuffer*>& /*inputs*/, AudioBuffer& /*outputBuffer*/) {
+  queue.drain([this](const SampleTrigger& trigger) {
+    if (trigger.handle < 0 || trigger.handle >= static_cast<SampleHandle>(samplers.size())) return;
+
+    Sampler* sampler = samplers[trigger.handle];
+    if (trigger.release) {
+      sampler->noteOff();
+    } else {
+      sampler->startVoice(trigger.gain, trigger.pitchShift);
+    }
+  });
+  outputSilence();
+}
+
+} // namespace
@@ -1,9 +1,34 @@
 #include <string>
+#include <cmath>
 #include "../include/Sampler.h"
-#include "../miniaudio.h"
 
 namespace MittelVec {
 
+template <typename Stage> Stage voiceStage(SamplerVoice& voice);
+template <> PitchStage voiceStage<PitchStage>(SamplerVoice& voice) { return PitchStage { *voice.pitchShifter }; }
+template <> EnvelopeStage voiceStage<EnvelopeStage>(SamplerVoice& voice) { return EnvelopeStage { *voice.envelope }; }
+template <> BiquadStage voiceStage<BiquadStage>(SamplerVoice& voice) { return BiquadStage { *voice.filter }; }
+
+template <typename... Stages>
+static void renderVoiceChain(SamplerVoice& voice, float* samples, int numFrames, int numChannels) {
+  Chain<Stages...>::render(samples, numFrames, numChannels, voiceStage<Stages>(voice)...);
+}
+
+VoiceChainFn Sampler::selectVoiceChain(bool pitch, bool envelope, bool filter) {
+  // Indexed by pitch/envelope/filter bits, stages always run in that order.
+  static const VoiceChainFn chains[8] = {
+    &renderVoiceChain<>,
+    &renderVoiceChain<BiquadStage>,
+    &renderVoiceChain<EnvelopeStage>,
+    &renderVoiceChain<EnvelopeStage, BiquadStage>,
+    &renderVoiceChain<PitchStage>,
+    &renderVoiceChain<PitchStage, BiquadStage>,
+    &renderVoiceChain<PitchStage, EnvelopeStage>,
+    &renderVoiceChain<PitchStage, EnvelopeStage, BiquadStage>,
+  };
+  return chains[(pitch ? 4 : 0) | (envelope ? 2 : 0) | (filter ? 1 : 0)];
+}
+
 Sampler::Sampler(
   const AudioContext &context,
   std::string samplePath,
@@ -12,55 +37,95 @@ Sampler::Sampler(
   float gain,
   int pitchShift,
   std::optional<EnvConfig> envConfig,
+  std::optional<FilterConfig> filterConfig,
+  SampleFormat storage
+)
+  : Sampler(
+    context,
+    SampleData::fromFile(context, samplePath, storage),
+    polyphony, loop, gain, pitchShift, envConfig, filterConfig
+  ) {}
+
+Sampler::Sampler(
+  const AudioContext &context,
+  std::shared_ptr<const SampleData> sample,
+  int polyphony,
+  bool loop,
+  float gain,
+  int pitchShift,
+  std::optional<EnvConfig> envConfig,
   std::optional<FilterConfig> filterConfig
 )
-  : AudioNode(context), sample(context), polyphony(polyphony),
+  : Sampler(
+    context,
+    std::make_shared<ResidentSample>(std::move(sample)),
+    polyphony, loop, gain, pitchShift, envConfig, filterConfig
+  ) {}
+
+Sampler::Sampler(
+  const AudioContext &context,
+  std::shared_ptr<ResidentSample> sample,
+  int polyphony,
+  bool loop,
+  float gain,
+  int pitchShift,
+  std::optional<EnvConfig> envConfig,
+  std::optional<FilterConfig> filterConfig
+)
+  : AudioNode(context), sample(std::move(sample)), polyphony(polyphony), voiceLimit(polyphony),
   loop(loop), gain(gain), pitchShift(pitchShift),
-  envConfig(envConfig), filterConfig(filterConfig)
+  envConfig(envConfig), filterConfig(filterConfig),
+  voiceChain(selectVoiceChain(pitchShift != 0, envConfig.has_value(), filterConfig.has_value()))
 {
-  // Load sample
-  ma_decoder decoder;
-  ma_decoder_config decoderConfig = ma_decoder_config_init(
-    ma_format_f32,
-    context.numChannels,
-    context.sampleRate
-  );
-
-  if (ma_decoder_init_file(samplePath.c_str(), &decoderConfig, &decoder) != MA_SUCCESS) {
-    printf("Failed to load WAV file at path %s\n", samplePath.c_str());
-  } else {
-    ma_uint64 totalFrames;
-    ma_result result = ma_decoder_get_length_in_pcm_frames(&decoder, &totalFrames);
+  // Setup voices, each only gets the DSP this sampler is configured with.
+  voices.reserve(polyphony);
+  for (int i = 0; i < polyphony; ++i) {
+    voices.emplace_back(context, pitchShift, envConfig, filterConfig);
+  }
 
-    if (result != MA_SUCCESS) {
-      printf("Failed to get length of WAV file.\n");
-      ma_decoder_uninit(&decoder);
-    }
+  crossfadeScratch.resize(static_cast<size_t>(context.bufferSize) * context.numChannels);
+  updateLoopRegion();
+}
+
+Sampler::~Sampler() {
+  if (pinsSample) sample->unpin();
+}
 
-    sample.resize(static_cast<size_t>(totalFrames));
+void Sampler::setLoopPoints(std::optional<SampleLoop> points) {
+  loopPoints = points;
+  updateLoopRegion();
+}
 
-    ma_uint64 framesRead;
-    result = ma_decoder_read_pcm_frames(&decoder, sample.data.data(), totalFrames, &framesRead);
-    if (result != MA_SUCCESS) {
-      printf("Failed to read WAV file.\n");
+void Sampler::updateLoopRegion() {
+  const int channels = sample->getNumChannels();
+  const int numFrames = channels > 0 ? sample->size() / channels : 0;
+  const double rate = sample->getSampleRate();
+  auto toFrame = [&](double seconds) { return std::clamp(static_cast<int>(std::lround(seconds * rate)), 0, numFrames); };
+
+  int start = 0, end = numFrames, crossfade = 0;
+  const std::optional<SampleLoop>& points = loopPoints ? loopPoints : sample->getLoop();
+  if (points) {
+    const int pointsStart = toFrame(points->start);
+    const int pointsEnd = points->end > 0.0 ? toFrame(points->end) : numFrames;
+    // An empty or backwards loop falls back to the whole sample.
+    if (pointsEnd > pointsStart) {
+      start = pointsStart;
+      end = pointsEnd;
     }
+    // Can't fade in more than there is before the start, or than the loop is long.
+    crossfade = std::min(toFrame(points->crossfade), std::min(start, end - start));
   }
-  
-  // Cleanup miniaudio decoder.
-  ma_decoder_uninit(&decoder);
 
-  // Setup voices.
-  voices.reserve(polyphony);
-  for (int i = 0; i < polyphony; ++i) {
-    voices.emplace_back(context);
-  }
+  loopRegion = LoopRegion { start * channels, end * channels, crossfade * channels };
 }
 
 SamplerVoice* Sampler::allocateVoice() {
-  // Try first inactive voice.
-  for (SamplerVoice& voice : voices) {
-    if (!voice.active) {
-      return &voice;
+  // Try first inactive voice, while under the voice limit.
+  if (static_cast<int>(activeVoices.size()) < voiceLimit) {
+    for (SamplerVoice& voice : voices) {
+      if (!voice.active) {
+        return &voice;
+      }
     }
   }
 
@@ -70,15 +135,38 @@ SamplerVoice* Sampler::allocateVoice() {
   return oldestVoice;
 }
 
-void Sampler::noteOn() {
+void Sampler::noteOn(float gain, int pitchShift) {
+  touchSample();
+  startVoice(gain, pitchShift);
+}
+
+void Sampler::startVoice(float gain, int pitchShift) {
   SamplerVoice* freeVoice = allocateVoice();
-  freeVoice->trigger();
+  freeVoice->trigger(gain, pitchShift);
   activeVoices.push_back(freeVoice);
+  updateSamplePin();
+}
+
+// Only changes when the sampler starts or stops sounding, not per voice.
+void Sampler::updateSamplePin() {
+  const bool playing = !activeVoices.empty();
+  if (playing == pinsSample) return;
+  if (playing) {
+    sample->pin();
+  } else {
+    sample->unpin();
+  }
+  pinsSample = playing;
+}
+
+void Sampler::touchSample() {
+  // Lets a residency manager mark the sample as used and start reloading it if evicted.
+  sample->touch();
 }
 
 void Sampler::noteOff() {
   for (SamplerVoice* voice : activeVoices) {
-    if (envConfig.has_value()) {
+    if (voice->envelope) {
       voice->envelope->noteOff();
     } else {
       voice->active = false;
@@ -87,18 +175,26 @@ void Sampler::noteOff() {
 }
 
 void Sampler::process(const std::vector<const AudioBuffer *> &inputs, AudioBuffer &outputBuffer) {
+  // Idle samplers report silence instead of clearing/summing every block.
+  if (activeVoices.empty()) {
+    outputSilence();
+    return;
+  }
+
   outputBuffer.clear();
+  const bool virtualize = quality >= Quality::VirtualVoices;
 
   for (SamplerVoice& voice : voices) {
-    if (voice.active) {
+    if (voice.active && virtualize && voice.getLevel(gain) < virtualVoiceLevel) {
+      voice.skipVoice(*sample, loop ? &loopRegion : nullptr);
+    } else if (voice.active) {
       voice.processVoice(
-        sample,
+        *sample,
         outputBuffer,
-        loop,
+        loop ? &loopRegion : nullptr,
         gain,
-        pitchShift,
-        envConfig,
-        filterConfig
+        voiceChain,
+        crossfadeScratch.data()
       );
     }
 
@@ -109,6 +205,45 @@ void Sampler::process(const std::vector<const AudioBuffer *> &inputs, AudioBuffe
       activeVoices.remove(&voice);
     }
   }
+  updateSamplePin();
+}
+
+bool Sampler::lockSampleMemory() {
+  return sample->lockMemory();
+}
+
+void Sampler::prepareAudioContext(const AudioContext& context) {
+  sample->prepareSampleRate(context.sampleRate);
+}
+
+void Sampler::setAudioContext(const AudioContext& context) {
+  const double ratio = static_cast<double>(context.sampleRate) / outputBuffer.getSampleRate();
+  AudioNode::setAudioContext(context);
+  sample->prepareSampleRate(context.sampleRate); // Nothing to do if that already happened.
+  sample->applySampleRate();
+
+  for (SamplerVoice& voice : voices) {
+    voice.setAudioContext(context, ratio, sample->size());
+  }
+  crossfadeScratch.resize(static_cast<size_t>(context.bufferSize) * context.numChannels);
+  updateLoopRegion();
+}
+
+void Sampler::setQuality(Quality newQuality) {
+  const bool filters = filterConfig.has_value() && newQuality < Quality::NoVoiceFilters;
+  const bool filtersWereOn = filterConfig.has_value() && quality < Quality::NoVoiceFilters;
+  quality = newQuality;
+
+  for (SamplerVoice& voice : voices) {
+    if (voice.pitchShifter) voice.pitchShifter->setCubicInterpolation(quality < Quality::LinearInterpolation);
+    // Skipped filters kept their old state, start them clean rather than with a stale tail.
+    if (voice.filter && filters && !filtersWereOn) voice.filter->reset();
+  }
+
+  voiceChain = selectVoiceChain(pitchShift != 0, envConfig.has_value(), filters);
+
+  // Voices already playing past the limit are left to finish.
+  voiceLimit = quality >= Quality::ReducedPolyphony ? std::max(1, polyphony / 2) : polyphony;
 }
 
 }
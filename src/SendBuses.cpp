@@ -0,0 +1,88 @@
+#include "../include/SendBuses.h"
+#include <cstdio>
+#include <stdexcept>
+
+namespace MittelVec {
+
+SendBuses::SendBuses(AudioGraph& graph) : graph(graph) {}
+
+void SendBuses::setReturnNode(int nodeId) {
+  returnNodeId = nodeId;
+}
+
+void SendBuses::addSource(const std::string& slug, int nodeId, const AudioNode* node, SendLevels levels) {
+  sources[slug] = Source { nodeId, node, std::move(levels) };
+}
+
+AudioNode* SendBuses::addBus(const std::string& name, std::unique_ptr<AudioNode> effect) {
+  if (returnNodeId < 0) {
+    throw std::runtime_error("Send bus '" + name + "' has nowhere to return to.");
+  }
+  if (buses.count(name)) {
+    throw std::runtime_error("Duplicate send bus name: " + name);
+  }
+
+  auto sendNode = std::make_unique<Mixer>(graph.audioContext, 1.0f);
+  Bus bus { -1, sendNode.get(), -1, effect.get(), {} };
+
+  // One edit, so the audio thread never runs a bus with half its sources.
+  auto lock = graph.lockGraphFor({ sendNode.get(), effect.get() });
+  bus.sendNodeId = graph.addNode(std::move(sendNode));
+  bus.effectNodeId = graph.addNode(std::move(effect));
+  graph.connect(bus.sendNodeId, bus.effectNodeId);
+  graph.connect(bus.effectNodeId, returnNodeId);
+
+  for (const auto& [slug, source] : sources) {
+    auto level = source.levels.find(name);
+    if (level != source.levels.end() && level->second > 0.0f) {
+      connectSource(bus, slug, source, level->second);
+    }
+  }
+
+  AudioNode* effectPtr = bus.effect;
+  buses.emplace(name, std::move(bus));
+  return effectPtr;
+}
+
+// Caller holds the graph lock.
+void SendBuses::connectSource(Bus& bus, const std::string& slug, const Source& source, float level) {
+  bus.send->setInputGain(source.node, level);
+  graph.connect(source.nodeId, bus.sendNodeId);
+  bus.connected.insert(slug);
+}
+
+void SendBuses::setSendLevel(const std::string& slug, const std::string& busName, float level) {
+  auto source = sources.find(slug);
+  if (source == sources.end()) {
+    printf("No send source named %s\n", slug.c_str());
+    return;
+  }
+  source->second.levels[busName] = level;
+
+  auto bus = buses.find(busName);
+  if (bus == buses.end()) {
+    return; // Picked up when the bus is added.
+  }
+
+  if (bus->second.connected.count(slug)) {
+    // Already connected, just a new gain. Zero keeps the edge, the send mixer just scales by it.
+    bus->second.send->setInputGain(source->second.node, level);
+  } else if (level > 0.0f) {
+    auto lock = graph.lockGraph();
+    connectSource(bus->second, slug, source->second, level);
+  }
+}
+
+float SendBuses::getSendLevel(const std::string& slug, const std::string& bus) const {
+  auto source = sources.find(slug);
+  if (source == sources.end()) return 0.0f;
+  auto level = source->second.levels.find(bus);
+  return level == source->second.levels.end() ? 0.0f : level->second;
+}
+
+AudioNode* SendBuses::getEffect(const std::string& bus) const {
+  auto it = buses.find(bus);
+  return it == buses.end() ? nullptr : it->second.effect;
+}
+
+} // namespace
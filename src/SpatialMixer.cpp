@@ -0,0 +1,223 @@
+#include "../include/SpatialMixer.h"
+#include <algorithm>
+#include <cmath>
+
+namespace MittelVec {
+
+void SpatialMixer::Emitters::resize(size_t size) {
+  x.resize(size, 0.0f);
+  y.resize(size, 0.0f);
+  z.resize(size, 0.0f);
+  gain.resize(size, 1.0f);
+}
+
+SpatialMixer::SpatialMixer(const AudioContext& context, float referenceDistance, float maxDistance, float rolloff)
+  : AudioNode(context),
+    channels(context.numChannels),
+    referenceDistance(std::max(referenceDistance, 1e-3f)),
+    maxDistance(maxDistance),
+    rolloff(std::max(rolloff, 0.0f)),
+    monoScratch(context.bufferSize) {}
+
+int SpatialMixer::addEmitter(const AudioNode* source, float gain) {
+  auto existing = emitterIndex.find(&source->outputBuffer);
+  if (existing != emitterIndex.end()) {
+    return existing->second;
+  }
+
+  int index;
+  if (!freeEmitters.empty()) {
+    index = freeEmitters.back();
+    freeEmitters.pop_back();
+  } else {
+    index = numEmitters++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    pending.resize(numEmitters);
+    pending.x[index] = pendingListener.x;
+    pending.y[index] = pendingListener.y;
+    pending.z[index] = pendingListener.z;
+    pending.gain[index] = gain;
+    pendingDirty.store(true, std::memory_order_release);
+  }
+
+  // The audio thread is held off by the graph lock, so its arrays can grow here.
+  live.resize(numEmitters);
+  live.gain[index] = 0.0f; // Silent until the pending state is picked up.
+  targetLeft.resize(numEmitters, 0.0f);
+  targetRight.resize(numEmitters, 0.0f);
+  previousLeft.resize(numEmitters, 0.0f);
+  previousRight.resize(numEmitters, 0.0f);
+  emitterIndex[&source->outputBuffer] = index;
+  return index;
+}
+
+void SpatialMixer::sourceDisconnected(const AudioNode& source) {
+  auto emitter = emitterIndex.find(&source.outputBuffer);
+  if (emitter == emitterIndex.end()) return;
+
+  // Otherwise a node added later at the same address would turn up as this emitter.
+  // The slot stays in the arrays, silenced, until addEmitter hands it out again.
+  const int index = emitter->second;
+  emitterIndex.erase(emitter);
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    pending.gain[index] = 0.0f;
+  }
+  live.gain[index] = 0.0f;
+  targetLeft[index] = targetRight[index] = 0.0f;
+  previousLeft[index] = previousRight[index] = 0.0f;
+  freeEmitters.push_back(index);
+}
+
+void SpatialMixer::setEmitterPosition(int emitter, float x, float y, float z) {
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  if (emitter < 0 || emitter >= static_cast<int>(pending.x.size())) return;
+  pending.x[emitter] = x;
+  pending.y[emitter] = y;
+  pending.z[emitter] = z;
+  pendingDirty.store(true, std::memory_order_release);
+}
+
+void SpatialMixer::setEmitterGain(int emitter, float gain) {
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  if (emitter < 0 || emitter >= static_cast<int>(pending.gain.size())) return;
+  pending.gain[emitter] = gain;
+  pendingDirty.store(true, std::memory_order_release);
+}
+
+void SpatialMixer::setEmitterPositions(const float* x, const float* y, const float* z, int count) {
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  count = std::min(count, static_cast<int>(pending.x.size()));
+  std::copy(x, x + count, pending.x.begin());
+  std::copy(y, y + count, pending.y.begin());
+  std::copy(z, z + count, pending.z.begin());
+  pendingDirty.store(true, std::memory_order_release);
+}
+
+void SpatialMixer::setListener(const SpatialListener& newListener) {
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  pendingListener = newListener;
+  pendingDirty.store(true, std::memory_order_release);
+}
+
+// Never waits on the control thread, if it's mid update we just use last block's state.
+void SpatialMixer::pullUpdates() {
+  if (!pendingDirty.load(std::memory_order_acquire) || !pendingMutex.try_lock()) {
+    return;
+  }
+  std::copy(pending.x.begin(), pending.x.end(), live.x.begin());
+  std::copy(pending.y.begin(), pending.y.end(), live.y.begin());
+  std::copy(pending.z.begin(), pending.z.end(), live.z.begin());
+  std::copy(pending.gain.begin(), pending.gain.end(), live.gain.begin());
+  listener = pendingListener;
+  pendingDirty.store(false, std::memory_order_relaxed);
+  pendingMutex.unlock();
+}
+
+// Every emitter at once. Written without branches (selects and max only) so it vectorizes,
+// sqrt needs -fno-math-errno for that or the compiler has to keep a scalar errno path.
+void SpatialMixer::computeGains() {
+  const float* x = live.x.data();
+  const float* y = live.y.data();
+  const float* z = live.z.data();
+  const float* gain = live.gain.data();
+  float* left = targetLeft.data();
+  float* right = targetRight.data();
+
+  const SpatialListener l = listener;
+  const float ref = referenceDistance;
+  const float maxDist = maxDistance;
+  const float roll = rolloff;
+  // Mono gets no panning, and the centre gain scaled back up to unity.
+  const float panWidth = channels > 1 ? 1.0f : 0.0f;
+  const float centreGain = channels > 1 ? 1.0f : std::sqrt(2.0f);
+
+  for (int i = 0; i < numEmitters; ++i) {
+    const float dx = x[i] - l.x;
+    const float dy = y[i] - l.y;
+    const float dz = z[i] - l.z;
+    const float distance = std::sqrt(dx * dx + dy * dy + dz * dz);
+
+    const float inRange = distance <= maxDist ? 1.0f : 0.0f;
+    const float attenuation = inRange * gain[i] * centreGain * ref / (ref + roll * (std::max(distance, ref) - ref));
+
+    // -1 is hard left, 1 hard right. Sources on top of the listener sit in the middle.
+    const float pan = panWidth * (dx * l.rightX + dy * l.rightY + dz * l.rightZ) / std::max(distance, 1e-6f);
+
+    // Equal power, left^2 + right^2 stays constant across the pan.
+    // The max only guards against rounding taking |pan| just past 1.
+    left[i] = attenuation * std::sqrt(std::max(0.5f - 0.5f * pan, 0.0f));
+    right[i] = attenuation * std::sqrt(std::max(0.5f + 0.5f * pan, 0.0f));
+  }
+}
+
+void SpatialMixer::process(const std::vector<const AudioBuffer*>& inputs, AudioBuffer& outputBuffer) {
+  pullUpdates();
+  computeGains();
+
+  if (inputs.empty()) {
+    std::copy(targetLeft.begin(), targetLeft.end(), previousLeft.begin());
+    std::copy(targetRight.begin(), targetRight.end(), previousRight.begin());
+    outputSilence();
+    return;
+  }
+
+  const int numFrames = outputBuffer.getNumFrames();
+  float* out = outputBuffer.data.data();
+  float* mono = monoScratch.data();
+  std::fill(outputBuffer.data.begin(), outputBuffer.data.end(), 0.0f);
+
+  for (const AudioBuffer* input : inputs) {
+    const float* in = input->data.data();
+    auto emitter = emitterIndex.find(input);
+
+    if (emitter == emitterIndex.end()) {
+      // Not an emitter, mix it straight through.
+      for (int i = 0; i < outputBuffer.size(); ++i) out[i] += in[i];
+      continue;
+    }
+
+    const int e = emitter->second;
+    const float startLeft = previousLeft[e];
+    const float startRight = previousRight[e];
+    const float endLeft = targetLeft[e];
+    const float endRight = targetRight[e];
+
+    // Culled, out of range now and last block too.
+    if (startLeft == 0.0f && startRight == 0.0f && endLeft == 0.0f && endRight == 0.0f) {
+      continue;
+    }
+
+    for (int i = 0; i < numFrames; ++i) {
+      float sum = 0.0f;
+      for (int ch = 0; ch < channels; ++ch) sum += in[i * channels + ch];
+      mono[i] = sum / channels;
+    }
+
+    const float stepLeft = (endLeft - startLeft) / numFrames;
+    const float stepRight = (endRight - startRight) / numFrames;
+
+    if (channels == 1) {
+      for (int i = 0; i < numFrames; ++i) {
+        out[i] += mono[i] * (startLeft + stepLeft * (i + 1));
+      }
+    } else {
+      for (int i = 0; i < numFrames; ++i) {
+        out[i * channels] += mono[i] * (startLeft + stepLeft * (i + 1));
+        out[i * channels + 1] += mono[i] * (startRight + stepRight * (i + 1));
+      }
+    }
+  }
+
+  std::copy(targetLeft.begin(), targetLeft.end(), previousLeft.begin());
+  std::copy(targetRight.begin(), targetRight.end(), previousRight.begin());
+}
+
+void SpatialMixer::setAudioContext(const AudioContext& context) {
+  AudioNode::setAudioContext(context);
+  monoScratch.resize(context.bufferSize);
+}
+
+} // namespace